@@ -0,0 +1,584 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+// Headless benchmark: typeset documents, render their pages offscreen and
+// replay edits, reporting timings instead of showing a window.
+//
+// Usage: texpresso-bench [-I path]* [-edits N] [-size WxH]
+//                        [-snapshot-budget MB] [-memdiff MB]
+//                        [-dviscan file.xdv] file.tex...
+
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "driver.h"
+#include "engine.hpp"
+#include "renderer.h"
+#include "editor.h"
+#include "textbuf.h"
+#include "txp_log.h"
+#include "txp_memdiff.h"
+#include "mydvi_interp.h"
+#include "mupdf_compat.h"
+
+struct bench_options
+{
+  const char *tectonic_path;
+  const char *inclusion_path;
+  size_t snapshot_budget;
+  int edits;
+  int width, height;
+  // Size in MB of the buffers of the first-difference benchmark, 0 to skip
+  int memdiff;
+  // DVI or XDV file to scan instruction by instruction, NULL to skip
+  const char *dviscan;
+};
+
+struct bench_stat
+{
+  int count;
+  double total, max;
+};
+
+static double now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void stat_add(struct bench_stat *s, double ms)
+{
+  s->count += 1;
+  s->total += ms;
+  if (ms > s->max)
+    s->max = ms;
+}
+
+static double stat_avg(struct bench_stat *s)
+{
+  return s->count ? s->total / s->count : 0;
+}
+
+static size_t peak_rss_kb(void)
+{
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0)
+    return 0;
+#ifdef __APPLE__
+  return ru.ru_maxrss >> 10;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+static void run_to_completion(txp::Engine *eng)
+{
+  while (eng->get_status() == DOC_RUNNING)
+  {
+    if (!eng->step(false))
+    {
+      // Wait for the next query
+      struct pollfd pfd;
+      pfd.fd = eng->query_fd();
+      pfd.events = POLLRDNORM;
+      pfd.revents = 0;
+      poll(&pfd, 1, 10);
+    }
+  }
+}
+
+// Offset of the first character after pattern in the text, or -1
+static int find_after(fz_context *ctx, textbuf_t *t, const char *pattern)
+{
+  fz_buffer *buf = textbuf_buffer(ctx, t);
+  size_t len = strlen(pattern);
+  for (size_t i = 0; i + len <= buf->len; ++i)
+    if (memcmp(buf->data + i, pattern, len) == 0)
+      return i + len;
+  return -1;
+}
+
+// Move offset to the beginning of the next word, so that an edit does not
+// split a control sequence
+static int word_boundary(fz_context *ctx, textbuf_t *t, int offset, int limit)
+{
+  fz_buffer *buf = textbuf_buffer(ctx, t);
+  while (offset < limit && buf->data[offset] != ' ' && buf->data[offset] != '\n')
+    offset++;
+  return offset < limit ? offset + 1 : -1;
+}
+
+static int render_pages(fz_context *ctx, txp::Engine *eng, SDL_Renderer *sdl)
+{
+  txp_renderer *r = txp_renderer_new(ctx, sdl);
+  int pages = eng->page_count();
+
+  for (int page = 0; page < pages; ++page)
+  {
+    fz_display_list *dl = eng->render_page(page);
+    txp_renderer_set_contents(ctx, r, dl);
+    fz_drop_display_list(ctx, dl);
+    SDL_RenderClear(sdl);
+    txp_renderer_render(ctx, r);
+  }
+
+  txp_renderer_free(ctx, r);
+  return pages;
+}
+
+static void bench_document(fz_context *ctx, SDL_Renderer *sdl,
+                           struct bench_options *opt, FILE *report,
+                           const char *doc_arg, const char *doc_abspath)
+{
+  char doc_path[PATH_MAX];
+  strcpy(doc_path, doc_abspath);
+
+  char *doc_name = strrchr(doc_path, '/');
+  *doc_name++ = '\0';
+  if (chdir(doc_path) == -1)
+  {
+    perror("chdir to document path");
+    return;
+  }
+
+  // Initial compilation
+  double start = now_ms();
+  txp::Engine *eng =
+      new txp::TexEngine(*ctx, opt->tectonic_path, opt->inclusion_path,
+                         doc_path, doc_name, opt->snapshot_budget);
+  eng->step(true);
+  run_to_completion(eng);
+  double compile_ms = now_ms() - start;
+
+  start = now_ms();
+  int pages = render_pages(ctx, eng, sdl);
+  double render_ms = now_ms() - start;
+
+  // Edits: alternately insert a word at a pseudo-random position in the body
+  // of the document and remove it.
+  struct bench_stat rollback = {0,}, recompile = {0,};
+  fileentry_t *e = eng->find_file(doc_name);
+  fz_buffer *contents = NULL;
+
+  fz_try(ctx)
+  {
+    contents = fz_read_file(ctx, doc_name);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[bench] cannot read %s: %s\n",
+            doc_name, fz_caught_message(ctx));
+  }
+
+  if (e && contents && opt->edits > 0)
+  {
+    e->edit_data = textbuf_new_from_buffer(ctx, contents);
+
+    int body = find_after(ctx, e->edit_data, "\\begin{document}");
+    if (body < 0)
+      body = 0;
+    int end = find_after(ctx, e->edit_data, "\\end{document}");
+    if (end < body)
+      end = textbuf_length(e->edit_data);
+
+    unsigned int seed = 42;
+    int offset = -1;
+
+    for (int i = 0; i < opt->edits; ++i)
+    {
+      eng->begin_changes();
+      if (offset == -1)
+      {
+        seed = seed * 1103515245 + 12345;
+        int candidate = body + (seed >> 8) % fz_maxi(1, end - body);
+        offset = word_boundary(ctx, e->edit_data, candidate, end);
+        if (offset == -1)
+          offset = body;
+        textbuf_replace(ctx, e->edit_data, offset, 0, "x ", 2);
+        eng->notify_file_changes(e, offset);
+      }
+      else
+      {
+        textbuf_replace(ctx, e->edit_data, offset, 2, NULL, 0);
+        eng->notify_file_changes(e, offset);
+        offset = -1;
+      }
+
+      start = now_ms();
+      if (eng->end_changes())
+      {
+        stat_add(&rollback, now_ms() - start);
+        eng->step(true);
+        run_to_completion(eng);
+        stat_add(&recompile, now_ms() - start);
+      }
+    }
+  }
+
+  if (contents)
+    fz_drop_buffer(ctx, contents);
+
+  fprintf(report,
+          "%s: compile %.0fms, %d pages, render %.0fms (%.1f pages/s), "
+          "%d edits, rollback avg %.1fms max %.1fms, "
+          "recompile avg %.0fms max %.0fms, peak RSS %zuMB\n",
+          doc_arg, compile_ms, pages, render_ms,
+          render_ms > 0 ? pages * 1000.0 / render_ms : 0.0,
+          rollback.count, stat_avg(&rollback), rollback.max,
+          stat_avg(&recompile), recompile.max,
+          peak_rss_kb() >> 10);
+  fflush(report);
+
+  eng->save_session();
+  delete eng;
+}
+
+// Reference for the first-difference benchmark, called through a pointer so
+// that the compiler cannot hoist it out of the loop
+static size_t byte_diff(const void *a, const void *b, size_t len)
+{
+  const unsigned char *pa = (const unsigned char *)a;
+  const unsigned char *pb = (const unsigned char *)b;
+  size_t i = 0;
+  while (i < len && pa[i] == pb[i])
+    i += 1;
+  return i;
+}
+
+static double time_diff(size_t (*diff)(const void *, const void *, size_t),
+                        const unsigned char *a, const unsigned char *b,
+                        size_t size, int rounds)
+{
+  size_t (*volatile fn)(const void *, const void *, size_t) = diff;
+  double start = now_ms();
+  for (int i = 0; i < rounds; ++i)
+    if (fn(a, b, size) != size - 1)
+      abort();
+  return now_ms() - start;
+}
+
+// Throughput of txp_memdiff, on buffers that only differ by their last byte
+// (the worst case: a change at the end of a large file).
+static void bench_memdiff(FILE *report, int mb)
+{
+  size_t size = (size_t)mb << 20;
+  unsigned char *a = (unsigned char *)malloc(size);
+  unsigned char *b = (unsigned char *)malloc(size);
+  if (!a || !b)
+  {
+    fprintf(stderr, "[bench] cannot allocate %dMB for memdiff\n", mb);
+    free(a);
+    free(b);
+    return;
+  }
+
+  unsigned int seed = 42;
+  for (size_t i = 0; i < size; ++i)
+  {
+    seed = seed * 1103515245 + 12345;
+    a[i] = seed >> 16;
+  }
+  memcpy(b, a, size);
+  b[size - 1] ^= 1;
+
+  // About 4GB compared per measure
+  int rounds = fz_maxi(1, 4096 / mb);
+  double wide_ms = time_diff(txp_memdiff, a, b, size, rounds);
+  double byte_ms = time_diff(byte_diff, a, b, size, rounds);
+  double gb = (double)size * rounds / (1 << 30);
+
+  fprintf(report, "memdiff: %dMB x %d, %.1fGB/s (byte loop %.1fGB/s)\n",
+          mb, rounds,
+          wide_ms > 0 ? gb * 1000.0 / wide_ms : 0.0,
+          byte_ms > 0 ? gb * 1000.0 / byte_ms : 0.0);
+  fflush(report);
+  free(a);
+  free(b);
+}
+
+// Throughput of dvi_instr_size, walking a DVI file from the preamble to the
+// end of the postamble as incdvi does when indexing pages.
+static void bench_dviscan(FILE *report, const char *path)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+  {
+    perror(path);
+    return;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *buf = (uint8_t *)malloc(size > 0 ? size : 1);
+  if (!buf) abort();
+  bool ok = size > 2 && fread(buf, size, 1, f) == 1;
+  fclose(f);
+  if (!ok)
+  {
+    fprintf(stderr, "[bench] cannot read %s\n", path);
+    free(buf);
+    return;
+  }
+
+  enum dvi_version version = (enum dvi_version)buf[1];
+  int count = 0, pos = 0;
+  while (pos < size)
+  {
+    int n = dvi_instr_size(buf + pos, size - pos, version);
+    if (n <= 0)
+      break;
+    pos += n;
+    count += 1;
+  }
+  if (pos < size)
+    fprintf(stderr, "[bench] %s: stopped at offset %d\n", path, pos);
+
+  // About 4GB scanned per measure
+  int rounds = fz_maxi(1, (int)((4096LL << 20) / fz_maxi(pos, 1)));
+  double start = now_ms();
+  for (int i = 0; i < rounds; ++i)
+  {
+    int p = 0;
+    while (p < pos)
+      p += dvi_instr_size(buf + p, pos - p, version);
+    if (p != pos)
+      abort();
+  }
+  double ms = now_ms() - start;
+  double mb = (double)pos * rounds / (1 << 20);
+
+  fprintf(report, "dviscan: %s, %.1fMB x %d, %d instructions, %.0fMB/s\n",
+          path, pos / 1048576.0, rounds, count, ms > 0 ? mb * 1000.0 / ms : 0.0);
+  fflush(report);
+  free(buf);
+}
+
+static pthread_mutex_t fz_mutexes[FZ_LOCK_MAX];
+
+static void fz_lock_pthread(void *user, int lock)
+{
+  if (pthread_mutex_lock(&fz_mutexes[lock]) != 0)
+    abort();
+}
+
+static void fz_unlock_pthread(void *user, int lock)
+{
+  if (pthread_mutex_unlock(&fz_mutexes[lock]) != 0)
+    abort();
+}
+
+// Locks are needed for the render and prerender workers to clone the context
+static fz_locks_context *fz_pthread_locks(void)
+{
+  static fz_locks_context locks;
+
+  for (int i = 0; i < FZ_LOCK_MAX; ++i)
+    pthread_mutex_init(&fz_mutexes[i], NULL);
+
+  locks.user = NULL;
+  locks.lock = fz_lock_pthread;
+  locks.unlock = fz_unlock_pthread;
+  return &locks;
+}
+
+static void find_tectonic(char tectonic_path[PATH_MAX], const char *argv0)
+{
+  char exe_path[PATH_MAX];
+  if (realpath("/proc/self/exe", exe_path) || realpath(argv0, exe_path))
+  {
+    char *basename = strrchr(exe_path, '/');
+    if (basename)
+    {
+      strcpy(basename + 1, "texpresso-tonic");
+      if (access(exe_path, X_OK) == 0)
+      {
+        strcpy(tectonic_path, exe_path);
+        return;
+      }
+    }
+  }
+  strcpy(tectonic_path, "texpresso-tonic");
+}
+
+int main(int argc, char **argv)
+{
+  struct bench_options opt = {
+    .tectonic_path = NULL,
+    .inclusion_path = NULL,
+    .snapshot_budget = (size_t)SNAPSHOT_BUDGET_MB << 20,
+    .edits = 20,
+    .width = 800,
+    .height = 1000,
+    .memdiff = 0,
+    .dviscan = NULL,
+  };
+
+  // Inclusion path is a sequence of null-terminated strings, ending with an
+  // empty one
+  char *inclusion_path = (char *)calloc(1, 1);
+  size_t inclusion_len = 0;
+  int first_doc = argc;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    if (arg[0] != '-')
+    {
+      first_doc = i;
+      break;
+    }
+    if (i + 1 == argc)
+    {
+      fprintf(stderr, "[error] Expecting an argument after %s\n", arg);
+      exit(1);
+    }
+    const char *val = argv[++i];
+    if (strcmp(arg, "-I") == 0)
+    {
+      // Documents are processed from their own directory
+      char abs_val[PATH_MAX];
+      if (realpath(val, abs_val))
+        val = abs_val;
+      size_t len = strlen(val) + 1;
+      inclusion_path = (char *)realloc(inclusion_path, inclusion_len + len + 1);
+      if (!inclusion_path) abort();
+      memcpy(inclusion_path + inclusion_len, val, len);
+      inclusion_len += len;
+      inclusion_path[inclusion_len] = '\0';
+    }
+    else if (strcmp(arg, "-edits") == 0)
+      opt.edits = atoi(val);
+    else if (strcmp(arg, "-snapshot-budget") == 0)
+      opt.snapshot_budget = (size_t)atoi(val) << 20;
+    else if (strcmp(arg, "-memdiff") == 0)
+      opt.memdiff = atoi(val);
+    else if (strcmp(arg, "-dviscan") == 0)
+      opt.dviscan = val;
+    else if (strcmp(arg, "-size") == 0)
+    {
+      if (sscanf(val, "%dx%d", &opt.width, &opt.height) != 2 ||
+          opt.width <= 0 || opt.height <= 0)
+      {
+        fprintf(stderr, "[error] Invalid size %s, expecting WxH\n", val);
+        exit(1);
+      }
+    }
+    else
+    {
+      fprintf(stderr, "[error] Unknown option %s\n", arg);
+      exit(1);
+    }
+  }
+
+  if (first_doc == argc && opt.memdiff <= 0 && !opt.dviscan)
+  {
+    fprintf(stderr, "Usage: texpresso-bench [-I path]* [-edits N] [-size WxH] [-snapshot-budget MB] [-memdiff MB] [-dviscan file.xdv] file.tex...\n");
+    exit(1);
+  }
+
+  char tectonic_path[PATH_MAX];
+  find_tectonic(tectonic_path, argv[0]);
+  opt.tectonic_path = tectonic_path;
+  opt.inclusion_path = inclusion_path;
+
+  // Only warnings by default, TEXPRESSO_LOG can ask for more
+  for (int i = 0; i < TXP_LOG_CATEGORIES; ++i)
+    txp_log_levels[i] = TXP_LOG_WARN;
+  txp_log_init();
+
+  // Messages for the editor are written to stdout: discard them and keep the
+  // original stdout for the report.
+  FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+  if (!report || !freopen("/dev/null", "w", stdout))
+  {
+    perror("redirecting stdout");
+    exit(1);
+  }
+
+  if (opt.memdiff > 0)
+    bench_memdiff(report, opt.memdiff);
+  if (opt.dviscan)
+    bench_dviscan(report, opt.dviscan);
+  if (first_doc == argc)
+  {
+    fclose(report);
+    return 0;
+  }
+
+  if (SDL_Init(SDL_INIT_TIMER) < 0)
+  {
+    fprintf(stderr, "SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+    exit(1);
+  }
+
+  // Pages are rasterized through the regular renderer, drawing to a surface
+  SDL_Surface *surface =
+    SDL_CreateRGBSurfaceWithFormat(0, opt.width, opt.height, 32,
+                                   SDL_PIXELFORMAT_ARGB8888);
+  SDL_Renderer *sdl = surface ? SDL_CreateSoftwareRenderer(surface) : NULL;
+  if (!sdl)
+  {
+    fprintf(stderr, "[error] cannot create offscreen renderer: %s\n",
+            SDL_GetError());
+    exit(1);
+  }
+
+  fz_context *ctx = fz_new_context(NULL, fz_pthread_locks(), FZ_STORE_DEFAULT);
+  fz_register_document_handlers(ctx);
+
+  // Each document is processed from its own directory: resolve them all
+  // before the first chdir
+  int doc_count = argc - first_doc;
+  char **docs = (char **)calloc(doc_count, sizeof(char *));
+  if (!docs) abort();
+  for (int i = 0; i < doc_count; ++i)
+    if (!(docs[i] = realpath(argv[first_doc + i], NULL)))
+      perror(argv[first_doc + i]);
+
+  for (int i = 0; i < doc_count; ++i)
+  {
+    if (docs[i])
+      bench_document(ctx, sdl, &opt, report, argv[first_doc + i], docs[i]);
+    free(docs[i]);
+  }
+  free(docs);
+
+  SDL_DestroyRenderer(sdl);
+  SDL_FreeSurface(surface);
+  SDL_Quit();
+  fz_drop_context(ctx);
+  txp_log_flush();
+  free(inclusion_path);
+  fclose(report);
+  return 0;
+}
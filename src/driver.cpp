@@ -24,9 +24,14 @@
 
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <mupdf/fitz.h>
 #include "logo.h"
 #include "driver.h"
+#include "dvi/mydvi.h"
+#include "dvi/txp_memstat.h"
 
 #ifdef __APPLE__
 #include <sys/syslimits.h>
@@ -70,6 +75,139 @@ static void signal_usr1(int sig)
   }
 }
 
+/* MuPDF locking */
+
+// Render workers run on cloned fz_contexts, which requires the root context
+// to have been created with locking functions.
+
+static SDL_mutex *fz_mutexes[FZ_LOCK_MAX];
+
+static void fz_lock_sdl(void *user, int lock)
+{
+  SDL_mutex **mutexes = user;
+  if (SDL_LockMutex(mutexes[lock]) != 0)
+    abort();
+}
+
+static void fz_unlock_sdl(void *user, int lock)
+{
+  SDL_mutex **mutexes = user;
+  if (SDL_UnlockMutex(mutexes[lock]) != 0)
+    abort();
+}
+
+static fz_locks_context *fz_sdl_locks(void)
+{
+  static fz_locks_context locks;
+
+  for (int i = 0; i < FZ_LOCK_MAX; ++i)
+  {
+    fz_mutexes[i] = SDL_CreateMutex();
+    if (!fz_mutexes[i])
+    {
+      fprintf(stderr, "[error] cannot create mutex: %s\n", SDL_GetError());
+      abort();
+    }
+  }
+
+  locks.user = fz_mutexes;
+  locks.lock = fz_lock_sdl;
+  locks.unlock = fz_unlock_sdl;
+  return &locks;
+}
+
+/* MuPDF allocator */
+
+// Each block is prefixed by its size and the tag of the thread that
+// allocated it, and accounted in the counters of that tag (see
+// txp_memstat.h). The counters live here so that they outlive reloads of
+// the viewer code.
+
+static struct txp_memstat memstat;
+static thread_local int memstat_tag = TXP_MEM_OTHER;
+
+typedef union {
+  struct {
+    size_t size;
+    int tag;
+  } h;
+  max_align_t align;
+} mem_header;
+
+static int memstat_set_tag(int tag)
+{
+  int previous = memstat_tag;
+  memstat_tag = tag;
+  return previous;
+}
+
+static void memstat_add(int tag, size_t size, size_t grown)
+{
+  struct txp_mem_counter *c = &memstat.tags[tag];
+  size_t live = __atomic_add_fetch(&c->live, size, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+  while (live > peak &&
+         !__atomic_compare_exchange_n(&c->peak, &peak, live, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  __atomic_add_fetch(&c->allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&c->bytes, grown, __ATOMIC_RELAXED);
+}
+
+static void memstat_sub(int tag, size_t size)
+{
+  __atomic_sub_fetch(&memstat.tags[tag].live, size, __ATOMIC_RELAXED);
+}
+
+static void *mem_malloc(void *user, size_t size)
+{
+  (void)user;
+  mem_header *h = (mem_header *)malloc(sizeof(mem_header) + size);
+  if (!h)
+    return NULL;
+  h->h.size = size;
+  h->h.tag = memstat_tag;
+  memstat_add(h->h.tag, size, size);
+  return h + 1;
+}
+
+// A block keeps the tag it was allocated with
+static void *mem_realloc(void *user, void *old, size_t size)
+{
+  if (!old)
+    return mem_malloc(user, size);
+  mem_header *h = (mem_header *)old - 1;
+  size_t old_size = h->h.size;
+  h = (mem_header *)realloc(h, sizeof(mem_header) + size);
+  if (!h)
+    return NULL;
+  h->h.size = size;
+  memstat_sub(h->h.tag, old_size);
+  memstat_add(h->h.tag, size, size > old_size ? size - old_size : 0);
+  return h + 1;
+}
+
+static void mem_free(void *user, void *ptr)
+{
+  (void)user;
+  if (!ptr)
+    return;
+  mem_header *h = (mem_header *)ptr - 1;
+  memstat_sub(h->h.tag, h->h.size);
+  free(h);
+}
+
+static fz_alloc_context *fz_memstat_alloc(void)
+{
+  static fz_alloc_context alloc;
+  memstat.set_tag = memstat_set_tag;
+  alloc.user = &memstat;
+  alloc.malloc = mem_malloc;
+  alloc.realloc = mem_realloc;
+  alloc.free = mem_free;
+  return &alloc;
+}
+
 /* Misc routines */
 
 static char *last_index(char *path, char needle)
@@ -126,6 +264,9 @@ int main(int argc, const char **argv)
   const char *doc_arg = NULL;
   enum editor_protocol protocol = EDITOR_SEXP;
   bool line_output = 0;
+  size_t snapshot_budget = (size_t)SNAPSHOT_BUDGET_MB << 20;
+  const char *trace_path = NULL;
+  int memory_summary = 0;
 
   int inclusion_path_size = 1;
   for (int i = 1; i < argc; i++)
@@ -142,6 +283,10 @@ int main(int argc, const char **argv)
       {
         protocol = EDITOR_JSON;
       }
+      else if (strcmp(arg, "-binary") == 0)
+      {
+        protocol = EDITOR_BINARY;
+      }
       else if (arg[1] == 'I' && arg[2] == '\0')
       {
         i += 1;
@@ -161,6 +306,40 @@ int main(int argc, const char **argv)
       {
         line_output = 1;
       }
+      else if (strcmp(arg, "-snapshot-budget") == 0)
+      {
+        i += 1;
+        char *end;
+        long mb = i < argc ? strtol(argv[i], &end, 10) : -1;
+        if (mb < 0 || i == argc || *end != '\0')
+        {
+          fprintf(stderr, "[error] Expecting a size in megabytes after -snapshot-budget\n");
+          exit(1);
+        }
+        snapshot_budget = (size_t)mb << 20;
+      }
+      else if (strcmp(arg, "-trace") == 0)
+      {
+        i += 1;
+        if (i == argc)
+        {
+          fprintf(stderr, "[error] Expecting a path after -trace\n");
+          exit(1);
+        }
+        trace_path = argv[i];
+      }
+      else if (strcmp(arg, "-memory-summary") == 0)
+      {
+        i += 1;
+        char *end;
+        long period = i < argc ? strtol(argv[i], &end, 10) : -1;
+        if (period <= 0 || i == argc || *end != '\0')
+        {
+          fprintf(stderr, "[error] Expecting a period in seconds after -memory-summary\n");
+          exit(1);
+        }
+        memory_summary = period;
+      }
       else
       {
         fprintf(stderr, "[error] Unknown option %s\n", arg);
@@ -183,7 +362,7 @@ int main(int argc, const char **argv)
 
   if (doc_arg == NULL)
   {
-    fprintf(stderr, "Usage: texpresso [-I path]* [-json] root_file.tex\n");
+    fprintf(stderr, "Usage: texpresso [-I path]* [-json] [-binary] [-lines] [-snapshot-budget MB] [-trace file.json] [-memory-summary seconds] root_file.tex\n");
     exit(1);
   }
 
@@ -198,6 +377,10 @@ int main(int argc, const char **argv)
       i += 1;
       p = stpcpy(p, argv[i]) + 1;
     }
+    else if (strcmp(argv[i], "-snapshot-budget") == 0 ||
+             strcmp(argv[i], "-trace") == 0 ||
+             strcmp(argv[i], "-memory-summary") == 0)
+      i += 1;
   }
   *p = '\0';
 
@@ -222,7 +405,7 @@ int main(int argc, const char **argv)
     abort();
   }
 
-  fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+  fz_context *ctx = fz_new_context(fz_memstat_alloc(), fz_sdl_locks(), FZ_STORE_DEFAULT);
   fz_register_document_handlers(ctx);
 
   bool init = 0;
@@ -270,6 +453,10 @@ int main(int argc, const char **argv)
       .initial = {0,},
       .protocol = protocol,
       .line_output = line_output,
+      .snapshot_budget = snapshot_budget,
+      .trace_path = trace_path,
+      .memstat = &memstat,
+      .memory_summary = memory_summary,
       .custom_event = custom_event,
       .schedule_event = &schedule_event,
       .should_reload_binary = &should_reload_binary,
@@ -287,7 +474,11 @@ int main(int argc, const char **argv)
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
+  dvi_mipmap_flush(ctx);
+  dvi_resmanager_flush_shared(ctx);
   fz_drop_context(ctx);
+  for (int i = 0; i < FZ_LOCK_MAX; ++i)
+    SDL_DestroyMutex(fz_mutexes[i]);
 
   return 0;
 }
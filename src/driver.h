@@ -48,6 +48,8 @@ struct initial_state
   int page;
   int need_synctex;
   int zoom;
+  int continuous;
+  float scroll;
   txp_renderer_config config;
   fz_display_list *display_list;
 };
@@ -56,12 +58,25 @@ enum editor_protocol
 {
   EDITOR_SEXP,
   EDITOR_JSON,
+  // SEXP syntax with length-prefixed strings, see -binary
+  EDITOR_BINARY,
 };
 
+// Default memory budget for TeX snapshots, see -snapshot-budget
+#define SNAPSHOT_BUDGET_MB 2048
+
 struct persistent_state {
   struct initial_state initial;
   enum editor_protocol protocol;
   int line_output;
+  // Memory allowed for TeX snapshots, in bytes (0 for no limit)
+  size_t snapshot_budget;
+  // File receiving latency traces, see -trace (NULL if none)
+  const char *trace_path;
+  // Counters of the fz_context allocator, and the period of their summary
+  // on stderr in seconds, see -memory-summary (0 if none)
+  struct txp_memstat *memstat;
+  int memory_summary;
   Uint32 custom_event;
 
   void (*schedule_event)(enum custom_events ev);
@@ -23,6 +23,9 @@
  */
 
 #include "mydvi.h"
+#include "mydvi_interp.h"
+#include "vstack.h"
+#include "txp_log.h"
 
 dvi_context *dvi_context_new(fz_context *ctx, dvi_reshooks hooks)
 {
@@ -59,8 +62,13 @@ dvi_context_set_device(fz_context *ctx, dvi_context *dc, fz_device *dev)
 void dvi_context_free(fz_context *ctx, dvi_context *dc)
 {
   dvi_context_set_device(ctx, dc, NULL);
+  dvi_free_special_cache(ctx, dc);
   dvi_resmanager_free(ctx, dc->resmanager);
   dvi_scratch_release(ctx, &dc->scratch);
+  if (dc->pdf_stack)
+    vstack_free(ctx, dc->pdf_stack);
+  if (dc->unit_rect)
+    fz_drop_path(ctx, dc->unit_rect);
   fz_free(ctx, dc);
 }
 
@@ -83,16 +91,20 @@ void dvi_context_begin_frame(fz_context *ctx, dvi_context *dc, fz_device *dev)
 
 void dvi_context_end_frame(fz_context *ctx, dvi_context *dc)
 {
+  if (dc->dev)
+    dvi_context_flush_text(ctx, dc, &dc->root);
   dvi_scratch_clear(ctx, &dc->scratch);
+  if (dc->pdf_stack)
+    vstack_reset(ctx, dc->pdf_stack);
   dvi_context_set_device(ctx, dc, NULL);
 
   if (dc->colorstack.depth > 0)
-    fprintf(stderr, "default color stack: ending frame with %d colors\n", dc->colorstack.depth);
+    txp_debug(TXP_LOG_DVI, "default color stack: ending frame with %d colors\n", dc->colorstack.depth);
 
   for (int i = 0; i < dc->pdfcolorstacks.capacity; i++)
     if (dc->pdfcolorstacks.stacks[i].depth > 0)
-      fprintf(stderr, "default color stack: ending frame with %d colors\n",
-              dc->pdfcolorstacks.stacks[i].depth);
+      txp_debug(TXP_LOG_DVI, "default color stack: ending frame with %d colors\n",
+                dc->pdfcolorstacks.stacks[i].depth);
 }
 
 dvi_state *dvi_context_state(dvi_context *dc)
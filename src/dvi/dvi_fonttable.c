@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "mydvi.h"
+#include "txp_log.h"
 
 struct dvi_fonttable
 {
@@ -51,7 +52,7 @@ dvi_fontdef *dvi_fonttable_get(fz_context *ctx, dvi_fonttable *ft, int f)
 {
   if (f < 0 || f > 9999)
   {
-    fprintf(stderr, "dvi_fonttable_get(_, %d)\n", f);
+    txp_error(TXP_LOG_DVI, "dvi_fonttable_get(_, %d)\n", f);
     abort();
   }
   if (f >= ft->capacity)
@@ -26,6 +26,7 @@
 #include "mydvi_interp.h"
 #include "mydvi_opcodes.h"
 #include "intcodec.h"
+#include "txp_log.h"
 
 #define case4(I, n) case I##1: case I##2: case I##3: case I##4: n = op - I##1 + 1;
 #define PRINTF_DEBUG 0
@@ -42,44 +43,41 @@ int dvi_preamble_size(const uint8_t *buf, int len)
   return 15 + buf[14];
 }
 
+// Size of the instructions without variable-length operands, 0 for the
+// others and for undefined opcodes.
+// Fixed sizes do not depend on the DVI version: the XDV extensions are all
+// variable-length.
+
+#define RANGE4(I) [I##1] = 2, [I##2] = 3, [I##3] = 4, [I##4] = 5
+
+static const uint8_t dvi_fixed_size[256] = {
+  [SET_CHAR_0 ... SET_CHAR_127] = 1,
+  [FNT_NUM_0 ... FNT_NUM_63] = 1,
+  RANGE4(SET), RANGE4(PUT), RANGE4(RIGHT), RANGE4(DOWN),
+  RANGE4(FNT), RANGE4(W), RANGE4(X), RANGE4(Y), RANGE4(Z),
+  [SET_RULE] = 9, [PUT_RULE] = 9,
+  [NOP] = 1, [EOP] = 1, [PUSH] = 1, [POP] = 1,
+  [W0] = 1, [X0] = 1, [Y0] = 1, [Z0] = 1,
+  [PADDING] = 1, [BEGIN_REFLECT] = 1, [END_REFLECT] = 1,
+  [BOP] = 45,
+  [POST] = 29,
+  [POST_POST] = 6,
+};
+
+#undef RANGE4
+
 int dvi_instr_size(const uint8_t *buf, int len, enum dvi_version version)
 {
   CHECK_LEN(0);
 
   enum dvi_opcode op = buf[0];
 
-  if (op <= SET_CHAR_127)
-    return 1;
-
-  if (op >= FNT_NUM_0 && op <= FNT_NUM_63)
-    return 1;
+  int fixed = dvi_fixed_size[op];
+  if (fixed)
+    return fixed;
 
   switch (op)
   {
-#define INSTR4(F,V) F(SET,V) F(PUT,V) F(RIGHT,V) F(DOWN,V) F(FNT,V) F(W,V) F(X,V) F(Y,V) F(Z,V)
-#define CASE(I,N) case I##N:
-
-    INSTR4(CASE,1) return 2;
-    INSTR4(CASE,2) return 3;
-    INSTR4(CASE,3) return 4;
-    INSTR4(CASE,4) return 5;
-
-#undef INSTR4
-#undef CASE
-
-    case SET_RULE: case PUT_RULE:
-    return 9;
-
-    case NOP: case EOP:
-    case PUSH: case POP:
-    case W0: case X0: case Y0: case Z0:
-    case PADDING:
-    case BEGIN_REFLECT: case END_REFLECT:
-    return 1;
-
-    case BOP:
-    return 45;
-
     case XXX1:
     CHECK_LEN(1);
     return 2 + decode_u8(buf + 1);
@@ -106,12 +104,6 @@ int dvi_instr_size(const uint8_t *buf, int len, enum dvi_version version)
     case PRE:
     return dvi_preamble_size(buf, len);
 
-    case POST:
-    return 29;
-
-    case POST_POST:
-    return 6;
-
     // https://tex.stackexchange.com/questions/496061/syntax-and-semantics-of-xdv-commands-xetex
 
     case XDV_NATIVE_FONT_DEF:
@@ -224,7 +216,7 @@ bool dvi_preamble_parse(fz_context *ctx, dvi_context *dc, dvi_state *st, const u
   enum dvi_opcode op = read_u8(&buf);
   if (op != PRE)
   {
-    fprintf(stderr, "dvi_parse_preamble: invalid opcode (expecting PRE)\n");
+    txp_warn(TXP_LOG_DVI, "dvi_parse_preamble: invalid opcode (expecting PRE)\n");
     return 0;
   }
   uint8_t  i   = read_u8(&buf);
@@ -236,6 +228,9 @@ bool dvi_preamble_parse(fz_context *ctx, dvi_context *dc, dvi_state *st, const u
   return dvi_exec_pre(ctx, dc, st, i, num, den, mag, comment, len);
 }
 
+// Not dispatched through dvi_fixed_size or a table of handlers: the dense
+// switch already compiles to a jump table, and handlers behind function
+// pointers could no longer be inlined with their decoding.
 bool dvi_interp_sub(fz_context *ctx, dvi_context *dc, dvi_state *st, const uint8_t *buf)
 {
   enum dvi_opcode op = read_u8(&buf);
@@ -377,6 +372,10 @@ bool dvi_interp_sub(fz_context *ctx, dvi_context *dc, dvi_state *st, const uint8
     {
       uint32_t k = read_uB(&buf, n);
       const char *ptr = (const char *)buf;
+      // Specials can draw or clip: emit pending glyphs first to keep the
+      // painting order
+      if (dc->dev)
+        dvi_context_flush_text(ctx, dc, st);
       if (!dvi_exec_special(ctx, dc, st, ptr, ptr + k))
       {
         // fprintf(stderr, "interp: special failed: %.*s\n", k, ptr);
@@ -409,7 +408,7 @@ bool dvi_interp_sub(fz_context *ctx, dvi_context *dc, dvi_state *st, const uint8
 
     case PRE:
     {
-      fprintf(stderr, "dvi_interp: unexpected preamble\n");
+      txp_warn(TXP_LOG_DVI, "dvi_interp: unexpected preamble\n");
       return 0;
     }
 
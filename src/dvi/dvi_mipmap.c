@@ -0,0 +1,240 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "mydvi.h"
+
+// Decoded pixmaps of large images, at power-of-two subsample levels.
+//
+// The draw device picks a level from its CTM and asks the image for it, the
+// level decoded once is then reused for all pages and by all render threads:
+// their images are distinct objects, levels are shared by looking up the
+// identity of the source file.
+
+// Bytes of decoded pixmaps kept for all images
+#define MIPMAP_BUDGET (256 << 20)
+
+// Smaller images are left to the mupdf store
+#define MIPMAP_MIN_PIXELS (1 << 20)
+
+typedef struct {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+} file_id;
+
+typedef struct {
+  file_id id;
+  int l2factor;
+  fz_pixmap *pix;
+  size_t bytes;
+  unsigned long last_use;
+} mip_level;
+
+static struct {
+  pthread_mutex_t mutex;
+  mip_level *levels;
+  int count, cap;
+  size_t bytes;
+  unsigned long clock;
+} cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+typedef struct {
+  fz_image super;
+  fz_image *base;
+  file_id id;
+} mip_image;
+
+static bool same_file(const file_id *a, const file_id *b)
+{
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+         a->mtime == b->mtime && strcmp(a->path, b->path) == 0;
+}
+
+// Called with the mutex held
+static mip_level *find_level(const file_id *id, int l2factor)
+{
+  for (int i = 0; i < cache.count; ++i)
+    if (cache.levels[i].l2factor == l2factor && same_file(&cache.levels[i].id, id))
+      return &cache.levels[i];
+  return NULL;
+}
+
+// Called with the mutex held
+static void evict_levels(fz_context *ctx)
+{
+  while (cache.bytes > MIPMAP_BUDGET && cache.count > 1)
+  {
+    int oldest = 0;
+    for (int i = 1; i < cache.count; ++i)
+      if (cache.levels[i].last_use < cache.levels[oldest].last_use)
+        oldest = i;
+
+    mip_level *l = &cache.levels[oldest];
+    cache.bytes -= l->bytes;
+    fz_drop_pixmap(ctx, l->pix);
+    free(l->id.path);
+    *l = cache.levels[--cache.count];
+  }
+}
+
+static fz_pixmap *lookup_level(fz_context *ctx, const file_id *id, int l2factor)
+{
+  fz_pixmap *pix = NULL;
+  pthread_mutex_lock(&cache.mutex);
+  mip_level *l = find_level(id, l2factor);
+  if (l)
+  {
+    l->last_use = ++cache.clock;
+    pix = fz_keep_pixmap(ctx, l->pix);
+  }
+  pthread_mutex_unlock(&cache.mutex);
+  return pix;
+}
+
+// Take ownership of pix, return the pixmap of the level (the existing one if
+// another thread decoded it in the meantime)
+static fz_pixmap *insert_level(fz_context *ctx, const file_id *id, int l2factor, fz_pixmap *pix)
+{
+  pthread_mutex_lock(&cache.mutex);
+
+  mip_level *l = find_level(id, l2factor);
+  if (l)
+  {
+    fz_drop_pixmap(ctx, pix);
+    pix = fz_keep_pixmap(ctx, l->pix);
+    l->last_use = ++cache.clock;
+  }
+  else
+  {
+    if (cache.count == cache.cap)
+    {
+      cache.cap = cache.cap ? cache.cap * 2 : 16;
+      cache.levels = realloc(cache.levels, cache.cap * sizeof(mip_level));
+      if (!cache.levels)
+        abort();
+    }
+    l = &cache.levels[cache.count++];
+    l->id = *id;
+    l->id.path = strdup(id->path);
+    l->l2factor = l2factor;
+    l->pix = fz_keep_pixmap(ctx, pix);
+    l->bytes = (size_t)pix->stride * pix->h;
+    l->last_use = ++cache.clock;
+    cache.bytes += l->bytes;
+    evict_levels(ctx);
+  }
+
+  pthread_mutex_unlock(&cache.mutex);
+  return pix;
+}
+
+static fz_pixmap *
+mip_get_pixmap(fz_context *ctx, fz_image *image, fz_irect *subarea, int w, int h, int *l2factor)
+{
+  mip_image *mi = (mip_image *)image;
+  fz_image *base = mi->base;
+  int l2 = l2factor ? *l2factor : 0;
+
+  while (l2 > 0 && ((base->w >> l2) <= 2 || (base->h >> l2) <= 2))
+    l2 -= 1;
+
+  fz_pixmap *pix = lookup_level(ctx, &mi->id, l2);
+  if (!pix)
+  {
+    // Ask for a size just below the level, so that the base image decodes
+    // (JPEG scales while decoding) and subsamples to exactly this level
+    fz_matrix ctm = fz_scale((base->w >> l2) - 2, (base->h >> l2) - 2);
+    int dw, dh;
+    pix = fz_get_pixmap_from_image(ctx, base, NULL, l2 ? &ctm : NULL, &dw, &dh);
+    pix = insert_level(ctx, &mi->id, l2, pix);
+  }
+
+  // The whole image is decoded, and no subsampling is left to do: the
+  // pixmap is shared and must not be subsampled in place
+  if (subarea)
+  {
+    subarea->x0 = subarea->y0 = 0;
+    subarea->x1 = image->w;
+    subarea->y1 = image->h;
+  }
+  if (l2factor)
+    *l2factor = 0;
+
+  return pix;
+}
+
+static size_t mip_get_size(fz_context *ctx, fz_image *image)
+{
+  return sizeof(mip_image);
+}
+
+static void mip_drop(fz_context *ctx, fz_image *image)
+{
+  mip_image *mi = (mip_image *)image;
+  fz_drop_image(ctx, mi->base);
+  fz_free(ctx, mi->id.path);
+}
+
+fz_image *dvi_new_mipmap_image(fz_context *ctx, fz_image *base, const char *path)
+{
+  struct stat st;
+  if ((size_t)base->w * base->h < MIPMAP_MIN_PIXELS || stat(path, &st) != 0)
+    return fz_keep_image(ctx, base);
+
+  mip_image *mi = (mip_image *)
+    fz_new_image_of_size(ctx, base->w, base->h, base->bpc, base->colorspace,
+                         base->xres, base->yres, base->interpolate,
+                         base->imagemask, NULL, NULL, base->mask,
+                         sizeof(mip_image), mip_get_pixmap, mip_get_size,
+                         mip_drop);
+  mi->base = fz_keep_image(ctx, base);
+  mi->id.path = fz_strdup(ctx, path);
+  mi->id.dev = st.st_dev;
+  mi->id.ino = st.st_ino;
+  mi->id.size = st.st_size;
+  mi->id.mtime = st.st_mtime;
+  return &mi->super;
+}
+
+void dvi_mipmap_flush(fz_context *ctx)
+{
+  pthread_mutex_lock(&cache.mutex);
+  for (int i = 0; i < cache.count; ++i)
+  {
+    fz_drop_pixmap(ctx, cache.levels[i].pix);
+    free(cache.levels[i].id.path);
+  }
+  free(cache.levels);
+  cache.levels = NULL;
+  cache.count = cache.cap = 0;
+  cache.bytes = 0;
+  pthread_mutex_unlock(&cache.mutex);
+}
@@ -26,19 +26,28 @@
 #include "mydvi.h"
 #include "mydvi_interp.h"
 #include "fz_util.h"
+#include "txp_log.h"
 
 #define color_params fz_default_color_params
 
+// Rules fill a unit square, created once per context and mapped to the rule
+// by the transformation, instead of allocating a path for each rule.
+// Empty rules draw nothing.
 static void output_fill_rect(fz_context *ctx, dvi_context *dc, dvi_state *st, int32_t x0, int32_t y0, int32_t x1, int32_t y1)
 {
-  if (ctx && dc->dev)
+  if (ctx && dc->dev && x0 != x1 && y0 != y1)
   {
+    dvi_context_flush_text(ctx, dc, st);
     float s = dc->scale;
-    fz_path *path = fz_new_path(ctx);
-    fz_rectto(ctx, path, x0 * s, - y0 * s, x1 * s, - y1 * s);
-    fz_fill_path(ctx, dc->dev, path, 0, st->gs.ctm, fz_device_rgb(ctx),
-                 st->gs.colors.fill, 1.0, color_params);
-    fz_drop_path(ctx, path);
+    if (!dc->unit_rect)
+    {
+      dc->unit_rect = fz_new_path(ctx);
+      fz_rectto(ctx, dc->unit_rect, 0, 0, 1, 1);
+    }
+    fz_matrix rect = fz_make_matrix((x1 - x0) * s, 0, 0, - (y1 - y0) * s,
+                                    x0 * s, - y0 * s);
+    fz_fill_path(ctx, dc->dev, dc->unit_rect, 0, fz_concat(rect, st->gs.ctm),
+                 fz_device_rgb(ctx), st->gs.colors.fill, 1.0, color_params);
   }
 }
 
@@ -46,6 +55,7 @@ static void output_debug_rect(fz_context *ctx, dvi_context *dc, dvi_state *st, i
 {
   if (ctx && dc->dev)
   {
+    dvi_context_flush_text(ctx, dc, st);
     fz_path *path = fz_new_path(ctx);
     fz_rectto(ctx, path, x0 * dc->scale, - y0 * dc->scale, x1 * dc->scale, - y1 * dc->scale);
     fz_stroke_path(ctx, dc->dev, path, &fz_default_stroke_state, st->gs.ctm,
@@ -54,23 +64,36 @@ static void output_debug_rect(fz_context *ctx, dvi_context *dc, dvi_state *st, i
   }
 }
 
+// Glyphs accumulate in a single fz_text until something else is drawn or the
+// fill color changes: glyphs carry their own font and matrix, so font
+// switches and push/pop groups do not need to break the run.
+// The display list keeps a reference to each flushed text, so the object
+// cannot be recycled and a new one is allocated for the next run.
+
 void dvi_context_flush_text(fz_context *ctx, dvi_context *dc, dvi_state *st)
 {
+  (void)st;
   if (dc->text)
   {
     if (!dc->dev)
       abort();
     fz_fill_text(ctx, dc->dev, dc->text, fz_identity, fz_device_rgb(ctx),
-        st->gs.colors.fill, 1.0, color_params);
+        dc->text_color, 1.0, color_params);
     fz_drop_text(ctx, dc->text);
     dc->text = NULL;
   }
 }
 
-static fz_text *get_text(fz_context *ctx, dvi_context *dc)
+static fz_text *get_text(fz_context *ctx, dvi_context *dc, dvi_state *st)
 {
+  const float *fill = st->gs.colors.fill;
+  if (dc->text && memcmp(dc->text_color, fill, sizeof(dc->text_color)) != 0)
+    dvi_context_flush_text(ctx, dc, st);
   if (!dc->text)
+  {
     dc->text = fz_new_text(ctx);
+    memcpy(dc->text_color, fill, sizeof(dc->text_color));
+  }
   return dc->text;
 }
 
@@ -88,7 +111,7 @@ void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c,
   dvi_fontdef *def = dvi_current_font(ctx, st);
   if (def->kind != TEX_FONT)
   {
-    fprintf(stderr, "dvi_exec_char: expecting TeX font\n");
+    txp_warn(TXP_LOG_DVI, "dvi_exec_char: expecting TeX font\n");
     abort();
   }
 
@@ -98,7 +121,7 @@ void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c,
   {
     if (!font->fz && !font->vf)
     {
-      fprintf(stderr, "No fz nor vf font for %s\n", font->name);
+      txp_warn(TXP_LOG_DVI, "No fz nor vf font for %s\n", font->name);
     }
     if (font->fz)
     {
@@ -129,14 +152,14 @@ void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c,
       }
       else
       {
-        fprintf(stderr, "character out of bounds\n");
+        txp_warn(TXP_LOG_DVI, "character out of bounds\n");
         u = fz_encode_character(ctx, font->fz, c);
       }
 
       if (dc->dev)
       {
         float s = dc->scale * scale_factor.value;
-        fz_show_glyph(ctx, get_text(ctx, dc), font->fz,
+        fz_show_glyph(ctx, get_text(ctx, dc, st), font->fz,
                       fz_pre_scale(dvi_get_ctm(dc, st), s, s), u, c, 0, 0,
                       FZ_BIDI_LTR, FZ_LANG_UNSET);
       }
@@ -157,14 +180,14 @@ void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c,
           //fprintf(stderr, "VF: %s (%d) at offset %d/%d\n", dvi_opname(dvi[pos]), size, pos, dvi_length);
           if (!dvi_interp_sub(ctx, dc, &vfst, dvi + pos))
           {
-            fprintf(stderr, "VF: failed\n");
+            txp_warn(TXP_LOG_DVI, "VF: failed\n");
             break;
           }
           pos += size;
         }
       }
       else
-        fprintf(stderr, "VirtualFont: cannot enter state (vfc: %p)\n", vfc);
+        txp_warn(TXP_LOG_DVI, "VirtualFont: cannot enter state (vfc: %p)\n", vfc);
       if (vfc && set)
       {
         st->registers.h += fixed_mul(vfc->width, scale_factor).value;
@@ -184,13 +207,13 @@ void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c,
         {
           h = fixed_mul(h, scale_factor);
           d = fixed_mul(d, scale_factor);
-          fprintf(stderr, "setchar%u h:=%d+%d=%d\n", c, st->registers.h,
-                  w.value, st->registers.h + w.value);
-          fprintf(stderr, "  char: w:%dr, h:%dr, d:%dr\n", w.value, h.value,
-                  d.value);
-          fprintf(stderr, "  box: (%dr, %dr, %dr, %dr)\n", st->registers.h,
-                  st->registers.v - h.value, st->registers.h + w.value,
-                  st->registers.v + d.value);
+          txp_debug(TXP_LOG_DVI, "setchar%u h:=%d+%d=%d\n", c, st->registers.h,
+                    w.value, st->registers.h + w.value);
+          txp_debug(TXP_LOG_DVI, "  char: w:%dr, h:%dr, d:%dr\n", w.value, h.value,
+                    d.value);
+          txp_debug(TXP_LOG_DVI, "  box: (%dr, %dr, %dr, %dr)\n", st->registers.h,
+                    st->registers.v - h.value, st->registers.h + w.value,
+                    st->registers.v + d.value);
 
           output_debug_rect(
               ctx, dc, st, st->registers.h, st->registers.v - h.value,
@@ -205,7 +228,8 @@ void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c,
 
 bool dvi_exec_push(fz_context *ctx, dvi_context *dc, dvi_state *st)
 {
-  dvi_context_flush_text(ctx, dc, st);
+  (void)ctx;
+  (void)dc;
   if (st->registers_stack.depth >= st->registers_stack.limit)
     return 0;
   st->registers_stack.base[st->registers_stack.depth] = st->registers;
@@ -215,7 +239,8 @@ bool dvi_exec_push(fz_context *ctx, dvi_context *dc, dvi_state *st)
 
 bool dvi_exec_pop(fz_context *ctx, dvi_context *dc, dvi_state *st)
 {
-  dvi_context_flush_text(ctx, dc, st);
+  (void)ctx;
+  (void)dc;
   if (st->registers_stack.depth == 0)
     return 0;
   st->registers_stack.depth -= 1;
@@ -227,7 +252,7 @@ void dvi_exec_fnt_num(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t
 {
   (void)dc;
   if (!dvi_current_font(ctx, st))
-    fprintf(stderr, "fnt_num: undefined font %u\n", f);
+    txp_warn(TXP_LOG_DVI, "fnt_num: undefined font %u\n", f);
   st->f = f;
 }
 
@@ -275,12 +300,12 @@ bool dvi_exec_bop(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c[10
   (void)dc;
   if (st->gs_stack.depth != 0)
   {
-    fprintf(stderr, "beginning_of_page: transformation stack was not at empty\n");
+    txp_warn(TXP_LOG_DVI, "beginning_of_page: transformation stack was not at empty\n");
     st->gs_stack.depth = 0;
   }
   if (st->registers_stack.depth != 0)
   {
-    fprintf(stderr, "beginning_of_page: stack was not at empty\n");
+    txp_warn(TXP_LOG_DVI, "beginning_of_page: stack was not at empty\n");
     st->registers_stack.depth = 0;
   }
   (void)c;
@@ -297,12 +322,12 @@ void dvi_exec_eop(fz_context *ctx, dvi_context *dc, dvi_state *st)
 bool dvi_exec_pre(fz_context *ctx, dvi_context *dc, dvi_state *st, uint8_t i, uint32_t num, uint32_t den, uint32_t mag, const char *comment, size_t len)
 {
   (void)dc;
-  fprintf(stderr, "pre:\n");
-  fprintf(stderr, "  i: %u\n", i);
-  fprintf(stderr, "  num: %u\n", num);
-  fprintf(stderr, "  den: %u\n", den);
-  fprintf(stderr, "  mag: %u\n", mag);
-  fprintf(stderr, "  comment: %.*s\n", (int)len, comment);
+  txp_debug(TXP_LOG_DVI, "pre:\n");
+  txp_debug(TXP_LOG_DVI, "  i: %u\n", i);
+  txp_debug(TXP_LOG_DVI, "  num: %u\n", num);
+  txp_debug(TXP_LOG_DVI, "  den: %u\n", den);
+  txp_debug(TXP_LOG_DVI, "  mag: %u\n", mag);
+  txp_debug(TXP_LOG_DVI, "  comment: %.*s\n", (int)len, comment);
 
   dc->scale = num/254000.0*72.27/den*mag/1000.0 * 800/803;
 
@@ -329,7 +354,7 @@ void dvi_exec_xdvglyphs(fz_context *ctx, dvi_context *dc, dvi_state *st, fixed_t
   dvi_fontdef *def = dvi_current_font(ctx, st);
   if (def->kind != XDV_FONT)
   {
-    fprintf(stderr, "dvi_exec_xdvglyphs: expecting XDV font\n");
+    txp_warn(TXP_LOG_DVI, "dvi_exec_xdvglyphs: expecting XDV font\n");
     abort();
   }
   fz_font *font = def->xdv_font.font;
@@ -344,7 +369,7 @@ void dvi_exec_xdvglyphs(fz_context *ctx, dvi_context *dc, dvi_state *st, fixed_t
     int32_t sv = st->registers.v + dy0.value - st->gs.v;
     if (dc->dev)
     {
-      fz_text *text = get_text(ctx, dc);
+      fz_text *text = get_text(ctx, dc, st);
       for (int i = 0; i < num_glyphs; ++i)
       {
         int32_t h = sh + dx[i].value;
@@ -357,6 +382,6 @@ void dvi_exec_xdvglyphs(fz_context *ctx, dvi_context *dc, dvi_state *st, fixed_t
     }
   }
   else
-    fprintf(stderr, "dvi_exec_xdvglyphs: font not found\n");
+    txp_warn(TXP_LOG_DVI, "dvi_exec_xdvglyphs: font not found\n");
   st->registers.h += width.value;
 }
@@ -26,58 +26,257 @@
 #include FT_FREETYPE_H
 #include "mydvi.h"
 #include "fz_util.h"
+#include "txp_log.h"
+#include "txp_memstat.h"
 #include "../mupdf_compat.h"
 #include <sys/wait.h>
 #include <sys/file.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+typedef struct reslink reslink;
 typedef struct cell_dvi_font cell_dvi_font;
 typedef struct cell_tex_enc cell_tex_enc;
 typedef struct cell_pdf_doc cell_pdf_doc;
 typedef struct cell_fz_font cell_fz_font;
 typedef struct cell_image cell_image;
 
+// Header of all cells: cells of a kind are chained in the buckets of a
+// restable, indexed by the hash of their name.
+struct reslink {
+  reslink *next;
+  unsigned long hash;
+};
+
 struct cell_dvi_font {
+  reslink link;
   dvi_font font;
-  cell_dvi_font *next;
 };
 
 struct cell_tex_enc {
+  reslink link;
   const char *name;
   tex_enc *enc;
-  cell_tex_enc *next;
 };
 
 struct cell_fz_font {
+  reslink link;
   const char *name;
   int index;
   fz_font *font;
-  cell_fz_font *next;
+  // In the font store, environment of the hooks the font was loaded from,
+  // and while the font is being loaded, a token of the loading thread
+  const void *owner, *loader;
 };
 
+// Pages of a document that have been embedded, recorded once as display
+// lists so that they are not interpreted again at each render
+typedef struct {
+  int index;
+  fz_rect mediabox;
+  fz_display_list *list;
+} pdf_page_list;
+
 struct cell_pdf_doc {
+  reslink link;
   const char *name;
   pdf_document *doc;
-  cell_pdf_doc *next;
+  pdf_page_list *pages;
+  int page_count, page_cap;
 };
 
 struct cell_image {
+  reslink link;
   const char *name;
   fz_image *img;
-  cell_image *next;
 };
 
+typedef struct {
+  const char *kind;
+  reslink **buckets;
+  int count, cap;
+
+  // Statistics
+  unsigned long lookups, hits, probes;
+} restable;
+
 struct dvi_resmanager {
   dvi_reshooks hooks;
-  cell_dvi_font *first_dvi_font;
-  cell_tex_enc  *first_tex_enc;
-  cell_pdf_doc  *first_pdf_doc;
-  cell_fz_font  *first_fz_font;
-  cell_image    *first_image;
+  restable dvi_fonts, tex_encs, pdf_docs, fz_fonts, images;
   tex_fontmap *map;
 };
 
+static void restable_init(restable *t, const char *kind)
+{
+  *t = (restable){.kind = kind};
+}
+
+// First cell with the given hash, or NULL
+static reslink *restable_skip(restable *t, reslink *link, unsigned long hash)
+{
+  while (link && link->hash != hash)
+  {
+    t->probes += 1;
+    link = link->next;
+  }
+  return link;
+}
+
+static reslink *restable_first(restable *t, unsigned long hash)
+{
+  t->lookups += 1;
+  if (t->cap == 0)
+    return NULL;
+  return restable_skip(t, t->buckets[hash_bucket(hash, t->cap)], hash);
+}
+
+static reslink *restable_next(restable *t, reslink *link, unsigned long hash)
+{
+  t->probes += 1;
+  return restable_skip(t, link->next, hash);
+}
+
+#define restable_foreach(t, hash, type, cell)                          \
+  for (type *cell = (type *)restable_first(t, hash); cell;            \
+       cell = (type *)restable_next(t, &cell->link, hash))
+
+static void restable_add(fz_context *ctx, restable *t, reslink *link, unsigned long hash)
+{
+  if (t->count >= t->cap)
+  {
+    int cap = t->cap ? t->cap * 2 : 64;
+    reslink **buckets = fz_malloc_struct_array(ctx, cap, reslink *);
+    for (int i = 0; i < t->cap; ++i)
+    {
+      for (reslink *l = t->buckets[i], *next; l; l = next)
+      {
+        next = l->next;
+        l->next = buckets[hash_bucket(l->hash, cap)];
+        buckets[hash_bucket(l->hash, cap)] = l;
+      }
+    }
+    fz_free(ctx, t->buckets);
+    t->buckets = buckets;
+    t->cap = cap;
+  }
+
+  reslink **bucket = &t->buckets[hash_bucket(hash, t->cap)];
+  link->hash = hash;
+  link->next = *bucket;
+  *bucket = link;
+  t->count += 1;
+}
+
+// Remove the cells with the given hash for which `match' returns true
+static void restable_remove(fz_context *ctx, restable *t, unsigned long hash,
+                            bool (*match)(reslink *link, const char *name),
+                            const char *name,
+                            void (*free_cell)(fz_context *ctx, reslink *link))
+{
+  if (t->cap == 0)
+    return;
+
+  for (reslink **l = &t->buckets[hash_bucket(hash, t->cap)]; *l; )
+  {
+    reslink *link = *l;
+    if (link->hash == hash && match(link, name))
+    {
+      *l = link->next;
+      t->count -= 1;
+      free_cell(ctx, link);
+    }
+    else
+      l = &link->next;
+  }
+}
+
+static void restable_free(fz_context *ctx, restable *t,
+                          void (*free_cell)(fz_context *ctx, reslink *link))
+{
+  for (int i = 0; i < t->cap; ++i)
+  {
+    for (reslink *l = t->buckets[i], *next; l; l = next)
+    {
+      next = l->next;
+      free_cell(ctx, l);
+    }
+  }
+  fz_free(ctx, t->buckets);
+  t->buckets = NULL;
+  t->count = t->cap = 0;
+}
+
+static void restable_print_stats(restable *t)
+{
+  int longest = 0;
+  for (int i = 0; i < t->cap; ++i)
+  {
+    int length = 0;
+    for (reslink *l = t->buckets[i]; l; l = l->next)
+      length += 1;
+    if (length > longest)
+      longest = length;
+  }
+  txp_info(TXP_LOG_DVI,
+           "[resmanager] %s: %d entries, %lu lookups, %lu hits, "
+           "%lu probes, longest chain %d\n",
+           t->kind, t->count, t->lookups, t->hits, t->probes, longest);
+}
+
+static void free_dvi_font_cell(fz_context *ctx, reslink *link)
+{
+  cell_dvi_font *cell = (cell_dvi_font *)link;
+  fz_free(ctx, (void*)cell->font.name);
+  if (cell->font.tfm)
+    tex_tfm_free(ctx, cell->font.tfm);
+  if (cell->font.fz)
+    fz_drop_font(ctx, cell->font.fz);
+  fz_free(ctx, cell);
+}
+
+static void free_tex_enc_cell(fz_context *ctx, reslink *link)
+{
+  cell_tex_enc *cell = (cell_tex_enc *)link;
+  fz_free(ctx, (void*)cell->name);
+  if (cell->enc)
+    tex_enc_free(ctx, cell->enc);
+  fz_free(ctx, cell);
+}
+
+static void free_fz_font_cell(fz_context *ctx, reslink *link)
+{
+  cell_fz_font *cell = (cell_fz_font *)link;
+  fz_free(ctx, (void*)cell->name);
+  if (cell->font)
+    fz_drop_font(ctx, cell->font);
+  fz_free(ctx, cell);
+}
+
+static void free_pdf_doc_cell(fz_context *ctx, reslink *link)
+{
+  cell_pdf_doc *cell = (cell_pdf_doc *)link;
+  fz_free(ctx, (void*)cell->name);
+  for (int i = 0; i < cell->page_count; ++i)
+    fz_drop_display_list(ctx, cell->pages[i].list);
+  fz_free(ctx, cell->pages);
+  if (cell->doc)
+    pdf_drop_document(ctx, cell->doc);
+  fz_free(ctx, cell);
+}
+
+static void free_image_cell(fz_context *ctx, reslink *link)
+{
+  cell_image *cell = (cell_image *)link;
+  fz_free(ctx, (void*)cell->name);
+  if (cell->img)
+    fz_drop_image(ctx, cell->img);
+  fz_free(ctx, cell);
+}
+
 static void
 default_hooks_free_env(fz_context *ctx, void *env)
 {
@@ -89,7 +288,7 @@ tectonic_hooks_open_file(fz_context *ctx, void *env, dvi_reskind kind, const cha
 {
   char *path = NULL;
   bool free_path = 0;
-  fprintf(stderr, "[dvi] loading %s\n", name);
+  txp_debug(TXP_LOG_BUNDLE, "[dvi] loading %s\n", name);
   switch (kind)
   {
     case RES_PDF:
@@ -171,7 +370,10 @@ tectonic_hooks_open_file(fz_context *ctx, void *env, dvi_reskind kind, const cha
         sprintf(command, "tectonic -X bundle cat %s%s", name, *ext);
         FILE *f = popen(command, "r");
         if (!f)
-          abort();
+        {
+          txp_warn(TXP_LOG_BUNDLE, "[bundle] cannot run %s\n", command);
+          return NULL;
+        }
         fz_stream *stream = fz_open_file_ptr_no_close(ctx, f);
         fz_buffer *buffer = fz_read_all(ctx, stream, 4096);
         fz_drop_stream(ctx, stream);
@@ -196,7 +398,7 @@ tectonic_hooks_open_file(fz_context *ctx, void *env, dvi_reskind kind, const cha
 
   if (path == NULL)
   {
-    fprintf(stderr, "dvi_resmanager_open_file(%s): no path found\n", name);
+    txp_warn(TXP_LOG_DVI, "dvi_resmanager_open_file(%s): no path found\n", name);
     return NULL;
   }
 
@@ -230,10 +432,74 @@ dvi_reshooks dvi_tectonic_hooks(fz_context *ctx, const char *document_dir)
   };
 }
 
+// Reply received before it was asked for, see bundle_serve_hooks_prefetch
+typedef struct prefetched_reply prefetched_reply;
+struct prefetched_reply {
+  char *name;
+  char code;
+  fz_buffer *data;
+  prefetched_reply *next;
+};
+
+// Files of the bundle cache, answered by path ('P' replies), are immutable:
+// they are mapped read-only once and shared by all the bundle servers of
+// the process. Fonts made from a mapping can outlive the server that
+// answered (in the font store, the glyph cache of any context...), so the
+// mappings belong to the process and are released by
+// dvi_resmanager_flush_shared, once nothing refers to them.
+typedef struct mapped_file mapped_file;
+struct mapped_file {
+  char *path;
+  void *addr;
+  size_t len;
+  fz_buffer *buffer;
+  mapped_file *next;
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  mapped_file *files;
+} mapped_store = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .files = NULL,
+};
+
+// Files of the bundle used for a document directory, by the viewer or by
+// TeX (bundle_server_take), are listed in a manifest, saved in the persistent
+// cache when the viewer exits (bundle_server_save_manifest). The next server
+// for the same directory prefetches them from a background thread, before
+// TeX asks for them and the pages that need them are rendered.
+#define MANIFEST_KIND "manifest"
+#define MANIFEST_VERSION 1
+
 struct bundle_server {
   char *document_dir;
   pid_t pid;
   FILE *o, *i, *lock;
+  // flock only serializes processes, threads of the viewer sharing the
+  // server (render workers) are serialized by this mutex
+  pthread_mutex_t mutex;
+  // Most recent first, and the total size of their data
+  prefetched_reply *prefetched;
+  int prefetched_count;
+  size_t prefetched_bytes;
+  // Set if the server stopped answering or answered out of protocol: its
+  // replies can no longer be matched with requests, resources are then
+  // reported as missing
+  bool broken;
+
+  // Names of the files served in this session, for the next manifest
+  char **manifest;
+  int manifest_count, manifest_cap;
+
+  // Manifest of the previous session, prefetched by a thread
+  fz_context *startup_ctx;
+  fz_buffer *startup_data;
+  const char **startup;
+  int startup_count;
+  pthread_t startup_thread;
+  // Set to stop the prefetch after the current batch
+  int startup_cancel;
 };
 
 static void my_flock(int fd, int flag)
@@ -246,33 +512,30 @@ static void my_flock(int fd, int flag)
   }
 }
 
-static fz_stream *
-bundle_serve_hooks_cat(fz_context *ctx, struct bundle_server *env, const char *name)
+static bool send_request(bundle_server *env, const char *name)
 {
-  fz_stream *result = NULL;
-
-  my_flock(fileno(env->lock), LOCK_EX);
-
   if (fwrite(name, strlen(name), 1, env->o) != 1)
   {
-    fprintf(stderr, "bundle_serve_hooks_cat: cannot send request\n");
-    goto release;
+    txp_error(TXP_LOG_BUNDLE, "bundle_serve_hooks_cat: cannot send request\n");
+    return 0;
   }
   if (fwrite("\n", 1, 1, env->o) != 1)
   {
-    fprintf(stderr, "bundle_serve_hooks_cat: cannot send newline\n");
-    goto release;
-  }
-  if (fflush(env->o) != 0)
-  {
-    perror("bundle_serve_hooks_cat: fflush");
-    goto release;
+    txp_error(TXP_LOG_BUNDLE, "bundle_serve_hooks_cat: cannot send newline\n");
+    return 0;
   }
+  return 1;
+}
+
+// Read the answer to the oldest pending request
+static bool read_reply(fz_context *ctx, bundle_server *env,
+                       char *code, fz_buffer **data)
+{
   uint8_t answer[9];
   if (fread(answer, 9, 1, env->i) != 1)
   {
-    fprintf(stderr, "bundle_serve_hooks_cat: cannot read answer\n");
-    goto release;
+    txp_error(TXP_LOG_BUNDLE, "bundle_serve_hooks_cat: cannot read answer\n");
+    return 0;
   }
 
   switch (answer[0])
@@ -280,8 +543,8 @@ bundle_serve_hooks_cat(fz_context *ctx, struct bundle_server *env, const char *n
     case 'C': case 'P': case 'E': 
     break;
     default:
-    fprintf(stderr, "bundle_serve_hooks_cat: unknown response %C\n", answer[0]);
-    abort();
+    txp_error(TXP_LOG_BUNDLE, "bundle_serve_hooks_cat: unknown response %C\n", answer[0]);
+    return 0;
   };
 
   uint64_t size =
@@ -296,35 +559,553 @@ bundle_serve_hooks_cat(fz_context *ctx, struct bundle_server *env, const char *n
 
   fz_buffer *buffer = fz_new_buffer(ctx, size);
   buffer->len = size;
-  fprintf(stderr, "success code:%c size:%d\n", answer[0], (int)size);
+  txp_debug(TXP_LOG_BUNDLE, "[bundle] success code:%c size:%d\n", answer[0], (int)size);
 
   if (fread(buffer->data, size, 1, env->i) != 1)
   {
     fz_drop_buffer(ctx, buffer);
-    fprintf(stderr, "bundle_serve_hooks_cat: cannot read data\n");
-    goto release;
+    txp_error(TXP_LOG_BUNDLE, "bundle_serve_hooks_cat: cannot read data\n");
+    return 0;
   }
 
-  if (answer[0] == 'C')
-    result = fz_open_buffer(ctx, buffer);
-  else if (answer[0] == 'P')
-    result = fz_open_file(ctx, fz_string_from_buffer(ctx, buffer));
-  else
-    fprintf(stderr, "bundle_serve_hooks_cat: error loading %s: %.*s\n",
-            name, (int)size, buffer->data);
-  fz_drop_buffer(ctx, buffer);
+  *code = answer[0];
+  *data = buffer;
+  return 1;
+}
+
+// Map a file of the bundle cache, or reuse its mapping
+static fz_buffer *map_file(fz_context *ctx, const char *path)
+{
+  fz_buffer *result = NULL;
+  pthread_mutex_lock(&mapped_store.mutex);
+  for (mapped_file *m = mapped_store.files; m; m = m->next)
+    if (strcmp(m->path, path) == 0)
+    {
+      result = fz_keep_buffer(ctx, m->buffer);
+      break;
+    }
+  pthread_mutex_unlock(&mapped_store.mutex);
+  if (result)
+    return result;
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    fz_throw(ctx, FZ_ERROR_GENERIC, "cannot open %s: %s", path, strerror(errno));
+
+  struct stat st;
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  // Empty files cannot be mapped
+  if (addr == MAP_FAILED)
+    return fz_read_file(ctx, path);
+
+  mapped_file *m = NULL;
+  fz_var(m);
+  fz_try(ctx)
+  {
+    m = fz_malloc_struct(ctx, mapped_file);
+    m->path = fz_strdup(ctx, path);
+    m->buffer = fz_new_buffer_from_shared_data(ctx, addr, st.st_size);
+  }
+  fz_catch(ctx)
+  {
+    munmap(addr, st.st_size);
+    if (m)
+    {
+      fz_free(ctx, m->path);
+      fz_free(ctx, m);
+    }
+    fz_rethrow(ctx);
+  }
+  m->addr = addr;
+  m->len = st.st_size;
+
+  pthread_mutex_lock(&mapped_store.mutex);
+  m->next = mapped_store.files;
+  mapped_store.files = m;
+  result = fz_keep_buffer(ctx, m->buffer);
+  pthread_mutex_unlock(&mapped_store.mutex);
+
+  return result;
+}
+
+// Release the mappings that nothing refers to anymore
+static void flush_mapped_files(fz_context *ctx)
+{
+  int kept = 0;
+  pthread_mutex_lock(&mapped_store.mutex);
+  for (mapped_file **p = &mapped_store.files; *p; )
+  {
+    mapped_file *m = *p;
+    if (m->buffer->refs > 1)
+    {
+      kept += 1;
+      p = &m->next;
+      continue;
+    }
+    *p = m->next;
+    fz_drop_buffer(ctx, m->buffer);
+    munmap(m->addr, m->len);
+    fz_free(ctx, m->path);
+    fz_free(ctx, m);
+  }
+  pthread_mutex_unlock(&mapped_store.mutex);
+  if (kept > 0)
+    txp_debug(TXP_LOG_BUNDLE, "[bundle] %d mapped files still in use\n", kept);
+}
+
+// Turn a reply into the contents of the file, dropping its data.
+// Called with the mutex held.
+static fz_buffer *
+reply_buffer(fz_context *ctx, bundle_server *env, const char *name,
+             char code, fz_buffer *data)
+{
+  fz_buffer *result = NULL;
+
+  if (code == 'C')
+    return data;
+
+  fz_try(ctx)
+  {
+    if (code == 'P')
+      result = map_file(ctx, fz_string_from_buffer(ctx, data));
+    else
+      txp_warn(TXP_LOG_BUNDLE, "bundle_serve_hooks_cat: error loading %s: %.*s\n",
+               name, (int)data->len, data->data);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_buffer(ctx, data);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+
+  return result;
+}
+
+static prefetched_reply **find_prefetched(bundle_server *env, const char *name)
+{
+  prefetched_reply **p = &env->prefetched;
+  while (*p && strcmp((*p)->name, name) != 0)
+    p = &(*p)->next;
+  return p;
+}
+
+// Replies that were prefetched but not asked for, beyond which the oldest
+// are dropped (they will be requested again if needed)
+#define PREFETCH_MAX_REPLIES 1024
+#define PREFETCH_MAX_BYTES (64 << 20)
+
+static void free_prefetched(fz_context *ctx, prefetched_reply *reply)
+{
+  fz_free(ctx, reply->name);
+  fz_drop_buffer(ctx, reply->data);
+  fz_free(ctx, reply);
+}
+
+// Called with the mutex held
+static void trim_prefetched(fz_context *ctx, bundle_server *env)
+{
+  while (env->prefetched_count > PREFETCH_MAX_REPLIES ||
+         env->prefetched_bytes > PREFETCH_MAX_BYTES)
+  {
+    prefetched_reply **p = &env->prefetched;
+    while ((*p)->next)
+      p = &(*p)->next;
+    prefetched_reply *oldest = *p;
+    *p = NULL;
+    txp_debug(TXP_LOG_BUNDLE, "[bundle] dropping unused prefetch of %s\n",
+              oldest->name);
+    env->prefetched_count -= 1;
+    env->prefetched_bytes -= oldest->data->len;
+    free_prefetched(ctx, oldest);
+  }
+}
+
+// Called with the mutex held
+static void mark_broken(bundle_server *env)
+{
+  if (!env->broken)
+    txp_error(TXP_LOG_BUNDLE, "[bundle] server is out of sync, "
+                              "bundle files are no longer available\n");
+  env->broken = 1;
+}
+
+// Called with the mutex held
+static void manifest_add(fz_context *ctx, bundle_server *env, const char *name)
+{
+  for (int i = 0; i < env->manifest_count; ++i)
+    if (strcmp(env->manifest[i], name) == 0)
+      return;
+
+  if (env->manifest_count == env->manifest_cap)
+  {
+    env->manifest_cap = env->manifest_cap ? env->manifest_cap * 2 : 64;
+    env->manifest = (char **)fz_realloc(ctx, env->manifest,
+                                        env->manifest_cap * sizeof(char *));
+  }
+  env->manifest[env->manifest_count++] = fz_strdup(ctx, name);
+}
+
+static uint64_t manifest_key(bundle_server *env)
+{
+  return tex_cache_hash(env->document_dir, strlen(env->document_dir));
+}
+
+static fz_buffer *
+bundle_serve_hooks_cat(fz_context *ctx, struct bundle_server *env, const char *name)
+{
+  char code = 0;
+  fz_buffer *data = NULL, *result = NULL;
+
+  pthread_mutex_lock(&env->mutex);
+
+  prefetched_reply **p = find_prefetched(env, name);
+  if (*p)
+  {
+    prefetched_reply *reply = *p;
+    *p = reply->next;
+    code = reply->code;
+    data = reply->data;
+    env->prefetched_count -= 1;
+    env->prefetched_bytes -= data->len;
+    fz_free(ctx, reply->name);
+    fz_free(ctx, reply);
+  }
+  else if (!env->broken)
+  {
+    my_flock(fileno(env->lock), LOCK_EX);
+
+    bool ok = send_request(env, name);
+    if (ok && fflush(env->o) != 0)
+    {
+      perror("bundle_serve_hooks_cat: fflush");
+      ok = 0;
+    }
+    if (ok)
+      ok = read_reply(ctx, env, &code, &data);
+    // A request may have been sent without its reply being read
+    if (!ok)
+      mark_broken(env);
+
+    my_flock(fileno(env->lock), LOCK_UN);
+  }
+
+  fz_try(ctx)
+  {
+    if (data)
+      result = reply_buffer(ctx, env, name, code, data);
+    if (result)
+      manifest_add(ctx, env, name);
+  }
+  fz_always(ctx)
+  {
+    pthread_mutex_unlock(&env->mutex);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
 
-release:
-  my_flock(fileno(env->lock), LOCK_UN);
   return result;
 }
 
+fz_buffer *bundle_server_take(fz_context *ctx, bundle_server *env, const char *name)
+{
+  fz_buffer *result = NULL;
+
+  if (name[0] == '/')
+    return NULL;
+
+  pthread_mutex_lock(&env->mutex);
+  fz_try(ctx)
+  {
+    prefetched_reply **p = find_prefetched(env, name);
+    if (*p)
+    {
+      prefetched_reply *reply = *p;
+      *p = reply->next;
+      env->prefetched_count -= 1;
+      env->prefetched_bytes -= reply->data->len;
+      char code = reply->code;
+      fz_buffer *data = reply->data;
+      reply->data = NULL;
+      free_prefetched(ctx, reply);
+      result = reply_buffer(ctx, env, name, code, data);
+      // Not in the bundle: don't prefetch it again
+      if (result)
+        manifest_add(ctx, env, name);
+    }
+    else
+      manifest_add(ctx, env, name);
+  }
+  fz_always(ctx)
+  {
+    pthread_mutex_unlock(&env->mutex);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+
+  return result;
+}
+
+// Requests sent before reading the first reply. The server answers in
+// order, keep the total size of a batch below the capacity of a pipe so
+// that neither side blocks on a full pipe while the other is writing.
+#define PREFETCH_BATCH 32
+
+// Candidate names of a resource in the bundle, with the extension of the
+// name or, if it has none, the default extensions of its kind.
+// Returns false if the resource does not come from the bundle.
+static bool resource_exts(fz_context *ctx, dvi_reskind kind,
+                          const char *name, const char *exts[5])
+{
+  switch (kind)
+  {
+    case RES_FONT:
+      if (name[0] == '/' || name[0] == '.' || fz_file_exists(ctx, name))
+        return 0;
+    case RES_ENC:
+    case RES_MAP:
+    case RES_TFM:
+    case RES_VF:
+      break;
+    default:
+      return 0;
+  }
+
+  const char *ext0 = name;
+  while (*ext0 && *ext0 != '.') ext0++;
+  exts[0] = ext0;
+  exts[1] = NULL;
+  if (!*ext0)
+  {
+    switch (kind)
+    {
+      case RES_ENC:
+        exts[0] = ".enc";
+        break;
+      case RES_MAP:
+        exts[0] = ".map";
+        break;
+      case RES_TFM:
+        exts[0] = ".tfm";
+        break;
+      case RES_VF:
+        exts[0] = ".vf";
+        break;
+      case RES_FONT:
+        exts[0] = ".pfb";
+        exts[1] = ".otf";
+        exts[2] = ".ttf";
+        exts[3] = NULL;
+        break;
+      default:
+        exts[0] = "";
+    }
+  }
+  else
+    exts[0] = "";
+  return 1;
+}
+
+// Ask for many resources at once: requests are written back to back and
+// the replies are kept until bundle_serve_hooks_cat asks for them, so that
+// a batch costs a single round-trip instead of one per file.
+// Only the first candidate name of each resource is prefetched.
+// If kinds is NULL, names are paths in the bundle.
+// Prefetching is only a hint: failures throw, leaving nothing prefetched.
+static void
+prefetch(fz_context *ctx, bundle_server *env, int count,
+         const dvi_reskind *kinds, const char *const *names)
+{
+  prefetched_reply *batch[PREFETCH_BATCH];
+  int pending = 0;
+  fz_var(pending);
+
+  pthread_mutex_lock(&env->mutex);
+  my_flock(fileno(env->lock), LOCK_EX);
+
+  fz_try(ctx)
+  {
+    if (env->broken)
+      count = 0;
+    for (int i = 0; i < count; )
+    {
+      int size = 0;
+      for (; i < count && pending < PREFETCH_BATCH && size < 2048; ++i)
+      {
+        const char *exts[5];
+        char buffer[1024];
+        const char *path = names[i];
+        if (kinds)
+        {
+          if (!resource_exts(ctx, kinds[i], names[i], exts))
+            continue;
+          snprintf(buffer, sizeof(buffer), "%s%s", names[i], exts[0]);
+          path = buffer;
+        }
+        if (*find_prefetched(env, path))
+          continue;
+        prefetched_reply *reply = fz_malloc_struct(ctx, prefetched_reply);
+        batch[pending++] = reply;
+        reply->name = fz_strdup(ctx, path);
+        size += strlen(path) + 1;
+      }
+
+      if (pending == 0)
+        break;
+
+      txp_info(TXP_LOG_BUNDLE, "[bundle] prefetching %d files\n", pending);
+      bool ok = 1;
+      for (int j = 0; ok && j < pending; ++j)
+        ok = send_request(env, batch[j]->name);
+      if (ok && fflush(env->o) != 0)
+      {
+        perror("bundle_serve_hooks_prefetch: fflush");
+        ok = 0;
+      }
+      for (int j = 0; ok && j < pending; ++j)
+        ok = read_reply(ctx, env, &batch[j]->code, &batch[j]->data);
+      if (!ok)
+      {
+        mark_broken(env);
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot prefetch from the bundle server");
+      }
+
+      for (int j = 0; j < pending; ++j)
+      {
+        batch[j]->next = env->prefetched;
+        env->prefetched = batch[j];
+        env->prefetched_count += 1;
+        env->prefetched_bytes += batch[j]->data->len;
+      }
+      pending = 0;
+      trim_prefetched(ctx, env);
+    }
+  }
+  fz_always(ctx)
+  {
+    my_flock(fileno(env->lock), LOCK_UN);
+    pthread_mutex_unlock(&env->mutex);
+  }
+  fz_catch(ctx)
+  {
+    for (int j = 0; j < pending; ++j)
+      free_prefetched(ctx, batch[j]);
+    fz_rethrow(ctx);
+  }
+}
+
+static void
+bundle_serve_hooks_prefetch(fz_context *ctx, void *_env, int count,
+                            const dvi_reskind *kinds, const char *const *names)
+{
+  prefetch(ctx, _env, count, kinds, names);
+}
+
+static void *startup_thread_main(void *data)
+{
+  bundle_server *env = data;
+  fz_context *ctx = env->startup_ctx;
+
+  // One batch at a time, so that the requests of TeX and of the renderer
+  // are not delayed until the whole manifest is fetched
+  fz_try(ctx)
+  {
+    for (int i = 0; i < env->startup_count &&
+                    !__atomic_load_n(&env->startup_cancel, __ATOMIC_RELAXED);
+         i += PREFETCH_BATCH)
+      prefetch(ctx, env, fz_mini(PREFETCH_BATCH, env->startup_count - i),
+               NULL, (const char *const *)env->startup + i);
+  }
+  fz_catch(ctx)
+    txp_warn(TXP_LOG_BUNDLE, "[bundle] manifest prefetch failed: %s\n",
+             fz_caught_message(ctx));
+
+  return NULL;
+}
+
+// Start prefetching the files of the previous manifest, if any
+static void manifest_load(fz_context *ctx, bundle_server *env)
+{
+  tex_cache_entry entry;
+  if (!tex_cache_load(MANIFEST_KIND, MANIFEST_VERSION, manifest_key(env), 0, &entry))
+    return;
+
+  const char *p = entry.data, *lim = p + entry.len;
+  int count = 0;
+  for (const char *q = p; q < lim; ++q)
+    count += (*q == 0);
+
+  if (count == 0 || lim[-1] != 0 ||
+      !(env->startup_ctx = fz_clone_context(ctx)))
+  {
+    tex_cache_release(&entry);
+    return;
+  }
+
+  env->startup_data = fz_new_buffer_from_copied_data(ctx, entry.data, entry.len);
+  tex_cache_release(&entry);
+  env->startup = fz_malloc_array(ctx, count, const char *);
+
+  const char *name = (const char *)env->startup_data->data;
+  for (int i = 0; i < count; ++i)
+  {
+    env->startup[i] = name;
+    name += strlen(name) + 1;
+  }
+  env->startup_count = count;
+
+  txp_info(TXP_LOG_BUNDLE, "[bundle] prefetching %d files of the manifest\n", count);
+  if (pthread_create(&env->startup_thread, NULL, startup_thread_main, env) != 0)
+  {
+    perror("bundle_server_start: pthread_create");
+    env->startup_count = 0;
+    fz_drop_context(env->startup_ctx);
+    env->startup_ctx = NULL;
+  }
+}
+
+void bundle_server_save_manifest(fz_context *ctx, bundle_server *env)
+{
+  fz_buffer *buf = NULL;
+  fz_var(buf);
+  pthread_mutex_lock(&env->mutex);
+  fz_try(ctx)
+  {
+    if (env->manifest_count > 0)
+    {
+      buf = fz_new_buffer(ctx, env->manifest_count * 32);
+      for (int i = 0; i < env->manifest_count; ++i)
+        fz_append_data(ctx, buf, env->manifest[i], strlen(env->manifest[i]) + 1);
+      tex_cache_store(MANIFEST_KIND, MANIFEST_VERSION, manifest_key(env), 0,
+                      buf->data, buf->len);
+    }
+  }
+  fz_always(ctx)
+  {
+    pthread_mutex_unlock(&env->mutex);
+    fz_drop_buffer(ctx, buf);
+  }
+  fz_catch(ctx)
+    txp_warn(TXP_LOG_BUNDLE, "[bundle] cannot save manifest: %s\n",
+             fz_caught_message(ctx));
+}
+
 static fz_stream *
 bundle_serve_hooks_open_file(fz_context *ctx, void *_env, dvi_reskind kind, const char *name)
 {
   char *path = NULL;
   bool free_path = 0;
-  fprintf(stderr, "[dvi] loading %s\n", name);
+  txp_debug(TXP_LOG_BUNDLE, "[dvi] loading %s\n", name);
   bundle_server *env = _env;
   switch (kind)
   {
@@ -352,62 +1133,47 @@ bundle_serve_hooks_open_file(fz_context *ctx, void *_env, dvi_reskind kind, cons
           path[root_len] = '/';
           memcpy(path + root_len + 1, name, name_len);
         }
-        else
-          memcpy(path + root_len, name, name_len);
-        path[len] = 0;
-      }
-      break;
-
-    case RES_FONT:
-      if (name[0] == '/' || name[0] == '.' || fz_file_exists(ctx, name))
-      {
-        path = (char *)name;
-        break;
-      }
-    case RES_ENC:
-    case RES_MAP:
-    case RES_TFM:
-    case RES_VF:
-    {
-      const char *ext0 = name;
-      while (*ext0 && *ext0 != '.') ext0++;
-      const char *exts[5] = {ext0, NULL};
-      if (!*ext0)
-      {
-        switch (kind)
-        {
-          case RES_ENC:
-            exts[0] = ".enc";
-            break;
-          case RES_MAP:
-            exts[0] = ".map";
-            break;
-          case RES_TFM:
-            exts[0] = ".tfm";
-            break;
-          case RES_VF:
-            exts[0] = ".vf";
-            break;
-          case RES_FONT:
-            exts[0] = ".pfb";
-            exts[1] = ".otf";
-            exts[2] = ".ttf";
-            exts[3] = NULL;
-            break;
-          default:
-            exts[0] = "";
-        }
+        else
+          memcpy(path + root_len, name, name_len);
+        path[len] = 0;
+      }
+      break;
+
+    case RES_FONT:
+    case RES_ENC:
+    case RES_MAP:
+    case RES_TFM:
+    case RES_VF:
+    {
+      const char *exts[5];
+      if (!resource_exts(ctx, kind, name, exts))
+      {
+        path = (char *)name;
+        break;
       }
-      else
-        exts[0] = "";
 
       for (const char **ext = exts; *ext; ++ext)
       {
         char path[1024];
         sprintf(path, "%s%s", name, *ext);
-        fz_stream *stream = bundle_serve_hooks_cat(ctx, env, path);
-        if (stream)
+        fz_buffer *buffer = bundle_serve_hooks_cat(ctx, env, path);
+        if (buffer)
+        {
+          fz_stream *stream = NULL;
+          fz_try(ctx)
+          {
+            stream = fz_open_buffer(ctx, buffer);
+          }
+          fz_always(ctx)
+          {
+            fz_drop_buffer(ctx, buffer);
+          }
+          fz_catch(ctx)
+          {
+            fz_rethrow(ctx);
+          }
           return stream;
+        }
       }
       return NULL;
     }
@@ -421,7 +1187,7 @@ bundle_serve_hooks_open_file(fz_context *ctx, void *_env, dvi_reskind kind, cons
 
   if (path == NULL)
   {
-    fprintf(stderr, "dvi_resmanager_open_file(%s): no path found\n", name);
+    txp_warn(TXP_LOG_DVI, "dvi_resmanager_open_file(%s): no path found\n", name);
     return NULL;
   }
 
@@ -445,11 +1211,66 @@ bundle_serve_hooks_open_file(fz_context *ctx, void *_env, dvi_reskind kind, cons
   return result;
 }
 
+// Contents of a file without copying what is already in memory: replies of
+// the server are returned directly and the bundle cache is mapped
+static fz_buffer *
+bundle_serve_hooks_load_file(fz_context *ctx, void *_env, dvi_reskind kind, const char *name)
+{
+  bundle_server *env = _env;
+  const char *exts[5];
+
+  if (resource_exts(ctx, kind, name, exts))
+  {
+    for (const char **ext = exts; *ext; ++ext)
+    {
+      char path[1024];
+      snprintf(path, sizeof(path), "%s%s", name, *ext);
+      fz_buffer *buffer = bundle_serve_hooks_cat(ctx, env, path);
+      if (buffer)
+        return buffer;
+    }
+    return NULL;
+  }
+
+  fz_stream *stm = bundle_serve_hooks_open_file(ctx, env, kind, name);
+  fz_buffer *buffer = NULL;
+  if (!stm)
+    return NULL;
+
+  fz_try(ctx)
+  {
+    buffer = fz_read_all(ctx, stm, 16384);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_stream(ctx, stm);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+  return buffer;
+}
+
 static void
 bundle_serve_free_env(fz_context *ctx, void *_env)
 {
   bundle_server *env = _env;
 
+  if (env->startup_ctx)
+  {
+    // Wait for the batch in flight only
+    __atomic_store_n(&env->startup_cancel, 1, __ATOMIC_RELAXED);
+    pthread_join(env->startup_thread, NULL);
+    fz_drop_context(env->startup_ctx);
+  }
+  fz_free(ctx, env->startup);
+  fz_drop_buffer(ctx, env->startup_data);
+
+  for (int i = 0; i < env->manifest_count; ++i)
+    fz_free(ctx, env->manifest[i]);
+  fz_free(ctx, env->manifest);
+
   if (fclose(env->i) != 0)
     perror("bundle_serve_free_env: fclose(i)");
 
@@ -460,6 +1281,13 @@ bundle_serve_free_env(fz_context *ctx, void *_env)
   if (waitpid(env->pid, dummy, 0) != env->pid)
     perror("bundle_serve_free_env: waitpid");
 
+  for (prefetched_reply *reply = env->prefetched, *next; reply; reply = next)
+  {
+    next = reply->next;
+    free_prefetched(ctx, reply);
+  }
+
+  pthread_mutex_destroy(&env->mutex);
   fz_free(ctx, env->document_dir);
   fz_free(ctx, env);
 }
@@ -534,6 +1362,8 @@ bundle_server_start(fz_context *ctx,
     abort();
   }
   env->document_dir = path;
+  pthread_mutex_init(&env->mutex, NULL);
+  manifest_load(ctx, env);
   return env;
 }
 
@@ -558,13 +1388,26 @@ dvi_reshooks bundle_server_hooks(bundle_server *env)
     .env = env,
     .free_env = bundle_serve_free_env,
     .open_file = bundle_serve_hooks_open_file,
+    .load_file = bundle_serve_hooks_load_file,
+    .prefetch = bundle_serve_hooks_prefetch,
   };
 }
 
+dvi_reshooks dvi_borrow_hooks(dvi_reshooks hooks)
+{
+  hooks.free_env = NULL;
+  return hooks;
+}
+
+static void font_store_release(fz_context *ctx, const void *owner);
+
 void dvi_free_hooks(fz_context *ctx, const dvi_reshooks *hooks)
 {
   if (hooks->free_env)
+  {
+    font_store_release(ctx, hooks->env);
     hooks->free_env(ctx, hooks->env);
+  }
 }
 
 
@@ -576,6 +1419,32 @@ static fz_stream *dvi_resmanager_open_file(fz_context *ctx, dvi_resmanager *rm,
   return rm->hooks.open_file(ctx, rm->hooks.env, kind, path);
 }
 
+// Read a whole file, avoiding a copy when the hooks can provide it directly
+static fz_buffer *dvi_resmanager_load_file(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *path)
+{
+  if (rm->hooks.load_file)
+    return rm->hooks.load_file(ctx, rm->hooks.env, kind, path);
+
+  fz_stream *stm = dvi_resmanager_open_file(ctx, rm, kind, path);
+  fz_buffer *buffer = NULL;
+  if (!stm)
+    return NULL;
+
+  fz_try(ctx)
+  {
+    buffer = fz_read_all(ctx, stm, 16384);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_stream(ctx, stm);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+  return buffer;
+}
+
 static void load_fontmap(fz_context *ctx, dvi_resmanager *rm)
 {
   if (rm->map)
@@ -607,11 +1476,11 @@ static void load_fontmap(fz_context *ctx, dvi_resmanager *rm)
 dvi_resmanager *dvi_resmanager_new(fz_context *ctx, dvi_reshooks hooks)
 {
   dvi_resmanager *rm = fz_malloc_struct(ctx, dvi_resmanager);
-  rm->first_dvi_font = NULL;
-  rm->first_tex_enc = NULL;
-  rm->first_pdf_doc = NULL;
-  rm->first_fz_font = NULL;
-  rm->first_image = NULL;
+  restable_init(&rm->dvi_fonts, "tex fonts");
+  restable_init(&rm->tex_encs, "encodings");
+  restable_init(&rm->pdf_docs, "pdf documents");
+  restable_init(&rm->fz_fonts, "font files");
+  restable_init(&rm->images, "images");
   rm->hooks = hooks;
 
   load_fontmap(ctx, rm);
@@ -619,79 +1488,116 @@ dvi_resmanager *dvi_resmanager_new(fz_context *ctx, dvi_reshooks hooks)
   return rm;
 }
 
-void dvi_resmanager_free(fz_context *ctx, dvi_resmanager *rm)
+void dvi_resmanager_print_stats(fz_context *ctx, dvi_resmanager *rm)
 {
-  dvi_free_hooks(ctx, &rm->hooks);
+  restable_print_stats(&rm->dvi_fonts);
+  restable_print_stats(&rm->tex_encs);
+  restable_print_stats(&rm->fz_fonts);
+  restable_print_stats(&rm->pdf_docs);
+  restable_print_stats(&rm->images);
+}
 
+void dvi_resmanager_free(fz_context *ctx, dvi_resmanager *rm)
+{
   if (rm->map)
   {
     tex_fontmap_free(ctx, rm->map);
     rm->map = NULL;
   }
 
-  for (cell_dvi_font *cell = rm->first_dvi_font; cell; )
-  {
-    cell_dvi_font *next = cell->next;
-    fz_free(ctx, (void*)cell->font.name);
-    if (cell->font.tfm)
-      tex_tfm_free(ctx, cell->font.tfm);
-    if (cell->font.fz)
-      fz_drop_font(ctx, cell->font.fz);
-    fz_free(ctx, cell);
-    cell = next;
-  }
-  for (cell_tex_enc *cell = rm->first_tex_enc; cell; )
-  {
-    cell_tex_enc *next = cell->next;
-    fz_free(ctx, (void*)cell->name);
-    if (cell->enc)
-      tex_enc_free(ctx, cell->enc);
-    fz_free(ctx, cell);
-    cell = next;
-  }
-  for (cell_fz_font *cell = rm->first_fz_font; cell; )
+  if (rm->dvi_fonts.lookups > 0)
+    dvi_resmanager_print_stats(ctx, rm);
+
+  restable_free(ctx, &rm->dvi_fonts, free_dvi_font_cell);
+  restable_free(ctx, &rm->tex_encs, free_tex_enc_cell);
+  restable_free(ctx, &rm->fz_fonts, free_fz_font_cell);
+  restable_free(ctx, &rm->pdf_docs, free_pdf_doc_cell);
+  restable_free(ctx, &rm->images, free_image_cell);
+
+  // Resources can reference memory owned by the hooks (mapped files)
+  dvi_free_hooks(ctx, &rm->hooks);
+  fz_free(ctx, rm);
+}
+
+void dvi_resmanager_prefetch_tex_fonts(fz_context *ctx, dvi_resmanager *rm, int count,
+                                       const char *const *names, const int *lens)
+{
+  if (!rm->hooks.prefetch || count == 0)
+    return;
+
+  // Each font needs a TFM, a VF and possibly a font file and an encoding
+  int cap = count * 4, len = 0;
+  fz_ptr(dvi_reskind, kinds);
+  fz_ptr(const char *, reqs);
+  fz_ptr(char *, owned);
+
+  fz_try(ctx)
   {
-    cell_fz_font *next = cell->next;
-    fz_free(ctx, (void*)cell->name);
-    if (cell->font)
-      fz_drop_font(ctx, cell->font);
-    fz_free(ctx, cell);
-    cell = next;
+    kinds = fz_malloc_struct_array(ctx, cap, dvi_reskind);
+    reqs = fz_malloc_struct_array(ctx, cap, const char *);
+    owned = fz_malloc_struct_array(ctx, count, char *);
+
+    for (int i = 0; i < count; ++i)
+    {
+      unsigned long hash = sdbm_hash(0, names[i], lens[i]);
+      bool loaded = 0;
+      restable_foreach(&rm->dvi_fonts, hash, cell_dvi_font, cell)
+      {
+        if (strncmp(names[i], cell->font.name, lens[i]) == 0 &&
+            cell->font.name[lens[i]] == 0)
+          loaded = 1;
+      }
+      if (loaded)
+        continue;
+
+      char *name = owned[i] = dtx_strndup(ctx, names[i], lens[i]);
+      kinds[len] = RES_TFM; reqs[len++] = name;
+      kinds[len] = RES_VF; reqs[len++] = name;
+
+      tex_fontmap_entry *e = rm->map ? tex_fontmap_lookup(rm->map, name) : NULL;
+      if (e && e->font_file_name)
+      {
+        kinds[len] = RES_FONT; reqs[len++] = e->font_file_name;
+      }
+      if (e && e->enc_file_name)
+      {
+        kinds[len] = RES_ENC; reqs[len++] = e->enc_file_name;
+      }
+    }
+
+    rm->hooks.prefetch(ctx, rm->hooks.env, len, kinds, reqs);
   }
-  for (cell_pdf_doc *cell = rm->first_pdf_doc; cell; )
+  fz_always(ctx)
   {
-    cell_pdf_doc *next = cell->next;
-    fz_free(ctx, (void*)cell->name);
-    if (cell->doc)
-      pdf_drop_document(ctx, cell->doc);
-    fz_free(ctx, cell);
-    cell = next;
+    if (owned)
+      for (int i = 0; i < count; ++i)
+        if (owned[i])
+          fz_free(ctx, owned[i]);
+    fz_free(ctx, owned);
+    fz_free(ctx, reqs);
+    fz_free(ctx, kinds);
   }
-  for (cell_image *cell = rm->first_image; cell; )
+  fz_catch(ctx)
   {
-    cell_image *next = cell->next;
-    fz_free(ctx, (void*)cell->name);
-    if (cell->img)
-      fz_drop_image(ctx, cell->img);
-    fz_free(ctx, cell);
-    cell = next;
+    fz_warn(ctx, "dvi_resmanager_prefetch_tex_fonts: %s", fz_caught_message(ctx));
   }
-
-  fz_free(ctx, rm);
 }
 
 static tex_enc *dvi_resmanager_get_tex_enc(fz_context *ctx, dvi_resmanager *rm, const char *name)
 {
-  for (cell_tex_enc *cell = rm->first_tex_enc; cell; cell = cell->next)
+  unsigned long hash = sdbm_hash(0, name, strlen(name));
+  restable_foreach(&rm->tex_encs, hash, cell_tex_enc, cell)
   {
     if (strcmp(name, cell->name) == 0)
+    {
+      rm->tex_encs.hits += 1;
       return cell->enc;
+    }
   }
 
   cell_tex_enc *cell = fz_malloc_struct(ctx, cell_tex_enc);
-  cell->next = rm->first_tex_enc;
-  rm->first_tex_enc = cell;
   cell->name = fz_strdup(ctx, name);
+  restable_add(ctx, &rm->tex_encs, &cell->link, hash);
 
   fz_ptr(fz_stream, stm);
   fz_try(ctx)
@@ -712,40 +1618,214 @@ static tex_enc *dvi_resmanager_get_tex_enc(fz_context *ctx, dvi_resmanager *rm,
   return cell->enc;
 }
 
+// Font files are parsed once per document: the faces are shared by the
+// resource managers that use the same hooks (the one of the document and
+// those of its render and prerender workers, which borrow them), mupdf
+// serializes the use of FreeType between threads. The same name can
+// designate different files for different bundles or tectonic paths, so
+// fonts are keyed by the environment of the hooks and released with it.
+// Names relative to the document directory are not shared.
+//
+// The mutex only protects the table. A font is loaded without it, behind a
+// cell marking the load in flight: other threads asking for the same font
+// wait on `loaded', those asking for other fonts are not delayed.
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t loaded;
+  restable fonts;
+} font_store = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .loaded = PTHREAD_COND_INITIALIZER,
+  .fonts = {.kind = "shared font files"},
+};
+
+static bool font_store_shares(const char *name)
+{
+  return name[0] != '.';
+}
+
+// Called with the mutex held
+static cell_fz_font *font_store_find(const void *owner, const char *name, int len, int index)
+{
+  unsigned long hash = sdbm_hash(0, name, len);
+  restable_foreach(&font_store.fonts, hash, cell_fz_font, cell)
+  {
+    if (cell->owner == owner &&
+        strncmp(name, cell->name, len) == 0 &&
+        cell->name[len] == 0 &&
+        cell->index == index)
+      return cell;
+  }
+  return NULL;
+}
+
+// Look for a font in the store, waiting for it if it is being loaded.
+// Return 1 and the font, possibly NULL if it could not be loaded, if it is
+// known. Otherwise return 0 and let the caller load it: the other threads
+// wait until font_store_finish.
+static bool font_store_begin(fz_context *ctx, const void *owner, const void *loader,
+                             const char *name, int index, fz_font **font)
+{
+  int len = strlen(name);
+  bool known = 0;
+  *font = NULL;
+
+  pthread_mutex_lock(&font_store.mutex);
+  fz_try(ctx)
+  {
+    cell_fz_font *cell;
+    while ((cell = font_store_find(owner, name, len, index)) && cell->loader)
+      pthread_cond_wait(&font_store.loaded, &font_store.mutex);
+
+    if (cell)
+    {
+      font_store.fonts.hits += 1;
+      *font = cell->font ? fz_keep_font(ctx, cell->font) : NULL;
+      known = 1;
+    }
+    else
+    {
+      cell = fz_malloc_struct(ctx, cell_fz_font);
+      fz_try(ctx)
+        cell->name = fz_strdup(ctx, name);
+      fz_catch(ctx)
+      {
+        fz_free(ctx, cell);
+        fz_rethrow(ctx);
+      }
+      cell->index = index;
+      cell->owner = owner;
+      cell->loader = loader;
+      restable_add(ctx, &font_store.fonts, &cell->link, sdbm_hash(0, name, len));
+    }
+  }
+  fz_always(ctx)
+    pthread_mutex_unlock(&font_store.mutex);
+  fz_catch(ctx)
+    fz_rethrow(ctx);
+
+  return known;
+}
+
+// Publish the result of a load started by font_store_begin, or if it
+// failed with an error, forget the font so that it is tried again. The cell
+// may have been removed meanwhile, by an invalidation of the file: the font
+// is then not shared.
+static void font_store_finish(fz_context *ctx, const void *owner, const void *loader,
+                              const char *name, int index, fz_font *font, bool failed)
+{
+  restable *t = &font_store.fonts;
+  pthread_mutex_lock(&font_store.mutex);
+  cell_fz_font *cell = font_store_find(owner, name, strlen(name), index);
+  if (cell && cell->loader == loader)
+  {
+    if (failed)
+    {
+      reslink **l = &t->buckets[hash_bucket(cell->link.hash, t->cap)];
+      while (*l != &cell->link)
+        l = &(*l)->next;
+      *l = cell->link.next;
+      t->count -= 1;
+      free_fz_font_cell(ctx, &cell->link);
+    }
+    else
+    {
+      cell->font = font ? fz_keep_font(ctx, font) : NULL;
+      cell->loader = NULL;
+    }
+  }
+  pthread_cond_broadcast(&font_store.loaded);
+  pthread_mutex_unlock(&font_store.mutex);
+}
+
+static bool match_owner(reslink *link, const void *owner)
+{
+  return ((cell_fz_font *)link)->owner == owner;
+}
+
+// Drop the fonts loaded from the environment of some hooks, before it is freed
+static void font_store_release(fz_context *ctx, const void *owner)
+{
+  restable *t = &font_store.fonts;
+  pthread_mutex_lock(&font_store.mutex);
+  for (int i = 0; i < t->cap; ++i)
+  {
+    for (reslink **l = &t->buckets[i]; *l; )
+    {
+      reslink *link = *l;
+      if (match_owner(link, owner))
+      {
+        *l = link->next;
+        t->count -= 1;
+        free_fz_font_cell(ctx, link);
+      }
+      else
+        l = &link->next;
+    }
+  }
+  pthread_mutex_unlock(&font_store.mutex);
+}
+
+void dvi_resmanager_flush_shared(fz_context *ctx)
+{
+  pthread_mutex_lock(&font_store.mutex);
+  restable_print_stats(&font_store.fonts);
+  restable_free(ctx, &font_store.fonts, free_fz_font_cell);
+  pthread_mutex_unlock(&font_store.mutex);
+  flush_mapped_files(ctx);
+}
+
 static fz_font *dvi_resmanager_get_fz_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int len, int index)
 {
-  for (cell_fz_font *cell = rm->first_fz_font; cell; cell = cell->next)
+  // Faces of a font file share the hash of the file name, so that
+  // invalidation finds all of them
+  unsigned long hash = sdbm_hash(0, name, len);
+  restable_foreach(&rm->fz_fonts, hash, cell_fz_font, cell)
   {
     if (strncmp(name, cell->name, len) == 0 &&
         cell->name[len] == 0 &&
         cell->index == index)
+    {
+      rm->fz_fonts.hits += 1;
       return cell->font;
+    }
   }
 
   fz_ptr(cell_fz_font, cell);
   fz_ptr(char, cell_name);
-  fz_ptr(fz_stream, stm);
   fz_ptr(fz_buffer, buf);
 
+  // Identifies the load of this call in the store
+  char loader;
+  bool shared = font_store_shares(name), loading = 0;
+  fz_var(loading);
+
+  int tag = txp_mem_enter(TXP_MEM_RESOURCES);
   fz_try(ctx)
   {
     cell = fz_malloc_struct(ctx, cell_fz_font);
     cell_name = dtx_strndup(ctx, name, len);
-    cell->next = rm->first_fz_font;
     cell->name = cell_name;
     cell->index = index;
 
-    fprintf(stderr, "dvi_resmanager_get_fz_font: loading font %s\n", cell_name);
-
-    stm = dvi_resmanager_open_file(ctx, rm, RES_FONT, cell_name);
+    bool known = 0;
+    if (shared)
+    {
+      known = font_store_begin(ctx, rm->hooks.env, &loader, cell_name, index,
+                               &cell->font);
+      loading = !known;
+    }
 
-    if (stm)
+    if (!known)
     {
-      buf = fz_read_all(ctx, stm, 16384);
-      cell->font = fz_new_font_from_buffer(ctx, NULL, buf, index, 0);
+      txp_debug(TXP_LOG_DVI, "dvi_resmanager_get_fz_font: loading font %s\n", cell_name);
+
+      buf = dvi_resmanager_load_file(ctx, rm, RES_FONT, cell_name);
+      if (buf)
+        cell->font = fz_new_font_from_buffer(ctx, NULL, buf, index, 0);
     }
 
-    if (cell->font)
+    if (cell->font && !known)
     {
       FT_Face face = fz_font_ft_face(ctx, cell->font);
       if (face)
@@ -759,41 +1839,55 @@ static fz_font *dvi_resmanager_get_fz_font(fz_context *ctx, dvi_resmanager *rm,
         }
       }
     }
+
+    if (loading)
+    {
+      loading = 0;
+      font_store_finish(ctx, rm->hooks.env, &loader, cell_name, index, cell->font, 0);
+    }
+
+    restable_add(ctx, &rm->fz_fonts, &cell->link, hash);
   }
   fz_always(ctx)
   {
-    if (stm)
-      fz_drop_stream(ctx, stm);
+    txp_mem_leave(tag);
     if (buf)
       fz_drop_buffer(ctx, buf);
+    // Failed: don't leave the other threads waiting
+    if (loading)
+      font_store_finish(ctx, rm->hooks.env, &loader, cell_name, index, NULL, 1);
   }
   fz_catch(ctx)
   {
+    if (cell && cell->font)
+      fz_drop_font(ctx, cell->font);
     if (cell)
       fz_free(ctx, cell);
     if (cell_name)
       fz_free(ctx, cell_name);
     fz_rethrow(ctx);
   }
-  rm->first_fz_font = cell;
 
   return cell->font;
 }
 
 dvi_font *dvi_resmanager_get_tex_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int len)
 {
-  for (cell_dvi_font *cell = rm->first_dvi_font; cell; cell = cell->next)
+  unsigned long hash = sdbm_hash(0, name, len);
+  restable_foreach(&rm->dvi_fonts, hash, cell_dvi_font, cell)
   {
     if (strncmp(name, cell->font.name, len) == 0 && cell->font.name[len] == 0)
+    {
+      rm->dvi_fonts.hits += 1;
       return &cell->font;
+    }
   }
 
   cell_dvi_font *cell = fz_malloc_struct(ctx, cell_dvi_font);
   char *font_name = dtx_strndup(ctx, name, len);
   cell->font.name = font_name;
   font_name[len] = 0;
-  cell->next = rm->first_dvi_font;
-  rm->first_dvi_font = cell;
+  restable_add(ctx, &rm->dvi_fonts, &cell->link, hash);
 
   tex_fontmap_entry *e = tex_fontmap_lookup(rm->map, cell->font.name);
 
@@ -871,32 +1965,38 @@ fz_font *dvi_resmanager_get_xdv_font(fz_context *ctx, dvi_resmanager *rm, const
   return dvi_resmanager_get_fz_font(ctx, rm, name, len, index);
 }
 
+static bool match_dvi_font(reslink *link, const char *name)
+{
+  return strcmp(name, ((cell_dvi_font *)link)->font.name) == 0;
+}
+
+static bool match_tex_enc(reslink *link, const char *name)
+{
+  return strcmp(name, ((cell_tex_enc *)link)->name) == 0;
+}
+
+static bool match_fz_font(reslink *link, const char *name)
+{
+  return strcmp(name, ((cell_fz_font *)link)->name) == 0;
+}
+
+static bool match_pdf_doc(reslink *link, const char *name)
+{
+  return strcmp(name, ((cell_pdf_doc *)link)->name) == 0;
+}
+
 void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *name)
 {
+  unsigned long hash = sdbm_hash(0, name, strlen(name));
+
   switch (kind)
   {
     case RES_PDF:
-      for (cell_pdf_doc **cell = &rm->first_pdf_doc; *cell; cell = &(*cell)->next)
-      {
-        if (strcmp(name, (*cell)->name) != 0) continue;
-        fz_free(ctx, (void*)(*cell)->name);
-        pdf_drop_document(ctx, (*cell)->doc);
-        cell_pdf_doc *next = (*cell)->next;
-        fz_free(ctx, *cell);
-        *cell = next;
-      }
+      restable_remove(ctx, &rm->pdf_docs, hash, match_pdf_doc, name, free_pdf_doc_cell);
       break;
 
     case RES_ENC:
-      for (cell_tex_enc **cell = &rm->first_tex_enc; *cell; cell = &(*cell)->next)
-      {
-        if (strcmp(name, (*cell)->name) != 0) continue;
-        fz_free(ctx, (void*)(*cell)->name);
-        tex_enc_free(ctx, (*cell)->enc);
-        cell_tex_enc *next = (*cell)->next;
-        fz_free(ctx, *cell);
-        *cell = next;
-      }
+      restable_remove(ctx, &rm->tex_encs, hash, match_tex_enc, name, free_tex_enc_cell);
       break;
 
     case RES_MAP:
@@ -905,31 +2005,14 @@ void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind
 
     case RES_TFM:
     case RES_VF:
-      for (cell_dvi_font **cell = &rm->first_dvi_font; *cell; cell = &(*cell)->next)
-      {
-        if (strcmp(name, (*cell)->font.name) != 0) continue;
-        fz_free(ctx, (void*)(*cell)->font.name);
-        if ((*cell)->font.tfm)
-          tex_tfm_free(ctx, (*cell)->font.tfm);
-        if ((*cell)->font.fz)
-          fz_drop_font(ctx, (*cell)->font.fz);
-        cell_dvi_font *next = (*cell)->next;
-        fz_free(ctx, *cell);
-        *cell = next;
-      }
+      restable_remove(ctx, &rm->dvi_fonts, hash, match_dvi_font, name, free_dvi_font_cell);
       break;
 
     case RES_FONT:
-      for (cell_fz_font **cell = &rm->first_fz_font; *cell; cell = &(*cell)->next)
-      {
-        if (strcmp(name, (*cell)->name) != 0) continue;
-        fz_free(ctx, (void*)(*cell)->name);
-        if ((*cell)->font)
-          fz_drop_font(ctx, (*cell)->font);
-        cell_fz_font *next = (*cell)->next;
-        fz_free(ctx, *cell);
-        *cell = next;
-      }
+      restable_remove(ctx, &rm->fz_fonts, hash, match_fz_font, name, free_fz_font_cell);
+      pthread_mutex_lock(&font_store.mutex);
+      restable_remove(ctx, &font_store.fonts, hash, match_fz_font, name, free_fz_font_cell);
+      pthread_mutex_unlock(&font_store.mutex);
       break;
 
     default:
@@ -937,33 +2020,43 @@ void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind
   }
 }
 
-pdf_document *dvi_resmanager_get_pdf(fz_context *ctx, dvi_resmanager *rm, const char *filename)
+static cell_pdf_doc *get_pdf_cell(fz_context *ctx, dvi_resmanager *rm, const char *filename)
 {
-  for (cell_pdf_doc *cell = rm->first_pdf_doc; cell; cell = cell->next)
+  unsigned long hash = sdbm_hash(0, filename, strlen(filename));
+  restable_foreach(&rm->pdf_docs, hash, cell_pdf_doc, cell)
+  {
     if (strcmp(filename, cell->name) == 0)
-      return cell->doc;
+    {
+      rm->pdf_docs.hits += 1;
+      return cell;
+    }
+  }
 
   fz_ptr(cell_pdf_doc, cell);
   fz_ptr(char, pname);
   fz_ptr(fz_stream, stm);
 
+  int tag = txp_mem_enter(TXP_MEM_RESOURCES);
   fz_try(ctx)
   {
     cell = fz_malloc_struct(ctx, cell_pdf_doc);
     pname = fz_strdup(ctx, filename);
     cell->name = pname;
-    cell->next = rm->first_pdf_doc;
     stm = dvi_resmanager_open_file(ctx, rm, RES_PDF, pname);
     if (stm)
       cell->doc = pdf_open_document_with_stream(ctx, stm);
+    restable_add(ctx, &rm->pdf_docs, &cell->link, hash);
   }
   fz_always(ctx)
   {
+    txp_mem_leave(tag);
     if (stm)
       fz_drop_stream(ctx, stm);
   }
   fz_catch(ctx)
   {
+    if (cell && cell->doc)
+      pdf_drop_document(ctx, cell->doc);
     if (cell)
       fz_free(ctx, cell);
     if (pname)
@@ -971,30 +2064,128 @@ pdf_document *dvi_resmanager_get_pdf(fz_context *ctx, dvi_resmanager *rm, const
     fz_rethrow(ctx);
   }
 
-  rm->first_pdf_doc = cell;
+  return cell;
+}
+
+pdf_document *dvi_resmanager_get_pdf(fz_context *ctx, dvi_resmanager *rm, const char *filename)
+{
+  return get_pdf_cell(ctx, rm, filename)->doc;
+}
+
+// from mupdf/source/pdf/pdf-page.c: pdf_page_obj_transform
+static fz_rect pdf_page_mediabox(fz_context *ctx, pdf_page *page)
+{
+  pdf_obj *pageobj = page->obj;
+
+  fz_rect mediabox = pdf_to_rect(ctx, pdf_dict_get_inheritable(ctx, pageobj, PDF_NAME(MediaBox)));
+  if (fz_is_empty_rect(mediabox))
+  {
+    mediabox.x0 = 0;
+    mediabox.y0 = 0;
+    mediabox.x1 = 612;
+    mediabox.y1 = 792;
+  }
+
+  fz_rect cropbox = pdf_to_rect(ctx, pdf_dict_get_inheritable(ctx, pageobj, PDF_NAME(CropBox)));
+  if (!fz_is_empty_rect(cropbox))
+    mediabox = fz_intersect_rect(mediabox, cropbox);
+
+  return mediabox;
+}
+
+fz_display_list *dvi_resmanager_get_pdf_page(fz_context *ctx, dvi_resmanager *rm, const char *filename, int index, fz_rect *mediabox)
+{
+  cell_pdf_doc *cell = get_pdf_cell(ctx, rm, filename);
+  if (!cell->doc)
+    return NULL;
+
+  for (int i = 0; i < cell->page_count; ++i)
+  {
+    if (cell->pages[i].index == index)
+    {
+      *mediabox = cell->pages[i].mediabox;
+      return cell->pages[i].list;
+    }
+  }
+
+  fz_ptr(pdf_page, page);
+  fz_ptr(fz_display_list, list);
+  fz_ptr(fz_device, dev);
+  fz_rect box;
+
+  int tag = txp_mem_enter(TXP_MEM_RESOURCES);
+  fz_try(ctx)
+  {
+    page = pdf_load_page(ctx, cell->doc, index);
+    box = pdf_page_mediabox(ctx, page);
+    list = fz_new_display_list(ctx, fz_infinite_rect);
+    dev = fz_new_list_device(ctx, list);
+    pdf_run_page(ctx, page, dev, fz_identity, NULL);
+    fz_close_device(ctx, dev);
+
+    if (cell->page_count == cell->page_cap)
+    {
+      cell->page_cap = cell->page_cap ? cell->page_cap * 2 : 4;
+      cell->pages = fz_realloc(ctx, cell->pages, cell->page_cap * sizeof(pdf_page_list));
+    }
+    cell->pages[cell->page_count++] =
+      (pdf_page_list){.index = index, .mediabox = box, .list = list};
+  }
+  fz_always(ctx)
+  {
+    txp_mem_leave(tag);
+    if (dev)
+      fz_drop_device(ctx, dev);
+    if (page)
+      fz_drop_page(ctx, &page->super);
+  }
+  fz_catch(ctx)
+  {
+    if (list)
+      fz_drop_display_list(ctx, list);
+    fz_rethrow(ctx);
+  }
 
-  return cell->doc;
+  *mediabox = box;
+  return list;
 }
 
 fz_image *dvi_resmanager_get_img(fz_context *ctx, dvi_resmanager *rm, const char *filename)
 {
-  for (cell_image *cell = rm->first_image; cell; cell = cell->next)
+  unsigned long hash = sdbm_hash(0, filename, strlen(filename));
+  restable_foreach(&rm->images, hash, cell_image, cell)
+  {
     if (strcmp(filename, cell->name) == 0)
+    {
+      rm->images.hits += 1;
       return cell->img;
+    }
+  }
 
   fz_ptr(cell_image, cell);
   fz_ptr(char, pname);
+  fz_ptr(fz_image, base);
 
+  int tag = txp_mem_enter(TXP_MEM_RESOURCES);
   fz_try(ctx)
   {
     cell = fz_malloc_struct(ctx, cell_image);
     pname = fz_strdup(ctx, filename);
     cell->name = pname;
-    cell->next = rm->first_image;
-    cell->img = fz_new_image_from_file(ctx, filename);
+    base = fz_new_image_from_file(ctx, filename);
+    cell->img = dvi_new_mipmap_image(ctx, base, filename);
+    restable_add(ctx, &rm->images, &cell->link, hash);
+  }
+  fz_always(ctx)
+  {
+    txp_mem_leave(tag);
+    if (base)
+      fz_drop_image(ctx, base);
   }
   fz_catch(ctx)
   {
+    if (cell && cell->img)
+      fz_drop_image(ctx, cell->img);
     if (cell)
       fz_free(ctx, cell);
     if (pname)
@@ -1002,7 +2193,5 @@ fz_image *dvi_resmanager_get_img(fz_context *ctx, dvi_resmanager *rm, const char
     fz_rethrow(ctx);
   }
 
-  rm->first_image = cell;
-
   return cell->img;
 }
@@ -96,6 +96,21 @@ void dvi_scratch_release(fz_context *ctx, dvi_scratch *t)
 
 void dvi_scratch_clear(fz_context *ctx, dvi_scratch *t)
 {
-  if (t->buf)
-    free_bufs(ctx, &t->buf->prev);
+  if (!t->buf)
+    return;
+
+  if (t->buf->prev)
+  {
+    size_t total = 0;
+    for (struct dvi_scratch_buf *buf = t->buf; buf; buf = buf->prev)
+      total += buf->size;
+    free_bufs(ctx, &t->buf);
+    struct dvi_scratch_buf *buf =
+      fz_malloc(ctx, sizeof(struct dvi_scratch_buf) + total);
+    buf->prev = NULL;
+    buf->size = total;
+    t->buf = buf;
+  }
+
+  t->buf->cursor = t->buf->size;
 }
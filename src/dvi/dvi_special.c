@@ -31,6 +31,7 @@
 #include "mydvi_interp.h"
 #include "pdf_lexer.h"
 #include "vstack.h"
+#include "txp_log.h"
 #include <math.h>
 
 #define device_cs fz_device_rgb
@@ -55,7 +56,7 @@ static bool
 unhandled(const char *kind, cursor_t cur, cursor_t lim, int ignored)
 {
   if (0 && !ignored)
-    fprintf(stderr, "unhandled %s: \"%.*s\"\n", kind, (int)(lim - cur), cur);
+    txp_info(TXP_LOG_DVI, "unhandled %s: \"%.*s\"\n", kind, (int)(lim - cur), cur);
   return 0;
 }
 
@@ -989,7 +990,7 @@ pdfcolorstack_current(fz_context *ctx, dvi_context *dc, dvi_state *st, int index
   dvi_context_flush_text(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
-    fprintf(stderr, "pdfcolorstack_current %d: no such stack\n", index);
+    txp_warn(TXP_LOG_DVI, "pdfcolorstack_current %d: no such stack\n", index);
     return 0;
   }
   //printf("pdfcolorstack_current %d\n", index);
@@ -1007,7 +1008,7 @@ colorstack_push(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
   dvi_context_flush_text(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
-    fprintf(stderr, "pdfcolorstack_push %d: no such stack\n", index);
+    txp_warn(TXP_LOG_DVI, "pdfcolorstack_push %d: no such stack\n", index);
     return 0;
   }
   //printf("pdfcolorstack_push %d\n", index);
@@ -1041,13 +1042,13 @@ colorstack_pop(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
   dvi_context_flush_text(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
-    fprintf(stderr, "pdfcolorstack_pop %d: no such stack\n", index);
+    txp_warn(TXP_LOG_DVI, "pdfcolorstack_pop %d: no such stack\n", index);
     return 0;
   }
   dvi_colorstack *stack = index == -1 ? &dc->colorstack : &dc->pdfcolorstacks.stacks[index];
   if (stack->depth == 0)
   {
-    fprintf(stderr, "pdfcolorstack_pop %d: empty stack\n", index);
+    txp_warn(TXP_LOG_DVI, "pdfcolorstack_pop %d: empty stack\n", index);
     return 0;
   }
   stack->depth -= 1;
@@ -1116,31 +1117,17 @@ embed_pdf(fz_context *ctx, dvi_context *dc, dvi_state *st, struct xform_spec *xf
 {
   fz_try(ctx)
   {
-    pdf_document *doc = dvi_resmanager_get_pdf(ctx, dc->resmanager, filename);
-    if (!doc)
+    fz_rect mediabox;
+    fz_display_list *list =
+      dvi_resmanager_get_pdf_page(ctx, dc->resmanager, filename,
+                                  xf->page ? xf->page - 1 : 0, &mediabox);
+    if (!list)
       return 0;
 
-    // from mupdf/source/pdf/pdf-page.c: pdf_page_obj_transform
-    pdf_page *page = pdf_load_page(ctx, doc, xf->page ? xf->page - 1 : 0);
-    pdf_obj *pageobj = page ? page->obj : NULL;
-
-    fz_rect mediabox = pdf_to_rect(ctx, pdf_dict_get_inheritable(ctx, pageobj, PDF_NAME(MediaBox)));
-    if (fz_is_empty_rect(mediabox))
-    {
-      mediabox.x0 = 0;
-      mediabox.y0 = 0;
-      mediabox.x1 = 612;
-      mediabox.y1 = 792;
-    }
-
-    fz_rect cropbox = pdf_to_rect(ctx, pdf_dict_get_inheritable(ctx, pageobj, PDF_NAME(CropBox)));
-    if (!fz_is_empty_rect(cropbox))
-      mediabox = fz_intersect_rect(mediabox, cropbox);
-
     fz_matrix ctm = fz_flip_vertically(dvi_get_ctm(dc, st));
     ctm = fz_concat(xf->ctm, ctm);
     ctm = fz_pre_translate(ctm, 0, mediabox.y0 - mediabox.y1);
-    pdf_run_page(ctx, page, dc->dev, ctm, NULL);
+    fz_run_display_list(ctx, list, dc->dev, ctm, fz_infinite_rect, NULL);
   }
   fz_catch(ctx)
   {
@@ -1213,7 +1200,7 @@ parse_xform_or_dim(struct xform_spec *xf, cursor_t cur, cursor_t lim)
   while (cur < lim)
   {
     
-#line 1217 "dvi_special.c"
+#line 1203 "dvi_special.c"
 {
 	int yych;
 	static const unsigned char yybm[] = {
@@ -1288,14 +1275,14 @@ parse_xform_or_dim(struct xform_spec *xf, cursor_t cur, cursor_t lim)
 		}
 	}
 yy80:
-#line 650 "dvi_special.re2c.c"
+#line 636 "dvi_special.re2c.c"
 	{ break; }
-#line 1294 "dvi_special.c"
+#line 1280 "dvi_special.c"
 yy81:
 	++cur;
-#line 541 "dvi_special.re2c.c"
+#line 527 "dvi_special.re2c.c"
 	{ continue; }
-#line 1299 "dvi_special.c"
+#line 1285 "dvi_special.c"
 yy82:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -1638,12 +1625,12 @@ yy142:
 	if (yych <= '9') goto yy142;
 yy143:
 	f0 = yyt1;
-#line 550 "dvi_special.re2c.c"
+#line 536 "dvi_special.re2c.c"
 	{
       xf->clip = pint(f0, lim);
       continue;
     }
-#line 1647 "dvi_special.c"
+#line 1633 "dvi_special.c"
 yy144:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -1679,12 +1666,12 @@ yy147:
 	if (yych <= '9') goto yy147;
 yy148:
 	f0 = yyt1;
-#line 604 "dvi_special.re2c.c"
+#line 590 "dvi_special.re2c.c"
 	{
       xf->page = pint(f0, lim);
       continue;
     }
-#line 1688 "dvi_special.c"
+#line 1674 "dvi_special.c"
 yy149:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -1866,12 +1853,12 @@ yy164:
 	if (yych <= '9') goto yy164;
 yy165:
 	f0 = yyt1;
-#line 556 "dvi_special.re2c.c"
+#line 542 "dvi_special.re2c.c"
 	{
       sx = sy = pfloat(f0, lim);
       continue;
     }
-#line 1875 "dvi_special.c"
+#line 1861 "dvi_special.c"
 yy166:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -2086,12 +2073,12 @@ yy183:
 	if (yych <= '9') goto yy183;
 yy184:
 	f0 = yyt1;
-#line 544 "dvi_special.re2c.c"
+#line 530 "dvi_special.re2c.c"
 	{
       r = pfloat(f0, lim);
       continue;
     }
-#line 2095 "dvi_special.c"
+#line 2081 "dvi_special.c"
 yy185:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -2153,12 +2140,12 @@ yy192:
 	if (yych <= '9') goto yy192;
 yy193:
 	f0 = yyt1;
-#line 562 "dvi_special.re2c.c"
+#line 548 "dvi_special.re2c.c"
 	{
       sx = pfloat(f0, lim);
       continue;
     }
-#line 2162 "dvi_special.c"
+#line 2148 "dvi_special.c"
 yy194:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -2172,12 +2159,12 @@ yy195:
 	if (yych <= '9') goto yy195;
 yy196:
 	f0 = yyt1;
-#line 568 "dvi_special.re2c.c"
+#line 554 "dvi_special.re2c.c"
 	{
       sy = pfloat(f0, lim);
       continue;
     }
-#line 2181 "dvi_special.c"
+#line 2167 "dvi_special.c"
 yy197:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -2206,12 +2193,12 @@ yy198:
 yy199:
 	++cur;
 	f0 = yyt1;
-#line 586 "dvi_special.re2c.c"
+#line 572 "dvi_special.re2c.c"
 	{
       xf->depth = pdim(f0, lim);
       continue;
     }
-#line 2215 "dvi_special.c"
+#line 2201 "dvi_special.c"
 yy200:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -2318,12 +2305,12 @@ yy213:
 yy214:
 	++cur;
 	f0 = yyt1;
-#line 574 "dvi_special.re2c.c"
+#line 560 "dvi_special.re2c.c"
 	{
       xf->width = pdim(f0, lim);
       continue;
     }
-#line 2327 "dvi_special.c"
+#line 2313 "dvi_special.c"
 yy215:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -2366,12 +2353,12 @@ yy220:
 yy221:
 	++cur;
 	f0 = yyt1;
-#line 580 "dvi_special.re2c.c"
+#line 566 "dvi_special.re2c.c"
 	{
       xf->height = pdim(f0, lim);
       continue;
     }
-#line 2375 "dvi_special.c"
+#line 2361 "dvi_special.c"
 yy222:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -2540,7 +2527,7 @@ yy245:
 	f1 = yyt2;
 	f2 = yyt3;
 	f3 = yyt4;
-#line 595 "dvi_special.re2c.c"
+#line 581 "dvi_special.re2c.c"
 	{
       xf->bbox.x0 = pfloat(f0, lim);
       xf->bbox.x1 = pfloat(f1, lim);
@@ -2548,7 +2535,7 @@ yy245:
       xf->bbox.y1 = pfloat(f3, lim);
       continue;
     }
-#line 2552 "dvi_special.c"
+#line 2538 "dvi_special.c"
 yy246:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -2647,7 +2634,7 @@ yy257:
 yy258:
 	++cur;
 	f0 = yyt1;
-#line 610 "dvi_special.re2c.c"
+#line 596 "dvi_special.re2c.c"
 	{
       int c = f0[0];
       switch (c)
@@ -2670,7 +2657,7 @@ yy258:
       }
       continue;
     }
-#line 2674 "dvi_special.c"
+#line 2660 "dvi_special.c"
 yy259:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -2755,7 +2742,7 @@ yy267:
 	f3 = yyt4;
 	f4 = yyt5;
 	f5 = yyt6;
-#line 639 "dvi_special.re2c.c"
+#line 625 "dvi_special.re2c.c"
 	{
       xf->ctm.a = pfloat(f0, lim);
       xf->ctm.b = pfloat(f1, lim);
@@ -2765,7 +2752,7 @@ yy267:
       xf->ctm.f = pfloat(f5, lim);
       continue;
     }
-#line 2769 "dvi_special.c"
+#line 2755 "dvi_special.c"
 yy268:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -2773,7 +2760,7 @@ yy268:
 	if (yych <= '9') goto yy268;
 	goto yy267;
 }
-#line 652 "dvi_special.re2c.c"
+#line 638 "dvi_special.re2c.c"
 
   }
 
@@ -2837,391 +2824,556 @@ static void drop_path(fz_context *ctx, dvi_context *dc)
   }
 }
 
-static bool
-pdf_code(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t cur, cursor_t lim)
+// The stack is kept by the context and reset before each special: the
+// values of the previous one are not needed anymore
+static vstack *get_pdf_stack(fz_context *ctx, dvi_context *dc)
 {
-  vstack *stack = vstack_new(ctx);
-  fz_var(cur);
-  fz_var(stack);
+  if (!dc->pdf_stack)
+    dc->pdf_stack = vstack_new(ctx);
+  else
+    vstack_reset(ctx, dc->pdf_stack);
+  return dc->pdf_stack;
+}
 
-  // fprintf(stderr, "pdf code: %.*s\n", (int)(lim - cur), cur);
-  fz_try(ctx)
+// Compiled pdf:code specials
+//
+// TikZ and PGF pictures are made of many pdf:code specials, mostly the
+// same ones over and over. The operators of a special are first lexed and
+// executed one at a time; if all of them are supported, the special is
+// also compiled to a list of operators with their operands flattened to
+// floats, and kept in a table keyed by its bytes. Rendering it again (the
+// same page, or another use of the same picture) replays the compiled code
+// without lexing.
+
+// Maximum number of floats taken by an operator (cm, c; d takes at most
+// 1 + 4 + 1)
+#define PDF_CODE_ARGS 6
+// Specials longer than this are not compiled
+#define PDF_CODE_MAX_LEN 4096
+// The table is emptied when it reaches this number of specials
+#define PDF_CODE_MAX_ENTRIES 8192
+
+typedef struct
+{
+  uint16_t op, argc;
+} pdf_code_op;
+
+typedef struct pdf_code_entry
+{
+  struct pdf_code_entry *next;
+  unsigned long hash;
+  int len, count;
+  char *src;
+  pdf_code_op *ops;
+  float *args;
+} pdf_code_entry;
+
+struct dvi_codecache
+{
+  pdf_code_entry **buckets;
+  int count, cap;
+
+  // Statistics
+  unsigned long lookups, hits, compiled;
+};
+
+typedef struct
+{
+  pdf_code_op *ops;
+  float *args;
+  int count, op_cap, argc, arg_cap;
+} pdf_code_builder;
+
+static unsigned long
+pdf_code_hash(cursor_t cur, cursor_t lim)
+{
+  unsigned long hash = 5381;
+  for (; cur < lim; ++cur)
+    hash = (hash * 33) ^ (unsigned char)*cur;
+  return hash;
+}
+
+static void codecache_clear(fz_context *ctx, struct dvi_codecache *cc)
+{
+  for (int i = 0; i < cc->cap; ++i)
   {
-    enum PDF_OP op;
-    do {
-      cursor_t cur0 = cur;
-      op = pdf_parse_command(ctx, stack, &cur, lim);
-      switch (op)
-      {
-        case PDF_OP_cm:
-        {
-          float fmat[6];
-          vstack_get_floats(ctx, stack, fmat, 6);
-          fz_matrix mat;
-          mat.a = fmat[0]; mat.b = fmat[1]; mat.c = fmat[2];
-          mat.d = fmat[3]; mat.e = fmat[4]; mat.f = fmat[5];
-          fz_matrix ctm = fz_concat(mat, dvi_get_ctm(dc, st));
-          dvi_set_ctm(st, ctm);
-          break;
-        }
-        case PDF_OP_q:
-        {
-          if (st->gs_stack.depth >= st->gs_stack.limit)
-            fz_throw(ctx, 0, "PDF q: stack overflow");
-          st->gs_stack.base[st->gs_stack.depth] = st->gs;
-          st->gs_stack.depth += 1;
-          break;
-        }
-        case PDF_OP_Q:
-        {
-          if (st->gs_stack.depth == 0)
-            fz_throw(ctx, 0, "PDF Q: stack underflow");
-          st->gs_stack.depth -= 1;
-
-          int clip_depth0 = st->gs.clip_depth;
-          st->gs = st->gs_stack.base[st->gs_stack.depth];
-          if (dc->dev)
-            for (int i = st->gs.clip_depth; i < clip_depth0; ++i)
-              fz_pop_clip(ctx, dc->dev);
-          break;
-        }
-        case PDF_OP_G:
-        {
-          float c[1];
-          vstack_get_floats(ctx, stack, c, 1);
-          color_set_gray(st->gs.colors.line, c[0]);
-          break;
-        }
-        case PDF_OP_g:
-        {
-          float c[1];
-          vstack_get_floats(ctx, stack, c, 1);
-          color_set_gray(st->gs.colors.fill, c[0]);
-          break;
-        }
-        case PDF_OP_RG:
-        {
-          float c[3];
-          vstack_get_floats(ctx, stack, c, 3);
-          color_set_rgb(st->gs.colors.line, c[0], c[1], c[2]);
-          break;
-        }
-        case PDF_OP_rg:
-        {
-          float c[3];
-          vstack_get_floats(ctx, stack, c, 3);
-          color_set_rgb(st->gs.colors.fill, c[0], c[1], c[2]);
-          break;
-        }
-        case PDF_OP_K:
-        {
-          float c[4];
-          vstack_get_floats(ctx, stack, c, 4);
-          color_set_cmyk(st->gs.colors.line, c[0], c[1], c[2], c[3]);
-          break;
-        }
-        case PDF_OP_k:
-        {
-          float c[4];
-          vstack_get_floats(ctx, stack, c, 4);
-          color_set_cmyk(st->gs.colors.fill, c[0], c[1], c[2], c[3]);
-          break;
-        }
+    pdf_code_entry *e = cc->buckets[i];
+    while (e)
+    {
+      pdf_code_entry *next = e->next;
+      fz_free(ctx, e);
+      e = next;
+    }
+    cc->buckets[i] = NULL;
+  }
+  cc->count = 0;
+}
 
-        case PDF_OP_w:
-        {
-          vstack_get_floats(ctx, stack, &st->gs.line_width, 1);
-          break;
-        }
+void dvi_free_special_cache(fz_context *ctx, dvi_context *dc)
+{
+  struct dvi_codecache *cc = dc->codecache;
+  if (!cc)
+    return;
+  if (cc->lookups > 0)
+    txp_info(TXP_LOG_DVI,
+             "[special] pdf code: %d entries, %lu lookups, %lu hits (%.1f%%), "
+             "%lu compiled\n",
+             cc->count, cc->lookups, cc->hits,
+             100.0 * cc->hits / cc->lookups, cc->compiled);
+  codecache_clear(ctx, cc);
+  fz_free(ctx, cc->buckets);
+  fz_free(ctx, cc);
+  dc->codecache = NULL;
+}
 
-        case PDF_OP_j:
-        {
-          float c[1];
-          vstack_get_floats(ctx, stack, c, 1);
-          st->gs.line_join = c[0];
-          break;
-        }
+static pdf_code_entry *
+codecache_find(struct dvi_codecache *cc, unsigned long hash,
+               cursor_t cur, cursor_t lim)
+{
+  int len = lim - cur;
+  for (pdf_code_entry *e = cc->buckets[hash & (cc->cap - 1)]; e; e = e->next)
+    if (e->hash == hash && e->len == len && memcmp(e->src, cur, len) == 0)
+      return e;
+  return NULL;
+}
 
-        case PDF_OP_J:
-        {
-          float c[1];
-          vstack_get_floats(ctx, stack, c, 1);
-          st->gs.line_caps = c[0];
-          break;
-        }
+static void
+codecache_add(fz_context *ctx, struct dvi_codecache *cc, unsigned long hash,
+              cursor_t cur, cursor_t lim, pdf_code_builder *b)
+{
+  if (cc->count >= PDF_CODE_MAX_ENTRIES)
+    codecache_clear(ctx, cc);
 
-        case PDF_OP_M:
-        {
-          float c[1];
-          vstack_get_floats(ctx, stack, c, 1);
-          st->gs.miter_limit = c[0];
-          break;
-        }
+  int len = lim - cur;
+  pdf_code_entry *e = fz_malloc(ctx, sizeof(pdf_code_entry) +
+                                sizeof(float) * b->argc +
+                                sizeof(pdf_code_op) * b->count + len);
+  e->hash = hash;
+  e->len = len;
+  e->count = b->count;
+  e->args = (float *)(e + 1);
+  e->ops = (pdf_code_op *)(e->args + b->argc);
+  e->src = (char *)(e->ops + b->count);
+  memcpy(e->args, b->args, sizeof(float) * b->argc);
+  memcpy(e->ops, b->ops, sizeof(pdf_code_op) * b->count);
+  memcpy(e->src, cur, len);
 
-        case PDF_OP_m:
-        {
-          float c[2];
-          vstack_get_floats(ctx, stack, c, 2);
-          fz_moveto(ctx, get_path(ctx, dc), c[0], c[1]);
-          break;
-        }
+  pdf_code_entry **bucket = &cc->buckets[hash & (cc->cap - 1)];
+  e->next = *bucket;
+  *bucket = e;
+  cc->count += 1;
+  cc->compiled += 1;
+}
 
-        case PDF_OP_l:
-        {
-          float c[2];
-          vstack_get_floats(ctx, stack, c, 2);
-          fz_lineto(ctx, get_path(ctx, dc), c[0], c[1]);
-          break;
-        }
+static struct dvi_codecache *get_codecache(fz_context *ctx, dvi_context *dc)
+{
+  if (!dc->codecache)
+  {
+    struct dvi_codecache *cc = fz_malloc_struct(ctx, struct dvi_codecache);
+    cc->cap = 1024;
+    cc->buckets = fz_malloc_struct_array(ctx, cc->cap, pdf_code_entry *);
+    dc->codecache = cc;
+  }
+  return dc->codecache;
+}
 
-        case PDF_OP_c:
-        {
-          float c[6];
-          vstack_get_floats(ctx, stack, c, 6);
-          fz_curveto(ctx, get_path(ctx, dc), c[0], c[1], c[2], c[3], c[4], c[5]);
-          break;
-        }
-
-        case PDF_OP_b:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            fz_path *path = get_path(ctx, dc);
-            fz_closepath(ctx, path);
-            fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.line, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+static void
+pdf_code_emit(fz_context *ctx, pdf_code_builder *b, enum PDF_OP op,
+              const float *c, int argc)
+{
+  if (b->count == b->op_cap)
+  {
+    b->op_cap = b->op_cap ? b->op_cap * 2 : 16;
+    b->ops = fz_realloc(ctx, b->ops, sizeof(pdf_code_op) * b->op_cap);
+  }
+  if (b->argc + argc > b->arg_cap)
+  {
+    b->arg_cap = b->arg_cap ? b->arg_cap * 2 : 64;
+    b->args = fz_realloc(ctx, b->args, sizeof(float) * b->arg_cap);
+  }
+  b->ops[b->count].op = op;
+  b->ops[b->count].argc = argc;
+  b->count += 1;
+  memcpy(b->args + b->argc, c, sizeof(float) * argc);
+  b->argc += argc;
+}
 
-        case PDF_OP_b_star:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            fz_path *path = get_path(ctx, dc);
-            fz_closepath(ctx, path);
-            fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.line, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+// Number of float operands of a supported operator, -1 if unsupported
+static int pdf_code_arity(enum PDF_OP op)
+{
+  switch (op)
+  {
+    case PDF_OP_cm: case PDF_OP_c:
+      return 6;
+    case PDF_OP_K: case PDF_OP_k: case PDF_OP_re:
+      return 4;
+    case PDF_OP_RG: case PDF_OP_rg:
+      return 3;
+    case PDF_OP_m: case PDF_OP_l:
+      return 2;
+    case PDF_OP_G: case PDF_OP_g: case PDF_OP_w:
+    case PDF_OP_j: case PDF_OP_J: case PDF_OP_M:
+      return 1;
+    case PDF_OP_q: case PDF_OP_Q:
+    case PDF_OP_b: case PDF_OP_b_star: case PDF_OP_B: case PDF_OP_B_star:
+    case PDF_OP_f: case PDF_OP_F: case PDF_OP_f_star:
+    case PDF_OP_S: case PDF_OP_s: case PDF_OP_h: case PDF_OP_n:
+    case PDF_OP_W: case PDF_OP_W_star:
+    case PDF_NONE:
+      return 0;
+    default:
+      return -1;
+  }
+}
 
-        case PDF_OP_B:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            fz_path *path = get_path(ctx, dc);
-            fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.line, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+// Execute a supported operator with its flattened operands
+static void
+pdf_code_exec(fz_context *ctx, dvi_context *dc, dvi_state *st,
+              enum PDF_OP op, const float *c)
+{
+  switch (op)
+  {
+    case PDF_OP_cm:
+    {
+      fz_matrix mat;
+      mat.a = c[0]; mat.b = c[1]; mat.c = c[2];
+      mat.d = c[3]; mat.e = c[4]; mat.f = c[5];
+      fz_matrix ctm = fz_concat(mat, dvi_get_ctm(dc, st));
+      dvi_set_ctm(st, ctm);
+      break;
+    }
+    case PDF_OP_q:
+    {
+      if (st->gs_stack.depth >= st->gs_stack.limit)
+        fz_throw(ctx, 0, "PDF q: stack overflow");
+      st->gs_stack.base[st->gs_stack.depth] = st->gs;
+      st->gs_stack.depth += 1;
+      break;
+    }
+    case PDF_OP_Q:
+    {
+      if (st->gs_stack.depth == 0)
+        fz_throw(ctx, 0, "PDF Q: stack underflow");
+      st->gs_stack.depth -= 1;
 
-        case PDF_OP_B_star:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            fz_path *path = get_path(ctx, dc);
-            fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.fill, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+      int clip_depth0 = st->gs.clip_depth;
+      st->gs = st->gs_stack.base[st->gs_stack.depth];
+      if (dc->dev)
+        for (int i = st->gs.clip_depth; i < clip_depth0; ++i)
+          fz_pop_clip(ctx, dc->dev);
+      break;
+    }
+    case PDF_OP_G:
+      color_set_gray(st->gs.colors.line, c[0]);
+      break;
+    case PDF_OP_g:
+      color_set_gray(st->gs.colors.fill, c[0]);
+      break;
+    case PDF_OP_RG:
+      color_set_rgb(st->gs.colors.line, c[0], c[1], c[2]);
+      break;
+    case PDF_OP_rg:
+      color_set_rgb(st->gs.colors.fill, c[0], c[1], c[2]);
+      break;
+    case PDF_OP_K:
+      color_set_cmyk(st->gs.colors.line, c[0], c[1], c[2], c[3]);
+      break;
+    case PDF_OP_k:
+      color_set_cmyk(st->gs.colors.fill, c[0], c[1], c[2], c[3]);
+      break;
 
-        case PDF_OP_f:
-        case PDF_OP_F:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_path *path = get_path(ctx, dc);
-            fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_w:
+      st->gs.line_width = c[0];
+      break;
 
-        case PDF_OP_f_star:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_path *path = get_path(ctx, dc);
-            fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_j:
+      st->gs.line_join = c[0];
+      break;
 
-        case PDF_OP_S:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            fz_path *path = get_path(ctx, dc);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.line, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_J:
+      st->gs.line_caps = c[0];
+      break;
 
-        case PDF_OP_s:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            stst.dash_cap = stst.start_cap = stst.end_cap =
-                (int)st->gs.line_caps;
-            stst.dash_len = st->gs.dash_len;
-            memcpy(stst.dash_list, st->gs.dash,
-                   sizeof(float) * st->gs.dash_len);
-            stst.dash_phase = st->gs.dash_phase;
-            fz_path *path = get_path(ctx, dc);
-            fz_closepath(ctx, path);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.line, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_M:
+      st->gs.miter_limit = c[0];
+      break;
 
-        case PDF_OP_h:
-        {
-          fz_path *path = get_path(ctx, dc);
-          fz_closepath(ctx, path);
-          break;
-        }
+    case PDF_OP_m:
+      fz_moveto(ctx, get_path(ctx, dc), c[0], c[1]);
+      break;
 
-        case PDF_OP_re:
-        {
-          float c[4];
-          vstack_get_floats(ctx, stack, c, 4);
-          fz_rectto(ctx, get_path(ctx, dc), c[0], c[1], c[0] + c[2], c[1] + c[3]);
-          break;
-        }
+    case PDF_OP_l:
+      fz_lineto(ctx, get_path(ctx, dc), c[0], c[1]);
+      break;
 
-        case PDF_OP_n:
-        {
-          drop_path(ctx, dc);
-          break;
-        }
-
-        case PDF_OP_W:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_clip_path(ctx, dc->dev, get_path(ctx, dc), 0, ctm,
-                         fz_infinite_rect);
-            st->gs.clip_depth += 1;
-          }
-          break;
+    case PDF_OP_c:
+      fz_curveto(ctx, get_path(ctx, dc), c[0], c[1], c[2], c[3], c[4], c[5]);
+      break;
 
-        case PDF_OP_W_star:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_clip_path(ctx, dc->dev, get_path(ctx, dc), 1, ctm,
-                         fz_infinite_rect);
-            st->gs.clip_depth += 1;
-          }
-          break;
+    case PDF_OP_b:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        fz_path *path = get_path(ctx, dc);
+        fz_closepath(ctx, path);
+        fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.line, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
 
-        case PDF_OP_d:
-        {
-          val v[2];
-          vstack_get_arguments(ctx, stack, v, 2);
-          st->gs.dash_len = val_array_length(ctx, stack, v[0]);
-          if (st->gs.dash_len > 4) st->gs.dash_len = 4;
-          for (int i = 0; i < st->gs.dash_len; ++i)
-            st->gs.dash[i] = val_number(ctx, val_array_get(ctx, stack, v[0], i));
-          st->gs.dash_phase = val_number(ctx, v[1]);
-          break;
-        }
-
-        case PDF_OP_ri:
-        case PDF_OP_i:
-        case PDF_OP_gs:
-        case PDF_OP_v:
-        case PDF_OP_y:
-        case PDF_OP_BT:
-        case PDF_OP_ET:
-        case PDF_OP_Tc:
-        case PDF_OP_Tw:
-        case PDF_OP_Tz:
-        case PDF_OP_TL:
-        case PDF_OP_Tf:
-        case PDF_OP_Tr:
-        case PDF_OP_Ts:
-        case PDF_OP_Td:
-        case PDF_OP_TD:
-        case PDF_OP_Tm:
-        case PDF_OP_T_star:
-        case PDF_OP_Tj:
-        case PDF_OP_TJ:
-        case PDF_OP_squote:
-        case PDF_OP_dquote:
-        case PDF_OP_d0:
-        case PDF_OP_d1:
-        case PDF_OP_CS:
-        case PDF_OP_cs:
-        case PDF_OP_SC:
-        case PDF_OP_sc:
-        case PDF_OP_SCN:
-        case PDF_OP_scn:
-        case PDF_OP_sh:
-        case PDF_OP_Do:
-        case PDF_OP_MP:
-        case PDF_OP_DP:
-        case PDF_OP_BMC:
-        case PDF_OP_BDC:
-        case PDF_OP_EMC:
-        case PDF_OP_BX:
-        case PDF_OP_EX:
-        default:
-          fprintf(stderr, "pdf unhandled op %s in:\n%.*s\n", pdf_op_name(op),
-                  (int)(cur - cur0), cur0);
-          break;
+    case PDF_OP_b_star:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        fz_path *path = get_path(ctx, dc);
+        fz_closepath(ctx, path);
+        fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.line, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
 
-        case PDF_NONE:
-          break;
+    case PDF_OP_B:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        fz_path *path = get_path(ctx, dc);
+        fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.line, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_B_star:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        fz_path *path = get_path(ctx, dc);
+        fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.fill, 1.0, color_params);
       }
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_f:
+    case PDF_OP_F:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_path *path = get_path(ctx, dc);
+        fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_f_star:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_path *path = get_path(ctx, dc);
+        fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_S:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        fz_path *path = get_path(ctx, dc);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.line, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_s:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        stst.dash_cap = stst.start_cap = stst.end_cap =
+            (int)st->gs.line_caps;
+        stst.dash_len = st->gs.dash_len;
+        memcpy(stst.dash_list, st->gs.dash,
+               sizeof(float) * st->gs.dash_len);
+        stst.dash_phase = st->gs.dash_phase;
+        fz_path *path = get_path(ctx, dc);
+        fz_closepath(ctx, path);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.line, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_h:
+    {
+      fz_path *path = get_path(ctx, dc);
+      fz_closepath(ctx, path);
+      break;
+    }
+
+    case PDF_OP_re:
+      fz_rectto(ctx, get_path(ctx, dc), c[0], c[1], c[0] + c[2], c[1] + c[3]);
+      break;
+
+    case PDF_OP_n:
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_W:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_clip_path(ctx, dc->dev, get_path(ctx, dc), 0, ctm,
+                     fz_infinite_rect);
+        st->gs.clip_depth += 1;
+      }
+      break;
+
+    case PDF_OP_W_star:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_clip_path(ctx, dc->dev, get_path(ctx, dc), 1, ctm,
+                     fz_infinite_rect);
+        st->gs.clip_depth += 1;
+      }
+      break;
+
+    case PDF_OP_d:
+    {
+      // Operands are flattened: length, dashes, phase
+      st->gs.dash_len = c[0];
+      for (int i = 0; i < st->gs.dash_len; ++i)
+        st->gs.dash[i] = c[1 + i];
+      st->gs.dash_phase = c[1 + st->gs.dash_len];
+      break;
+    }
+
+
+    default:
+      break;
+  }
+}
+
+static bool
+pdf_code(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t cur, cursor_t lim)
+{
+  struct dvi_codecache *cc = get_codecache(ctx, dc);
+  unsigned long hash = pdf_code_hash(cur, lim);
+  cc->lookups += 1;
+
+  pdf_code_entry *e = codecache_find(cc, hash, cur, lim);
+  if (e)
+  {
+    cc->hits += 1;
+    fz_try(ctx)
+    {
+      const float *c = e->args;
+      for (int i = 0; i < e->count; ++i)
+      {
+        pdf_code_exec(ctx, dc, st, e->ops[i].op, c);
+        c += e->ops[i].argc;
+      }
+    }
+    fz_catch(ctx)
+      return 0;
+    return 1;
+  }
+
+  vstack *stack = get_pdf_stack(ctx, dc);
+  pdf_code_builder b = {0,};
+  bool compile = lim - cur <= PDF_CODE_MAX_LEN;
+  cursor_t cur_start = cur;
+  fz_var(cur);
+  fz_var(compile);
+  fz_var(b);
+
+  // fprintf(stderr, "pdf code: %.*s\n", (int)(lim - cur), cur);
+  fz_try(ctx)
+  {
+    enum PDF_OP op;
+    do {
+      cursor_t cur0 = cur;
+      op = pdf_parse_command(ctx, stack, &cur, lim);
+      float c[PDF_CODE_ARGS];
+      int argc = pdf_code_arity(op);
+      if (op == PDF_OP_d)
+      {
+        val v[2];
+        vstack_get_arguments(ctx, stack, v, 2);
+        int len = val_array_length(ctx, stack, v[0]);
+        if (len > 4) len = 4;
+        c[0] = len;
+        for (int i = 0; i < len; ++i)
+          c[1 + i] = val_number(ctx, val_array_get(ctx, stack, v[0], i));
+        c[1 + len] = val_number(ctx, v[1]);
+        argc = 2 + len;
+      }
+      else if (argc < 0)
+      {
+        txp_info(TXP_LOG_DVI, "pdf unhandled op %s in:\n%.*s\n", pdf_op_name(op),
+                 (int)(cur - cur0), cur0);
+        compile = 0;
+        continue;
+      }
+      else if (argc > 0)
+        vstack_get_floats(ctx, stack, c, argc);
+
+      if (op == PDF_NONE)
+        break;
+      if (compile)
+        pdf_code_emit(ctx, &b, op, c, argc);
+      pdf_code_exec(ctx, dc, st, op, c);
     } while (op != PDF_NONE);
+
+    if (compile)
+      codecache_add(ctx, cc, hash, cur_start, lim, &b);
   }
   fz_always(ctx)
   {
-    vstack_free(ctx, stack);
+    fz_free(ctx, b.ops);
+    fz_free(ctx, b.args);
   }
   fz_catch(ctx)
   {
@@ -3270,7 +3422,7 @@ dvi_exec_pdf(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t cur, curs
   cursor_t mar, i, f0, f1, f2, f3, f4, f5, pxform = NULL, pstart, pend;
 
   
-#line 3274 "dvi_special.c"
+#line 3425 "dvi_special.c"
 {
 	int yych;
 	unsigned int yyaccept = 0;
@@ -3321,9 +3473,9 @@ dvi_exec_pdf(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t cur, curs
 		default: goto yy270;
 	}
 yy270:
-#line 1211 "dvi_special.re2c.c"
+#line 1362 "dvi_special.re2c.c"
 	{ return unhandled("pdf special", cur, lim, 0); }
-#line 3327 "dvi_special.c"
+#line 3478 "dvi_special.c"
 yy271:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -3392,9 +3544,9 @@ yy279:
 	if (yych == 'r') goto yy298;
 	goto yy297;
 yy280:
-#line 1175 "dvi_special.re2c.c"
+#line 1326 "dvi_special.re2c.c"
 	{ return pdf_btrans(dc, st, cur, lim); }
-#line 3398 "dvi_special.c"
+#line 3549 "dvi_special.c"
 yy281:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -3407,11 +3559,11 @@ yy282:
 	yych = cur < lim ? *cur : -1;
 	if (yych == 'o') goto yy300;
 yy283:
-#line 1203 "dvi_special.re2c.c"
+#line 1354 "dvi_special.re2c.c"
 	{
     return colorstack_pop(ctx, dc, st, -1);
   }
-#line 3415 "dvi_special.c"
+#line 3566 "dvi_special.c"
 yy284:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -3424,9 +3576,9 @@ yy285:
 	yych = cur < lim ? *cur : -1;
 	if (yych == 'r') goto yy302;
 yy286:
-#line 1178 "dvi_special.re2c.c"
+#line 1329 "dvi_special.re2c.c"
 	{ return pdf_etrans(dc, st); }
-#line 3430 "dvi_special.c"
+#line 3581 "dvi_special.c"
 yy287:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -3478,7 +3630,7 @@ yy292:
 	f1 = yyt3;
 	f2 = yyt4;
 	f3 = yyt5;
-#line 1190 "dvi_special.re2c.c"
+#line 1341 "dvi_special.re2c.c"
 	{
     if (!colorstack_push(ctx, dc, st, -1))
       return 0;
@@ -3490,7 +3642,7 @@ yy292:
       color_set_gray(st->gs.colors.fill, pfloat(f4 ? f4 : f0, lim));
     return 1;
   }
-#line 3494 "dvi_special.c"
+#line 3645 "dvi_special.c"
 yy293:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -3632,9 +3784,9 @@ yy311:
 	goto yy272;
 yy312:
 	++cur;
-#line 1208 "dvi_special.re2c.c"
+#line 1359 "dvi_special.re2c.c"
 	{ return pdf_code(ctx, dc, st, cur, lim); }
-#line 3638 "dvi_special.c"
+#line 3789 "dvi_special.c"
 yy313:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -3887,24 +4039,24 @@ yy348:
 	pxform = yyt2;
 	pstart = cur;
 	pstart += -1;
-#line 1157 "dvi_special.re2c.c"
+#line 1308 "dvi_special.re2c.c"
 	{
     struct xform_spec xf = xform_spec();
     pxform = parse_xform_or_dim(&xf, pxform, pstart);
     if (pxform != pstart)
-      fprintf(stderr, "pdf unhandled transformation: %.*s\n",
-              (int)(pstart - pxform), pxform);
+      txp_info(TXP_LOG_DVI, "pdf unhandled transformation: %.*s\n",
+               (int)(pstart - pxform), pxform);
     char filename[2048];
     cur = parse_pdf_string(filename, filename + 2048, cur, lim);
     if (!embed_graphics(ctx, dc, st, &xf, filename))
     {
-      fprintf(stderr, "error rendering image: %.*s", (int)(lim-f0), f0);
+      txp_warn(TXP_LOG_DVI, "error rendering image: %.*s", (int)(lim-f0), f0);
       return 0;
     }
     else
       return 1;
   }
-#line 3908 "dvi_special.c"
+#line 4059 "dvi_special.c"
 yy349:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -3983,14 +4135,14 @@ yy355:
 	f0 = cur;
 	f0 += -8;
 	f1 = cur;
-#line 1181 "dvi_special.re2c.c"
+#line 1332 "dvi_special.re2c.c"
 	{
     if (f1 != lim)
-      fprintf(stderr, "unhandled pdf content: %.*s\n",
-              (int)(lim - f0), f0);
+      txp_info(TXP_LOG_DVI, "unhandled pdf content: %.*s\n",
+               (int)(lim - f0), f0);
     return 1;
   }
-#line 3994 "dvi_special.c"
+#line 4145 "dvi_special.c"
 yy356:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4205,9 +4357,9 @@ yy385:
 	}
 yy386:
 	++cur;
-#line 1154 "dvi_special.re2c.c"
+#line 1305 "dvi_special.re2c.c"
 	{ return 1; }
-#line 4211 "dvi_special.c"
+#line 4362 "dvi_special.c"
 yy387:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4420,9 +4572,9 @@ yy409:
 	++cur;
 	f0 = yyt1;
 	f1 = yyt2;
-#line 1151 "dvi_special.re2c.c"
+#line 1302 "dvi_special.re2c.c"
 	{ return 1; }
-#line 4426 "dvi_special.c"
+#line 4577 "dvi_special.c"
 yy410:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4440,7 +4592,7 @@ yy410:
 		default: goto yy272;
 	}
 }
-#line 1213 "dvi_special.re2c.c"
+#line 1364 "dvi_special.re2c.c"
 
 }
 
@@ -4453,7 +4605,7 @@ bool dvi_exec_special(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t
   for (;;)
   {
     
-#line 4457 "dvi_special.c"
+#line 4608 "dvi_special.c"
 {
 	int yych;
 	static const unsigned char yybm[] = {
@@ -4507,14 +4659,14 @@ bool dvi_exec_special(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t
 		}
 	}
 yy412:
-#line 1277 "dvi_special.re2c.c"
+#line 1428 "dvi_special.re2c.c"
 	{ return unhandled("special", cur, lim, 0); }
-#line 4513 "dvi_special.c"
+#line 4664 "dvi_special.c"
 yy413:
 	++cur;
-#line 1227 "dvi_special.re2c.c"
+#line 1378 "dvi_special.re2c.c"
 	{ continue; }
-#line 4518 "dvi_special.c"
+#line 4669 "dvi_special.c"
 yy414:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4554,7 +4706,7 @@ yy421:
 	goto yy415;
 yy422:
 	++cur;
-#line 1264 "dvi_special.re2c.c"
+#line 1415 "dvi_special.re2c.c"
 	{
       struct xform_spec xf = xform_spec();
       cur = parse_xform_or_dim(&xf, cur, lim);
@@ -4563,7 +4715,7 @@ yy422:
         return unhandled("pdf x", cur, lim, 0);
       return 1;
     }
-#line 4567 "dvi_special.c"
+#line 4718 "dvi_special.c"
 yy423:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4596,9 +4748,9 @@ yy428:
 	if (yybm[0+yych] & 64) {
 		goto yy428;
 	}
-#line 1274 "dvi_special.re2c.c"
+#line 1425 "dvi_special.re2c.c"
 	{ return dvi_exec_pdf(ctx, dc, st, cur, lim); }
-#line 4602 "dvi_special.c"
+#line 4753 "dvi_special.c"
 yy429:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4673,9 +4825,9 @@ yy442:
 	goto yy415;
 yy443:
 	++cur;
-#line 1255 "dvi_special.re2c.c"
+#line 1406 "dvi_special.re2c.c"
 	{ return colorstack_pop(ctx, dc, st, -1); }
-#line 4679 "dvi_special.c"
+#line 4830 "dvi_special.c"
 yy444:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4683,9 +4835,9 @@ yy444:
 	goto yy415;
 yy445:
 	++cur;
-#line 1230 "dvi_special.re2c.c"
+#line 1381 "dvi_special.re2c.c"
 	{ return 1; }
-#line 4689 "dvi_special.c"
+#line 4840 "dvi_special.c"
 yy446:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4705,12 +4857,12 @@ yy449:
 	++cur;
 	yych = cur < lim ? *cur : -1;
 	if (yych == ' ') goto yy449;
-#line 1258 "dvi_special.re2c.c"
+#line 1409 "dvi_special.re2c.c"
 	{
       return colorstack_push(ctx, dc, st, -1) &&
              parse_color(&st->gs.colors, cur, lim);
     }
-#line 4714 "dvi_special.c"
+#line 4865 "dvi_special.c"
 yy450:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4816,9 +4968,9 @@ yy464:
 yy465:
 	++cur;
 	i = yyt1;
-#line 1238 "dvi_special.re2c.c"
+#line 1389 "dvi_special.re2c.c"
 	{ return colorstack_pop(ctx, dc, st, pint(i, lim)); }
-#line 4822 "dvi_special.c"
+#line 4973 "dvi_special.c"
 yy466:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4871,12 +5023,12 @@ yy474:
 yy475:
 	++cur;
 	i = yyt1;
-#line 1242 "dvi_special.re2c.c"
+#line 1393 "dvi_special.re2c.c"
 	{
       return colorstack_push(ctx, dc, st, pint(i, lim)) &&
              parse_pdfcolor(&st->gs.colors, cur, lim);
     }
-#line 4880 "dvi_special.c"
+#line 5031 "dvi_special.c"
 yy476:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4885,9 +5037,9 @@ yy476:
 yy477:
 	++cur;
 	i = yyt1;
-#line 1234 "dvi_special.re2c.c"
+#line 1385 "dvi_special.re2c.c"
 	{ return pdfcolorstack_current(ctx, dc, st, pint(i, lim)); }
-#line 4891 "dvi_special.c"
+#line 5042 "dvi_special.c"
 yy478:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -4925,14 +5077,14 @@ yy480:
 	if (yych != '(') goto yy415;
 	++cur;
 	i = yyt1;
-#line 1249 "dvi_special.re2c.c"
+#line 1400 "dvi_special.re2c.c"
 	{
       return colorstack_init(ctx, dc, st, pint(i, lim)) &&
              parse_pdfcolor(&st->gs.colors, cur, lim);
     }
-#line 4934 "dvi_special.c"
+#line 5085 "dvi_special.c"
 }
-#line 1279 "dvi_special.re2c.c"
+#line 1430 "dvi_special.re2c.c"
 
   }
 }
@@ -4942,7 +5094,7 @@ bool dvi_init_special(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t
   cursor_t i, f0, f1, mar;
 
   
-#line 4946 "dvi_special.c"
+#line 5097 "dvi_special.c"
 {
 	int yych;
 	static const unsigned char yybm[] = {
@@ -4983,9 +5135,9 @@ bool dvi_init_special(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t
 	yych = cur < lim ? *cur : -1;
 	if (yych == 'p') goto yy483;
 yy482:
-#line 1297 "dvi_special.re2c.c"
+#line 1448 "dvi_special.re2c.c"
 	{ return 0; }
-#line 4989 "dvi_special.c"
+#line 5140 "dvi_special.c"
 yy483:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -5108,14 +5260,14 @@ yy490:
 	if (yych != '(') goto yy484;
 	++cur;
 	i = yyt1;
-#line 1291 "dvi_special.re2c.c"
+#line 1442 "dvi_special.re2c.c"
 	{
     return colorstack_init(ctx, dc, st, pint(i, lim)) &&
            parse_pdfcolor(&st->gs.colors, cur, lim);
   }
-#line 5117 "dvi_special.c"
+#line 5268 "dvi_special.c"
 }
-#line 1299 "dvi_special.re2c.c"
+#line 1450 "dvi_special.re2c.c"
 
 }
 
@@ -5126,7 +5278,7 @@ void dvi_prescan_special(cursor_t cur, cursor_t lim, float *width, float *height
   // fprintf(stderr, "prescan: %.*s\n", (int)(lim - cur), cur);
 
   
-#line 5130 "dvi_special.c"
+#line 5281 "dvi_special.c"
 {
 	int yych;
 	static const unsigned char yybm[] = {
@@ -5168,9 +5320,9 @@ void dvi_prescan_special(cursor_t cur, cursor_t lim, float *width, float *height
 	if (yych == 'l') goto yy493;
 	if (yych == 'p') goto yy495;
 yy492:
-#line 1328 "dvi_special.re2c.c"
+#line 1479 "dvi_special.re2c.c"
 	{ return; }
-#line 5174 "dvi_special.c"
+#line 5325 "dvi_special.c"
 yy493:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -5258,12 +5410,12 @@ yy509:
 	goto yy494;
 yy510:
 	++cur;
-#line 1311 "dvi_special.re2c.c"
+#line 1462 "dvi_special.re2c.c"
 	{
     *landscape = 1;
     return;
   }
-#line 5267 "dvi_special.c"
+#line 5418 "dvi_special.c"
 yy511:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -5363,9 +5515,9 @@ yy524:
 	}
 yy525:
 	++cur;
-#line 1325 "dvi_special.re2c.c"
+#line 1476 "dvi_special.re2c.c"
 	{ *width = 612; *height = 792; return; }
-#line 5369 "dvi_special.c"
+#line 5520 "dvi_special.c"
 yy526:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -5582,13 +5734,13 @@ yy548:
 	++cur;
 	f0 = yyt1;
 	f1 = yyt2;
-#line 1318 "dvi_special.re2c.c"
+#line 1469 "dvi_special.re2c.c"
 	{
     *width = pdim(f0, lim);
     *height = pdim(f1, lim);
     return;
   }
-#line 5592 "dvi_special.c"
+#line 5743 "dvi_special.c"
 yy549:
 	++cur;
 	yych = cur < lim ? *cur : -1;
@@ -5606,6 +5758,6 @@ yy549:
 		default: goto yy494;
 	}
 }
-#line 1330 "dvi_special.re2c.c"
+#line 1481 "dvi_special.re2c.c"
 
 }
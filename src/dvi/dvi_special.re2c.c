@@ -29,6 +29,7 @@
 #include "mydvi_interp.h"
 #include "pdf_lexer.h"
 #include "vstack.h"
+#include "txp_log.h"
 #include <math.h>
 
 #define device_cs fz_device_rgb
@@ -70,7 +71,7 @@ static bool
 unhandled(const char *kind, cursor_t cur, cursor_t lim, int ignored)
 {
   if (0 && !ignored)
-    fprintf(stderr, "unhandled %s: \"%.*s\"\n", kind, (int)(lim - cur), cur);
+    txp_info(TXP_LOG_DVI, "unhandled %s: \"%.*s\"\n", kind, (int)(lim - cur), cur);
   return 0;
 }
 
@@ -312,7 +313,7 @@ pdfcolorstack_current(fz_context *ctx, dvi_context *dc, dvi_state *st, int index
   dvi_context_flush_text(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
-    fprintf(stderr, "pdfcolorstack_current %d: no such stack\n", index);
+    txp_warn(TXP_LOG_DVI, "pdfcolorstack_current %d: no such stack\n", index);
     return 0;
   }
   //printf("pdfcolorstack_current %d\n", index);
@@ -330,7 +331,7 @@ colorstack_push(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
   dvi_context_flush_text(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
-    fprintf(stderr, "pdfcolorstack_push %d: no such stack\n", index);
+    txp_warn(TXP_LOG_DVI, "pdfcolorstack_push %d: no such stack\n", index);
     return 0;
   }
   //printf("pdfcolorstack_push %d\n", index);
@@ -364,13 +365,13 @@ colorstack_pop(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
   dvi_context_flush_text(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
-    fprintf(stderr, "pdfcolorstack_pop %d: no such stack\n", index);
+    txp_warn(TXP_LOG_DVI, "pdfcolorstack_pop %d: no such stack\n", index);
     return 0;
   }
   dvi_colorstack *stack = index == -1 ? &dc->colorstack : &dc->pdfcolorstacks.stacks[index];
   if (stack->depth == 0)
   {
-    fprintf(stderr, "pdfcolorstack_pop %d: empty stack\n", index);
+    txp_warn(TXP_LOG_DVI, "pdfcolorstack_pop %d: empty stack\n", index);
     return 0;
   }
   stack->depth -= 1;
@@ -439,31 +440,17 @@ embed_pdf(fz_context *ctx, dvi_context *dc, dvi_state *st, struct xform_spec *xf
 {
   fz_try(ctx)
   {
-    pdf_document *doc = dvi_resmanager_get_pdf(ctx, dc->resmanager, filename);
-    if (!doc)
+    fz_rect mediabox;
+    fz_display_list *list =
+      dvi_resmanager_get_pdf_page(ctx, dc->resmanager, filename,
+                                  xf->page ? xf->page - 1 : 0, &mediabox);
+    if (!list)
       return 0;
 
-    // from mupdf/source/pdf/pdf-page.c: pdf_page_obj_transform
-    pdf_page *page = pdf_load_page(ctx, doc, xf->page ? xf->page - 1 : 0);
-    pdf_obj *pageobj = page ? page->obj : NULL;
-
-    fz_rect mediabox = pdf_to_rect(ctx, pdf_dict_get_inheritable(ctx, pageobj, PDF_NAME(MediaBox)));
-    if (fz_is_empty_rect(mediabox))
-    {
-      mediabox.x0 = 0;
-      mediabox.y0 = 0;
-      mediabox.x1 = 612;
-      mediabox.y1 = 792;
-    }
-
-    fz_rect cropbox = pdf_to_rect(ctx, pdf_dict_get_inheritable(ctx, pageobj, PDF_NAME(CropBox)));
-    if (!fz_is_empty_rect(cropbox))
-      mediabox = fz_intersect_rect(mediabox, cropbox);
-
     fz_matrix ctm = fz_flip_vertically(dvi_get_ctm(dc, st));
     ctm = fz_concat(xf->ctm, ctm);
     ctm = fz_pre_translate(ctm, 0, mediabox.y0 - mediabox.y1);
-    pdf_run_page(ctx, page, dc->dev, ctm, NULL);
+    fz_run_display_list(ctx, list, dc->dev, ctm, fz_infinite_rect, NULL);
   }
   fz_catch(ctx)
   {
@@ -712,391 +699,556 @@ static void drop_path(fz_context *ctx, dvi_context *dc)
   }
 }
 
-static bool
-pdf_code(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t cur, cursor_t lim)
+// The stack is kept by the context and reset before each special: the
+// values of the previous one are not needed anymore
+static vstack *get_pdf_stack(fz_context *ctx, dvi_context *dc)
 {
-  vstack *stack = vstack_new(ctx);
-  fz_var(cur);
-  fz_var(stack);
+  if (!dc->pdf_stack)
+    dc->pdf_stack = vstack_new(ctx);
+  else
+    vstack_reset(ctx, dc->pdf_stack);
+  return dc->pdf_stack;
+}
 
-  // fprintf(stderr, "pdf code: %.*s\n", (int)(lim - cur), cur);
-  fz_try(ctx)
+// Compiled pdf:code specials
+//
+// TikZ and PGF pictures are made of many pdf:code specials, mostly the
+// same ones over and over. The operators of a special are first lexed and
+// executed one at a time; if all of them are supported, the special is
+// also compiled to a list of operators with their operands flattened to
+// floats, and kept in a table keyed by its bytes. Rendering it again (the
+// same page, or another use of the same picture) replays the compiled code
+// without lexing.
+
+// Maximum number of floats taken by an operator (cm, c; d takes at most
+// 1 + 4 + 1)
+#define PDF_CODE_ARGS 6
+// Specials longer than this are not compiled
+#define PDF_CODE_MAX_LEN 4096
+// The table is emptied when it reaches this number of specials
+#define PDF_CODE_MAX_ENTRIES 8192
+
+typedef struct
+{
+  uint16_t op, argc;
+} pdf_code_op;
+
+typedef struct pdf_code_entry
+{
+  struct pdf_code_entry *next;
+  unsigned long hash;
+  int len, count;
+  char *src;
+  pdf_code_op *ops;
+  float *args;
+} pdf_code_entry;
+
+struct dvi_codecache
+{
+  pdf_code_entry **buckets;
+  int count, cap;
+
+  // Statistics
+  unsigned long lookups, hits, compiled;
+};
+
+typedef struct
+{
+  pdf_code_op *ops;
+  float *args;
+  int count, op_cap, argc, arg_cap;
+} pdf_code_builder;
+
+static unsigned long
+pdf_code_hash(cursor_t cur, cursor_t lim)
+{
+  unsigned long hash = 5381;
+  for (; cur < lim; ++cur)
+    hash = (hash * 33) ^ (unsigned char)*cur;
+  return hash;
+}
+
+static void codecache_clear(fz_context *ctx, struct dvi_codecache *cc)
+{
+  for (int i = 0; i < cc->cap; ++i)
   {
-    enum PDF_OP op;
-    do {
-      cursor_t cur0 = cur;
-      op = pdf_parse_command(ctx, stack, &cur, lim);
-      switch (op)
-      {
-        case PDF_OP_cm:
-        {
-          float fmat[6];
-          vstack_get_floats(ctx, stack, fmat, 6);
-          fz_matrix mat;
-          mat.a = fmat[0]; mat.b = fmat[1]; mat.c = fmat[2];
-          mat.d = fmat[3]; mat.e = fmat[4]; mat.f = fmat[5];
-          fz_matrix ctm = fz_concat(mat, dvi_get_ctm(dc, st));
-          dvi_set_ctm(st, ctm);
-          break;
-        }
-        case PDF_OP_q:
-        {
-          if (st->gs_stack.depth >= st->gs_stack.limit)
-            fz_throw(ctx, 0, "PDF q: stack overflow");
-          st->gs_stack.base[st->gs_stack.depth] = st->gs;
-          st->gs_stack.depth += 1;
-          break;
-        }
-        case PDF_OP_Q:
-        {
-          if (st->gs_stack.depth == 0)
-            fz_throw(ctx, 0, "PDF Q: stack underflow");
-          st->gs_stack.depth -= 1;
-
-          int clip_depth0 = st->gs.clip_depth;
-          st->gs = st->gs_stack.base[st->gs_stack.depth];
-          if (dc->dev)
-            for (int i = st->gs.clip_depth; i < clip_depth0; ++i)
-              fz_pop_clip(ctx, dc->dev);
-          break;
-        }
-        case PDF_OP_G:
-        {
-          float c[1];
-          vstack_get_floats(ctx, stack, c, 1);
-          color_set_gray(st->gs.colors.line, c[0]);
-          break;
-        }
-        case PDF_OP_g:
-        {
-          float c[1];
-          vstack_get_floats(ctx, stack, c, 1);
-          color_set_gray(st->gs.colors.fill, c[0]);
-          break;
-        }
-        case PDF_OP_RG:
-        {
-          float c[3];
-          vstack_get_floats(ctx, stack, c, 3);
-          color_set_rgb(st->gs.colors.line, c[0], c[1], c[2]);
-          break;
-        }
-        case PDF_OP_rg:
-        {
-          float c[3];
-          vstack_get_floats(ctx, stack, c, 3);
-          color_set_rgb(st->gs.colors.fill, c[0], c[1], c[2]);
-          break;
-        }
-        case PDF_OP_K:
-        {
-          float c[4];
-          vstack_get_floats(ctx, stack, c, 4);
-          color_set_cmyk(st->gs.colors.line, c[0], c[1], c[2], c[3]);
-          break;
-        }
-        case PDF_OP_k:
-        {
-          float c[4];
-          vstack_get_floats(ctx, stack, c, 4);
-          color_set_cmyk(st->gs.colors.fill, c[0], c[1], c[2], c[3]);
-          break;
-        }
+    pdf_code_entry *e = cc->buckets[i];
+    while (e)
+    {
+      pdf_code_entry *next = e->next;
+      fz_free(ctx, e);
+      e = next;
+    }
+    cc->buckets[i] = NULL;
+  }
+  cc->count = 0;
+}
 
-        case PDF_OP_w:
-        {
-          vstack_get_floats(ctx, stack, &st->gs.line_width, 1);
-          break;
-        }
+void dvi_free_special_cache(fz_context *ctx, dvi_context *dc)
+{
+  struct dvi_codecache *cc = dc->codecache;
+  if (!cc)
+    return;
+  if (cc->lookups > 0)
+    txp_info(TXP_LOG_DVI,
+             "[special] pdf code: %d entries, %lu lookups, %lu hits (%.1f%%), "
+             "%lu compiled\n",
+             cc->count, cc->lookups, cc->hits,
+             100.0 * cc->hits / cc->lookups, cc->compiled);
+  codecache_clear(ctx, cc);
+  fz_free(ctx, cc->buckets);
+  fz_free(ctx, cc);
+  dc->codecache = NULL;
+}
 
-        case PDF_OP_j:
-        {
-          float c[1];
-          vstack_get_floats(ctx, stack, c, 1);
-          st->gs.line_join = c[0];
-          break;
-        }
+static pdf_code_entry *
+codecache_find(struct dvi_codecache *cc, unsigned long hash,
+               cursor_t cur, cursor_t lim)
+{
+  int len = lim - cur;
+  for (pdf_code_entry *e = cc->buckets[hash & (cc->cap - 1)]; e; e = e->next)
+    if (e->hash == hash && e->len == len && memcmp(e->src, cur, len) == 0)
+      return e;
+  return NULL;
+}
 
-        case PDF_OP_J:
-        {
-          float c[1];
-          vstack_get_floats(ctx, stack, c, 1);
-          st->gs.line_caps = c[0];
-          break;
-        }
+static void
+codecache_add(fz_context *ctx, struct dvi_codecache *cc, unsigned long hash,
+              cursor_t cur, cursor_t lim, pdf_code_builder *b)
+{
+  if (cc->count >= PDF_CODE_MAX_ENTRIES)
+    codecache_clear(ctx, cc);
+
+  int len = lim - cur;
+  pdf_code_entry *e = fz_malloc(ctx, sizeof(pdf_code_entry) +
+                                sizeof(float) * b->argc +
+                                sizeof(pdf_code_op) * b->count + len);
+  e->hash = hash;
+  e->len = len;
+  e->count = b->count;
+  e->args = (float *)(e + 1);
+  e->ops = (pdf_code_op *)(e->args + b->argc);
+  e->src = (char *)(e->ops + b->count);
+  memcpy(e->args, b->args, sizeof(float) * b->argc);
+  memcpy(e->ops, b->ops, sizeof(pdf_code_op) * b->count);
+  memcpy(e->src, cur, len);
+
+  pdf_code_entry **bucket = &cc->buckets[hash & (cc->cap - 1)];
+  e->next = *bucket;
+  *bucket = e;
+  cc->count += 1;
+  cc->compiled += 1;
+}
 
-        case PDF_OP_M:
-        {
-          float c[1];
-          vstack_get_floats(ctx, stack, c, 1);
-          st->gs.miter_limit = c[0];
-          break;
-        }
+static struct dvi_codecache *get_codecache(fz_context *ctx, dvi_context *dc)
+{
+  if (!dc->codecache)
+  {
+    struct dvi_codecache *cc = fz_malloc_struct(ctx, struct dvi_codecache);
+    cc->cap = 1024;
+    cc->buckets = fz_malloc_struct_array(ctx, cc->cap, pdf_code_entry *);
+    dc->codecache = cc;
+  }
+  return dc->codecache;
+}
 
-        case PDF_OP_m:
-        {
-          float c[2];
-          vstack_get_floats(ctx, stack, c, 2);
-          fz_moveto(ctx, get_path(ctx, dc), c[0], c[1]);
-          break;
-        }
+static void
+pdf_code_emit(fz_context *ctx, pdf_code_builder *b, enum PDF_OP op,
+              const float *c, int argc)
+{
+  if (b->count == b->op_cap)
+  {
+    b->op_cap = b->op_cap ? b->op_cap * 2 : 16;
+    b->ops = fz_realloc(ctx, b->ops, sizeof(pdf_code_op) * b->op_cap);
+  }
+  if (b->argc + argc > b->arg_cap)
+  {
+    b->arg_cap = b->arg_cap ? b->arg_cap * 2 : 64;
+    b->args = fz_realloc(ctx, b->args, sizeof(float) * b->arg_cap);
+  }
+  b->ops[b->count].op = op;
+  b->ops[b->count].argc = argc;
+  b->count += 1;
+  memcpy(b->args + b->argc, c, sizeof(float) * argc);
+  b->argc += argc;
+}
 
-        case PDF_OP_l:
-        {
-          float c[2];
-          vstack_get_floats(ctx, stack, c, 2);
-          fz_lineto(ctx, get_path(ctx, dc), c[0], c[1]);
-          break;
-        }
+// Number of float operands of a supported operator, -1 if unsupported
+static int pdf_code_arity(enum PDF_OP op)
+{
+  switch (op)
+  {
+    case PDF_OP_cm: case PDF_OP_c:
+      return 6;
+    case PDF_OP_K: case PDF_OP_k: case PDF_OP_re:
+      return 4;
+    case PDF_OP_RG: case PDF_OP_rg:
+      return 3;
+    case PDF_OP_m: case PDF_OP_l:
+      return 2;
+    case PDF_OP_G: case PDF_OP_g: case PDF_OP_w:
+    case PDF_OP_j: case PDF_OP_J: case PDF_OP_M:
+      return 1;
+    case PDF_OP_q: case PDF_OP_Q:
+    case PDF_OP_b: case PDF_OP_b_star: case PDF_OP_B: case PDF_OP_B_star:
+    case PDF_OP_f: case PDF_OP_F: case PDF_OP_f_star:
+    case PDF_OP_S: case PDF_OP_s: case PDF_OP_h: case PDF_OP_n:
+    case PDF_OP_W: case PDF_OP_W_star:
+    case PDF_NONE:
+      return 0;
+    default:
+      return -1;
+  }
+}
 
-        case PDF_OP_c:
-        {
-          float c[6];
-          vstack_get_floats(ctx, stack, c, 6);
-          fz_curveto(ctx, get_path(ctx, dc), c[0], c[1], c[2], c[3], c[4], c[5]);
-          break;
-        }
-
-        case PDF_OP_b:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            fz_path *path = get_path(ctx, dc);
-            fz_closepath(ctx, path);
-            fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.line, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+// Execute a supported operator with its flattened operands
+static void
+pdf_code_exec(fz_context *ctx, dvi_context *dc, dvi_state *st,
+              enum PDF_OP op, const float *c)
+{
+  switch (op)
+  {
+    case PDF_OP_cm:
+    {
+      fz_matrix mat;
+      mat.a = c[0]; mat.b = c[1]; mat.c = c[2];
+      mat.d = c[3]; mat.e = c[4]; mat.f = c[5];
+      fz_matrix ctm = fz_concat(mat, dvi_get_ctm(dc, st));
+      dvi_set_ctm(st, ctm);
+      break;
+    }
+    case PDF_OP_q:
+    {
+      if (st->gs_stack.depth >= st->gs_stack.limit)
+        fz_throw(ctx, 0, "PDF q: stack overflow");
+      st->gs_stack.base[st->gs_stack.depth] = st->gs;
+      st->gs_stack.depth += 1;
+      break;
+    }
+    case PDF_OP_Q:
+    {
+      if (st->gs_stack.depth == 0)
+        fz_throw(ctx, 0, "PDF Q: stack underflow");
+      st->gs_stack.depth -= 1;
+
+      int clip_depth0 = st->gs.clip_depth;
+      st->gs = st->gs_stack.base[st->gs_stack.depth];
+      if (dc->dev)
+        for (int i = st->gs.clip_depth; i < clip_depth0; ++i)
+          fz_pop_clip(ctx, dc->dev);
+      break;
+    }
+    case PDF_OP_G:
+      color_set_gray(st->gs.colors.line, c[0]);
+      break;
+    case PDF_OP_g:
+      color_set_gray(st->gs.colors.fill, c[0]);
+      break;
+    case PDF_OP_RG:
+      color_set_rgb(st->gs.colors.line, c[0], c[1], c[2]);
+      break;
+    case PDF_OP_rg:
+      color_set_rgb(st->gs.colors.fill, c[0], c[1], c[2]);
+      break;
+    case PDF_OP_K:
+      color_set_cmyk(st->gs.colors.line, c[0], c[1], c[2], c[3]);
+      break;
+    case PDF_OP_k:
+      color_set_cmyk(st->gs.colors.fill, c[0], c[1], c[2], c[3]);
+      break;
 
-        case PDF_OP_b_star:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            fz_path *path = get_path(ctx, dc);
-            fz_closepath(ctx, path);
-            fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.line, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_w:
+      st->gs.line_width = c[0];
+      break;
 
-        case PDF_OP_B:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            fz_path *path = get_path(ctx, dc);
-            fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.line, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_j:
+      st->gs.line_join = c[0];
+      break;
 
-        case PDF_OP_B_star:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            fz_path *path = get_path(ctx, dc);
-            fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.fill, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_J:
+      st->gs.line_caps = c[0];
+      break;
 
-        case PDF_OP_f:
-        case PDF_OP_F:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_path *path = get_path(ctx, dc);
-            fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_M:
+      st->gs.miter_limit = c[0];
+      break;
 
-        case PDF_OP_f_star:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_path *path = get_path(ctx, dc);
-            fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
-                         st->gs.colors.fill, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_m:
+      fz_moveto(ctx, get_path(ctx, dc), c[0], c[1]);
+      break;
 
-        case PDF_OP_S:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            fz_path *path = get_path(ctx, dc);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.line, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_l:
+      fz_lineto(ctx, get_path(ctx, dc), c[0], c[1]);
+      break;
 
-        case PDF_OP_s:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_stroke_state stst = fz_default_stroke_state;
-            stst.linewidth = st->gs.line_width;
-            stst.linejoin = (int)st->gs.line_join;
-            stst.miterlimit = (int)st->gs.miter_limit;
-            stst.dash_cap = stst.start_cap = stst.end_cap =
-                (int)st->gs.line_caps;
-            stst.dash_len = st->gs.dash_len;
-            memcpy(stst.dash_list, st->gs.dash,
-                   sizeof(float) * st->gs.dash_len);
-            stst.dash_phase = st->gs.dash_phase;
-            fz_path *path = get_path(ctx, dc);
-            fz_closepath(ctx, path);
-            fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
-                           st->gs.colors.line, 1.0, color_params);
-          }
-          drop_path(ctx, dc);
-          break;
+    case PDF_OP_c:
+      fz_curveto(ctx, get_path(ctx, dc), c[0], c[1], c[2], c[3], c[4], c[5]);
+      break;
 
-        case PDF_OP_h:
-        {
-          fz_path *path = get_path(ctx, dc);
-          fz_closepath(ctx, path);
-          break;
-        }
+    case PDF_OP_b:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        fz_path *path = get_path(ctx, dc);
+        fz_closepath(ctx, path);
+        fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.line, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
 
-        case PDF_OP_re:
-        {
-          float c[4];
-          vstack_get_floats(ctx, stack, c, 4);
-          fz_rectto(ctx, get_path(ctx, dc), c[0], c[1], c[0] + c[2], c[1] + c[3]);
-          break;
-        }
+    case PDF_OP_b_star:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        fz_path *path = get_path(ctx, dc);
+        fz_closepath(ctx, path);
+        fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.line, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
 
-        case PDF_OP_n:
-        {
-          drop_path(ctx, dc);
-          break;
-        }
-
-        case PDF_OP_W:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_clip_path(ctx, dc->dev, get_path(ctx, dc), 0, ctm,
-                         fz_infinite_rect);
-            st->gs.clip_depth += 1;
-          }
-          break;
+    case PDF_OP_B:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        fz_path *path = get_path(ctx, dc);
+        fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.line, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
 
-        case PDF_OP_W_star:
-          if (dc->dev)
-          {
-            fz_matrix ctm = dvi_get_ctm(dc, st);
-            fz_clip_path(ctx, dc->dev, get_path(ctx, dc), 1, ctm,
-                         fz_infinite_rect);
-            st->gs.clip_depth += 1;
-          }
-          break;
+    case PDF_OP_B_star:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        fz_path *path = get_path(ctx, dc);
+        fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.fill, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
 
-        case PDF_OP_d:
-        {
-          val v[2];
-          vstack_get_arguments(ctx, stack, v, 2);
-          st->gs.dash_len = val_array_length(ctx, stack, v[0]);
-          if (st->gs.dash_len > 4) st->gs.dash_len = 4;
-          for (int i = 0; i < st->gs.dash_len; ++i)
-            st->gs.dash[i] = val_number(ctx, val_array_get(ctx, stack, v[0], i));
-          st->gs.dash_phase = val_number(ctx, v[1]);
-          break;
-        }
-
-        case PDF_OP_ri:
-        case PDF_OP_i:
-        case PDF_OP_gs:
-        case PDF_OP_v:
-        case PDF_OP_y:
-        case PDF_OP_BT:
-        case PDF_OP_ET:
-        case PDF_OP_Tc:
-        case PDF_OP_Tw:
-        case PDF_OP_Tz:
-        case PDF_OP_TL:
-        case PDF_OP_Tf:
-        case PDF_OP_Tr:
-        case PDF_OP_Ts:
-        case PDF_OP_Td:
-        case PDF_OP_TD:
-        case PDF_OP_Tm:
-        case PDF_OP_T_star:
-        case PDF_OP_Tj:
-        case PDF_OP_TJ:
-        case PDF_OP_squote:
-        case PDF_OP_dquote:
-        case PDF_OP_d0:
-        case PDF_OP_d1:
-        case PDF_OP_CS:
-        case PDF_OP_cs:
-        case PDF_OP_SC:
-        case PDF_OP_sc:
-        case PDF_OP_SCN:
-        case PDF_OP_scn:
-        case PDF_OP_sh:
-        case PDF_OP_Do:
-        case PDF_OP_MP:
-        case PDF_OP_DP:
-        case PDF_OP_BMC:
-        case PDF_OP_BDC:
-        case PDF_OP_EMC:
-        case PDF_OP_BX:
-        case PDF_OP_EX:
-        default:
-          fprintf(stderr, "pdf unhandled op %s in:\n%.*s\n", pdf_op_name(op),
-                  (int)(cur - cur0), cur0);
-          break;
+    case PDF_OP_f:
+    case PDF_OP_F:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_path *path = get_path(ctx, dc);
+        fz_fill_path(ctx, dc->dev, path, 0, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
 
-        case PDF_NONE:
-          break;
+    case PDF_OP_f_star:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_path *path = get_path(ctx, dc);
+        fz_fill_path(ctx, dc->dev, path, 1, ctm, device_cs(ctx),
+                     st->gs.colors.fill, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_S:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.start_cap = stst.end_cap = (int)st->gs.line_caps;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        fz_path *path = get_path(ctx, dc);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.line, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_s:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_stroke_state stst = fz_default_stroke_state;
+        stst.linewidth = st->gs.line_width;
+        stst.linejoin = (int)st->gs.line_join;
+        stst.miterlimit = (int)st->gs.miter_limit;
+        stst.dash_cap = stst.start_cap = stst.end_cap =
+            (int)st->gs.line_caps;
+        stst.dash_len = st->gs.dash_len;
+        memcpy(stst.dash_list, st->gs.dash,
+               sizeof(float) * st->gs.dash_len);
+        stst.dash_phase = st->gs.dash_phase;
+        fz_path *path = get_path(ctx, dc);
+        fz_closepath(ctx, path);
+        fz_stroke_path(ctx, dc->dev, path, &stst, ctm, device_cs(ctx),
+                       st->gs.colors.line, 1.0, color_params);
+      }
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_h:
+    {
+      fz_path *path = get_path(ctx, dc);
+      fz_closepath(ctx, path);
+      break;
+    }
+
+    case PDF_OP_re:
+      fz_rectto(ctx, get_path(ctx, dc), c[0], c[1], c[0] + c[2], c[1] + c[3]);
+      break;
+
+    case PDF_OP_n:
+      drop_path(ctx, dc);
+      break;
+
+    case PDF_OP_W:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_clip_path(ctx, dc->dev, get_path(ctx, dc), 0, ctm,
+                     fz_infinite_rect);
+        st->gs.clip_depth += 1;
+      }
+      break;
+
+    case PDF_OP_W_star:
+      if (dc->dev)
+      {
+        fz_matrix ctm = dvi_get_ctm(dc, st);
+        fz_clip_path(ctx, dc->dev, get_path(ctx, dc), 1, ctm,
+                     fz_infinite_rect);
+        st->gs.clip_depth += 1;
+      }
+      break;
+
+    case PDF_OP_d:
+    {
+      // Operands are flattened: length, dashes, phase
+      st->gs.dash_len = c[0];
+      for (int i = 0; i < st->gs.dash_len; ++i)
+        st->gs.dash[i] = c[1 + i];
+      st->gs.dash_phase = c[1 + st->gs.dash_len];
+      break;
+    }
+
+
+    default:
+      break;
+  }
+}
+
+static bool
+pdf_code(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t cur, cursor_t lim)
+{
+  struct dvi_codecache *cc = get_codecache(ctx, dc);
+  unsigned long hash = pdf_code_hash(cur, lim);
+  cc->lookups += 1;
+
+  pdf_code_entry *e = codecache_find(cc, hash, cur, lim);
+  if (e)
+  {
+    cc->hits += 1;
+    fz_try(ctx)
+    {
+      const float *c = e->args;
+      for (int i = 0; i < e->count; ++i)
+      {
+        pdf_code_exec(ctx, dc, st, e->ops[i].op, c);
+        c += e->ops[i].argc;
+      }
+    }
+    fz_catch(ctx)
+      return 0;
+    return 1;
+  }
+
+  vstack *stack = get_pdf_stack(ctx, dc);
+  pdf_code_builder b = {0,};
+  bool compile = lim - cur <= PDF_CODE_MAX_LEN;
+  cursor_t cur_start = cur;
+  fz_var(cur);
+  fz_var(compile);
+  fz_var(b);
+
+  // fprintf(stderr, "pdf code: %.*s\n", (int)(lim - cur), cur);
+  fz_try(ctx)
+  {
+    enum PDF_OP op;
+    do {
+      cursor_t cur0 = cur;
+      op = pdf_parse_command(ctx, stack, &cur, lim);
+      float c[PDF_CODE_ARGS];
+      int argc = pdf_code_arity(op);
+      if (op == PDF_OP_d)
+      {
+        val v[2];
+        vstack_get_arguments(ctx, stack, v, 2);
+        int len = val_array_length(ctx, stack, v[0]);
+        if (len > 4) len = 4;
+        c[0] = len;
+        for (int i = 0; i < len; ++i)
+          c[1 + i] = val_number(ctx, val_array_get(ctx, stack, v[0], i));
+        c[1 + len] = val_number(ctx, v[1]);
+        argc = 2 + len;
+      }
+      else if (argc < 0)
+      {
+        txp_info(TXP_LOG_DVI, "pdf unhandled op %s in:\n%.*s\n", pdf_op_name(op),
+                 (int)(cur - cur0), cur0);
+        compile = 0;
+        continue;
       }
+      else if (argc > 0)
+        vstack_get_floats(ctx, stack, c, argc);
+
+      if (op == PDF_NONE)
+        break;
+      if (compile)
+        pdf_code_emit(ctx, &b, op, c, argc);
+      pdf_code_exec(ctx, dc, st, op, c);
     } while (op != PDF_NONE);
+
+    if (compile)
+      codecache_add(ctx, cc, hash, cur_start, lim, &b);
   }
   fz_always(ctx)
   {
-    vstack_free(ctx, stack);
+    fz_free(ctx, b.ops);
+    fz_free(ctx, b.args);
   }
   fz_catch(ctx)
   {
@@ -1158,13 +1310,13 @@ dvi_exec_pdf(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t cur, curs
     struct xform_spec xf = xform_spec();
     pxform = parse_xform_or_dim(&xf, pxform, pstart);
     if (pxform != pstart)
-      fprintf(stderr, "pdf unhandled transformation: %.*s\n",
-              (int)(pstart - pxform), pxform);
+      txp_info(TXP_LOG_DVI, "pdf unhandled transformation: %.*s\n",
+               (int)(pstart - pxform), pxform);
     char filename[2048];
     cur = parse_pdf_string(filename, filename + 2048, cur, lim);
     if (!embed_graphics(ctx, dc, st, &xf, filename))
     {
-      fprintf(stderr, "error rendering image: %.*s", (int)(lim-f0), f0);
+      txp_warn(TXP_LOG_DVI, "error rendering image: %.*s", (int)(lim-f0), f0);
       return 0;
     }
     else
@@ -1180,8 +1332,8 @@ dvi_exec_pdf(fz_context *ctx, dvi_context *dc, dvi_state *st, cursor_t cur, curs
   @f0 ("bcontent" | "econtent") @f1
   {
     if (f1 != lim)
-      fprintf(stderr, "unhandled pdf content: %.*s\n",
-              (int)(lim - f0), f0);
+      txp_info(TXP_LOG_DVI, "unhandled pdf content: %.*s\n",
+               (int)(lim - f0), f0);
     return 1;
   }
 
@@ -46,6 +46,42 @@ static inline fz_matrix fz_flip_vertically(fz_matrix ctm)
   return ctm;
 }
 
+// sdbm hash of len bytes, continuing from seed.
+// Its low bits only depend on the low bits of the bytes, and multiplying by
+// an odd constant would not change that: tables take the index of a bucket
+// from the high bits, with hash_bucket.
+static inline uint64_t sdbm_hash(uint64_t seed, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t hash = seed;
+  for (size_t i = 0; i < len; ++i)
+    hash = p[i] + (hash << 6) + (hash << 16) - hash;
+  return hash;
+}
+
+// Same for a null-terminated string, also computing its length
+static inline uint64_t sdbm_hash_string(const char *str, int *len)
+{
+  const unsigned char *p = (const unsigned char *)str;
+  uint64_t hash = 0;
+  int c;
+  while ((c = *p++))
+    hash = c + (hash << 6) + (hash << 16) - hash;
+  if (len)
+    *len = p - (const unsigned char *)str - 1;
+  return hash;
+}
+
+// Bucket of a hash in a table of cap entries, cap being a power of two.
+// Fibonacci hashing: the high bits of the product depend on all the bits of
+// the hash.
+static inline unsigned hash_bucket(uint64_t hash, unsigned cap)
+{
+  if (cap <= 1)
+    return 0;
+  return (hash * 11400714819323198485ull) >> (64 - __builtin_ctz(cap));
+}
+
 static inline char *dtx_strndup(fz_context *ctx, const void *buf, size_t len)
 {
   char *result = fz_malloc_array(ctx, len + 1, char);
@@ -112,6 +112,37 @@ tex_enc *tex_enc_load(fz_context *ctx, fz_stream *stream);
 void tex_enc_free(fz_context *ctx, tex_enc *fm);
 const char *tex_enc_get(tex_enc *fm, uint8_t code);
 
+// Large images, wrapped so that their decoded pixmaps are cached at the
+// subsample levels asked by draw devices, and shared by all threads
+
+fz_image *dvi_new_mipmap_image(fz_context *ctx, fz_image *base, const char *path);
+// Drop all cached levels (before dropping the context)
+void dvi_mipmap_flush(fz_context *ctx);
+
+// Drop the font files shared by all resource managers, and the mappings of
+// the bundle cache no longer in use (before dropping the context)
+void dvi_resmanager_flush_shared(fz_context *ctx);
+
+// Persistent cache of parsed TeX data, in $XDG_CACHE_HOME/texpresso
+// (~/.cache/texpresso by default).
+// Entries are keyed by kind and by a hash of the source data, they are
+// mapped read-only in memory. Bumping the version of a kind invalidates its
+// entries.
+
+typedef struct {
+  void *map;
+  size_t map_len;
+  const void *data;
+  size_t len;
+} tex_cache_entry;
+
+uint64_t tex_cache_hash(const void *data, size_t len);
+bool tex_cache_load(const char *kind, uint32_t version, uint64_t hash,
+                    size_t source_len, tex_cache_entry *entry);
+void tex_cache_release(tex_cache_entry *entry);
+void tex_cache_store(const char *kind, uint32_t version, uint64_t hash,
+                     size_t source_len, const void *data, size_t len);
+
 /***************************/
 /* Definition of DVI fonts */
 /***************************/
@@ -203,6 +234,11 @@ typedef struct {
   void *env;
   fz_stream *(*open_file)(fz_context *ctx, void *env, dvi_reskind kind, const char *name);
   void (*free_env)(fz_context *ctx, void *env);
+  // Optional: whole contents of a file, possibly shared with other users
+  fz_buffer *(*load_file)(fz_context *ctx, void *env, dvi_reskind kind, const char *name);
+  // Optional: announce resources that are likely to be opened soon
+  void (*prefetch)(fz_context *ctx, void *env, int count,
+                   const dvi_reskind *kinds, const char *const *names);
 } dvi_reshooks;
 
 dvi_reshooks dvi_tectonic_hooks(fz_context *ctx, const char *document_directory);
@@ -218,7 +254,17 @@ int bundle_server_input(bundle_server *server);
 int bundle_server_output(bundle_server *server);
 int bundle_server_lock(bundle_server *server);
 dvi_reshooks bundle_server_hooks(bundle_server *server);
-
+// Record the files served in this session, for the next server started for
+// the same document directory
+void bundle_server_save_manifest(fz_context *ctx, bundle_server *server);
+// A file that TeX looks up in the bundle itself (the engine answers `pass').
+// Its name is recorded in the manifest, so that the next session prefetches
+// it; returns its contents if it was prefetched, NULL otherwise.
+fz_buffer *bundle_server_take(fz_context *ctx, bundle_server *server, const char *name);
+
+// Share the environment of hooks without taking ownership: the result is
+// safe to pass to another resmanager, the original owner frees the env.
+dvi_reshooks dvi_borrow_hooks(dvi_reshooks hooks);
 void dvi_free_hooks(fz_context *ctx, const dvi_reshooks *hooks);
 
 dvi_resmanager *dvi_resmanager_new(fz_context *ctx, dvi_reshooks hooks);
@@ -226,8 +272,17 @@ void dvi_resmanager_free(fz_context *ctx, dvi_resmanager *rm);
 dvi_font *dvi_resmanager_get_tex_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int namelen);
 fz_font *dvi_resmanager_get_xdv_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int namelen, int index);
 pdf_document *dvi_resmanager_get_pdf(fz_context *ctx, dvi_resmanager *rm, const char *filename);
+// Display list of a page of a PDF document (owned by the resource manager,
+// dropped when the document is invalidated) and its media box, or NULL if the
+// document could not be opened
+fz_display_list *dvi_resmanager_get_pdf_page(fz_context *ctx, dvi_resmanager *rm, const char *filename, int index, fz_rect *mediabox);
 fz_image *dvi_resmanager_get_img(fz_context *ctx, dvi_resmanager *rm, const char *filename);
 void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *name);
+void dvi_resmanager_print_stats(fz_context *ctx, dvi_resmanager *rm);
+// Fetch in a single batch the files needed by the TeX fonts that are not
+// loaded yet (names are not null-terminated)
+void dvi_resmanager_prefetch_tex_fonts(fz_context *ctx, dvi_resmanager *rm, int count,
+                                       const char *const *names, const int *lens);
 
 /****************************************/
 /* Definition of DVI runtime structures */
@@ -253,7 +308,9 @@ typedef struct
   int32_t h, v, w, x, y, z;
 } dvi_registers;
 
-// A simple arena allocator from page-scoped allocation
+// A simple arena allocator from page-scoped allocation.
+// Clearing keeps a single buffer as large as all those used by the frame,
+// so that frames stop allocating once the largest one has been seen.
 
 typedef struct
 {
@@ -339,8 +396,17 @@ typedef struct
 {
   fz_device *dev;
   fz_text *text;
+  // Fill color of the glyphs accumulated in text
+  float text_color[3];
   fz_path *path;
+
+  // Transient state of a frame (see dvi_context_begin_frame): allocated for
+  // the first pages, then reset at the end of each frame and reused
   dvi_scratch scratch;
+  // Operand stack of pdf:code specials
+  struct vstack *pdf_stack;
+  // Unit square, filled with a transformation to draw rules
+  fz_path *unit_rect;
   dvi_resmanager *resmanager;
   dvi_state root;
   dvi_registers registers_stack[256];
@@ -351,6 +417,9 @@ typedef struct
   // Pdf color stacks (introduced by pdftex)
   dvi_colorstacks pdfcolorstacks;
   float scale;
+
+  // Compiled pdf:code specials (see dvi_special.c), NULL until the first one
+  struct dvi_codecache *codecache;
 } dvi_context;
 
 #define DC_ALLOC(ctx, dc, type, count) ((type*)dvi_scratch_alloc(ctx, &(dc)->scratch, sizeof(type) * (count)))
@@ -71,6 +71,9 @@ bool dvi_exec_special(fz_context *ctx, dvi_context *dc, dvi_state *st, const cha
 bool dvi_init_special(fz_context *ctx, dvi_context *dc, dvi_state *st, const char *ptr, const char *lim);
 void dvi_prescan_special(const char *ptr, const char *lim, float *width, float *height, bool *landscape);
 
+// Drop the compiled specials of a context and report the hit rate
+void dvi_free_special_cache(fz_context *ctx, dvi_context *dc);
+
 #endif /*!DVI_INTERP_H*/
 #ifdef __cplusplus
 }
@@ -0,0 +1,179 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mydvi.h"
+#include "fz_util.h"
+#include "txp_log.h"
+
+// Layout of a cache file: a header followed by the payload.
+// Files are written to a temporary name then renamed, so concurrent
+// processes never observe a partial entry.
+
+#define TEX_CACHE_MAGIC "TXPCACHE"
+
+typedef struct {
+  char magic[8];
+  uint32_t version, header_size;
+  uint64_t hash, source_len, payload_len;
+} tex_cache_header;
+
+uint64_t tex_cache_hash(const void *data, size_t len)
+{
+  return sdbm_hash(len, data, len);
+}
+
+static const char *cache_dir(void)
+{
+  static char dir[1024];
+  static int initialized = 0;
+
+  if (initialized)
+    return dir[0] ? dir : NULL;
+  initialized = 1;
+
+  const char *base = getenv("XDG_CACHE_HOME");
+  int n;
+  if (base && *base)
+    n = snprintf(dir, sizeof(dir), "%s", base);
+  else
+  {
+    const char *home = getenv("HOME");
+    if (!home || !*home)
+      return NULL;
+    n = snprintf(dir, sizeof(dir), "%s/.cache", home);
+  }
+  if (n <= 0 || n >= (int)sizeof(dir) - 16)
+  {
+    dir[0] = 0;
+    return NULL;
+  }
+
+  mkdir(dir, 0755);
+  strcat(dir, "/texpresso");
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+  {
+    perror("tex_cache: mkdir");
+    dir[0] = 0;
+    return NULL;
+  }
+  return dir;
+}
+
+static bool cache_path(char *path, size_t size, const char *kind, uint64_t hash)
+{
+  const char *dir = cache_dir();
+  if (!dir)
+    return 0;
+  int n = snprintf(path, size, "%s/%s-%016llx.bin", dir, kind,
+                   (unsigned long long)hash);
+  return (n > 0 && n < (int)size);
+}
+
+bool tex_cache_load(const char *kind, uint32_t version, uint64_t hash,
+                    size_t source_len, tex_cache_entry *entry)
+{
+  char path[1200];
+  if (!cache_path(path, sizeof(path), kind, hash))
+    return 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(tex_cache_header))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+    return 0;
+
+  const tex_cache_header *h = map;
+  if (memcmp(h->magic, TEX_CACHE_MAGIC, 8) != 0 ||
+      h->version != version ||
+      h->header_size != sizeof(tex_cache_header) ||
+      h->hash != hash ||
+      h->source_len != source_len ||
+      h->payload_len != st.st_size - sizeof(tex_cache_header))
+  {
+    txp_info(TXP_LOG_DVI, "[tex_cache] ignoring stale entry %s\n", path);
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  entry->map = map;
+  entry->map_len = st.st_size;
+  entry->data = (const char *)map + sizeof(tex_cache_header);
+  entry->len = h->payload_len;
+  return 1;
+}
+
+void tex_cache_release(tex_cache_entry *entry)
+{
+  if (entry->map)
+    munmap(entry->map, entry->map_len);
+  *entry = (tex_cache_entry){0,};
+}
+
+void tex_cache_store(const char *kind, uint32_t version, uint64_t hash,
+                     size_t source_len, const void *data, size_t len)
+{
+  char path[1200], tmp[1300];
+  if (!cache_path(path, sizeof(path), kind, hash))
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+  FILE *f = fopen(tmp, "wb");
+  if (!f)
+    return;
+
+  tex_cache_header h = {
+    .version = version,
+    .header_size = sizeof(tex_cache_header),
+    .hash = hash,
+    .source_len = source_len,
+    .payload_len = len,
+  };
+  memcpy(h.magic, TEX_CACHE_MAGIC, 8);
+
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+            (len == 0 || fwrite(data, len, 1, f) == 1);
+  ok = (fclose(f) == 0) && ok;
+
+  if (!ok || rename(tmp, path) != 0)
+  {
+    txp_warn(TXP_LOG_DVI, "[tex_cache] cannot write %s\n", path);
+    unlink(tmp);
+  }
+}
@@ -25,6 +25,7 @@
 #include <string.h>
 #include "mydvi.h"
 #include "fz_util.h"
+#include "txp_log.h"
 
 struct tex_enc {
   fz_buffer *buffer;
@@ -123,7 +124,7 @@ tex_enc *tex_enc_load(fz_context *ctx, fz_stream *stream)
     *ending = 0;
 
     if (entry < 256)
-      fprintf(stderr, "tex_enc_load: incomplete encoding, %d entries\n", entry);
+      txp_warn(TXP_LOG_DVI, "tex_enc_load: incomplete encoding, %d entries\n", entry);
   }
   fz_catch(ctx)
   {
@@ -26,35 +26,142 @@
 #include <mupdf/fitz/context.h>
 #include "mydvi.h"
 #include "fz_util.h"
+#include "txp_log.h"
 
-static unsigned long
-sdbm_hash(const void *p)
-{
-    unsigned long hash = 0;
-    int c;
-
-    for (const unsigned char *str = p; (c = *str); str++)
-        hash = c + (hash << 6) + (hash << 16) - hash;
-
-    return hash * 2654435761;
-}
-
-#define str_hash sdbm_hash
 
 struct tex_fontmap {
+  // Strings are either in the buffer (parsed map) or in the cache entry
   fz_buffer *buffer;
+  tex_cache_entry cache;
   int mask;
   tex_fontmap_entry *table;
 };
 
-tex_fontmap *tex_fontmap_load(fz_context *ctx, fz_stream **streams, int count)
+// Persistent cache of parsed fontmaps: a cached_fontmap header, the hash
+// table then the text of the maps, with strings as offsets in the text.
+
+#define FONTMAP_CACHE_VERSION 2
+#define NO_STRING 0xFFFFFFFF
+
+typedef struct {
+  uint32_t capacity, text_len;
+} cached_fontmap;
+
+typedef struct {
+  uint64_t hash;
+  uint32_t strings[5];
+  uint32_t padding;
+} cached_entry;
+
+static const char **entry_string(tex_fontmap_entry *e, int i)
 {
-  fz_ptr(tex_fontmap, result);
-  fz_ptr(fz_buffer, buffer);
+  switch (i)
+  {
+    case 0: return &e->pk_font_name;
+    case 1: return &e->ps_font_name;
+    case 2: return &e->ps_snippet;
+    case 3: return &e->enc_file_name;
+    case 4: return &e->font_file_name;
+    default: abort();
+  }
+}
+
+static tex_fontmap *fontmap_from_cache(fz_context *ctx, tex_cache_entry *entry)
+{
+  const cached_fontmap *h = entry->data;
+  if (entry->len < sizeof(cached_fontmap))
+    return NULL;
+
+  uint32_t capacity = h->capacity;
+  const cached_entry *entries = (const void *)(h + 1);
+  const char *text = (const void *)(entries + capacity);
+
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+      entry->len != sizeof(cached_fontmap) +
+                    sizeof(cached_entry) * (size_t)capacity + h->text_len ||
+      h->text_len == 0 || text[h->text_len - 1] != 0)
+    return NULL;
+
+  tex_fontmap_entry *table =
+    fz_malloc_struct_array(ctx, capacity, tex_fontmap_entry);
+
+  for (uint32_t i = 0; i < capacity; ++i)
+  {
+    table[i].hash = entries[i].hash;
+    for (int j = 0; j < 5; ++j)
+    {
+      uint32_t offset = entries[i].strings[j];
+      if (offset == NO_STRING)
+        continue;
+      if (offset >= h->text_len)
+      {
+        fz_free(ctx, table);
+        return NULL;
+      }
+      *entry_string(&table[i], j) = text + offset;
+    }
+  }
+
+  tex_fontmap *result = fz_malloc_struct(ctx, tex_fontmap);
+  result->cache = *entry;
+  result->mask = capacity - 1;
+  result->table = table;
+  return result;
+}
+
+static void fontmap_store_cache(fz_context *ctx, uint64_t hash,
+                                size_t source_len, tex_fontmap *fm)
+{
+  const char *text = (const char *)fm->buffer->data;
+  uint32_t capacity = fm->mask + 1;
+  size_t len = sizeof(cached_fontmap) +
+               sizeof(cached_entry) * capacity + fm->buffer->len;
+
+  if (capacity == 0)
+    return;
+
+  fz_ptr(void, data);
+  fz_try(ctx)
+  {
+    data = fz_malloc(ctx, len);
+    cached_fontmap *h = data;
+    cached_entry *entries = (void *)(h + 1);
+    h->capacity = capacity;
+    h->text_len = fm->buffer->len;
+
+    for (uint32_t i = 0; i < capacity; ++i)
+    {
+      tex_fontmap_entry *e = &fm->table[i];
+      entries[i] = (cached_entry){.hash = e->hash};
+      for (int j = 0; j < 5; ++j)
+      {
+        const char *str = *entry_string(e, j);
+        entries[i].strings[j] = str ? str - text : NO_STRING;
+      }
+    }
+    memcpy(entries + capacity, text, fm->buffer->len);
+
+    tex_cache_store("fontmap", FONTMAP_CACHE_VERSION, hash, source_len,
+                    data, len);
+  }
+  fz_always(ctx)
+  {
+    if (data)
+      fz_free(ctx, data);
+  }
+  fz_catch(ctx)
+  {
+    fz_warn(ctx, "tex_fontmap: cannot cache fontmap: %s",
+            fz_caught_message(ctx));
+  }
+}
+
+static fz_buffer *fontmap_read(fz_context *ctx, fz_stream **streams, int count)
+{
+  fz_buffer *buffer = fz_new_buffer(ctx, 1024 * 1024);
 
   fz_try(ctx)
   {
-    fz_buffer *buffer = fz_new_buffer(ctx, 1024 * 1024);
     for (int i = 0; i < count; ++i)
     {
       if (!streams[i]) continue;
@@ -77,7 +184,23 @@ tex_fontmap *tex_fontmap_load(fz_context *ctx, fz_stream **streams, int count)
     }
     fz_append_byte(ctx, buffer, 0);
     fz_trim_buffer(ctx, buffer);
+  }
+  fz_catch(ctx)
+  {
+    fz_drop_buffer(ctx, buffer);
+    fz_rethrow(ctx);
+  }
+
+  return buffer;
+}
+
+// Parse the fontmap, taking ownership of the buffer
+static tex_fontmap *fontmap_parse(fz_context *ctx, fz_buffer *buffer)
+{
+  fz_ptr(tex_fontmap, result);
 
+  fz_try(ctx)
+  {
     result = fz_malloc_struct(ctx, tex_fontmap);
 
     char *ptr = (char *)buffer->data;
@@ -176,7 +299,7 @@ tex_fontmap *tex_fontmap_load(fz_context *ctx, fz_stream **streams, int count)
         //printf("- ps snippet: %s\n", entry.ps_snippet);
         //printf("-   enc file: %s\n", entry.enc_file_name);
         //printf("-  font file: %s\n", entry.font_file_name);
-        entry.hash = str_hash(entry.pk_font_name);
+        entry.hash = sdbm_hash_string(entry.pk_font_name, NULL);
         rawtable[count] = entry;
         count += 1;
         continue;
@@ -186,14 +309,14 @@ seek_next_line:
       {
         char c = *ptr;
         *ptr = '\0';
-        if (0 && entry.pk_font_name)
+        if (entry.pk_font_name)
         {
-          fprintf(stderr, "skip entry:\n");
-          fprintf(stderr, "-    pk name: %s\n", entry.pk_font_name);
-          fprintf(stderr, "-    ps name: %s\n", entry.ps_font_name);
-          fprintf(stderr, "- ps snippet: %s\n", entry.ps_snippet);
-          fprintf(stderr, "-   enc file: %s\n", entry.enc_file_name);
-          fprintf(stderr, "-  font file: %s\n", entry.font_file_name);
+          txp_debug(TXP_LOG_DVI, "skip entry:\n");
+          txp_debug(TXP_LOG_DVI, "-    pk name: %s\n", entry.pk_font_name);
+          txp_debug(TXP_LOG_DVI, "-    ps name: %s\n", entry.ps_font_name);
+          txp_debug(TXP_LOG_DVI, "- ps snippet: %s\n", entry.ps_snippet);
+          txp_debug(TXP_LOG_DVI, "-   enc file: %s\n", entry.enc_file_name);
+          txp_debug(TXP_LOG_DVI, "-  font file: %s\n", entry.font_file_name);
         }
         *ptr = c;
         while (*ptr && !is_nl(*ptr)) ptr++;
@@ -218,10 +341,11 @@ seek_next_line:
     for (int i = 0; i < count; ++i)
     {
       tex_fontmap_entry entry = rawtable[i];
-      int index = entry.hash & mask;
+      int index = hash_bucket(entry.hash, capacity);
       while (hashtable[index].pk_font_name)
       {
-        if ((entry.hash & mask) < (hashtable[index].hash & mask))
+        if (hash_bucket(entry.hash, capacity) <
+            hash_bucket(hashtable[index].hash, capacity))
         {
           tex_fontmap_entry tmp = hashtable[index];
           hashtable[index] = entry;
@@ -250,10 +374,44 @@ seek_next_line:
   return result;
 }
 
+tex_fontmap *tex_fontmap_load(fz_context *ctx, fz_stream **streams, int count)
+{
+  fz_buffer *buffer = fontmap_read(ctx, streams, count);
+  size_t source_len = buffer->len;
+  uint64_t hash = tex_cache_hash(buffer->data, source_len);
+
+  tex_cache_entry entry;
+  if (tex_cache_load("fontmap", FONTMAP_CACHE_VERSION, hash, source_len, &entry))
+  {
+    tex_fontmap *result = NULL;
+    fz_try(ctx)
+    {
+      result = fontmap_from_cache(ctx, &entry);
+    }
+    fz_catch(ctx)
+    {
+      result = NULL;
+    }
+
+    if (result)
+    {
+      fz_drop_buffer(ctx, buffer);
+      return result;
+    }
+    tex_cache_release(&entry);
+  }
+
+  tex_fontmap *result = fontmap_parse(ctx, buffer);
+  fontmap_store_cache(ctx, hash, source_len, result);
+  return result;
+}
+
 void tex_fontmap_free(fz_context *ctx, tex_fontmap *t)
 {
   fz_free(ctx, t->table);
-  fz_drop_buffer(ctx, t->buffer);
+  if (t->buffer)
+    fz_drop_buffer(ctx, t->buffer);
+  tex_cache_release(&t->cache);
   fz_free(ctx, t);
 }
 
@@ -262,10 +420,10 @@ int max_poschain = 0, max_negchain = 0, lookup_count = 0, lookup_probe = 0;
 
 static void print_chain(void)
 {
-  fprintf(stderr, "tex_fontmap: max_pos_chain: %d\n", max_poschain);
-  fprintf(stderr, "tex_fontmap: max_neg_chain: %d\n", max_negchain);
-  fprintf(stderr, "tex_fontmap: lookup_count: %d\n", lookup_count);
-  fprintf(stderr, "tex_fontmap: average_chain: %f\n", (double)lookup_probe / (double)lookup_count);
+  txp_debug(TXP_LOG_DVI, "tex_fontmap: max_pos_chain: %d\n", max_poschain);
+  txp_debug(TXP_LOG_DVI, "tex_fontmap: max_neg_chain: %d\n", max_negchain);
+  txp_debug(TXP_LOG_DVI, "tex_fontmap: lookup_count: %d\n", lookup_count);
+  txp_debug(TXP_LOG_DVI, "tex_fontmap: average_chain: %f\n", (double)lookup_probe / (double)lookup_count);
 }
 #endif
 
@@ -283,8 +441,8 @@ tex_fontmap_entry *tex_fontmap_lookup(tex_fontmap *t, const char *name)
 #endif
 
 
-  unsigned long hash = str_hash(name);
-  int index = hash & t->mask;
+  unsigned long hash = sdbm_hash_string(name, NULL);
+  int index = hash_bucket(hash, t->mask + 1);
 
   while (t->table[index].pk_font_name)
   {
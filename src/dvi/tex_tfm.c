@@ -26,6 +26,7 @@
 #include "mydvi.h"
 #include "intcodec.h"
 #include "fz_util.h"
+#include "txp_log.h"
 
 // the char info word for each character consists of 4 bytes holding the following information:
 // width index w, height index (h), depth index (d), italic correction index (it),
@@ -246,24 +247,24 @@ tex_tfm *tex_tfm_load(fz_context *ctx, fz_stream *stm)
     if (p - buf != 24) abort();
 
 #ifdef DEBUG_TFM
-    fprintf(stderr, "lf = %4u   %% length of the entire file, in words\n",        lf);
-    fprintf(stderr, "lh = %4u   %% length of the header data, in words\n",        lh);
-    fprintf(stderr, "bc = %4u   %% smallest character code in the font\n",        bc);
-    fprintf(stderr, "ec = %4u   %% largest character code in the font\n",         ec);
-    fprintf(stderr, "nw = %4u   %% number of words in the width table\n",         nw);
-    fprintf(stderr, "nh = %4u   %% number of words in the height table\n",        nh);
-    fprintf(stderr, "nd = %4u   %% number of words in the depth table\n",         nd);
-    fprintf(stderr, "ni = %4u   %% number of words in the italic correction table\n",   ni);
-    fprintf(stderr, "nl = %4u   %% number of words in the lig/kern table\n",        nl);
-    fprintf(stderr, "nk = %4u   %% number of words in the kern table\n",          nk);
-    fprintf(stderr, "ne = %4u   %% number of words in the extensible character table\n",  ne);
-    fprintf(stderr, "np = %4u   %% number of font parameter words\n",           np);
+    txp_debug(TXP_LOG_DVI, "lf = %4u   %% length of the entire file, in words\n",        lf);
+    txp_debug(TXP_LOG_DVI, "lh = %4u   %% length of the header data, in words\n",        lh);
+    txp_debug(TXP_LOG_DVI, "bc = %4u   %% smallest character code in the font\n",        bc);
+    txp_debug(TXP_LOG_DVI, "ec = %4u   %% largest character code in the font\n",         ec);
+    txp_debug(TXP_LOG_DVI, "nw = %4u   %% number of words in the width table\n",         nw);
+    txp_debug(TXP_LOG_DVI, "nh = %4u   %% number of words in the height table\n",        nh);
+    txp_debug(TXP_LOG_DVI, "nd = %4u   %% number of words in the depth table\n",         nd);
+    txp_debug(TXP_LOG_DVI, "ni = %4u   %% number of words in the italic correction table\n",   ni);
+    txp_debug(TXP_LOG_DVI, "nl = %4u   %% number of words in the lig/kern table\n",        nl);
+    txp_debug(TXP_LOG_DVI, "nk = %4u   %% number of words in the kern table\n",          nk);
+    txp_debug(TXP_LOG_DVI, "ne = %4u   %% number of words in the extensible character table\n",  ne);
+    txp_debug(TXP_LOG_DVI, "np = %4u   %% number of font parameter words\n",           np);
 #endif
 
     int expected_len = 6+lh+(ec - bc +1)+nw+nh+nd+ni+nl+nk+ne+np;
     if (expected_len != lf)
     {
-      fprintf(stderr, "length = %d, expected %d\n", lf, expected_len);
+      txp_error(TXP_LOG_DVI, "length = %d, expected %d\n", lf, expected_len);
       FAIL("Inconsistent length values");
     }
     if (lh < 2)
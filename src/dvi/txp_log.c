@@ -0,0 +1,173 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "txp_log.h"
+
+#define LOG_BUFFER_SIZE 16384
+
+int txp_log_levels[TXP_LOG_CATEGORIES] = {
+  [0 ... TXP_LOG_CATEGORIES - 1] = TXP_LOG_INFO,
+};
+
+static const char *category_names[TXP_LOG_CATEGORIES] = {
+  [TXP_LOG_MAIN]     = "main",
+  [TXP_LOG_ENGINE]   = "engine",
+  [TXP_LOG_RENDER]   = "render",
+  [TXP_LOG_DVI]      = "dvi",
+  [TXP_LOG_BUNDLE]   = "bundle",
+  [TXP_LOG_SYNCTEX]  = "synctex",
+  [TXP_LOG_PROTOCOL] = "protocol",
+};
+
+static const char *level_names[] = {
+  [TXP_LOG_ERROR] = "error",
+  [TXP_LOG_WARN]  = "warn",
+  [TXP_LOG_INFO]  = "info",
+  [TXP_LOG_DEBUG] = "debug",
+};
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char log_buffer[LOG_BUFFER_SIZE];
+static int log_len;
+
+static int parse_level(const char *s, int len)
+{
+  for (int i = 0; i <= TXP_LOG_DEBUG; ++i)
+    if (strlen(level_names[i]) == len && strncmp(level_names[i], s, len) == 0)
+      return i;
+  fprintf(stderr, "[log] unknown level %.*s\n", len, s);
+  return -1;
+}
+
+static void parse_setting(const char *s, int len)
+{
+  const char *eq = memchr(s, '=', len);
+
+  if (!eq)
+  {
+    int level = parse_level(s, len);
+    if (level >= 0)
+      for (int i = 0; i < TXP_LOG_CATEGORIES; ++i)
+        txp_log_levels[i] = level;
+    return;
+  }
+
+  int level = parse_level(eq + 1, len - (eq + 1 - s));
+  if (level < 0)
+    return;
+
+  for (int i = 0; i < TXP_LOG_CATEGORIES; ++i)
+  {
+    if (strlen(category_names[i]) == eq - s &&
+        strncmp(category_names[i], s, eq - s) == 0)
+    {
+      txp_log_levels[i] = level;
+      return;
+    }
+  }
+  fprintf(stderr, "[log] unknown category %.*s\n", (int)(eq - s), s);
+}
+
+void txp_log_init(void)
+{
+  // Each session calls this again after a reload of the dev build. The
+  // handler belongs to this module: when it is unloaded, the C library runs
+  // it at dlclose instead of at exit.
+  static int registered = 0;
+  if (!registered)
+  {
+    atexit(txp_log_flush);
+    registered = 1;
+  }
+
+  const char *spec = getenv("TEXPRESSO_LOG");
+  if (!spec)
+    return;
+
+  while (*spec)
+  {
+    const char *end = strchr(spec, ',');
+    if (!end)
+      end = spec + strlen(spec);
+    if (end > spec)
+      parse_setting(spec, end - spec);
+    spec = *end ? end + 1 : end;
+  }
+}
+
+static void flush_buffer(void)
+{
+  if (log_len > 0)
+  {
+    fwrite(log_buffer, 1, log_len, stderr);
+    log_len = 0;
+  }
+}
+
+void txp_log_flush(void)
+{
+  pthread_mutex_lock(&log_mutex);
+  flush_buffer();
+  fflush(stderr);
+  pthread_mutex_unlock(&log_mutex);
+}
+
+void txp_log_print(int level, const char *fmt, ...)
+{
+  va_list ap;
+
+  pthread_mutex_lock(&log_mutex);
+
+  va_start(ap, fmt);
+  int len = vsnprintf(log_buffer + log_len, LOG_BUFFER_SIZE - log_len, fmt, ap);
+  va_end(ap);
+
+  if (len >= LOG_BUFFER_SIZE - log_len)
+  {
+    // Did not fit: flush what was there and try again
+    flush_buffer();
+    va_start(ap, fmt);
+    if (len >= LOG_BUFFER_SIZE)
+      vfprintf(stderr, fmt, ap);
+    else
+      log_len = vsnprintf(log_buffer, LOG_BUFFER_SIZE, fmt, ap);
+    va_end(ap);
+  }
+  else if (len > 0)
+    log_len += len;
+
+  if (level <= TXP_LOG_WARN)
+  {
+    flush_buffer();
+    fflush(stderr);
+  }
+
+  pthread_mutex_unlock(&log_mutex);
+}
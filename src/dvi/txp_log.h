@@ -0,0 +1,87 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef TXP_LOG_H_
+#define TXP_LOG_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Leveled logging to stderr.
+//
+// Messages less severe than TXP_LOG_LEVEL are compiled out: the arguments
+// are not even evaluated. The others are filtered at runtime by category, using the
+// TEXPRESSO_LOG environment variable (e.g. "debug" or "info,render=debug"),
+// and buffered. The buffer is written when it is full, when a warning or an
+// error is logged, on txp_log_flush and at exit.
+//
+// Build with -DTXP_LOG_LEVEL=TXP_LOG_WARN to strip informational messages
+// from a release binary.
+
+#define TXP_LOG_ERROR 0
+#define TXP_LOG_WARN  1
+#define TXP_LOG_INFO  2
+#define TXP_LOG_DEBUG 3
+
+#ifndef TXP_LOG_LEVEL
+#define TXP_LOG_LEVEL TXP_LOG_DEBUG
+#endif
+
+enum txp_log_category
+{
+  TXP_LOG_MAIN,
+  TXP_LOG_ENGINE,
+  TXP_LOG_RENDER,
+  TXP_LOG_DVI,
+  TXP_LOG_BUNDLE,
+  TXP_LOG_SYNCTEX,
+  TXP_LOG_PROTOCOL,
+  TXP_LOG_CATEGORIES,
+};
+
+extern int txp_log_levels[TXP_LOG_CATEGORIES];
+
+void txp_log_init(void);
+void txp_log_flush(void);
+void txp_log_print(int level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+#define txp_log(level, cat, ...)                                      \
+  do {                                                                \
+    if ((level) <= TXP_LOG_LEVEL && (level) <= txp_log_levels[cat])   \
+      txp_log_print(level, __VA_ARGS__);                              \
+  } while (0)
+
+#define txp_error(cat, ...) txp_log(TXP_LOG_ERROR, cat, __VA_ARGS__)
+#define txp_warn(cat, ...)  txp_log(TXP_LOG_WARN, cat, __VA_ARGS__)
+#define txp_info(cat, ...)  txp_log(TXP_LOG_INFO, cat, __VA_ARGS__)
+#define txp_debug(cat, ...) txp_log(TXP_LOG_DEBUG, cat, __VA_ARGS__)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TXP_LOG_H_
@@ -0,0 +1,140 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "txp_memdiff.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#if defined(__SSE2__)
+
+// Bit i is set if byte i of the 16-byte blocks differ
+static inline unsigned block_diff(const uint8_t *a, const uint8_t *b)
+{
+  __m128i va = _mm_loadu_si128((const __m128i *)a);
+  __m128i vb = _mm_loadu_si128((const __m128i *)b);
+  return ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+}
+
+static size_t wide_diff(const uint8_t *a, const uint8_t *b, size_t len)
+{
+  size_t i = 0;
+
+  // Four blocks per iteration, the position is only computed once a
+  // difference was seen
+  for (; i + 64 <= len; i += 64)
+  {
+    __m128i a0 = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i a1 = _mm_loadu_si128((const __m128i *)(a + i + 16));
+    __m128i a2 = _mm_loadu_si128((const __m128i *)(a + i + 32));
+    __m128i a3 = _mm_loadu_si128((const __m128i *)(a + i + 48));
+    __m128i e0 = _mm_cmpeq_epi8(a0, _mm_loadu_si128((const __m128i *)(b + i)));
+    __m128i e1 = _mm_cmpeq_epi8(a1, _mm_loadu_si128((const __m128i *)(b + i + 16)));
+    __m128i e2 = _mm_cmpeq_epi8(a2, _mm_loadu_si128((const __m128i *)(b + i + 32)));
+    __m128i e3 = _mm_cmpeq_epi8(a3, _mm_loadu_si128((const __m128i *)(b + i + 48)));
+    __m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+    if (_mm_movemask_epi8(all) != 0xFFFF)
+      break;
+  }
+
+  for (; i + 16 <= len; i += 16)
+  {
+    unsigned mask = block_diff(a + i, b + i);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i;
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+static inline uint64_t block_diff(const uint8_t *a, const uint8_t *b)
+{
+  uint8x16_t ne = vmvnq_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b)));
+  // Narrow each byte to 4 bits: 16 bytes fit in a 64-bit mask
+  uint8x8_t mask = vshrn_n_u16(vreinterpretq_u16_u8(ne), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(mask), 0);
+}
+
+static size_t wide_diff(const uint8_t *a, const uint8_t *b, size_t len)
+{
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64)
+  {
+    uint8x16_t e0 = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+    uint8x16_t e1 = vceqq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16));
+    uint8x16_t e2 = vceqq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32));
+    uint8x16_t e3 = vceqq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48));
+    uint8x16_t all = vandq_u8(vandq_u8(e0, e1), vandq_u8(e2, e3));
+    if (vminvq_u8(all) != 0xFF)
+      break;
+  }
+
+  for (; i + 16 <= len; i += 16)
+  {
+    uint64_t mask = block_diff(a + i, b + i);
+    if (mask)
+      return i + (__builtin_ctzll(mask) >> 2);
+  }
+  return i;
+}
+
+#else
+
+static size_t wide_diff(const uint8_t *a, const uint8_t *b, size_t len)
+{
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+  {
+    uint64_t wa, wb;
+    memcpy(&wa, a + i, 8);
+    memcpy(&wb, b + i, 8);
+    if (wa != wb)
+    {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return i + (__builtin_ctzll(wa ^ wb) >> 3);
+#else
+      break;
+#endif
+    }
+  }
+  return i;
+}
+
+#endif
+
+size_t txp_memdiff(const void *a, const void *b, size_t len)
+{
+  const uint8_t *pa = a, *pb = b;
+  size_t i = wide_diff(pa, pb, len);
+  while (i < len && pa[i] == pb[i])
+    i += 1;
+  return i;
+}
@@ -0,0 +1,128 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "txp_memstat.h"
+#include "txp_log.h"
+
+static struct txp_memstat *memstat;
+static int summary_period;
+static struct txp_mem_window summary_window;
+
+static const char *tag_names[TXP_MEM_TAGS] = {
+  [TXP_MEM_OTHER]     = "other",
+  [TXP_MEM_DISPLAY]   = "display-lists",
+  [TXP_MEM_STEXT]     = "stext",
+  [TXP_MEM_RENDER]    = "render",
+  [TXP_MEM_FILES]     = "files",
+  [TXP_MEM_ROLLBACK]  = "rollback",
+  [TXP_MEM_RESOURCES] = "resources",
+};
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void txp_memstat_attach(struct txp_memstat *ms, int period)
+{
+  memstat = ms;
+  summary_period = period;
+  summary_window = (struct txp_mem_window){0,};
+  if (ms)
+    txp_memstat_sample(&summary_window, NULL);
+}
+
+int txp_mem_enter(int tag)
+{
+  if (!memstat)
+    return TXP_MEM_OTHER;
+  return memstat->set_tag(tag);
+}
+
+void txp_mem_leave(int previous)
+{
+  if (memstat)
+    memstat->set_tag(previous);
+}
+
+const char *txp_mem_tag_name(int tag)
+{
+  return tag_names[tag];
+}
+
+bool txp_memstat_sample(struct txp_mem_window *w,
+                        struct txp_mem_sample out[TXP_MEM_TAGS])
+{
+  if (!memstat)
+    return 0;
+
+  uint64_t now = now_us();
+  double elapsed = w->time_us ? (now - w->time_us) / 1e6 : 0;
+
+  for (int i = 0; i < TXP_MEM_TAGS; ++i)
+  {
+    struct txp_mem_counter *c = &memstat->tags[i];
+    uint64_t allocs = __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+    if (out)
+    {
+      out[i].live = __atomic_load_n(&c->live, __ATOMIC_RELAXED);
+      out[i].peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+      out[i].allocs = elapsed > 0 ? (allocs - w->allocs[i]) / elapsed : 0;
+      out[i].bytes = elapsed > 0 ? (bytes - w->bytes[i]) / elapsed : 0;
+    }
+    w->allocs[i] = allocs;
+    w->bytes[i] = bytes;
+  }
+  w->time_us = now;
+  return 1;
+}
+
+#define MIB (1024.0 * 1024.0)
+
+void txp_memstat_tick(void)
+{
+  if (!memstat || summary_period <= 0 ||
+      now_us() - summary_window.time_us < (uint64_t)summary_period * 1000000)
+    return;
+
+  struct txp_mem_sample s[TXP_MEM_TAGS];
+  txp_memstat_sample(&summary_window, s);
+
+  size_t total = 0;
+  for (int i = 0; i < TXP_MEM_TAGS; ++i)
+    total += s[i].live;
+
+  txp_log_print(TXP_LOG_INFO, "[memory] %.1fMiB live\n", total / MIB);
+  for (int i = 0; i < TXP_MEM_TAGS; ++i)
+    txp_log_print(TXP_LOG_INFO,
+                  "[memory]   %-13s %8.1fMiB (peak %.1fMiB), "
+                  "%.0f allocs/s, %.1fMiB/s\n",
+                  tag_names[i], s[i].live / MIB, s[i].peak / MIB,
+                  s[i].allocs, s[i].bytes / MIB);
+}
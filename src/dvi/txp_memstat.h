@@ -0,0 +1,114 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef TXP_MEMSTAT_H_
+#define TXP_MEMSTAT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Accounting of the memory allocated through the fz_context.
+//
+// The driver installs an allocator on the context that remembers, for each
+// block, its size and the subsystem of the thread that allocated it. A
+// thread selects its subsystem with txp_mem_enter/txp_mem_leave around the
+// work that allocates on its behalf; by default it is TXP_MEM_OTHER.
+// The counters are shared with the viewer through a txp_memstat structure,
+// so that they survive a reload of the viewer code.
+// Without an allocator attached (e.g. texpresso-bench), tagging costs a test
+// and the samples are empty.
+
+enum txp_mem_tag
+{
+  TXP_MEM_OTHER,
+  // Page display lists, built by the engines or in background
+  TXP_MEM_DISPLAY,
+  // Structured text extracted for selections
+  TXP_MEM_STEXT,
+  // Rasterization: pixmaps, tiles, glyph and image caches while drawing
+  TXP_MEM_RENDER,
+  // File contents: fs_data, edit_data and saved.data
+  TXP_MEM_FILES,
+  // Rollback log of the TeX process state
+  TXP_MEM_ROLLBACK,
+  // Fonts, images and PDF figures loaded by the DVI resource manager
+  TXP_MEM_RESOURCES,
+  TXP_MEM_TAGS,
+};
+
+struct txp_mem_counter
+{
+  // Bytes in use and their maximum
+  size_t live, peak;
+  // Allocations and bytes allocated since the start
+  uint64_t allocs, bytes;
+};
+
+struct txp_memstat
+{
+  struct txp_mem_counter tags[TXP_MEM_TAGS];
+  // Select the tag of the calling thread, return the previous one
+  int (*set_tag)(int tag);
+};
+
+// Counters maintained by the allocator, and the period in seconds of the
+// summary written on stderr by txp_memstat_tick (0 to disable)
+void txp_memstat_attach(struct txp_memstat *ms, int period);
+
+int txp_mem_enter(int tag);
+void txp_mem_leave(int previous);
+
+const char *txp_mem_tag_name(int tag);
+
+// Previous counters, to compute rates
+struct txp_mem_window
+{
+  uint64_t allocs[TXP_MEM_TAGS], bytes[TXP_MEM_TAGS];
+  uint64_t time_us;
+};
+
+struct txp_mem_sample
+{
+  size_t live, peak;
+  // Per second, since the previous sample taken with the same window
+  double allocs, bytes;
+};
+
+// Sample the counters, false if no allocator is attached
+bool txp_memstat_sample(struct txp_mem_window *w,
+                        struct txp_mem_sample out[TXP_MEM_TAGS]);
+
+// Write the summary on stderr if its period elapsed
+void txp_memstat_tick(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TXP_MEMSTAT_H_
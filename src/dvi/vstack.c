@@ -84,8 +84,12 @@ enum
   TAG_ARRAY,
   TAG_DICT,
   TAG_REF,
+  TAG_LONGSTRING,
 };
 
+// Strings longer than this are moved to a buffer of their own
+#define LONGSTRING_THRESHOLD 65536
+
 enum val_string_kind
 {
   CTX_NONE,
@@ -112,8 +116,22 @@ struct vstack
 
   uint8_t *data;
   size_t len, cap;
+
+  // Long strings, and the one being built (or NULL)
+  fz_buffer **buffers;
+  int buffer_count, buffer_cap;
+  fz_buffer *string_buffer;
 };
 
+static void drop_buffers(fz_context *ctx, vstack *t)
+{
+  for (int i = 0; i < t->buffer_count; ++i)
+    fz_drop_buffer(ctx, t->buffers[i]);
+  t->buffer_count = 0;
+  fz_drop_buffer(ctx, t->string_buffer);
+  t->string_buffer = NULL;
+}
+
 void vstack_reset(fz_context *ctx, vstack *t)
 {
   t->string_kind = CTX_NONE;
@@ -122,6 +140,10 @@ void vstack_reset(fz_context *ctx, vstack *t)
   t->struct_length = 0;
   t->previous = 0;
   t->len = 0;
+  // Long strings stay valid until the stack is reused, like the values that
+  // can still be read after vstack_get_values
+  fz_drop_buffer(ctx, t->string_buffer);
+  t->string_buffer = NULL;
 }
 
 vstack *vstack_new(fz_context *ctx)
@@ -129,6 +151,9 @@ vstack *vstack_new(fz_context *ctx)
   vstack *t = fz_malloc_struct(ctx, vstack);
   t->data = NULL;
   t->cap = 0;
+  t->buffers = NULL;
+  t->buffer_count = t->buffer_cap = 0;
+  t->string_buffer = NULL;
   vstack_reset(ctx, t);
   return t;
 }
@@ -137,12 +162,17 @@ void vstack_free(fz_context *ctx, vstack *t)
 {
   if (t->data)
     fz_free(ctx, t->data);
+  drop_buffers(ctx, t);
+  fz_free(ctx, t->buffers);
   fz_free(ctx, t);
 }
 
 static uint8_t *vstack_alloc(fz_context *ctx, vstack *t, size_t len)
 {
   size_t offset = t->len;
+  // Values of the previous command are no longer reachable
+  if (offset == 0 && t->buffer_count > 0)
+    drop_buffers(ctx, t);
   t->len += len;
   if (t->len > t->cap)
   {
@@ -230,7 +260,7 @@ static void vstack_close_struct(fz_context *ctx, vstack *t, uint8_t tag, val *ou
         offset += 5;
         break;
 
-      case TAG_REF:
+      case TAG_REF: case TAG_LONGSTRING:
         offset += 8;
         break;
 
@@ -291,8 +321,39 @@ static void vstack_open_string(fz_context *ctx, vstack *t, enum val_string_kind
   vstack_alloc(ctx, t, 4)[0] = tag;
 }
 
+static void vstack_close_longstring(fz_context *ctx, vstack *t)
+{
+  if (t->buffer_count == t->buffer_cap)
+  {
+    t->buffer_cap = t->buffer_cap == 0 ? 4 : t->buffer_cap * 2;
+    t->buffers = fz_realloc(ctx, t->buffers, t->buffer_cap * sizeof(fz_buffer*));
+  }
+  // The buffer was grown ahead while appending: give back the unused
+  // capacity, keeping room for the terminator (fz_trim_buffer does not, and
+  // fz_terminate_buffer would then double it again)
+  fz_resize_buffer(ctx, t->string_buffer, t->string_buffer->len + 1);
+  fz_terminate_buffer(ctx, t->string_buffer);
+  int index = t->buffer_count++;
+  t->buffers[index] = t->string_buffer;
+  t->string_buffer = NULL;
+
+  // Only the header is in the stack
+  uint8_t *data = vstack_alloc(ctx, t, 4) - 4;
+  store_u08(data + 0, TAG_LONGSTRING);
+  store_u24(data + 1, index);
+  store_u32(data + 4, t->string_length);
+  t->string_kind = CTX_NONE;
+  t->string_length = 0;
+  t->struct_length += 1;
+}
+
 static void vstack_close_string(fz_context *ctx, vstack *t)
 {
+  if (t->string_buffer)
+  {
+    vstack_close_longstring(ctx, t);
+    return;
+  }
   uint32_t offset = t->len - t->string_length - 4;
   store_u24(&t->data[offset + 1], t->string_length);
   vstack_alloc(ctx, t, 1)[0] = 0;
@@ -337,10 +398,36 @@ void vstack_end_name(fz_context *ctx, vstack *t)
   vstack_close_string(ctx, t);
 }
 
+// Lengths of strings are stored on 24 bits in the stack, and on 32 bits
+// for long strings
+#define STRING_MAX_LENGTH 0xFFFFFF
+#define LONGSTRING_MAX_LENGTH UINT32_MAX
+
+// Move the string being built out of the stack when it becomes long
+static bool vstack_longstring(fz_context *ctx, vstack *t, size_t len)
+{
+  size_t max = t->string_kind == CTX_STRING ? LONGSTRING_MAX_LENGTH : STRING_MAX_LENGTH;
+  if (len > max - t->string_length)
+    fz_throw(ctx, 0, "vstack: string too long");
+  if (t->string_buffer)
+    return 1;
+  if (t->string_kind != CTX_STRING ||
+      t->string_length + len <= LONGSTRING_THRESHOLD)
+    return 0;
+  size_t start = t->len - t->string_length;
+  t->string_buffer = fz_new_buffer(ctx, (t->string_length + len) * 2);
+  fz_append_data(ctx, t->string_buffer, &t->data[start], t->string_length);
+  t->len = start;
+  return 1;
+}
+
 void vstack_push_char(fz_context *ctx, vstack *t, int c)
 {
   ASSERT(t->string_kind != CTX_NONE);
-  vstack_alloc(ctx, t, 1)[0] = c;
+  if (vstack_longstring(ctx, t, 1))
+    fz_append_byte(ctx, t->string_buffer, c);
+  else
+    vstack_alloc(ctx, t, 1)[0] = c;
   t->string_length += 1;
 }
 
@@ -349,7 +436,10 @@ void vstack_push_chars(fz_context *ctx, vstack *t, const void *data, size_t len)
   ASSERT(t->string_kind != CTX_NONE);
   if (len == 0)
     return;
-  memcpy(vstack_alloc(ctx, t, len), data, len);
+  if (vstack_longstring(ctx, t, len))
+    fz_append_data(ctx, t->string_buffer, data, len);
+  else
+    memcpy(vstack_alloc(ctx, t, len), data, len);
   t->string_length += len;
 }
 
@@ -396,6 +486,14 @@ static val decode(const uint8_t* data, uint32_t *offset)
       return result;
       break;
 
+    case TAG_LONGSTRING:
+      result.kind = VAL_LONGSTRING;
+      result.o = load_u24(&data[*offset + 1]);
+      // Does not fit: see val_longstring_length
+      result.length = 0;
+      *offset += 8;
+      return result;
+
     case TAG_ARRAY:
     case TAG_DICT:
       len = load_u24(&data[*offset + 1]);
@@ -468,12 +566,29 @@ val val_dict_get_value(fz_context *ctx, vstack *t, val dict, int index)
 const char *val_string(fz_context *ctx, vstack *t, val v)
 {
   ASSERT(
-    (v.kind == VAL_STRING || v.kind == VAL_HEXSTRING || v.kind == VAL_NAME)
+    (v.kind == VAL_STRING || v.kind == VAL_HEXSTRING || v.kind == VAL_NAME ||
+     v.kind == VAL_LONGSTRING)
     && t->len == 0
   );
+  if (v.kind == VAL_LONGSTRING)
+    return (const char *)t->buffers[v.o]->data;
   return (const char *)&t->data[v.o];
 }
 
+uint32_t val_longstring_length(fz_context *ctx, vstack *t, val v)
+{
+  ASSERT(v.kind == VAL_LONGSTRING && t->len == 0);
+  return t->buffers[v.o]->len;
+}
+
+fz_buffer *val_string_buffer(fz_context *ctx, vstack *t, val v)
+{
+  ASSERT(val_is_string(v) && t->len == 0);
+  if (v.kind == VAL_LONGSTRING)
+    return t->buffers[v.o];
+  return NULL;
+}
+
 const char *val_as_string(fz_context *ctx, vstack *t, val v)
 {
   if (!val_is_string(v))
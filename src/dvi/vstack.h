@@ -29,6 +29,7 @@ extern "C" {
 #define VSTACK_H_
 
 #include <mupdf/fitz/context.h>
+#include <mupdf/fitz/buffer.h>
 #include <stdbool.h>
 
 typedef struct vstack vstack;
@@ -71,11 +72,14 @@ enum val_kind
   VAL_ARRAY,
   VAL_DICT,
   VAL_REF,
+  VAL_LONGSTRING,
 };
 
 typedef struct
 {
   enum val_kind kind : 4;
+  // Length of strings in the stack (at most 16MB), arrays and dicts; the
+  // length of a long string is kept with its buffer (val_string_length)
   uint32_t length : 28;
   union
   {
@@ -94,7 +98,8 @@ void vstack_get_floats(fz_context *ctx, vstack *t, float *values, int count);
 inlined bool val_is_null(val v)   { return (v.kind == VAL_NULL); }
 inlined bool val_is_number(val v) { return (v.kind == VAL_NUMBER); }
 inlined bool val_is_bool(val v)   { return (v.kind == VAL_BOOL); }
-inlined bool val_is_string(val v) { return (v.kind == VAL_STRING || v.kind == VAL_HEXSTRING); }
+inlined bool val_is_string(val v) { return (v.kind == VAL_STRING || v.kind == VAL_HEXSTRING ||
+                                           v.kind == VAL_LONGSTRING); }
 inlined bool val_is_name(val v)   { return (v.kind == VAL_NAME); }
 inlined bool val_is_array(val v)  { return (v.kind == VAL_ARRAY); }
 inlined bool val_is_dict(val v)   { return (v.kind == VAL_DICT); }
@@ -110,8 +115,13 @@ inlined float val_number(fz_context *ctx, val v)
 inlined bool val_bool(fz_context *ctx, val v)
 { VAL_CHECK(v, bool); return v.b; }
 
+uint32_t val_longstring_length(fz_context *ctx, vstack *t, val v);
+
 inlined uint32_t val_string_length(fz_context *ctx, vstack *t, val v)
-{ VAL_CHECK(v, string); return v.length; }
+{
+  VAL_CHECK(v, string);
+  return v.kind == VAL_LONGSTRING ? val_longstring_length(ctx, t, v) : v.length;
+}
 
 inlined uint32_t val_array_length(fz_context *ctx, vstack *t, val v)
 { VAL_CHECK(v, array); return v.length; }
@@ -136,6 +146,12 @@ const char *val_string(fz_context *ctx, vstack *t, val v);
 const char *val_as_string(fz_context *ctx, vstack *t, val v);
 const char *val_as_name(fz_context *ctx, vstack *t, val v);
 
+// Long strings are not stored in the stack but in a buffer of their own,
+// which can be shared without copying. Return this buffer or NULL for
+// strings stored in the stack. The buffer is borrowed: it lives as long as
+// the value, take a reference to keep it.
+fz_buffer *val_string_buffer(fz_context *ctx, vstack *t, val v);
+
 bool vstack_in_string(vstack *t);
 bool vstack_in_name(vstack *t);
 bool vstack_in_dict(vstack *t);
@@ -1,6 +1,9 @@
+#include <limits.h>
 #include "editor.h"
 #include "driver.h"
 #include "vstack.h"
+#include "txp_log.h"
+#include "txp_memdiff.h"
 #include "mupdf_compat.h"
 
 static enum editor_protocol protocol = EDITOR_SEXP;
@@ -38,14 +41,14 @@ bool editor_parse(fz_context *ctx,
 {
   if (!val_is_array(command))
   {
-    fprintf(stderr, "[command] invalid (not an array)");
+    txp_warn(TXP_LOG_MAIN, "[command] invalid (not an array)");
     return 0;
   }
 
   int len = val_array_length(ctx, stack, command);
   if (len == 0)
   {
-    fprintf(stderr, "[command] invalid (empty array)");
+    txp_warn(TXP_LOG_MAIN, "[command] invalid (empty array)");
     return 0;
   }
 
@@ -58,7 +61,7 @@ bool editor_parse(fz_context *ctx,
 
   if (!verb)
   {
-    fprintf(stderr, "[command] invalid (no verb)");
+    txp_warn(TXP_LOG_MAIN, "[command] invalid (no verb)");
     return 0;
   }
 
@@ -77,6 +80,7 @@ bool editor_parse(fz_context *ctx,
                 .path = val_string(ctx, stack, path),
                 .data = val_string(ctx, stack, data),
                 .length = val_string_length(ctx, stack, data),
+                .buffer = val_string_buffer(ctx, stack, data),
             },
 
     };
@@ -281,19 +285,25 @@ bool editor_parse(fz_context *ctx,
       goto arity;
     *out = (struct editor_command){.tag = EDIT_INVERT, .invert = {}};
   }
+  else if (strcmp(verb, "memory") == 0)
+  {
+    if (len != 1)
+      goto arity;
+    *out = (struct editor_command){.tag = EDIT_MEMORY, .memory = {}};
+  }
   else
   {
-    fprintf(stderr, "[command] unknown verb: %s\n", verb);
+    txp_warn(TXP_LOG_MAIN, "[command] unknown verb: %s\n", verb);
     return 0;
   }
   return 1;
 
 arity:
-  fprintf(stderr, "[command] %s: invalid arity\n", verb);
+  txp_warn(TXP_LOG_MAIN, "[command] %s: invalid arity\n", verb);
   return 0;
 
 arguments:
-  fprintf(stderr, "[command] %s: invalid arguments\n", verb);
+  txp_warn(TXP_LOG_MAIN, "[command] %s: invalid arguments\n", verb);
   return 0;
 }
 
@@ -370,9 +380,36 @@ static void output_data_string(FILE *f, const char *ptr, int len)
     case EDITOR_JSON:
       output_json_string(f, ptr, len);
       break;
+
+    case EDITOR_BINARY:
+      fwrite(ptr, 1, len, f);
+      break;
   }
 }
 
+// Strings are quoted in text protocols, and prefixed by their length in
+// bytes in the binary protocol, where they are sent verbatim
+static void output_string_begin(FILE *f, int len)
+{
+  if (protocol == EDITOR_BINARY)
+    fprintf(f, "#%d:", len);
+  else
+    putc_unlocked('"', f);
+}
+
+static void output_string_end(FILE *f)
+{
+  if (protocol != EDITOR_BINARY)
+    putc_unlocked('"', f);
+}
+
+static void output_string(FILE *f, const char *ptr, int len)
+{
+  output_string_begin(f, len);
+  output_data_string(f, ptr, len);
+  output_string_end(f);
+}
+
 static const char *editor_info_buffer(enum EDITOR_INFO_BUFFER name)
 {
   switch (name)
@@ -385,47 +422,170 @@ static const char *editor_info_buffer(enum EDITOR_INFO_BUFFER name)
   }
 }
 
+// Output buffers are not sent as TeX writes them: changes are accumulated
+// and sent at most every EDITOR_SYNC_INTERVAL ms, or at a flush.
+// A copy of the contents is kept to compare what TeX writes again after a
+// rollback with what the editor already has: when a replay reproduces the
+// same output, the truncate and append cancel out and nothing is sent.
+
+#define EDITOR_SYNC_INTERVAL 50
+
+struct editor_output
+{
+  unsigned char *data;
+  int cap;
+
+  // Length of the current contents
+  int len;
+
+  // Length of the contents the editor has, and number of lines in it.
+  // In line mode, line_ends has the offset following each of these lines:
+  // the data past keep is overwritten before the lines to truncate are
+  // counted.
+  int sent, sent_lines;
+  int *line_ends, line_cap;
+
+  // Position of the first change to the contents the editor has, INT_MAX if
+  // they did not change
+  int diverge;
+};
+
+static struct editor_output outputs[2];
+static Uint32 last_sync;
+
+static void output_copy(struct editor_output *o, fz_buffer *buf, int pos)
+{
+  int len = buf->len;
+  if (pos > o->len)
+    pos = o->len;
+
+  if (len > o->cap)
+  {
+    int cap = o->cap == 0 ? 4096 : o->cap;
+    while (cap < len)
+      cap *= 2;
+    o->data = (unsigned char*)realloc(o->data, cap);
+    if (!o->data) abort();
+    o->cap = cap;
+  }
+
+  // Look for the first byte that differs from what was sent
+  int check = fz_mini(len, fz_mini(o->sent, o->diverge));
+  if (pos < check)
+  {
+    int i = pos + txp_memdiff(o->data + pos, buf->data + pos, check - pos);
+    if (i < check)
+      o->diverge = i;
+  }
+
+  memcpy(o->data + pos, buf->data + pos, len - pos);
+  o->len = len;
+}
+
 void editor_append(enum EDITOR_INFO_BUFFER name, fz_buffer *buf, int pos)
 {
   if (!buf)
     return;
-  const char *data = (const char *)buf->data;
-  if (line_output)
+  output_copy(&outputs[name], buf, pos);
+}
+
+void editor_truncate(enum EDITOR_INFO_BUFFER name, fz_buffer *buf)
+{
+  struct editor_output *o = &outputs[name];
+  int len = buf ? buf->len : 0;
+  if (len > o->len)
+    output_copy(o, buf, o->len);
+  else
+    o->len = len;
+}
+
+// Record the lines sent between start and end
+static void push_lines(struct editor_output *o, int start, int end)
+{
+  for (int i = start; i < end; ++i)
+  {
+    if (o->data[i] != '\n')
+      continue;
+    if (o->sent_lines == o->line_cap)
+    {
+      o->line_cap = o->line_cap == 0 ? 256 : o->line_cap * 2;
+      o->line_ends = (int *)realloc(o->line_ends, o->line_cap * sizeof(int));
+      if (!o->line_ends) abort();
+    }
+    o->line_ends[o->sent_lines++] = i + 1;
+  }
+}
+
+// Number of sent lines that end at or before pos
+static int lines_before(struct editor_output *o, int pos)
+{
+  int lo = 0, hi = o->sent_lines;
+  while (lo < hi)
   {
-    int next = pos;
-    while (next < buf->len && buf->data[next] != '\n') next++;
-    if (next == buf->len)
-      return;
+    int mid = (lo + hi) / 2;
+    if (o->line_ends[mid] <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
 
-    // Find where line begins and ends
-    while (pos > 0 && data[pos - 1] != '\n') pos--;
+// Beginning of the line that contains pos
+static int line_start(const unsigned char *data, int pos)
+{
+  while (pos > 0 && data[pos - 1] != '\n')
+    pos--;
+  return pos;
+}
 
+static void output_send_truncate(enum EDITOR_INFO_BUFFER name, int count)
+{
+  const char *suffix = line_output ? "-lines" : "";
+
+  switch (protocol)
+  {
+    case EDITOR_SEXP:
+    case EDITOR_BINARY:
+      fprintf(stdout, "(truncate%s %s %d)\n", suffix, editor_info_buffer(name), count);
+      break;
+    case EDITOR_JSON:
+      fprintf(stdout, "[\"truncate%s\", \"%s\", %d]\n", suffix, editor_info_buffer(name), count);
+      break;
+  }
+}
+
+static void output_send_append(enum EDITOR_INFO_BUFFER name,
+                               const unsigned char *data, int pos, int end)
+{
+  const char *text = (const char *)data;
+
+  if (line_output)
+  {
     // Header
     switch (protocol)
     {
-      case EDITOR_SEXP: fprintf(stdout, "(append-lines %s", editor_info_buffer(name)); break;
+      case EDITOR_SEXP:
+      case EDITOR_BINARY: fprintf(stdout, "(append-lines %s", editor_info_buffer(name)); break;
       case EDITOR_JSON: fprintf(stdout, "[\"append-lines\", \"%s\"", editor_info_buffer(name)); break;
     }
 
-    // pos points to the beginning of a line,
-    // next points to the ending '\n'
-    while (next < buf->len)
+    // pos points to the beginning of a line, end after the last '\n'
+    while (pos < end)
     {
-      // Not a well-formed line
-      fprintf(stdout, protocol == EDITOR_SEXP ? " \"" : ", \"");
-      output_data_string(stdout, data + pos, next - pos);
-      fprintf(stdout, "\"");
-      pos = next;
-      do {
+      int next = pos;
+      while (data[next] != '\n')
         next++;
-      }
-      while (next < buf->len && buf->data[next] != '\n');
+      fprintf(stdout, protocol == EDITOR_JSON ? ", " : " ");
+      output_string(stdout, text + pos, next - pos);
+      pos = next + 1;
     }
 
     // Trailer
     switch (protocol)
     {
-      case EDITOR_SEXP: fprintf(stdout, ")\n"); break;
+      case EDITOR_SEXP:
+      case EDITOR_BINARY: fprintf(stdout, ")\n"); break;
       case EDITOR_JSON: fprintf(stdout, "]\n"); break;
     }
   }
@@ -434,49 +594,75 @@ void editor_append(enum EDITOR_INFO_BUFFER name, fz_buffer *buf, int pos)
     switch (protocol)
     {
       case EDITOR_SEXP:
-        fprintf(stdout, "(append %s %d \"", editor_info_buffer(name), pos);
-        output_data_string(stdout, data + pos, (int)buf->len - pos);
-        fprintf(stdout, "\")\n");
+      case EDITOR_BINARY:
+        fprintf(stdout, "(append %s %d ", editor_info_buffer(name), pos);
+        output_string(stdout, text + pos, end - pos);
+        fprintf(stdout, ")\n");
         break;
       case EDITOR_JSON:
-        fprintf(stdout, "[\"append\", \"%s\", %d, \"", editor_info_buffer(name), pos);
-        output_data_string(stdout, data + pos, (int)buf->len - pos);
-        fprintf(stdout, "\"]\n");
+        fprintf(stdout, "[\"append\", \"%s\", %d, ", editor_info_buffer(name), pos);
+        output_string(stdout, text + pos, end - pos);
+        fprintf(stdout, "]\n");
         break;
     }
   }
 }
 
-void editor_truncate(enum EDITOR_INFO_BUFFER name, fz_buffer *buf)
+static void output_send(enum EDITOR_INFO_BUFFER name)
 {
-  int count = buf ? buf->len : 0;
+  struct editor_output *o = &outputs[name];
 
-  if (line_output && buf)
+  // Contents the editor has and that did not change
+  int keep = fz_mini(o->sent, fz_mini(o->diverge, o->len));
+  // Contents to send
+  int end = o->len;
+
+  if (line_output)
   {
-    count = 0;
-    for (int i = 0; i < buf->len; ++i)
-      if (buf->data[i] == '\n')
-        count++;
+    // Only complete lines are sent
+    keep = line_start(o->data, keep);
+    end = line_start(o->data, end);
   }
 
-  const char *suffix = line_output ? "-lines" : "";
+  if (keep < o->sent)
+  {
+    if (line_output)
+    {
+      o->sent_lines = lines_before(o, keep);
+      output_send_truncate(name, o->sent_lines);
+    }
+    else
+      output_send_truncate(name, keep);
+  }
 
-  switch (protocol)
+  if (end > keep)
   {
-    case EDITOR_SEXP:
-      fprintf(stdout, "(truncate%s %s %d)\n", suffix, editor_info_buffer(name), count);
-      break;
-    case EDITOR_JSON:
-      fprintf(stdout, "[\"truncate%s\", \"%s\", %d]\n", suffix, editor_info_buffer(name), count);
-      break;
+    output_send_append(name, o->data, keep, end);
+    if (line_output)
+      push_lines(o, keep, end);
   }
+
+  o->sent = end;
+  o->diverge = INT_MAX;
+}
+
+void editor_sync(bool force)
+{
+  Uint32 now = SDL_GetTicks();
+  if (!force && now - last_sync < EDITOR_SYNC_INTERVAL)
+    return;
+  last_sync = now;
+  output_send(BUF_OUT);
+  output_send(BUF_LOG);
 }
 
 void editor_flush(void)
 {
+  editor_sync(1);
   switch (protocol)
   {
     case EDITOR_SEXP:
+    case EDITOR_BINARY:
       puts("(flush)\n");
       break;
     case EDITOR_JSON:
@@ -492,21 +678,26 @@ void editor_synctex(const char *dirname,
                     int column)
 {
   bool need_dir = basename[0] != '/';
+  int dirname_len = need_dir ? strlen(dirname) : 0;
   switch (protocol)
   {
-    case EDITOR_SEXP: fprintf(stdout, "(synctex \""); break;
-    case EDITOR_JSON: fprintf(stdout, "[\"synctex\", \""); break;
+    case EDITOR_SEXP:
+    case EDITOR_BINARY: fprintf(stdout, "(synctex "); break;
+    case EDITOR_JSON: fprintf(stdout, "[\"synctex\", "); break;
   }
+  output_string_begin(stdout, need_dir ? dirname_len + 1 + basename_len : basename_len);
   if (need_dir)
   {
-    output_data_string(stdout, dirname, strlen(dirname));
+    output_data_string(stdout, dirname, dirname_len);
     output_data_string(stdout, "/", 1);
   }
   output_data_string(stdout, (const void *)basename, basename_len);
+  output_string_end(stdout);
   switch (protocol)
   {
-    case EDITOR_SEXP: fprintf(stdout, "\" %d %d)\n", line, column); break;
-    case EDITOR_JSON: fprintf(stdout, "\", %d, %d]\n", line, column); break;
+    case EDITOR_SEXP:
+    case EDITOR_BINARY: fprintf(stdout, " %d %d)\n", line, column); break;
+    case EDITOR_JSON: fprintf(stdout, ", %d, %d]\n", line, column); break;
   }
 }
 
@@ -515,6 +706,7 @@ void editor_reset_sync(void)
   switch (protocol)
   {
     case EDITOR_SEXP:
+    case EDITOR_BINARY:
       puts("(reset-sync)\n");
       break;
     case EDITOR_JSON:
@@ -522,3 +714,35 @@ void editor_reset_sync(void)
       break;
   }
 }
+
+void editor_memory(const struct txp_mem_sample *samples)
+{
+  switch (protocol)
+  {
+    case EDITOR_SEXP:
+    case EDITOR_BINARY: fprintf(stdout, "(memory"); break;
+    case EDITOR_JSON: fprintf(stdout, "[\"memory\", {"); break;
+  }
+  for (int i = 0; samples && i < TXP_MEM_TAGS; ++i)
+  {
+    const struct txp_mem_sample *s = &samples[i];
+    switch (protocol)
+    {
+      case EDITOR_SEXP:
+      case EDITOR_BINARY:
+        fprintf(stdout, " (%s %zu %zu %.0f %.0f)", txp_mem_tag_name(i),
+                s->live, s->peak, s->allocs, s->bytes);
+        break;
+      case EDITOR_JSON:
+        fprintf(stdout, "%s\"%s\": [%zu, %zu, %.0f, %.0f]", i ? ", " : "",
+                txp_mem_tag_name(i), s->live, s->peak, s->allocs, s->bytes);
+        break;
+    }
+  }
+  switch (protocol)
+  {
+    case EDITOR_SEXP:
+    case EDITOR_BINARY: fprintf(stdout, ")\n"); break;
+    case EDITOR_JSON: fprintf(stdout, "}]\n"); break;
+  }
+}
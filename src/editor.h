@@ -6,6 +6,7 @@ extern "C" {
 
 #include "driver.h"
 #include "vstack.h"
+#include "txp_memstat.h"
 
 void editor_set_protocol(enum editor_protocol protocol);
 void editor_set_line_output(bool line);
@@ -35,6 +36,7 @@ enum EDITOR_COMMAND
   EDIT_UNMAP_WINDOW,
   EDIT_CROP,
   EDIT_INVERT,
+  EDIT_MEMORY,
 };
 
 struct editor_change
@@ -70,6 +72,8 @@ struct editor_command
       const char *path;
       const char *data;
       int length;
+      // Buffer holding data if the parser stored it apart, or NULL
+      fz_buffer *buffer;
     } open;
 
     struct {
@@ -116,6 +120,9 @@ struct editor_command
 
     struct {
     } invert;
+
+    struct {
+    } memory;
   };
 };
 
@@ -132,11 +139,16 @@ enum EDITOR_INFO_BUFFER
   BUF_LOG, // TeX output log file
 };
 
+// Changes to the output buffers are accumulated and sent by editor_sync,
+// at a bounded rate unless force is set, and by editor_flush
 void editor_append(enum EDITOR_INFO_BUFFER name, fz_buffer *buf, int pos);
 void editor_truncate(enum EDITOR_INFO_BUFFER name, fz_buffer *buf);
+void editor_sync(bool force);
 void editor_flush(void);
 void editor_synctex(const char *dirname, const char *basename, int basename_len, int line, int column);
 void editor_reset_sync(void);
+// Reply to the memory command, samples is NULL when memory is not accounted
+void editor_memory(const struct txp_mem_sample *samples);
 
 #endif  // EDITOR_H_
 #ifdef __cplusplus
@@ -29,7 +29,9 @@
 
 
 #include "incdvi.h"
+#include "prerender.h"
 #include "synctex.h"
+#include "watcher.h"
 
 typedef enum {
   DOC_RUNNING,
@@ -41,7 +43,11 @@ class Engine
 {
 public:
   virtual ~Engine() = default;
+  // Process the pending queries without waiting for new ones; return false
+  // if there were none
   virtual bool step(bool restart_if_needed) = 0;
+  // File descriptor on which the next query will arrive, or -1
+  virtual int query_fd() = 0;
   virtual void begin_changes() = 0;
   virtual void detect_changes() = 0;
   virtual bool end_changes() = 0;
@@ -52,6 +58,9 @@ public:
   virtual synctex_t *synctex(fz_buffer **buf) = 0;
   virtual fileentry_t *find_file(const char *path) = 0;
   virtual void notify_file_changes(fileentry_t *entry, int offset) = 0;
+  // Write what should be reused by the next session; called once, when the
+  // viewer exits (the engine itself is never destroyed)
+  virtual void save_session() {}
 };
 
 
@@ -60,6 +69,10 @@ typedef struct
   int pid, fd;
   int trace_len;
   mark_t snap;
+  // Serial number of the edit this snapshot was placed for, or -1
+  int edit;
+  // Last measure of the memory private to the process
+  size_t memory;
 } process_t;
 typedef struct
 {
@@ -71,6 +84,11 @@ typedef struct
   fileentry_t *entry;
   int seen, time;
 } trace_entry_t;
+typedef struct
+{
+  fileentry_t *entry;
+  int offset;
+} edit_t;
 
 class TexEngine : public Engine
 {
@@ -80,9 +98,11 @@ public:
             const char *tectonic_path,
             const char *inclusion_path,
             const char *tex_dir,
-            const char *tex_name);
+            const char *tex_name,
+            size_t snapshot_budget);
   ~TexEngine();
   bool step(bool restart_if_needed) override;
+  int query_fd() override;
   void begin_changes() override;
   void detect_changes() override;
   bool end_changes() override;
@@ -93,47 +113,169 @@ public:
   synctex_t *synctex(fz_buffer **buf) override;
   fileentry_t *find_file(const char *path) override;
   void notify_file_changes(fileentry_t *entry, int offset) override;
+  void save_session() override;
 // private:
   char *name;
   char *tectonic_path;
   char *inclusion_path;
   filesystem_t *fs;
+  watcher_t *watcher;
   state_t st;
   log_t *log;
 
   Channel *c;
   process_t processes[32];
   int process_count;
+  // Process launched in advance to restart from scratch (fd == -1 if none)
+  process_t standby;
 
   trace_entry_t *trace;
   int trace_cap;
-  fence_t fences[16];
-  int fence_pos;
+  // Fences, from the innermost (right before the change) to the outermost;
+  // fence_pos is the next one TeX will reach, or -1 if there are none
+  fence_t *fences;
+  int fence_pos, fence_cap;
   mark_t restart;
 
+  // Ring of the most recent edits, used to place snapshots in front of the
+  // regions the user is working on
+  edit_t edits[8];
+  int edit_count;
+  int snapshot_edit;
+
+  // Bound on the memory used by snapshots (0 for no limit)
+  size_t snapshot_budget;
+  int measure_next;
+
   bundle_server *bundle;
   incdvi_t *dvi;
+  prerender_t *prerender;
   synctex_t *stex;
 
   struct {
     int trace_len, offset, flush;
   } rollback;
+
+  // Output saved by the previous session (see save_checkpoint), shown until
+  // TeX catches up or something changes; dvi is NULL if there is none
+  struct {
+    uint64_t key;
+    incdvi_t *dvi;
+    fz_buffer *data;
+    int pages;
+    // Trace position where TeX opened the main .aux for writing, which
+    // LaTeX does in \begin{document}, -1 if it did not
+    int preamble;
+  } checkpoint;
+
+  // Picture bounds saved by the previous session (see save_pictures),
+  // restored when TeX opens a file that did not change since
+  struct {
+    fz_buffer *data;
+    // Records of data, sorted by path
+    const char **index;
+    int count;
+  } pictures;
+
+  // Trace time replayed after rollbacks to reach the changed contents
+  struct {
+    int count, max;
+    long long total;
+    // Bytes of TeX output kept by the restored snapshots
+    long long output;
+  } replay;
+};
+
+// Displays a PDF (or any document MuPDF can open) produced by an external
+// tool, reloading it when it changes on disk.
+typedef struct {
+  // Signature of the page object and of everything it refers to, 0 if
+  // unknown (the page is then never reused)
+  uint64_t signature;
+  fz_display_list *dl;
+} pdf_page_cache_t;
+
+class PDFEngine : public Engine
+{
+public:
+  fz_context &ctx;
+  PDFEngine(fz_context &ctx, const char *pdf_path);
+  ~PDFEngine();
+  bool step(bool restart_if_needed) override;
+  int query_fd() override;
+  void begin_changes() override;
+  void detect_changes() override;
+  bool end_changes() override;
+  int page_count() override;
+  fz_display_list *render_page(int page) override;
+  txp_engine_status get_status() override;
+  float scale_factor() override;
+  synctex_t *synctex(fz_buffer **buf) override;
+  fileentry_t *find_file(const char *path) override;
+  void notify_file_changes(fileentry_t *entry, int offset) override;
+// private:
+  char *path;
+  fz_document *doc;
+  bool changed;
+  watcher_t *watcher;
+  fileentry_t *entry;
+
+  // State of the file when it was last loaded
+  struct stat st;
+  uint64_t hash;
+
+  pdf_page_cache_t *pages;
+  int count;
+};
+
+// Displays a DVI or XDV file produced by an external tool, following it as
+// it grows.
+
+// Large enough for the preamble (15 bytes and a comment of up to 255)
+#define DVI_ENGINE_HEAD 272
+
+class DVIEngine : public Engine
+{
+public:
+  fz_context &ctx;
+  DVIEngine(fz_context &ctx,
+            const char *tectonic_path,
+            const char *dvi_dir,
+            const char *dvi_path);
+  ~DVIEngine();
+  bool step(bool restart_if_needed) override;
+  int query_fd() override;
+  void begin_changes() override;
+  void detect_changes() override;
+  bool end_changes() override;
+  int page_count() override;
+  fz_display_list *render_page(int page) override;
+  txp_engine_status get_status() override;
+  float scale_factor() override;
+  synctex_t *synctex(fz_buffer **buf) override;
+  fileentry_t *find_file(const char *path) override;
+  void notify_file_changes(fileentry_t *entry, int offset) override;
+  void save_session() override;
+// private:
+  char *path;
+  bundle_server *bundle;
+  incdvi_t *dvi;
+  watcher_t *watcher;
+  fileentry_t *entry;
+
+  // Copy of the file, extended with the bytes appended since the last look
+  int fd;
+  struct stat st;
+  fz_buffer *buffer;
+
+  // Copy of the first bytes of the output, to recognize a new one
+  unsigned char head[DVI_ENGINE_HEAD];
+  int head_len;
+
+  // The postamble was read: the output is complete
+  bool complete;
+  bool changed;
 };
-// class PDFEngine : Engine
-// {
-//   fz_context &ctx;
-//   PDFEngine(fz_context *ctx, const char *pdf_path);
-//   ~PDFEngine();
-// };
-// class DVIEngine : Engine
-// {
-//   fz_context &ctx;
-//   DVIEngine(fz_context *ctx,
-//             const char *tectonic_path,
-//             const char *dvi_dir,
-//             const char *dvi_path);
-//   ~DVIEngine();
-// };
 }
 
 #endif // GENERIC_ENGINE_H_
@@ -23,109 +23,270 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include <mupdf/fitz.h>
-#include "engine.h"
-#include "incdvi.h"
+#include "engine.hpp"
+#include "mydvi_opcodes.h"
+#include "txp_log.h"
 
-struct dvi_engine
+using namespace txp;
+
+// Following the output
+//
+// The file is copied in memory and the DVI index is extended with the bytes
+// appended since the last look, like `tail -f': only the new bytes are
+// read, pages already indexed are not scanned again, and their display
+// lists stay in the cache of incdvi.
+//
+// The output is considered new (a new run of the producer) when the file was
+// replaced, shrank, or its first bytes changed: TeX writes the date in the
+// preamble comment. The file is then read and indexed from the start, which
+// is still cheap: incdvi recognizes the pages that hash the same as before
+// and keeps their display lists.
+//
+// The file is looked at when the watcher reports it, also once the output
+// is complete: the engine thread waits on query_fd whatever the status, so
+// a new run is followed without a rescan from the UI.
+//
+// The file is not mapped: TeX rewrites it in place (O_TRUNC on the same
+// inode), and any read of a mapping past the new end of the file, by the
+// interpreter or a display list, until the next refresh, would kill the
+// viewer with SIGBUS. With a copy, a producer truncating or rewriting the
+// file while it is read gives at worst inconsistent pages, replaced at the
+// next refresh when the change is noticed.
+
+static void drop_output(fz_context *ctx, DVIEngine *self)
 {
-  struct txp_engine_class *_class;
-  fz_buffer *buffer;
-  incdvi_t *dvi;
-};
+  fz_drop_buffer(ctx, self->buffer);
+  self->buffer = NULL;
+}
+
+// Read the file from offset `from' to `len' at the end of the first `from'
+// bytes of the buffer. Stops early if the file was truncated meanwhile.
+static bool read_output(fz_context *ctx, DVIEngine *self, size_t from, size_t len)
+{
+  fz_buffer *buf = self->buffer;
+  if (buf->cap < len)
+    fz_resize_buffer(ctx, buf, len > buf->cap * 2 ? len : buf->cap * 2);
+  buf->len = from;
+  while (buf->len < len)
+  {
+    ssize_t n = pread(self->fd, buf->data + buf->len, len - buf->len, buf->len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return 0;
+    if (n == 0)
+      break;
+    buf->len += n;
+  }
+  return 1;
+}
+
+// True if the file ends with a complete postamble:
+// post_post, q[4], i[1] and at least four 223's
+static bool has_postamble(const unsigned char *data, size_t len)
+{
+  size_t i = len;
+  while (i > 0 && data[i - 1] == PADDING)
+    i--;
+  return len - i >= 4 && i >= 6 && data[i - 6] == POST_POST;
+}
+
+// Look at the file again; return true if the output changed
+static bool refresh(fz_context *ctx, DVIEngine *self)
+{
+  struct stat st;
+  if (stat(self->path, &st) != 0)
+    // Being replaced, keep the current output
+    return 0;
+  if (self->fd != -1 && stat_same(&st, &self->st))
+    return 0;
+
+  bool replaced = self->fd == -1 ||
+                  st.st_dev != self->st.st_dev ||
+                  st.st_ino != self->st.st_ino;
+  if (replaced)
+  {
+    int fd = open(self->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      return 0;
+    if (self->fd != -1)
+      close(self->fd);
+    self->fd = fd;
+    if (self->watcher)
+      watcher_add(ctx, self->watcher, self->entry, self->path);
+  }
 
-#define SELF struct dvi_engine *self = (struct dvi_engine*)_self
+  if (fstat(self->fd, &st) != 0)
+    return 0;
+  size_t len = st.st_size;
 
-// Useful routines
+  unsigned char head[DVI_ENGINE_HEAD];
+  ssize_t head_len = pread(self->fd, head, len < DVI_ENGINE_HEAD ? len : DVI_ENGINE_HEAD, 0);
+  if (head_len < 0)
+  {
+    txp_warn(TXP_LOG_ENGINE, "[dvi] cannot read %s\n", self->path);
+    return 0;
+  }
 
-TXP_ENGINE_DEF_CLASS;
+  bool rewritten = replaced || !self->buffer || len < self->buffer->len;
+  int common = head_len < self->head_len ? head_len : self->head_len;
+  if (memcmp(head, self->head, common) != 0)
+    rewritten = 1;
+  memcpy(self->head, head, head_len);
+  self->head_len = head_len;
 
-static void engine_destroy(txp_engine *_self, fz_context *ctx)
+  if (!self->buffer)
+    self->buffer = fz_new_buffer(ctx, len > 0 ? len : 1024);
+  int pages = incdvi_page_count(self->dvi);
+  size_t from = rewritten ? 0 : self->buffer->len;
+  if (!read_output(ctx, self, from, len))
+  {
+    // Retried at the next refresh, self->st is not updated
+    txp_warn(TXP_LOG_ENGINE, "[dvi] cannot read %s\n", self->path);
+    self->buffer->len = from;
+    if (rewritten)
+    {
+      incdvi_truncate(self->dvi, 0);
+      self->head_len = 0;
+      if (pages > 0)
+        self->changed = 1;
+    }
+    return rewritten;
+  }
+  self->st = st;
+  len = self->buffer->len;
+  const unsigned char *data = self->buffer->data;
+
+  if (rewritten)
+  {
+    incdvi_truncate(self->dvi, 0);
+    // Pages already displayed might be different
+    if (pages > 0)
+      self->changed = 1;
+  }
+  incdvi_update(ctx, self->dvi, self->buffer);
+  self->complete = has_postamble(data, len);
+
+  txp_debug(TXP_LOG_ENGINE, "[dvi] %s: %d bytes, %d pages%s%s\n",
+            self->path, (int)len, incdvi_page_count(self->dvi),
+            rewritten ? ", new output" : "",
+            self->complete ? ", complete" : "");
+  return 1;
+}
+
+// Engine class implementation
+
+DVIEngine::DVIEngine(fz_context &ctx,
+                     const char *tectonic_path,
+                     const char *dvi_dir,
+                     const char *dvi_path): ctx(ctx)
 {
-  SELF;
-  fz_drop_buffer(ctx, self->buffer);
-  incdvi_free(ctx, self->dvi);
+  this->path = fz_strdup(&ctx, dvi_path);
+  this->bundle = bundle_server_start(&ctx, tectonic_path, dvi_dir);
+  this->dvi = incdvi_new(&ctx, bundle_server_hooks(this->bundle));
+  this->watcher = watcher_new(&ctx);
+  this->entry = fz_malloc_struct(&ctx, fileentry_t);
+  this->entry->path = this->path;
+  this->fd = -1;
+  memset(&this->st, 0, sizeof(this->st));
+  this->buffer = NULL;
+  this->head_len = 0;
+  this->complete = 0;
+  this->changed = 0;
+
+  if (!refresh(&ctx, this))
+  {
+    txp_warn(TXP_LOG_ENGINE, "[dvi] cannot read %s, waiting for it\n", dvi_path);
+    if (this->watcher)
+      watcher_add(&ctx, this->watcher, this->entry, this->path);
+  }
+}
+
+DVIEngine::~DVIEngine()
+{
+  drop_output(&this->ctx, this);
+  if (this->fd != -1)
+    close(this->fd);
+  if (this->watcher)
+    watcher_free(&this->ctx, this->watcher);
+  incdvi_free(&this->ctx, this->dvi);
+  fz_free(&this->ctx, this->entry);
+  fz_free(&this->ctx, this->path);
 }
 
-static fz_display_list *engine_render_page(txp_engine *_self,
-                                           fz_context *ctx,
-                                           int index)
+bool DVIEngine::step(bool restart_if_needed)
 {
-  SELF;
-  float width, height;
-  incdvi_page_dim(self->dvi, self->buffer, index, &width, &height, NULL);
-  fz_rect box = fz_make_rect(0, 0, width, height);
-  fz_display_list *dl = fz_new_display_list(ctx, box);
-  fz_device *dev = fz_new_list_device(ctx, dl);
-  incdvi_render_page(ctx, self->dvi, self->buffer, index, dev);
-  fz_close_device(ctx, dev);
-  fz_drop_device(ctx, dev);
-  return dl;
+  if (this->watcher)
+    watcher_poll(this->watcher);
+  return refresh(&this->ctx, this);
 }
 
-static bool engine_step(txp_engine *_self,
-                        fz_context *ctx,
-                        bool restart_if_needed)
+int DVIEngine::query_fd()
 {
-  return 0;
+  return this->watcher ? watcher_fd(this->watcher) : -1;
 }
 
-static void engine_begin_changes(txp_engine *_self, fz_context *ctx)
+void DVIEngine::begin_changes()
 {
 }
 
-static void engine_detect_changes(txp_engine *_self, fz_context *ctx)
+void DVIEngine::detect_changes()
 {
+  refresh(&this->ctx, this);
 }
 
-static bool engine_end_changes(txp_engine *_self, fz_context *ctx)
+bool DVIEngine::end_changes()
 {
-  return 0;
+  bool changed = this->changed;
+  this->changed = 0;
+  return changed;
 }
 
+int DVIEngine::page_count()
+{
+  return incdvi_page_count(this->dvi);
+}
 
-static int engine_page_count(txp_engine *_self)
+fz_display_list *DVIEngine::render_page(int page)
 {
-  SELF;
-  return incdvi_page_count(self->dvi);
+  if (!this->buffer || page < 0 || page >= incdvi_page_count(this->dvi))
+    return NULL;
+  return incdvi_display_list(&this->ctx, this->dvi, this->buffer, page);
 }
 
-static txp_engine_status engine_get_status(txp_engine *_self)
+txp_engine_status DVIEngine::get_status()
 {
-  return DOC_TERMINATED;
+  return this->complete ? DOC_TERMINATED : DOC_RUNNING;
 }
 
-static float engine_scale_factor(txp_engine *_self)
+float DVIEngine::scale_factor()
 {
-  SELF;
-  return incdvi_tex_scale_factor(self->dvi);
+  return incdvi_tex_scale_factor(this->dvi);
 }
 
-static synctex_t *engine_synctex(txp_engine *_self, fz_buffer **buf)
+synctex_t *DVIEngine::synctex(fz_buffer **buf)
 {
+  if (buf)
+    *buf = NULL;
   return NULL;
 }
 
-static fileentry_t *engine_find_file(txp_engine *_self, fz_context *ctx, const char *path)
+fileentry_t *DVIEngine::find_file(const char *path)
 {
   return NULL;
 }
 
-static void engine_notify_file_changes(txp_engine *_self,
-                                       fz_context *ctx,
-                                       fileentry_t *entry,
-                                       int offset)
+void DVIEngine::notify_file_changes(fileentry_t *entry, int offset)
 {
 }
 
-txp_engine *txp_create_dvi_engine(fz_context *ctx, const char *tectonic_path, const char *dvi_dir, const char *dvi_path)
+void DVIEngine::save_session()
 {
-  fz_buffer *buffer = fz_read_file(ctx, dvi_path);
-  struct dvi_engine *self = fz_malloc_struct(ctx, struct dvi_engine);
-  self->_class = &_class;
-  self->buffer = buffer;
-  bundle_server *bundle = bundle_server_start(ctx, tectonic_path, dvi_dir);
-  self->dvi = incdvi_new(ctx, bundle_server_hooks(bundle));
-  incdvi_update(ctx, self->dvi, buffer);
-  return (txp_engine*)self;
+  bundle_server_save_manifest(&this->ctx, this->bundle);
 }
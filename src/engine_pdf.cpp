@@ -23,123 +23,412 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
 #include "engine.hpp"
+#include "txp_log.h"
+#include "txp_memstat.h"
 
-struct pdf_engine
+using namespace txp;
+
+// Change detection
+//
+// A change is looked for when the UI rescans (focus, rescan command) and
+// when the watcher reports the file: it is only read when its stat changed,
+// and only reloaded when its contents changed. Build tools often rewrite the file with the same
+// contents, or touch it.
+//
+// After a reload, the display list of a page is reused if the page did not
+// change: pages are identified by a signature of their object and of all the
+// objects they refer to (contents, resources, fonts, images, ...), which does
+// not depend on the object numbers. Rebuilding a PDF where a single page
+// changed then only renders that page again, and the renderer keeps the
+// textures of the others.
+
+static uint64_t mix(uint64_t h, uint64_t v)
 {
-  struct txp_engine_class *_class;
-  char *path;
-  int page_count;
-  fz_document *doc;
-  bool changed;
-};
+  h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  return h * 0xff51afd7ed558ccdULL;
+}
 
-#define SELF struct pdf_engine *self = (struct pdf_engine*)_self
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  for (size_t i = 0; i < len; ++i)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  return mix(h, len);
+}
 
-// Useful routines
+// Signatures of indirect objects, memoized for one reload
+typedef struct {
+  pdf_document *pdf;
+  uint64_t *memo;
+  int len;
+} signer;
 
-TXP_ENGINE_DEF_CLASS;
+static uint64_t sign_obj(fz_context *ctx, signer *s, pdf_obj *obj);
 
-static void engine_destroy(txp_engine *_self, fz_context *ctx)
+static uint64_t sign_direct(fz_context *ctx, signer *s, pdf_obj *obj)
 {
-  SELF;
-  fz_free(ctx, self->path);
-  fz_drop_document(ctx, self->doc);
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  if (pdf_is_null(ctx, obj))
+    return mix(h, 1);
+  if (pdf_is_bool(ctx, obj))
+    return mix(h, 2 + pdf_to_bool(ctx, obj));
+  if (pdf_is_int(ctx, obj))
+    return mix(mix(h, 4), (uint64_t)pdf_to_int64(ctx, obj));
+  if (pdf_is_real(ctx, obj))
+  {
+    float f = pdf_to_real(ctx, obj);
+    return hash_bytes(mix(h, 5), &f, sizeof(f));
+  }
+  if (pdf_is_name(ctx, obj))
+  {
+    const char *name = pdf_to_name(ctx, obj);
+    return hash_bytes(mix(h, 6), name, strlen(name));
+  }
+  if (pdf_is_string(ctx, obj))
+    return hash_bytes(mix(h, 7), pdf_to_str_buf(ctx, obj), pdf_to_str_len(ctx, obj));
+
+  if (pdf_is_array(ctx, obj))
+  {
+    h = mix(h, 8);
+    int n = pdf_array_len(ctx, obj);
+    for (int i = 0; i < n; ++i)
+      h = mix(h, sign_obj(ctx, s, pdf_array_get(ctx, obj, i)));
+    return h;
+  }
+
+  if (pdf_is_dict(ctx, obj))
+  {
+    h = mix(h, 9);
+    int n = pdf_dict_len(ctx, obj);
+    for (int i = 0; i < n; ++i)
+    {
+      pdf_obj *key = pdf_dict_get_key(ctx, obj, i);
+      // The page tree and back-references don't affect the page
+      if (pdf_name_eq(ctx, key, PDF_NAME(Parent)) ||
+          pdf_name_eq(ctx, key, PDF_NAME(P)))
+        continue;
+      h = mix(h, sign_direct(ctx, s, key));
+      h = mix(h, sign_obj(ctx, s, pdf_dict_get_val(ctx, obj, i)));
+    }
+    return h;
+  }
+
+  return mix(h, 10);
+}
+
+static uint64_t sign_obj(fz_context *ctx, signer *s, pdf_obj *obj)
+{
+  if (!pdf_is_indirect(ctx, obj))
+    return sign_direct(ctx, s, obj);
+
+  int num = pdf_to_num(ctx, obj);
+  if (num > 0 && num < s->len && s->memo[num])
+    return s->memo[num];
+
+  // A reference cycle: the objects on the cycle are signed by the rest
+  if (pdf_mark_obj(ctx, obj))
+    return 11;
+
+  uint64_t h = 0;
+  fz_buffer *raw = NULL;
+  fz_var(raw);
+  fz_try(ctx)
+  {
+    h = sign_direct(ctx, s, pdf_resolve_indirect(ctx, obj));
+    if (pdf_is_stream(ctx, obj))
+    {
+      raw = pdf_load_raw_stream(ctx, obj);
+      h = hash_bytes(h, raw->data, raw->len);
+    }
+  }
+  fz_always(ctx)
+  {
+    fz_drop_buffer(ctx, raw);
+    pdf_unmark_obj(ctx, obj);
+  }
+  fz_catch(ctx)
+    fz_rethrow(ctx);
+
+  if (h == 0)
+    h = 1;
+  if (num > 0 && num < s->len)
+    s->memo[num] = h;
+  return h;
 }
 
-static fz_display_list *engine_render_page(txp_engine *_self,
-                                           fz_context *ctx,
-                                           int index)
+// Signatures of all the pages of a document (0 for pages that cannot be
+// signed, or for all of them if the document is not a PDF)
+static uint64_t *sign_pages(fz_context *ctx, fz_document *doc, int count)
 {
-  SELF;
-  fz_page *page = fz_load_page(ctx, self->doc, index);
-  fz_display_list *dl = fz_new_display_list_from_page(ctx, page);
-  fz_drop_page(ctx, page);
-  return dl;
+  uint64_t *sigs = fz_malloc_array(ctx, count, uint64_t);
+  memset(sigs, 0, count * sizeof(uint64_t));
+
+  pdf_document *pdf = pdf_specifics(ctx, doc);
+  if (!pdf)
+    return sigs;
+
+  signer s;
+  s.pdf = pdf;
+  s.len = pdf_xref_len(ctx, pdf);
+  s.memo = fz_malloc_array(ctx, s.len, uint64_t);
+  memset(s.memo, 0, s.len * sizeof(uint64_t));
+
+  for (int i = 0; i < count; ++i)
+  {
+    fz_try(ctx)
+      sigs[i] = sign_obj(ctx, &s, pdf_lookup_page_obj(ctx, pdf, i));
+    fz_catch(ctx)
+      sigs[i] = 0;
+  }
+
+  fz_free(ctx, s.memo);
+  return sigs;
 }
 
-static bool engine_step(txp_engine *_self,
-                        fz_context *ctx,
-                        bool restart_if_needed)
+static void drop_pages(fz_context *ctx, pdf_page_cache_t *pages, int count)
 {
-  return 0;
+  for (int i = 0; i < count; ++i)
+    if (pages[i].dl)
+      fz_drop_display_list(ctx, pages[i].dl);
+  fz_free(ctx, pages);
 }
 
-static void engine_begin_changes(txp_engine *_self, fz_context *ctx)
+// Take the cached display lists of the old pages for the new pages with the
+// same signature. Pages usually keep their position, or shift after an
+// insertion, so the search starts from the previous match.
+static void reuse_pages(fz_context *ctx, pdf_page_cache_t *old, int old_count,
+                        pdf_page_cache_t *pages, int count)
 {
+  int next = 0, reused = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    if (pages[i].signature == 0)
+      continue;
+    for (int k = 0; k < old_count; ++k)
+    {
+      pdf_page_cache_t *o = &old[(next + k) % old_count];
+      if (o->dl && o->signature == pages[i].signature)
+      {
+        pages[i].dl = o->dl;
+        o->dl = NULL;
+        next = (next + k + 1) % old_count;
+        reused += 1;
+        break;
+      }
+    }
+  }
+  txp_info(TXP_LOG_ENGINE, "[pdf] reloaded %d pages, %d reused\n", count, reused);
 }
 
-static void engine_detect_changes(txp_engine *_self, fz_context *ctx)
+static uint64_t hash_file(fz_context *ctx, const char *path)
 {
-  SELF;
-  fz_document *doc = fz_open_document(ctx, self->path);
-  if (!doc)
-    return;
+  fz_buffer *buf = fz_read_file(ctx, path);
+  uint64_t h = hash_bytes(0xcbf29ce484222325ULL, buf->data, buf->len);
+  fz_drop_buffer(ctx, buf);
+  return h;
+}
+
+// Open the document and set up its pages, reusing those of the previous one
+static bool load_document(fz_context *ctx, PDFEngine *self)
+{
+  fz_document *doc = NULL;
+  pdf_page_cache_t *pages = NULL;
+  uint64_t *sigs = NULL;
+  int count = 0;
+  fz_var(doc);
+  fz_var(pages);
+  fz_var(sigs);
+
+  fz_try(ctx)
+  {
+    doc = fz_open_document(ctx, self->path);
+    count = fz_count_pages(ctx, doc);
+    sigs = sign_pages(ctx, doc, count);
+    pages = fz_malloc_struct_array(ctx, count, pdf_page_cache_t);
+    for (int i = 0; i < count; ++i)
+      pages[i].signature = sigs[i];
+  }
+  fz_always(ctx)
+    fz_free(ctx, sigs);
+  fz_catch(ctx)
+  {
+    // The file might be in the middle of being written, keep the previous
+    // version until the next rescan
+    txp_warn(TXP_LOG_ENGINE, "[pdf] cannot load %s: %s\n", self->path,
+             fz_caught_message(ctx));
+    fz_free(ctx, pages);
+    fz_drop_document(ctx, doc);
+    return 0;
+  }
 
+  if (self->pages)
+  {
+    reuse_pages(ctx, self->pages, self->count, pages, count);
+    drop_pages(ctx, self->pages, self->count);
+  }
   fz_drop_document(ctx, self->doc);
   self->doc = doc;
-  self->page_count = fz_count_pages(ctx, doc);
-  self->changed = 1;
+  self->pages = pages;
+  self->count = count;
+  return 1;
 }
 
-static bool engine_end_changes(txp_engine *_self, fz_context *ctx)
+// Engine class implementation
+
+PDFEngine::PDFEngine(fz_context &ctx, const char *pdf_path): ctx(ctx)
 {
-  SELF;
-  if (self->changed)
+  this->path = fz_strdup(&ctx, pdf_path);
+  this->doc = NULL;
+  this->changed = 0;
+  this->pages = NULL;
+  this->count = 0;
+  this->hash = 0;
+  memset(&this->st, 0, sizeof(this->st));
+  this->watcher = watcher_new(&ctx);
+  this->entry = fz_malloc_struct(&ctx, fileentry_t);
+  this->entry->path = this->path;
+  if (this->watcher)
+    watcher_add(&ctx, this->watcher, this->entry, this->path);
+
+  if (stat(pdf_path, &this->st) == 0)
   {
-    self->changed = 0;
-    return 1;
+    fz_try(&ctx)
+      this->hash = hash_file(&ctx, pdf_path);
+    fz_catch(&ctx)
+      this->hash = 0;
   }
-  else
-  return 0;
+  load_document(&ctx, this);
 }
 
-static int engine_page_count(txp_engine *_self)
+PDFEngine::~PDFEngine()
 {
-  SELF;
-  return self->page_count;
+  drop_pages(&this->ctx, this->pages, this->count);
+  fz_drop_document(&this->ctx, this->doc);
+  if (this->watcher)
+    watcher_free(&this->ctx, this->watcher);
+  fz_free(&this->ctx, this->entry);
+  fz_free(&this->ctx, this->path);
 }
 
-static txp_engine_status engine_get_status(txp_engine *_self)
+// Called when the watcher descriptor is ready
+bool PDFEngine::step(bool restart_if_needed)
 {
-  return DOC_TERMINATED;
+  int index = 0;
+  if (!this->watcher || !watcher_poll(this->watcher) ||
+      watcher_scan(this->watcher, &index))
+    this->detect_changes();
+  bool changed = this->changed;
+  this->changed = 0;
+  return changed;
 }
 
-static float engine_scale_factor(txp_engine *_self)
+int PDFEngine::query_fd()
 {
-  return 1;
+  return this->watcher ? watcher_fd(this->watcher) : -1;
 }
 
-static synctex_t *engine_synctex(txp_engine *_self, fz_buffer **buf)
+void PDFEngine::begin_changes()
 {
-  return NULL;
 }
 
-static fileentry_t *engine_find_file(txp_engine *_self, fz_context *ctx, const char *path)
+void PDFEngine::detect_changes()
 {
-  return NULL;
+  struct stat st;
+  if (stat(this->path, &st) != 0)
+    return;
+
+  // Scanned: the watcher reports the file again on the next change, the
+  // watch is re-armed if the file was replaced
+  if (this->watcher)
+    watcher_add(&this->ctx, this->watcher, this->entry, this->path);
+
+  if (stat_same(&st, &this->st))
+    return;
+
+  uint64_t hash = 0;
+  fz_var(hash);
+  fz_try(&this->ctx)
+    hash = hash_file(&this->ctx, this->path);
+  fz_catch(&this->ctx)
+    return;
+
+  if (hash == this->hash)
+  {
+    this->st = st;
+    return;
+  }
+
+  if (load_document(&this->ctx, this))
+  {
+    this->st = st;
+    this->hash = hash;
+    this->changed = 1;
+  }
 }
 
-static void engine_notify_file_changes(txp_engine *_self,
-                                       fz_context *ctx,
-                                       fileentry_t *entry,
-                                       int offset)
+bool PDFEngine::end_changes()
 {
+  bool changed = this->changed;
+  this->changed = 0;
+  return changed;
 }
 
-txp_engine *txp_create_pdf_engine(fz_context *ctx, const char *pdf_path)
+int PDFEngine::page_count()
 {
-  fz_document *doc = fz_open_document(ctx, pdf_path);
-  if (!doc)
+  return this->count;
+}
+
+fz_display_list *PDFEngine::render_page(int page)
+{
+  if (page < 0 || page >= this->count)
     return NULL;
 
-  struct pdf_engine *self = fz_malloc_struct(ctx, struct pdf_engine);
-  self->_class = &_class;
+  pdf_page_cache_t *p = &this->pages[page];
+  if (!p->dl)
+  {
+    fz_page *fzp = fz_load_page(&this->ctx, this->doc, page);
+    int tag = txp_mem_enter(TXP_MEM_DISPLAY);
+    fz_try(&this->ctx)
+      p->dl = fz_new_display_list_from_page(&this->ctx, fzp);
+    fz_always(&this->ctx)
+    {
+      txp_mem_leave(tag);
+      fz_drop_page(&this->ctx, fzp);
+    }
+    fz_catch(&this->ctx)
+      fz_rethrow(&this->ctx);
+  }
+  return fz_keep_display_list(&this->ctx, p->dl);
+}
 
-  self->path = fz_strdup(ctx, pdf_path);
-  self->doc = doc;
-  self->page_count = fz_count_pages(ctx, doc);
+txp_engine_status PDFEngine::get_status()
+{
+  return DOC_TERMINATED;
+}
+
+float PDFEngine::scale_factor()
+{
+  return 1;
+}
+
+synctex_t *PDFEngine::synctex(fz_buffer **buf)
+{
+  if (buf)
+    *buf = NULL;
+  return NULL;
+}
 
-  return (txp_engine*)self;
+fileentry_t *PDFEngine::find_file(const char *path)
+{
+  return NULL;
+}
+
+void PDFEngine::notify_file_changes(fileentry_t *entry, int offset)
+{
 }
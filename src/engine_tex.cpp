@@ -33,11 +33,19 @@
 #include <sys/socket.h>
 #include <signal.h>
 #include <optional>
+#ifdef __APPLE__
+#include <libproc.h>
+#endif
 #include "engine.hpp"
 #include "incdvi.h"
+#include "prerender.h"
 #include "state.h"
 #include "synctex.h"
 #include "editor.h"
+#include "watcher.h"
+#include "latency.h"
+#include "txp_log.h"
+#include "txp_memstat.h"
 #include "mupdf_compat.h"
 
 template<class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
@@ -114,6 +122,7 @@ static char *last_index(char *path, char needle)
 
 
 static void answer_query(fz_context *ctx, TexEngine *self, query::data &q);
+static void restore_pictures(fz_context *ctx, TexEngine *self, fileentry_t *e);
 
 // Launching processes
 
@@ -191,10 +200,37 @@ static pid_t exec_xelatex(char *tectonic_path, const char *filename,
   };
 
   pid_t pid = exec_xelatex_generic(args, fd);
-  fprintf(stderr, "[process] launched pid %d (using %s)\n", pid, tectonic_path);
+  txp_info(TXP_LOG_ENGINE, "[process] launched pid %d (using %s)\n", pid, tectonic_path);
   return pid;
 }
 
+// When the process cannot be forked early (on macOS, see need_snapshot),
+// changes before the first snapshot restart TeX from scratch. A standby
+// process is then launched in advance, to not pay for starting the binary.
+// The handshake is delayed until it is used, so it stays idle meanwhile.
+// This only saves the start of the binary, not the replay of the preamble:
+// it is not a snapshot, which on macOS would need TeX to dump and restore
+// its state without fork (not supported by texpresso-tonic).
+#ifndef STANDBY_PROCESS
+#ifdef __APPLE__
+#define STANDBY_PROCESS 1
+#else
+#define STANDBY_PROCESS 0
+#endif
+#endif
+
+static void launch_process(TexEngine *self, process_t *p)
+{
+  p->pid = exec_xelatex(self->tectonic_path, self->name,
+                        bundle_server_input(self->bundle),
+                        bundle_server_output(self->bundle),
+                        bundle_server_lock(self->bundle),
+                        &p->fd);
+  p->trace_len = 0;
+  p->edit = -1;
+  p->memory = 0;
+}
+
 static void prepare_process(fz_context *ctx, TexEngine *self)
 {
   if (self->process_count == 0)
@@ -202,14 +238,18 @@ static void prepare_process(fz_context *ctx, TexEngine *self)
     log_rollback(ctx, self->log, self->restart);
     self->process_count = 1;
     process_t *p = get_process(self);
-    p->pid = exec_xelatex(self->tectonic_path, self->name,
-                          bundle_server_input(self->bundle),
-                          bundle_server_output(self->bundle),
-                          bundle_server_lock(self->bundle),
-                          &p->fd);
-    p->trace_len = 0;
+    if (self->standby.fd != -1)
+    {
+      *p = self->standby;
+      self->standby.fd = -1;
+      txp_info(TXP_LOG_ENGINE, "[process] using standby pid %d\n", p->pid);
+    }
+    else
+      launch_process(self, p);
     if (!self->c->handshake(p->fd))
       mabort();
+    if (STANDBY_PROCESS)
+      launch_process(self, &self->standby);
   }
 }
 
@@ -242,61 +282,181 @@ static std::optional<query::data> read_query(TexEngine *self, Channel *t)
   t->set_fd(p->fd);
   std::optional<query::data> q = t->read_query();
   if (!q.has_value()) {
-    fprintf(stderr, "[process] terminating process\n");
+    txp_info(TXP_LOG_ENGINE, "[process] terminating process\n");
     close_process(p);
   }
   return q;
 }
 
-static void decimate_processes(TexEngine *self)
+#define EDIT_RING 8
+
+static int process_time(TexEngine *self, process_t *p)
 {
-  fprintf(stderr, "before process decimation:\n");
-  for  (int i = 0; i < self->process_count; ++i)
-  {
-    process_t *p = &self->processes[i];
-    fprintf(stderr, "- position %d, time %dms [pid %d]\n",
-            p->trace_len,
-            p->trace_len == 0 ? 0 : self->trace[p->trace_len - 1].time,
-            p->pid);
-  }
+  return p->trace_len == 0 ? 0 : self->trace[p->trace_len - 1].time;
+}
+
+// Memory private to a process, in bytes, or 0 if it cannot be measured.
+// Pages still shared with other snapshots are not counted: this is what
+// closing the process gives back.
+static size_t process_memory(int pid)
+{
+#ifdef __APPLE__
+  struct rusage_info_v2 ri;
+  if (proc_pid_rusage(pid, RUSAGE_INFO_V2, (rusage_info_t *)&ri) != 0)
+    return 0;
+  return ri.ri_phys_footprint;
+#else
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+
+  char line[256];
+  unsigned long kb = 0;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "Private_Dirty: %lu kB", &kb) == 1)
+      break;
+  fclose(f);
+
+  return (size_t)kb * 1024;
+#endif
+}
+
+static size_t snapshots_memory(TexEngine *self)
+{
+  size_t total = 0;
+  for (int i = 0; i < self->process_count - 1; ++i)
+    total += self->processes[i].memory;
+  return total;
+}
+
+// Removing snapshot i makes the edits that fall after it replay from
+// snapshot i-1, at an extra cost of t(i) - t(i-1). If edits are uniformly
+// spread over time, the probability of one falling there is proportional to
+// t(i+1) - t(i). Snapshots placed for recent edits are worth more: the user is
+// likely to change the same region again.
+static double snapshot_value(TexEngine *self, int i)
+{
+  int t0 = process_time(self, &self->processes[i - 1]);
+  int t1 = process_time(self, &self->processes[i]);
+  int t2 = process_time(self, &self->processes[i + 1]);
+  double value = (double)(t1 - t0 + 1) * (double)(t2 - t1 + 1);
+
+  int edit = self->processes[i].edit;
+  int age = self->edit_count - 1 - edit;
+  if (edit >= 0 && age < EDIT_RING)
+    value *= 1 + EDIT_RING - age;
+
+  // Divide by the memory that evicting it would free (counting at least 1MB,
+  // the cost of a process that has not diverged or could not be measured)
+  return value / (double)(self->processes[i].memory + (1 << 20));
+}
+
+// Close the snapshot that is the cheapest to lose. The root process and the
+// running one are always kept.
+static bool evict_snapshot(TexEngine *self)
+{
+  int best = -1;
+  double best_value = 0;
 
-  int i = 0, bound = (self->process_count - 8) / 2;
-  while (i < bound)
+  for (int i = 1; i < self->process_count - 1; ++i)
   {
-    close_process(&self->processes[2*i]);
-    self->processes[i] = self->processes[2*i+1];
-    i++;
+    double value = snapshot_value(self, i);
+    if (best == -1 || value < best_value)
+    {
+      best = i;
+      best_value = value;
+    }
   }
-  for (int j = bound * 2; j < self->process_count; ++j)
+
+  if (best == -1)
+    return 0;
+
+  process_t *p = &self->processes[best];
+  txp_info(TXP_LOG_ENGINE, "[snapshot] evicting position %d, time %dms, %zuKB [pid %d]\n",
+           p->trace_len, process_time(self, p), p->memory >> 10, p->pid);
+
+  close_process(p);
+  memmove(p, p + 1, (self->process_count - best - 1) * sizeof(process_t));
+  self->process_count -= 1;
+
+  // Pages shared with the evicted process are now private to its neighbours
+  self->processes[best - 1].memory = process_memory(self->processes[best - 1].pid);
+  if (best < self->process_count - 1)
+    self->processes[best].memory = process_memory(self->processes[best].pid);
+
+  return 1;
+}
+
+// Called before freezing the running process into a new snapshot.
+// A process shares all its pages right after a fork, and it takes the running
+// process some time to diverge: measure the previous snapshot now, and one of
+// the older ones in turn. Then evict until the budget is respected.
+static void update_snapshots_memory(TexEngine *self)
+{
+  int snapshots = self->process_count - 1;
+  if (snapshots <= 0)
+    return;
+
+  process_t *last = &self->processes[snapshots - 1];
+  last->memory = process_memory(last->pid);
+
+  if (self->measure_next >= snapshots - 1)
+    self->measure_next = 0;
+  if (self->measure_next < snapshots - 1)
   {
-    self->processes[i] = self->processes[j];
-    i++;
+    process_t *p = &self->processes[self->measure_next];
+    p->memory = process_memory(p->pid);
+    self->measure_next += 1;
   }
-  self->process_count = i;
 
-  fprintf(stderr, "after process decimation:\n");
-  for  (int i = 0; i < self->process_count; ++i)
+  if (self->snapshot_budget == 0)
+    return;
+
+  size_t total;
+  while ((total = snapshots_memory(self)) > self->snapshot_budget)
   {
-    process_t *p = &self->processes[i];
-    fprintf(stderr, "- position %d, time %dms [pid %d]\n",
-            p->trace_len,
-            p->trace_len == 0 ? 0 : self->trace[p->trace_len - 1].time,
-            p->pid);
+    txp_info(TXP_LOG_ENGINE, "[snapshot] %d snapshots use %zuMB, budget is %zuMB\n",
+             self->process_count - 1, total >> 20, self->snapshot_budget >> 20);
+    if (!evict_snapshot(self))
+      break;
   }
 }
 
 // Engine class implementation
 
+static void save_checkpoint(fz_context *ctx, TexEngine *self);
+static void drop_checkpoint(fz_context *ctx, TexEngine *self);
+static void save_pictures(fz_context *ctx, TexEngine *self);
+static void drop_pictures(fz_context *ctx, TexEngine *self);
+
+void TexEngine::save_session()
+{
+  if (this->process_count > 0)
+    save_checkpoint(&this->ctx, this);
+  save_pictures(&this->ctx, this);
+  bundle_server_save_manifest(&this->ctx, this->bundle);
+}
+
 TexEngine::~TexEngine()
 {
+  drop_checkpoint(&this->ctx, this);
+  drop_pictures(&this->ctx, this);
   while (this->process_count > 0)
     pop_process(&this->ctx, this);
+  close_process(&this->standby);
+  free(this->trace);
+  free(this->fences);
+  prerender_free(&this->ctx, this->prerender);
   incdvi_free(&this->ctx, this->dvi);
   synctex_free(&this->ctx, this->stex);
+  if (this->watcher)
+    watcher_free(&this->ctx, this->watcher);
+  state_free(&this->ctx, &this->st);
   fz_free(&this->ctx, this->name);
   fz_free(&this->ctx, this->tectonic_path);
   fz_free(&this->ctx, this->inclusion_path);
-  fz_free(&this->ctx, this);
 }
 
 static const char *expand_path(const char **inclusion_path, const char *name, char buffer[1024])
@@ -347,10 +507,52 @@ static const char *expand_path(const char **inclusion_path, const char *name, ch
   return buffer;
 }
 
-static void check_fid(file_id fid)
+static filecell_t *get_cell(fz_context *ctx, TexEngine *self, file_id fid)
 {
-  if (fid < 0 || fid >= MAX_FILES)
+  if (fid < 0)
     mabort();
+  return state_cell(ctx, &self->st, fid);
+}
+
+// The trace is an array of runs: consecutive SEEN events for the same file
+// are merged in a single entry. Times of successive entries never decrease
+// (a process continues the clock of its parent), which allows looking up
+// entries by time with a binary search.
+
+static void trace_resize(TexEngine *self, int new_cap)
+{
+  txp_debug(TXP_LOG_ENGINE, "[info] trace has %d entries, resizing to %d\n",
+            self->trace_cap, new_cap);
+  trace_entry_t *newtr =
+    (trace_entry_t*)realloc(self->trace, sizeof(trace_entry_t) * new_cap);
+  if (newtr == NULL) abort();
+  self->trace = newtr;
+  self->trace_cap = new_cap;
+}
+
+// Release memory after a rollback dropped most of the trace
+static void trace_shrink(TexEngine *self, int len)
+{
+  int new_cap = self->trace_cap;
+  while (new_cap > 64 && len < new_cap / 4)
+    new_cap /= 2;
+  if (new_cap < self->trace_cap)
+    trace_resize(self, new_cap);
+}
+
+// Return the last entry in [lo, hi] whose time is at most `time', or lo - 1
+static int trace_find_time(TexEngine *self, int lo, int hi, int time)
+{
+  int first = lo;
+  while (lo <= hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (self->trace[mid].time <= time)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return fz_maxi(hi, first - 1);
 }
 
 static void record_seen(TexEngine *self, fileentry_t *entry, int seen, int time)
@@ -367,19 +569,7 @@ static void record_seen(TexEngine *self, fileentry_t *entry, int seen, int time)
   }
 
   if (p->trace_len == self->trace_cap)
-  {
-    int new_cap = self->trace_cap == 0 ? 8 : self->trace_cap * 2;
-    fprintf(stderr, "[info] trace has %d entries, growing to %d\n", self->trace_cap, new_cap);
-    trace_entry_t *newtr = calloc(sizeof(trace_entry_t), new_cap);
-    if (newtr == NULL) abort();
-    if (self->trace)
-    {
-      memcpy(newtr, self->trace, self->trace_cap * sizeof(trace_entry_t));
-      free(self->trace);
-    }
-    self->trace = newtr;
-    self->trace_cap = new_cap;
-  }
+    trace_resize(self, self->trace_cap == 0 ? 8 : self->trace_cap * 2);
 
   self->trace[p->trace_len] = (trace_entry_t){
     .entry = entry,
@@ -390,13 +580,60 @@ static void record_seen(TexEngine *self, fileentry_t *entry, int seen, int time)
   p->trace_len += 1;
 }
 
-static fz_buffer *entry_data(fileentry_t *e)
+// File contents are accounted apart (see txp_memstat.h). Buffers keep the tag
+// they were created with when they grow.
+
+static fz_buffer *new_file_buffer(fz_context *ctx, size_t size)
+{
+  int tag = txp_mem_enter(TXP_MEM_FILES);
+  fz_buffer *buf = NULL;
+  fz_try(ctx)
+    buf = fz_new_buffer(ctx, size);
+  fz_always(ctx)
+    txp_mem_leave(tag);
+  fz_catch(ctx)
+    fz_rethrow(ctx);
+  return buf;
+}
+
+static fz_buffer *read_file_data(fz_context *ctx, const char *path)
+{
+  int tag = txp_mem_enter(TXP_MEM_FILES);
+  fz_buffer *buf = NULL;
+  fz_try(ctx)
+    buf = fz_read_file(ctx, path);
+  fz_always(ctx)
+    txp_mem_leave(tag);
+  fz_catch(ctx)
+    fz_rethrow(ctx);
+  return buf;
+}
+
+// Contents of an entry as seen by TeX: its output, the editor buffer or the
+// file on disk
+
+static bool entry_has_data(fileentry_t *e)
+{
+  return e->saved.data || e->edit_data || e->fs_data;
+}
+
+static size_t entry_length(fileentry_t *e)
 {
   if (e->saved.data)
-    return e->saved.data;
+    return e->saved.data->len;
   if (e->edit_data)
-    return e->edit_data;
-  return e->fs_data;
+    return textbuf_length(e->edit_data);
+  return e->fs_data ? e->fs_data->len : 0;
+}
+
+// Contiguous bytes at pos, their count in *len
+static const unsigned char *entry_span(fileentry_t *e, size_t pos, size_t *len)
+{
+  fz_buffer *buf = e->saved.data ? e->saved.data : e->fs_data;
+  if (!e->saved.data && e->edit_data)
+    return textbuf_span(e->edit_data, pos, len);
+  *len = buf->len - pos;
+  return buf->data + pos;
 }
 
 static fz_buffer *output_data(fileentry_t *e)
@@ -425,7 +662,74 @@ lookup_path(TexEngine *self, const char *path, char buf[1024], struct stat *st)
   return fs_path;
 }
 
-static bool need_snapshot(fz_context *ctx, TexEngine *self, int time)
+// Snapshots are placed at regular intervals of the trace time, so that the
+// replay needed after an arbitrary change stays bounded, and just before the
+// regions of the recent edits, where the next change is likely to happen.
+
+#define SNAPSHOT_INTERVAL 500
+#define SNAPSHOT_EDIT_INTERVAL 20
+
+// Granularity of SEEN positions. TeX may report a position rounded up to the
+// end of its block, sending one SEEN per block rather than one per read: this
+// is conservative for rollbacks, and fences and snapshots in front of edits
+// are aligned on blocks, so it does not change where TeX restarts.
+#define SEEN_BLOCK 64
+
+// Find the first recently edited region of e that starts in [pos, pos + n).
+// Return the serial number of the edit and set *start to its position, or
+// return -1.
+static int next_edit(TexEngine *self, fileentry_t *e, int pos, int n, int *start)
+{
+  int best = -1;
+  int count = fz_mini(self->edit_count, EDIT_RING);
+
+  for (int i = 0; i < count; ++i)
+  {
+    int serial = self->edit_count - 1 - i;
+    edit_t *ed = &self->edits[serial % EDIT_RING];
+    if (ed->entry != e || ed->offset < pos)
+      continue;
+
+    int at = fz_maxi(0, (ed->offset - SEEN_BLOCK) & ~(SEEN_BLOCK - 1));
+    if (at < pos)
+      at = pos;
+    if (at >= pos + n)
+      continue;
+
+    if (best == -1 || at < *start)
+    {
+      best = serial;
+      *start = at;
+    }
+  }
+
+  return best;
+}
+
+static void record_edit(TexEngine *self, fileentry_t *e, int offset)
+{
+  // Consecutive changes to the same place count as a single edit
+  if (self->edit_count > 0)
+  {
+    edit_t *last = &self->edits[(self->edit_count - 1) % EDIT_RING];
+    if (last->entry == e && abs(last->offset - offset) < 1024)
+    {
+      last->offset = fz_mini(last->offset, offset);
+      return;
+    }
+  }
+
+  edit_t *ed = &self->edits[self->edit_count % EDIT_RING];
+  ed->entry = e;
+  ed->offset = offset;
+  self->edit_count += 1;
+}
+
+// Decide whether to snapshot before reading n bytes of e at pos.
+// The read can be shortened to stop in front of an edited region, the
+// snapshot is then taken by the next read.
+static bool need_snapshot(fz_context *ctx, TexEngine *self,
+                          fileentry_t *e, int pos, int *n, int time)
 {
   // Fences are pending: don't snapshot now
   if (self->fence_pos != -1)
@@ -441,7 +745,7 @@ static bool need_snapshot(fz_context *ctx, TexEngine *self, int time)
     if (self->processes[process].trace_len == self->processes[process-1].trace_len)
       return 0;
 
-    last_time = self->trace[self->processes[process-1].trace_len - 1].time;
+    last_time = process_time(self, &self->processes[process-1]);
 
     // TODO Alternative
     // Checking that some new event happened avoid entering an infinite fork
@@ -461,7 +765,8 @@ static bool need_snapshot(fz_context *ctx, TexEngine *self, int time)
     // The second best thing is to hopefully load all system fonts before the
     // first fork.
     // Therefore we delay forking until output started, hopping that all fonts
-    // have been specified at this point.
+    // have been specified at this point. Until then, restarts use the
+    // standby process (STANDBY_PROCESS).
     if (!incdvi_output_started(self->dvi))
       return 0;
     #endif
@@ -470,7 +775,33 @@ static bool need_snapshot(fz_context *ctx, TexEngine *self, int time)
     last_time = 0;
   }
 
-  return time > 500 + last_time;
+  int start, edit = next_edit(self, e, pos, *n, &start);
+  if (edit != -1 && time >= SNAPSHOT_EDIT_INTERVAL + last_time)
+  {
+    if (start == pos)
+    {
+      self->snapshot_edit = edit;
+      return 1;
+    }
+    *n = start - pos;
+    return 0;
+  }
+
+  if (time > SNAPSHOT_INTERVAL + last_time)
+  {
+    self->snapshot_edit = -1;
+    return 1;
+  }
+
+  return 0;
+}
+
+// The .aux file of the document, as opposed to those of \include
+static bool is_main_aux(TexEngine *self, const char *path)
+{
+  const char *dot = strrchr(self->name, '.');
+  size_t stem = dot ? dot - self->name : strlen(self->name);
+  return strncmp(path, self->name, stem) == 0 && strcmp(path + stem, ".aux") == 0;
 }
 
 static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
@@ -480,8 +811,7 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
   std::visit(
     overloaded {
         [=](query::open o) {
-            check_fid(o.fid);
-            filecell_t *cell = &self->st.table[o.fid];
+            filecell_t *cell = get_cell(ctx, self, o.fid);
             if (cell->entry != NULL) mabort();
 
             fileentry_t *e = NULL;
@@ -492,10 +822,24 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
             if (o.mode[0] == 'r')
             {
               e = filesystem_lookup(self->fs, o.path);
-              if (!e || !entry_data(e))
+              if (!e || !entry_has_data(e))
               {
                 fs_path = lookup_path(self, o.path, fs_path_buffer, NULL);
+                fz_buffer *bundled = NULL;
                 if (!fs_path)
+                  bundled = bundle_server_take(ctx, self->bundle, o.path);
+                if (bundled)
+                {
+                  // Prefetched from the bundle: serve it like a file, it
+                  // is not on disk and won't be scanned
+                  if (!e) e = filesystem_lookup_or_create(ctx, self->fs, o.path);
+                  fz_free(ctx, e->fs_hashes);
+                  e->fs_hashes = NULL;
+                  e->fs_data = bundled;
+                  e->saved.level = FILE_READ;
+                  memset(&e->fs_stat, 0, sizeof(e->fs_stat));
+                }
+                else if (!fs_path)
                 {
                   e = filesystem_lookup_or_create(ctx, self->fs, o.path);
                   log_fileentry(ctx, self->log, e);
@@ -535,31 +879,36 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
                 {
                   if (fs_path == o.path)
                     fs_path = e->path;
-                  e->fs_data = fz_read_file(ctx, fs_path);
+                  fz_free(ctx, e->fs_hashes);
+                  e->fs_hashes = NULL;
+                  e->fs_data = read_file_data(ctx, fs_path);
                   e->saved.level = FILE_READ;
                   stat(fs_path, &e->fs_stat);
+                  restore_pictures(ctx, self, e);
+                  if (self->watcher)
+                    watcher_add(ctx, self->watcher, e, fs_path);
                 }
               }
             }
             else
             {
-              e->saved.data = fz_new_buffer(ctx, 1024);
+              e->saved.data = new_file_buffer(ctx, 1024);
               e->saved.level = level;
             }
 
             if (level == FILE_READ)
             {
               if (0)
-                fprintf(stderr, "[info] opening %s\n", o.path);
+                txp_debug(TXP_LOG_ENGINE, "[info] opening %s\n", o.path);
             }
             else
             {
-              fprintf(stderr, "[info] writing %s\n", o.path);
+              txp_debug(TXP_LOG_ENGINE, "[info] writing %s\n", o.path);
               if (strcmp(o.path, "stdout") == 0)
               {
                 if (self->st.stdout.entry != NULL)
                 {
-                  fprintf(stderr, "[error] two stdouts!\n");
+                  txp_error(TXP_LOG_ENGINE, "[error] two stdouts!\n");
                   mabort();
                 }
                 log_filecell(ctx, self->log, &self->st.stdout);
@@ -569,7 +918,7 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
               {
                 char *ext = last_index(o.path, '.');
                 if (0)
-                  fprintf(stderr, "extension is %s\n", ext);
+                  txp_debug(TXP_LOG_ENGINE, "extension is %s\n", ext);
                 if (!ext);
                 else if ((strcmp(ext, "xdv") == 0 ||
                           strcmp(ext, "dvi") == 0 ||
@@ -577,36 +926,40 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
                 {
                   if (self->st.document.entry != NULL)
                   {
-                    fprintf(stderr, "[error] two outputs!\n");
+                    txp_error(TXP_LOG_ENGINE, "[error] two outputs!\n");
                     mabort();
                   }
                   log_filecell(ctx, self->log, &self->st.document);
                   self->st.document.entry = e;
                   incdvi_reset(self->dvi);
-                  fprintf(stderr, "[info] this is the output document\n");
+                  prerender_invalidate(ctx, self->prerender, 0);
+                  txp_debug(TXP_LOG_ENGINE, "[info] this is the output document\n");
                 }
+                else if (strcmp(ext, "aux") == 0 && is_main_aux(self, o.path))
+                  // In \begin{document}: what was read so far is the preamble
+                  self->checkpoint.preamble = get_process(self)->trace_len;
                 else if ((strcmp(ext, "synctex") == 0))
                 {
                   if (self->st.synctex.entry != NULL)
                   {
-                    fprintf(stderr, "[error] two synctex!\n");
+                    txp_error(TXP_LOG_ENGINE, "[error] two synctex!\n");
                     mabort();
                   }
                   log_filecell(ctx, self->log, &self->st.synctex);
                   self->st.synctex.entry = e;
                   synctex_rollback(ctx, self->stex, 0);
-                  fprintf(stderr, "[info] this is the synctex\n");
+                  txp_debug(TXP_LOG_ENGINE, "[info] this is the synctex\n");
                 }
                 else if ((strcmp(ext, "log") == 0))
                 {
                   if (self->st.log.entry != NULL)
                   {
-                    fprintf(stderr, "[error] two log files!\n");
+                    txp_error(TXP_LOG_ENGINE, "[error] two log files!\n");
                     mabort();
                   }
                   log_filecell(ctx, self->log, &self->st.log);
                   self->st.log.entry = e;
-                  fprintf(stderr, "[info] this is the log file\n");
+                  txp_debug(TXP_LOG_ENGINE, "[info] this is the log file\n");
                 }
               }
             }
@@ -616,24 +969,29 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
             self->c->write_answer(p->fd, answer::data(answer::open{ .size = n }));
         },
         [=](query::read r) {
-            check_fid(r.fid);
-            fileentry_t *e = self->st.table[r.fid].entry;
+            fileentry_t *e = get_cell(ctx, self, r.fid)->entry;
             if (e == NULL) mabort();
             if (e->saved.level < FILE_READ) mabort();
-            fz_buffer *data = entry_data(e);
+            int len = entry_length(e);
             if (e->debug_rollback_invalidation > -1)
             {
                 if (r.pos > e->debug_rollback_invalidation)
                 mabort();
                 e->debug_rollback_invalidation = -1;
             }
-            if (r.pos > data->len)
+            if (r.pos > len)
             {
-                fprintf(stderr, "read:%d\ndata->len:%d\n", r.pos, (int)data->len);
+                txp_debug(TXP_LOG_ENGINE, "read:%d\ndata->len:%d\n", r.pos, len);
                 mabort();
             }
             int n = r.size;
-            if (n > data->len - r.pos) n = data->len - r.pos;
+            if (n > len - r.pos) n = len - r.pos;
+
+            // Edited files are split in pieces, stop at the end of the
+            // current one
+            size_t avail;
+            const unsigned char *span = entry_span(e, r.pos, &avail);
+            if (n > (int)avail) n = avail;
 
             int fork = 0;
             if (self->fence_pos >= 0 &&
@@ -650,13 +1008,18 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
             }
             if (fork)
             {
+                // The innermost fence sits right before the change
+                self->snapshot_edit =
+                  self->fence_pos == 0 ? self->edit_count - 1 : -1;
                 self->fence_pos -= 1;
             }
-            else if (need_snapshot(ctx, self, q.time)) {} // fork in this case too
+            else if (need_snapshot(ctx, self, e, r.pos, &n, q.time)) {} // fork in this case too
             else
             {
-                memmove(self->c->get_buffer(n), data->data + r.pos, n);
-                self->c->write_answer(p->fd, answer::data(answer::read{ .size = n }));
+                // Send straight from the file contents, without staging
+                // them in the channel buffer
+                self->c->write_answer(p->fd, answer::data(answer::read{
+                    .size = n, .data = span }));
                 return;
             }
             // if (fork) fprintf(stderr, "read = fork\n");
@@ -677,7 +1040,7 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
                 self->st.stdout.entry = e;
                 if (e->saved.data == NULL)
                 {
-                  e->saved.data = fz_new_buffer(ctx, 1024);
+                  e->saved.data = new_file_buffer(ctx, 1024);
                   e->saved.level = FILE_WRITE;
                 }
               }
@@ -687,12 +1050,12 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
             }
             else
             {
-              check_fid(w.fid);
-              e = self->st.table[w.fid].entry;
+              e = get_cell(ctx, self, w.fid)->entry;
             }
 
             if (e == NULL || e->saved.level != FILE_WRITE) mabort();
             log_fileentry(ctx, self->log, e);
+            int olen = e->saved.data->len;
 
             if (w.pos + w.size > e->saved.data->len)
             {
@@ -705,10 +1068,17 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
             if (self->st.document.entry == e)
             {
               int opage = incdvi_page_count(self->dvi);
+              if (w.pos < olen)
+              {
+                incdvi_truncate(self->dvi, w.pos);
+                prerender_invalidate(ctx, self->prerender, w.pos);
+              }
+              uint64_t start = latency_now();
               incdvi_update(ctx, self->dvi, e->saved.data);
+              latency_span("incdvi_update", start);
               int npage = incdvi_page_count(self->dvi);
               if (opage != npage)
-                fprintf(stderr, "[info] output %d pages long\n", npage);
+                txp_info(TXP_LOG_ENGINE, "[info] output %d pages long\n", npage);
             }
             else if (self->st.synctex.entry == e)
             {
@@ -718,7 +1088,7 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
               int npage = synctex_page_count(self->stex);
               int ninput = synctex_input_count(self->stex);
               if (opage != npage || oinput != ninput)
-                fprintf(stderr, "[info] synctex used %d input files, is %d pages long\n", ninput, npage);
+                txp_info(TXP_LOG_ENGINE, "[info] synctex used %d input files, is %d pages long\n", ninput, npage);
             }
             else if (self->st.log.entry == e)
               editor_append(BUF_LOG, output_data(e), w.pos);
@@ -728,15 +1098,13 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
             self->c->write_answer(p->fd, answer::data(answer::done{}));
         },
         [=](query::clos c) {
-            check_fid(c.fid);
-
-            filecell_t *cell = &self->st.table[c.fid];
+            filecell_t *cell = get_cell(ctx, self, c.fid);
             fileentry_t *e = cell->entry;
             if (e == NULL) mabort();
             log_filecell(ctx, self->log, cell);
             cell->entry = NULL;
 
-            if (0) fprintf(stderr, "[info] closing %s\n", e->path);
+            txp_debug(TXP_LOG_ENGINE, "[info] closing %s\n", e->path);
 
             if (self->st.stdout.entry == e)
             {
@@ -746,7 +1114,7 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
 
             if (self->st.document.entry == e)
             {
-                fprintf(stderr, "[info] finished output\n");
+                txp_info(TXP_LOG_ENGINE, "[info] finished output\n");
                 // log_filecell(ctx, log, &st->document);
                 // st->document.entry = NULL;
             }
@@ -760,33 +1128,42 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
             self->c->write_answer(p->fd, answer::data(answer::done{}));
         },
         [=](query::size s) {
-            check_fid(s.fid);
-            fileentry_t *e = self->st.table[s.fid].entry;
+            fileentry_t *e = get_cell(ctx, self, s.fid)->entry;
             if (e == NULL || e->saved.level < FILE_READ) mabort();
             // if (LOG)
             //   fprintf(stderr, "SIZE = %d (seen = %d)\n", a.size.size, e->seen);
             self->c->write_answer(p->fd, answer::data(answer::size{
-                .size = (int) entry_data(e)->len // WARNING narrows size_t to int
+                .size = (int) entry_length(e) // WARNING narrows size_t to int
             }));
         },
         [=](query::seen s) {
-            check_fid(s.fid);
-            fileentry_t *e = self->st.table[s.fid].entry;
+            fileentry_t *e = get_cell(ctx, self, s.fid)->entry;
             if (e == NULL) mabort();
-            if (LOG)
-              fprintf(stderr, "[info] file %s seen: %d -> %d\n", e->path, e->seen, s.pos);
+            txp_debug(TXP_LOG_ENGINE, "[info] file %s seen: %d -> %d\n", e->path, e->seen, s.pos);
             if (e->saved.level < FILE_READ) mabort();
+
+            // A position reported per block can go past the bytes that TeX
+            // could read, the end of the file or the next fence: clamp it.
+            int limit = INT_MAX;
+            if (entry_has_data(e))
+              limit = entry_length(e);
+            if (self->fence_pos >= 0 &&
+                self->fences[self->fence_pos].entry == e)
+              limit = fz_mini(limit, self->fences[self->fence_pos].position);
+            if (s.pos > limit && s.pos - limit < SEEN_BLOCK)
+              s.pos = limit;
+
             if (self->fence_pos >= 0 &&
                 self->fences[self->fence_pos].entry == e &&
                 self->fences[self->fence_pos].position < s.pos)
             {
-              fprintf(stderr,
-                      "Seen position invalid wrt fence:\n"
-                      "  file %s, seen: %d -> %d\n"
-                      "  fence #%d position: %d\n",
-                      e->path, e->seen, s.pos,
-                      self->fence_pos,
-                      self->fences[self->fence_pos].position);
+              txp_error(TXP_LOG_ENGINE,
+                        "Seen position invalid wrt fence:\n"
+                        "  file %s, seen: %d -> %d\n"
+                        "  fence #%d position: %d\n",
+                        e->path, e->seen, s.pos,
+                        self->fence_pos,
+                        self->fences[self->fence_pos].position);
               mabort();
             }
             if (e->debug_rollback_invalidation != -1 &&
@@ -805,32 +1182,38 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
             }
         },
         [=,&p](query::chld c) {
+            update_snapshots_memory(self);
             if (self->process_count == 32)
-            {
-              decimate_processes(self);
-              p = get_process(self);
-            }
+              evict_snapshot(self);
+            p = get_process(self);
+            // Answers batched before the fork still belong to the parent
+            self->c->flush(p->fd);
             self->c->reset();
             self->process_count += 1;
             process_t *p2 = get_process(self);
             p->snap = log_snapshot(ctx, self->log);
+            p->edit = self->snapshot_edit;
+            self->snapshot_edit = -1;
             p2->fd = c.fd;
             p2->pid = c.pid;
             p2->trace_len = p->trace_len;
+            p2->edit = -1;
+            p2->memory = 0;
             self->c->write_answer(p->fd, answer::data(answer::done{}));
         },
         [=](query::gpic g) {
             fileentry_t *e = filesystem_lookup(self->fs, g.path);
-            if (e && e->saved.level == FILE_READ &&
-                e->pic_cache.type == g.type &&
-                e->pic_cache.page == g.page)
+            const pic_cache *pic = NULL;
+            if (e && e->saved.level == FILE_READ)
+              pic = fileentry_find_pic(e, g.type, g.page);
+            if (pic)
             {
               self->c->write_answer(p->fd, answer::data(answer::gpic{
                 .bounds = {
-                    e->pic_cache.bounds[0],
-                    e->pic_cache.bounds[1],
-                    e->pic_cache.bounds[2],
-                    e->pic_cache.bounds[3],
+                    pic->bounds[0],
+                    pic->bounds[1],
+                    pic->bounds[2],
+                    pic->bounds[3],
                 }
               }));
             }
@@ -840,7 +1223,8 @@ static void answer_query(fz_context *ctx, TexEngine *self, query::data &q)
         },
         [=](query::spic s) {
             fileentry_t *e = filesystem_lookup(self->fs, s.path);
-            if (e && e->saved.level == FILE_READ) e->pic_cache = s.cache;
+            if (e && e->saved.level == FILE_READ)
+              fileentry_add_pic(ctx, e, &s.cache);
             self->c->write_answer(p->fd, answer::data(answer::done{}));
         },
     }, q
@@ -870,57 +1254,91 @@ static void rollback_processes(fz_context *ctx, TexEngine *self, int reverted, i
   );
   if (self->fence_pos < 0)
   {
-    fprintf(stderr, "No fences, assuming process finished\n");
+    txp_info(TXP_LOG_ENGINE, "No fences, assuming process finished\n");
     // if (self->process_count > 0)
     //   mabort();
   }
 
-  fprintf(stderr, "Last trace entries:\n");
+  txp_debug(TXP_LOG_ENGINE, "Last trace entries:\n");
   for (int i = get_process(self)->trace_len - 1, j = fz_maxi(i - 10, 0); i > j; i--)
   {
-    fprintf(stderr, "- %s@%d, %dms\n",
-            self->trace[i].entry->path,
-            self->trace[i].seen,
-            self->trace[i].time);
+    txp_debug(TXP_LOG_ENGINE, "- %s@%d, %dms\n",
+              self->trace[i].entry->path,
+              self->trace[i].seen,
+              self->trace[i].time);
   }
 
-  fprintf(stderr, "Snapshots:\n");
+  txp_debug(TXP_LOG_ENGINE, "Snapshots:\n");
   for  (int i = 0; i < self->process_count; ++i)
   {
     process_t *p = &self->processes[i];
-    fprintf(stderr, "- position %d, time %dms\n", p->trace_len,
-            p->trace_len == 0 ? 0 : self->trace[p->trace_len - 1].time);
+    txp_debug(TXP_LOG_ENGINE, "- position %d, time %dms%s\n", p->trace_len,
+              process_time(self, p), p->edit >= 0 ? " (edit)" : "");
   }
 
+  // Time at which the changed contents were first observed
+  int change_time = -1;
+  if (self->process_count > 0 && reverted >= 0 &&
+      reverted < get_process(self)->trace_len)
+    change_time = self->trace[reverted].time;
+
   while (self->process_count > 0 && get_process(self)->trace_len > trace)
     pop_process(ctx, self);
 
   int trace_len = self->process_count == 0 ? 0 : get_process(self)->trace_len;
+
+  if (change_time >= 0)
+  {
+    int restored =
+      self->process_count == 0 ? 0 : process_time(self, get_process(self));
+    int replay = fz_maxi(0, change_time - restored);
+    self->replay.count += 1;
+    self->replay.total += replay;
+    self->replay.max = fz_maxi(self->replay.max, replay);
+    txp_info(TXP_LOG_ENGINE,
+             "[snapshot] replaying %dms to reach the change "
+             "(average %dms, max %dms over %d rollbacks)\n",
+             replay, (int)(self->replay.total / self->replay.count),
+             self->replay.max, self->replay.count);
+  }
+
   while (reverted > trace_len)
   {
     reverted--;
     revert_trace(&self->trace[reverted]);
   }
+  trace_shrink(self, trace_len);
 
-  fprintf(stderr, "after rollback: %d bytes of output\n",
-    self->st.document.entry
-    ? (int)self->st.document.entry->saved.data->len
-    : 0
-  );
+  int kept = output_length(self->st.document.entry);
+  txp_debug(TXP_LOG_ENGINE, "after rollback: %d bytes of output\n", kept);
+  if (change_time >= 0)
+  {
+    self->replay.output += kept;
+    txp_info(TXP_LOG_ENGINE,
+             "[snapshot] preserved %d bytes of output "
+             "(average %d bytes over %d rollbacks)\n",
+             kept, (int)(self->replay.output / self->replay.count),
+             self->replay.count);
+  }
 
   if (self->st.document.entry)
   {
-    fprintf(stderr, "[info] before rollback: %d pages\n", incdvi_page_count(self->dvi));
+    txp_debug(TXP_LOG_ENGINE, "[info] before rollback: %d pages\n", incdvi_page_count(self->dvi));
     incdvi_update(ctx, self->dvi, self->st.document.entry->saved.data);
-    fprintf(stderr, "[info] after  rollback: %d pages\n", incdvi_page_count(self->dvi));
+    txp_debug(TXP_LOG_ENGINE, "[info] after  rollback: %d pages\n", incdvi_page_count(self->dvi));
+    prerender_invalidate(ctx, self->prerender,
+                         self->st.document.entry->saved.data->len);
   }
   else
+  {
     incdvi_reset(self->dvi);
+    prerender_invalidate(ctx, self->prerender, 0);
+  }
   if (self->st.synctex.entry)
   {
-    fprintf(stderr, "[info] before rollback: %d pages in synctex\n", synctex_page_count(self->stex));
+    txp_debug(TXP_LOG_ENGINE, "[info] before rollback: %d pages in synctex\n", synctex_page_count(self->stex));
     synctex_update(ctx, self->stex, self->st.synctex.entry->saved.data);
-    fprintf(stderr, "[info] after  rollback: %d pages in synctex\n", synctex_page_count(self->stex));
+    txp_debug(TXP_LOG_ENGINE, "[info] after  rollback: %d pages in synctex\n", synctex_page_count(self->stex));
   }
   else
     synctex_rollback(ctx, self->stex, 0);
@@ -937,6 +1355,47 @@ static bool possible_fence(trace_entry_t *te)
   return 1;
 }
 
+static void push_fence(TexEngine *self, int trace, fileentry_t *entry, int position)
+{
+  if (self->fence_pos + 1 == self->fence_cap)
+  {
+    int new_cap = self->fence_cap == 0 ? 16 : self->fence_cap * 2;
+    fence_t *fences =
+      (fence_t*)realloc(self->fences, sizeof(fence_t) * new_cap);
+    if (fences == NULL) abort();
+    self->fences = fences;
+    self->fence_cap = new_cap;
+  }
+  self->fence_pos += 1;
+  self->fences[self->fence_pos].entry = entry;
+  self->fences[self->fence_pos].position = position;
+  txp_debug(TXP_LOG_ENGINE,
+            "[fence] placing fence %d at trace position %d, file %s, offset %d\n",
+            self->fence_pos, trace, entry->path, position);
+}
+
+// Return the latest snapshot that did not observe trace entry `trace', or -1
+static int find_restart_process(TexEngine *self, int trace)
+{
+  // Trace lengths of the snapshots increase: bisect
+  int lo = 0, hi = self->process_count - 1;
+  while (lo <= hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (self->processes[mid].trace_len <= trace)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return hi;
+}
+
+// Place fences between the change at trace position `trace' and the latest
+// snapshot that can be restored. The first one sits right before the change,
+// the next ones go back in time with exponentially growing intervals, so
+// that a process stops close to the change whatever the distance to the
+// snapshot, using a logarithmic number of fences.
+// Return the trace position to roll back to.
 static int compute_fences(fz_context *ctx, TexEngine *self, int trace, int offset)
 {
   self->fence_pos = -1;
@@ -947,45 +1406,33 @@ static int compute_fences(fz_context *ctx, TexEngine *self, int trace, int offse
   if (get_process(self)->trace_len <= trace)
     mabort();
 
-  self->fence_pos = 0;
-
-  offset = (offset - 64) & ~(64 - 1);
+  offset = (offset - SEEN_BLOCK) & ~(SEEN_BLOCK - 1);
   if (offset < self->trace[trace].seen)
     offset = self->trace[trace].seen;
   if (offset == -1)
     offset = 0;
 
-  self->fences[0].entry = self->trace[trace].entry;
-  self->fences[0].position = offset;
+  push_fence(self, trace, self->trace[trace].entry, offset);
 
-  int process = self->process_count - 1;
   int delta = 50;
   int time = self->trace[trace].time - 10;
 
-  fprintf(stderr,
-          "[fence] placing fence %d at trace position %d, file %s, offset %d\n",
-          self->fence_pos, trace, self->fences[self->fence_pos].entry->path,
-          self->fences[self->fence_pos].position);
-
-  int target_process = self->process_count - 1;
-  while (target_process >= 0 && self->processes[target_process].trace_len > trace)
-    target_process -= 1;
+  int target_process = find_restart_process(self, trace);
   int target_trace = target_process >= 0 ? self->processes[target_process].trace_len : -1;
-  while (trace > target_trace && self->fence_pos < 15)
+  while (trace > target_trace)
   {
-    if (self->trace[trace].time <= time && possible_fence(&self->trace[trace]))
+    // Skip the entries more recent than the next fence
+    if (self->trace[trace].time > time)
+    {
+      trace = trace_find_time(self, target_trace + 1, trace, time);
+      continue;
+    }
+    if (possible_fence(&self->trace[trace]))
     {
-      self->fence_pos += 1;
-      self->fences[self->fence_pos].entry = self->trace[trace].entry;
-      self->fences[self->fence_pos].position = self->trace[trace].seen;
-      if (self->fences[self->fence_pos].position == -1)
-        self->fences[self->fence_pos].position = 0;
+      push_fence(self, trace, self->trace[trace].entry,
+                 fz_maxi(0, self->trace[trace].seen));
       time -= delta;
       delta *= 2;
-      fprintf(stderr, "[fence] placing fence %d at trace position %d, file %s, offset %d\n",
-              self->fence_pos, trace,
-              self->fences[self->fence_pos].entry->path,
-              self->fences[self->fence_pos].position);
     }
     trace -= 1;
   }
@@ -993,27 +1440,454 @@ static int compute_fences(fz_context *ctx, TexEngine *self, int trace, int offse
   return trace;
 }
 
+// Persistent checkpoint of the output
+//
+// TeX processes cannot outlive the session: they are forks of one launched
+// at startup. What is saved instead is the output, keyed by the prefix of
+// the trace read before \begin{document}: the files TeX read up to there,
+// with the length read and a hash of those bytes. When the next session
+// starts with the same preamble, the saved pages are shown right away while
+// TeX typesets the document again, instead of waiting for the preamble.
+// Edits of the body don't prevent it: the pages are replaced as TeX
+// produces them.
+// Without a main .aux (not LaTeX), the key is everything TeX read.
+//
+// Payload: a uint32 count of files, then for each file its NUL-terminated
+// path, a uint32 length and a uint64 hash of its first length bytes, then
+// the DVI output.
+
+#define CHECKPOINT_KIND "output"
+#define CHECKPOINT_VERSION 2
+
+// Hash of the first len bytes of a file as seen by TeX, false if it has
+// none
+static bool entry_hash(fz_context *ctx, fileentry_t *e, size_t len, uint64_t *hash)
+{
+  fz_buffer *buf = e->edit_data ? textbuf_buffer(ctx, e->edit_data) : e->fs_data;
+  if (!buf || len > buf->len)
+    return 0;
+  *hash = tex_cache_hash(buf->data, len);
+  return 1;
+}
+
+// Set the seen offsets of the files back to trace position `to', or
+// forward again to position `from'. Each trace entry keeps the previous
+// offset of its file: exchanging them makes the walk reversible.
+static void rewind_seen(TexEngine *self, int from, int to)
+{
+  for (int i = from - 1; i >= to; --i)
+  {
+    trace_entry_t *t = &self->trace[i];
+    int seen = t->seen;
+    t->seen = t->entry->seen;
+    t->entry->seen = seen;
+  }
+}
+
+static void replay_seen(TexEngine *self, int from, int to)
+{
+  for (int i = from; i < to; ++i)
+  {
+    trace_entry_t *t = &self->trace[i];
+    int seen = t->seen;
+    t->seen = t->entry->seen;
+    t->entry->seen = seen;
+  }
+}
+
+static void save_checkpoint(fz_context *ctx, TexEngine *self)
+{
+  fz_buffer *data = output_data(self->st.document.entry);
+  int pages = incdvi_page_count(self->dvi);
+  if (!data || pages == 0)
+    return;
+
+  int bop, eop;
+  incdvi_page_offsets(self->dvi, pages - 1, &bop, &eop);
+  size_t len = fz_mini(eop + 1, data->len);
+
+  int trace_len = get_process(self)->trace_len;
+  int mark = self->checkpoint.preamble;
+  if (mark < 0 || mark > trace_len)
+    mark = trace_len;
+
+  fz_buffer *out = fz_new_buffer(ctx, len + 4096);
+  rewind_seen(self, trace_len, mark);
+  fz_try(ctx)
+  {
+    uint32_t count = 0;
+    fz_append_data(ctx, out, &count, sizeof(count));
+
+    fileentry_t *e;
+    bool ok = 1;
+    for (int index = 0; ok && (e = filesystem_scan(self->fs, &index));)
+    {
+      // Not open before the mark, or only served from the bundle
+      if (e->saved.level != FILE_READ || e->seen < 0 ||
+          (e->fs_stat.st_ino == 0 && !e->edit_data))
+        continue;
+      // Files that exist only in the editor cannot be checked at startup
+      uint32_t read = fz_mini(e->seen, entry_length(e));
+      uint64_t hash;
+      ok = e->fs_data && entry_hash(ctx, e, read, &hash);
+      if (ok)
+      {
+        fz_append_data(ctx, out, e->path, strlen(e->path) + 1);
+        fz_append_data(ctx, out, &read, sizeof(read));
+        fz_append_data(ctx, out, &hash, sizeof(hash));
+        count += 1;
+      }
+    }
+
+    if (ok)
+    {
+      memcpy(out->data, &count, sizeof(count));
+      fz_append_data(ctx, out, data->data, len);
+      tex_cache_store(CHECKPOINT_KIND, CHECKPOINT_VERSION,
+                      self->checkpoint.key, 0, out->data, out->len);
+      txp_info(TXP_LOG_ENGINE, "[checkpoint] saved %d pages, %d files%s\n",
+               pages, (int)count, mark < trace_len ? " of the preamble" : "");
+    }
+  }
+  fz_always(ctx)
+  {
+    replay_seen(self, mark, trace_len);
+    fz_drop_buffer(ctx, out);
+  }
+  fz_catch(ctx)
+    txp_warn(TXP_LOG_ENGINE, "[checkpoint] cannot save: %s\n",
+             fz_caught_message(ctx));
+}
+
+// Check that the part of a file read by the previous session is unchanged
+// on disk
+static bool checkpoint_file_valid(fz_context *ctx, TexEngine *self,
+                                  const char *path, uint32_t len, uint64_t hash)
+{
+  char buf[1024];
+  const char *fs_path = lookup_path(self, path, buf, NULL);
+  if (!fs_path)
+    return 0;
+
+  fz_buffer *data = NULL;
+  bool valid = 0;
+  fz_var(data);
+  fz_try(ctx)
+  {
+    data = fz_read_file(ctx, fs_path);
+    valid = len <= data->len && tex_cache_hash(data->data, len) == hash;
+  }
+  fz_always(ctx)
+    fz_drop_buffer(ctx, data);
+  fz_catch(ctx)
+    return 0;
+
+  return valid;
+}
+
+static void load_checkpoint(fz_context *ctx, TexEngine *self)
+{
+  tex_cache_entry entry;
+  if (!tex_cache_load(CHECKPOINT_KIND, CHECKPOINT_VERSION,
+                      self->checkpoint.key, 0, &entry))
+    return;
+
+  const char *p = (const char *)entry.data, *lim = p + entry.len;
+  uint32_t count;
+  bool ok = (size_t)(lim - p) >= sizeof(count);
+  if (ok)
+  {
+    memcpy(&count, p, sizeof(count));
+    p += sizeof(count);
+  }
+
+  for (uint32_t i = 0; ok && i < count; ++i)
+  {
+    const char *path = p;
+    const char *end = (const char *)memchr(p, 0, lim - p);
+    uint32_t len;
+    uint64_t hash;
+    ok = end && (size_t)(lim - end - 1) >= sizeof(len) + sizeof(hash);
+    if (!ok)
+      break;
+    memcpy(&len, end + 1, sizeof(len));
+    memcpy(&hash, end + 1 + sizeof(len), sizeof(hash));
+    p = end + 1 + sizeof(len) + sizeof(hash);
+    ok = checkpoint_file_valid(ctx, self, path, len, hash);
+    if (!ok)
+      txp_info(TXP_LOG_ENGINE, "[checkpoint] %s changed\n", path);
+  }
+
+  if (ok && p < lim)
+  {
+    self->checkpoint.data =
+      fz_new_buffer_from_copied_data(ctx, (const unsigned char *)p, lim - p);
+    // The bundle server is owned by self->dvi
+    self->checkpoint.dvi =
+      incdvi_new(ctx, dvi_borrow_hooks(bundle_server_hooks(self->bundle)));
+    incdvi_update(ctx, self->checkpoint.dvi, self->checkpoint.data);
+    self->checkpoint.pages = incdvi_page_count(self->checkpoint.dvi);
+    txp_info(TXP_LOG_ENGINE, "[checkpoint] showing %d pages of the last session\n",
+             self->checkpoint.pages);
+  }
+
+  tex_cache_release(&entry);
+}
+
+static void drop_checkpoint(fz_context *ctx, TexEngine *self)
+{
+  if (!self->checkpoint.dvi)
+    return;
+  incdvi_free(ctx, self->checkpoint.dvi);
+  fz_drop_buffer(ctx, self->checkpoint.data);
+  self->checkpoint.dvi = NULL;
+  self->checkpoint.data = NULL;
+  self->checkpoint.pages = 0;
+}
+
+// Persistent picture bounds
+//
+// Computing the bounds of a picture makes TeX open and parse the file, which
+// is slow for large PDFs. Bounds are saved at the end of the session with
+// the state of the file (inode, size and modification time) and restored
+// when the next session opens the file in the same state.
+//
+// Payload: a uint32 count of files, then for each file its NUL-terminated
+// path, a pic_stamp, a uint32 count of pictures and the pic_cache entries.
+
+#define PICTURES_KIND "pictures"
+#define PICTURES_VERSION 1
+
+typedef struct {
+  uint64_t ino, size;
+  int64_t sec, nsec;
+} pic_stamp;
+
+static pic_stamp stat_stamp(struct stat *st)
+{
+  pic_stamp s;
+  memset(&s, 0, sizeof(s));
+  s.ino = st->st_ino;
+  s.size = st->st_size;
+#ifndef __APPLE__
+  s.sec = st->st_mtim.tv_sec;
+  s.nsec = st->st_mtim.tv_nsec;
+#else
+  s.sec = st->st_mtimespec.tv_sec;
+  s.nsec = st->st_mtimespec.tv_nsec;
+#endif
+  return s;
+}
+
+// Length of the record starting at path, 0 if it does not fit before lim
+static size_t picture_record_len(const char *path, const char *lim)
+{
+  const char *end = (const char *)memchr(path, 0, lim - path);
+  if (!end)
+    return 0;
+  size_t len = end + 1 - path;
+  uint32_t count;
+  if ((size_t)(lim - path) < len + sizeof(pic_stamp) + sizeof(count))
+    return 0;
+  memcpy(&count, path + len + sizeof(pic_stamp), sizeof(count));
+  len += sizeof(pic_stamp) + sizeof(count);
+  if ((size_t)(lim - path - len) / sizeof(pic_cache) < count)
+    return 0;
+  return len + count * sizeof(pic_cache);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void load_pictures(fz_context *ctx, TexEngine *self)
+{
+  tex_cache_entry entry;
+  if (!tex_cache_load(PICTURES_KIND, PICTURES_VERSION,
+                      self->checkpoint.key, 0, &entry))
+    return;
+
+  // A record has at least a path terminator, a stamp and a count
+  const size_t min_record = 1 + sizeof(pic_stamp) + sizeof(uint32_t);
+  uint32_t count = 0;
+  if (entry.len >= sizeof(count))
+    memcpy(&count, entry.data, sizeof(count));
+
+  if (count == 0 || count > (entry.len - sizeof(count)) / min_record)
+  {
+    if (entry.len > sizeof(count))
+      txp_warn(TXP_LOG_ENGINE, "[pictures] ignoring invalid cache\n");
+    tex_cache_release(&entry);
+    return;
+  }
+
+  fz_buffer *data = NULL;
+  const char **index = NULL;
+  fz_var(data);
+  fz_var(index);
+  fz_try(ctx)
+  {
+    data = fz_new_buffer_from_copied_data(
+      ctx, (const unsigned char *)entry.data + sizeof(count),
+      entry.len - sizeof(count));
+    index = fz_malloc_array(ctx, count, const char *);
+    const char *p = (const char *)data->data, *lim = p + data->len;
+    int n = 0;
+    size_t len;
+    while (n < (int)count && p < lim && (len = picture_record_len(p, lim)))
+    {
+      index[n++] = p;
+      p += len;
+    }
+    qsort(index, n, sizeof(const char *), compare_paths);
+    self->pictures.data = data;
+    self->pictures.index = index;
+    self->pictures.count = n;
+    txp_info(TXP_LOG_ENGINE, "[pictures] loaded bounds of %d files\n", n);
+  }
+  fz_always(ctx)
+    tex_cache_release(&entry);
+  fz_catch(ctx)
+  {
+    // Behave as if there was no cache
+    fz_drop_buffer(ctx, data);
+    fz_free(ctx, index);
+    txp_warn(TXP_LOG_ENGINE, "[pictures] cannot load cache: %s\n",
+             fz_caught_message(ctx));
+  }
+}
+
+// Restore the bounds of the pictures of e if the file did not change
+static void restore_pictures(fz_context *ctx, TexEngine *self, fileentry_t *e)
+{
+  if (self->pictures.count == 0 || e->fs_stat.st_ino == 0)
+    return;
+
+  const char *path = e->path;
+  const char **rec = (const char **)
+    bsearch(&path, self->pictures.index, self->pictures.count,
+            sizeof(const char *), compare_paths);
+  if (!rec)
+    return;
+
+  const char *p = *rec + strlen(*rec) + 1;
+  pic_stamp saved, actual = stat_stamp(&e->fs_stat);
+  memcpy(&saved, p, sizeof(saved));
+  if (memcmp(&saved, &actual, sizeof(saved)) != 0)
+    return;
+  p += sizeof(saved);
+
+  uint32_t count;
+  memcpy(&count, p, sizeof(count));
+  p += sizeof(count);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    pic_cache pic;
+    memcpy(&pic, p + i * sizeof(pic), sizeof(pic));
+    fileentry_add_pic(ctx, e, &pic);
+  }
+  txp_debug(TXP_LOG_ENGINE, "[pictures] restored %d pictures of %s\n",
+            (int)count, e->path);
+}
+
+static void save_pictures(fz_context *ctx, TexEngine *self)
+{
+  fz_buffer *out = fz_new_buffer(ctx, 4096);
+  fz_try(ctx)
+  {
+    uint32_t count = 0;
+    fz_append_data(ctx, out, &count, sizeof(count));
+
+    fileentry_t *e;
+    for (int index = 0; (e = filesystem_scan(self->fs, &index));)
+    {
+      if (e->pics.len == 0 || e->fs_stat.st_ino == 0 || e->edit_data)
+        continue;
+      pic_stamp stamp = stat_stamp(&e->fs_stat);
+      uint32_t pics = e->pics.len;
+      fz_append_data(ctx, out, e->path, strlen(e->path) + 1);
+      fz_append_data(ctx, out, &stamp, sizeof(stamp));
+      fz_append_data(ctx, out, &pics, sizeof(pics));
+      fz_append_data(ctx, out, e->pics.entries, pics * sizeof(pic_cache));
+      count += 1;
+    }
+
+    // Keep the bounds of the files that this session did not open
+    const char *lim = self->pictures.data
+      ? (const char *)self->pictures.data->data + self->pictures.data->len
+      : NULL;
+    for (int i = 0; i < self->pictures.count; ++i)
+    {
+      const char *path = self->pictures.index[i];
+      e = filesystem_lookup(self->fs, path);
+      if (e && e->fs_stat.st_ino != 0)
+        continue;
+      fz_append_data(ctx, out, path, picture_record_len(path, lim));
+      count += 1;
+    }
+
+    memcpy(out->data, &count, sizeof(count));
+    if (count > 0)
+      tex_cache_store(PICTURES_KIND, PICTURES_VERSION,
+                      self->checkpoint.key, 0, out->data, out->len);
+  }
+  fz_always(ctx)
+    fz_drop_buffer(ctx, out);
+  fz_catch(ctx)
+    txp_warn(TXP_LOG_ENGINE, "[pictures] cannot save: %s\n",
+             fz_caught_message(ctx));
+}
+
+static void drop_pictures(fz_context *ctx, TexEngine *self)
+{
+  fz_drop_buffer(ctx, self->pictures.data);
+  fz_free(ctx, self->pictures.index);
+  self->pictures.data = NULL;
+  self->pictures.index = NULL;
+  self->pictures.count = 0;
+}
+
 int txp::TexEngine::page_count()
 {
-  return incdvi_page_count(this->dvi);
+  return fz_maxi(incdvi_page_count(this->dvi), this->checkpoint.pages);
 }
 
 fz_display_list *txp::TexEngine::render_page(int page)
 {
-  float pw, ph;
-  bool landscape;
+  // Pages TeX did not produce yet are taken from the checkpoint
+  if (this->checkpoint.dvi && page >= incdvi_page_count(this->dvi))
+    return incdvi_display_list(&this->ctx, this->checkpoint.dvi,
+                               this->checkpoint.data, page);
+
   fz_buffer *data = this->st.document.entry->saved.data;
-  incdvi_page_dim(this->dvi, data, page, &pw, &ph, &landscape);
-
-  fz_rect box = fz_make_rect(0, 0, pw, ph);
-  fz_display_list *dl = fz_new_display_list(&this->ctx, box);
-  fz_device *dev = fz_new_list_device(&this->ctx, dl);
-  incdvi_render_page(&this->ctx, this->dvi, data, page, dev);
-  fz_close_device(&this->ctx, dev);
-  fz_drop_device(&this->ctx, dev);
+
+  // Reuse the page from the cache or from the background workers if they
+  // already rendered it, otherwise render it now.
+  fz_display_list *dl =
+    incdvi_cached_display_list(&this->ctx, this->dvi, data, page);
+  if (!dl)
+  {
+    dl = prerender_take(&this->ctx, this->prerender, this->dvi, page);
+    if (dl)
+      incdvi_cache_display_list(&this->ctx, this->dvi, data, page, dl);
+    else
+      dl = incdvi_display_list(&this->ctx, this->dvi, data, page);
+  }
+
+  prerender_schedule(&this->ctx, this->prerender, this->dvi, data, page);
   return dl;
 }
 
+int txp::TexEngine::query_fd()
+{
+  // Once TeX is done its channel is not waited on: it may stay readable
+  // (end of file) and changes come from the UI
+  if (this->process_count == 0 || this->get_status() != DOC_RUNNING)
+    return -1;
+  return get_process(this)->fd;
+}
+
 bool txp::TexEngine::step(bool restart_if_needed)
 {
   if (restart_if_needed)
@@ -1024,11 +1898,23 @@ bool txp::TexEngine::step(bool restart_if_needed)
     int fd = get_process(this)->fd;
     if (fd == -1) return 0;
     this->c->set_fd(fd);
-    if (!this->c->has_pending_query(10)) return 0;
+    // Don't block: callers wait for query_fd() to become readable
+    if (!this->c->has_pending_query(0)) return 0;
     try {
-      query::data q = read_query(this, this->c).value();
-      answer_query(&this->ctx, this, q);
+      // Answer all the queries that were already received before flushing:
+      // TeX does not wait for answers to SEEN and can send several queries
+      // in a row.
+      do {
+        query::data q = read_query(this, this->c).value();
+        answer_query(&this->ctx, this, q);
+      } while (get_process(this)->fd == fd && this->c->has_buffered_query());
       this->c->flush(fd);
+      // TeX caught up with the saved output, or finished with fewer pages
+      // (the body changed since)
+      if (this->checkpoint.dvi &&
+          (incdvi_page_count(this->dvi) >= this->checkpoint.pages ||
+           this->get_status() != DOC_RUNNING))
+        drop_checkpoint(&this->ctx, this);
       return 1;
     } catch (...) {
       close(fd);
@@ -1047,7 +1933,7 @@ static int scan_entry(fz_context *ctx, TexEngine *self, fileentry_t *e)
 
   struct stat st;
 
-  fprintf(stderr, "[scan] scanning %s\n", e->path);
+  txp_debug(TXP_LOG_ENGINE, "[scan] scanning %s\n", e->path);
 
   const char *inclusion_path = self->inclusion_path;
   char fs_path_buffer[1024];
@@ -1055,54 +1941,24 @@ static int scan_entry(fz_context *ctx, TexEngine *self, fileentry_t *e)
 
   if (!fs_path)
   {
-      fprintf(stderr, "[scan] file removed\n");
+      txp_debug(TXP_LOG_ENGINE, "[scan] file removed\n");
       return -1;
   }
 
+  // Re-arm the watch if the file was replaced
+  if (self->watcher)
+    watcher_add(ctx, self->watcher, e, fs_path);
+
   if (stat_same(&st, &e->fs_stat))
     return -1;
 
   e->fs_stat = st;
-  fprintf(stderr, "[scan] file %s has changed\n", e->path);
-
-  fz_buffer *buf;
-  fz_var(buf);
-
-  fz_try(ctx)
-  {
-    buf = fz_read_file(ctx, fs_path);
-  }
-  fz_catch(ctx)
-  {
-    return -1;
-  }
-
-  e->pic_cache.type = -1;
-
-  int olen = e->fs_data->len, nlen = buf->len;
-  int len = olen < nlen ? olen : nlen;
-
-  int i = 0;
-  while (i < len && e->fs_data->data[i] == buf->data[i])
-    i += 1;
-
-  if (i != len)
-    fprintf(stderr, "[scan] first changed byte is %d\n", i);
-  else if (olen == nlen)
-  {
-    fprintf(stderr, "[scan] but content has not changed\n");
-    fz_drop_buffer(ctx, buf);
-    return -1;
-  }
-  else if (olen < nlen)
-    fprintf(stderr, "[scan] content has grown from %d to %d bytes\n", olen, nlen);
-  else
-    fprintf(stderr, "[scan] content was shrinked from %d to %d bytes\n", olen, nlen);
+  txp_debug(TXP_LOG_ENGINE, "[scan] file %s has changed\n", e->path);
 
-  fz_drop_buffer(ctx, e->fs_data);
-  e->fs_data = buf;
-
-  return i;
+  int changed = fileentry_reload(ctx, e, fs_path);
+  if (changed > -1)
+    e->pics.len = 0;
+  return changed;
 }
 
 #define NOT_IN_TRANSACTION (-2)
@@ -1148,8 +2004,8 @@ static bool rollback_end(fz_context *ctx, TexEngine *self, int *tracep, int *off
       self->rollback.offset = self->trace[trace_len].seen;
   }
 
-  fprintf(stderr, "[change] rewinded trace from %d to %d entries\n",
-          get_process(self)->trace_len, trace_len);
+  txp_info(TXP_LOG_ENGINE, "[change] rewinded trace from %d to %d entries\n",
+           get_process(self)->trace_len, trace_len);
 
   if (tracep)
     *tracep = trace_len;
@@ -1182,7 +2038,7 @@ static bool process_pending_messages(fz_context *ctx, TexEngine *self)
   do {
     if (!self->c->has_pending_query(10))
     {
-      fprintf(stderr, "[kill] worker might be stuck, killing\n");
+      txp_info(TXP_LOG_ENGINE, "[kill] worker might be stuck, killing\n");
       // The process hasn't answered in 10ms
       // It might be stuck in long computation or a loop, kill it to start from the previous one.
       close_process(p);
@@ -1222,6 +2078,8 @@ static void rollback_add_change(fz_context *ctx, TexEngine *self, fileentry_t *e
   if (trace_len == NOT_IN_TRANSACTION)
     mabort();
 
+  record_edit(self, e, changed);
+
   if (e->seen < changed && trace_len == get_process(self)->trace_len)
   {
     if (process_pending_messages(ctx, self))
@@ -1242,13 +2100,13 @@ static void rollback_add_change(fz_context *ctx, TexEngine *self, fileentry_t *e
 
   if (self->trace[trace_len].entry != e)
   {
-    fprintf(stderr, "Rollback position: %d. Entries: %d. Seen: %d. Changed: %d. Last trace entries:\n", trace_len, get_process(self)->trace_len, e->seen, changed);
+    txp_error(TXP_LOG_ENGINE, "Rollback position: %d. Entries: %d. Seen: %d. Changed: %d. Last trace entries:\n", trace_len, get_process(self)->trace_len, e->seen, changed);
     for (int i = get_process(self)->trace_len - 1, j = fz_maxi(i - 10, 0); i > j; i--)
     {
-      fprintf(stderr, "- %s@%d, %dms\n",
-              self->trace[i].entry->path,
-              self->trace[i].seen,
-              self->trace[i].time);
+      txp_error(TXP_LOG_ENGINE, "- %s@%d, %dms\n",
+                self->trace[i].entry->path,
+                self->trace[i].seen,
+                self->trace[i].time);
     }
     mabort();
   }
@@ -1270,6 +2128,19 @@ void txp::TexEngine::begin_changes()
 void txp::TexEngine::detect_changes()
 {
   fileentry_t *e;
+
+  // Only look at files that were notified or could not be watched
+  if (this->watcher && watcher_poll(this->watcher))
+  {
+    for (int index = 0; (e = watcher_scan(this->watcher, &index));)
+    {
+      int changed = scan_entry(&this->ctx, this, e);
+      if (changed > -1)
+        rollback_add_change(&this->ctx, this, e, changed);
+    }
+    return;
+  }
+
   for (int index = 0; (e = filesystem_scan(this->fs, &index));)
   {
     int changed = scan_entry(&this->ctx, this, e);
@@ -1284,8 +2155,13 @@ bool txp::TexEngine::end_changes()
 
   if (!rollback_end(&this->ctx, this, &reverted, &offset)) return false;
 
+  // The saved output no longer matches the files
+  drop_checkpoint(&this->ctx, this);
+
+  uint64_t start = latency_now();
   trace = reverted >= 0 ? compute_fences(&this->ctx, this, reverted, offset) : 0;
   rollback_processes(&this->ctx, this, reverted, trace);
+  latency_span("rollback", start);
 
   return true;
 }
@@ -1304,7 +2180,7 @@ float txp::TexEngine::scale_factor()
 synctex_t *txp::TexEngine::synctex(fz_buffer **buf)
 {
   if (buf)
-    *buf = this->st.synctex.entry ? entry_data(this->st.synctex.entry) : NULL;
+    *buf = this->st.synctex.entry ? output_data(this->st.synctex.entry) : NULL;
   return this->stex;
 }
 
@@ -1317,26 +2193,56 @@ txp::TexEngine::TexEngine(fz_context &ctx,
                           const char *tectonic_path,
                           const char *inclusion_path,
                           const char *tex_dir,
-                          const char *tex_name): ctx(ctx)
+                          const char *tex_name,
+                          size_t snapshot_budget): ctx(ctx)
 {
   this->name = fz_strdup(&ctx, tex_name);
   this->tectonic_path = fz_strdup(&ctx, tectonic_path);
   this->inclusion_path = fz_strdup(&ctx, inclusion_path ? inclusion_path : "");
   state_init(&this->st);
   this->fs = filesystem_new(&ctx);
+  this->watcher = watcher_new(&ctx);
   this->log = log_new(&ctx);
   this->trace = NULL;
   this->trace_cap = 0;
+  this->fences = NULL;
   this->fence_pos = -1;
+  this->fence_cap = 0;
+  this->edit_count = 0;
+  this->snapshot_edit = -1;
+  this->snapshot_budget = snapshot_budget;
+  this->measure_next = 0;
+  this->replay.count = 0;
+  this->replay.max = 0;
+  this->replay.total = 0;
+  this->replay.output = 0;
   this->restart = log_snapshot(&ctx, this->log);
   this->c = new Channel();
   this->process_count = 0;
+  this->standby.fd = -1;
 
   this->bundle = bundle_server_start(&ctx, tectonic_path, tex_dir);
   this->dvi = incdvi_new(&ctx, bundle_server_hooks(this->bundle));
+  this->prerender = prerender_new(&ctx, bundle_server_hooks(this->bundle));
 
   this->stex = synctex_new(&ctx);
   this->rollback.trace_len = NOT_IN_TRANSACTION;
 
+  {
+    char key[2048];
+    int n = snprintf(key, sizeof(key), "%s%c%s%c%s", tectonic_path, 0,
+                     tex_dir, 0, tex_name);
+    this->checkpoint.key = tex_cache_hash(key, fz_clampi(n, 0, sizeof(key) - 1));
+    this->checkpoint.dvi = NULL;
+    this->checkpoint.data = NULL;
+    this->checkpoint.pages = 0;
+    this->checkpoint.preamble = -1;
+    load_checkpoint(&ctx, this);
+    this->pictures.data = NULL;
+    this->pictures.index = NULL;
+    this->pictures.count = 0;
+    load_pictures(&ctx, this);
+  }
+
   signal(SIGCHLD, SIG_IGN);
 }
@@ -23,27 +23,23 @@
  */
 
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include "state.h"
 #include "mupdf_compat.h"
 #include "dvi/fz_util.h"
+#include "txp_log.h"
+#include "txp_memstat.h"
+#include "txp_memdiff.h"
 
-static unsigned long
-sdbm_hash(const unsigned char *str)
-{
-  unsigned long hash = 0;
-  int c;
-
-  while ((c = *str++))
-    hash = c + (hash << 6) + (hash << 16) - hash;
-
-  return hash * 2654435761;
-}
-
-#define str_hash sdbm_hash
 
+// Open-addressing table of entries, cells keep the hash and length of the
+// path so that most mismatches are rejected without touching the entry
 typedef struct
 {
   unsigned long hash;
+  int len;
   fileentry_t *entry;
 } tablecell;
 
@@ -51,6 +47,10 @@ struct filesystem_s
 {
   int count, cap;
   tablecell *table;
+
+  // Entries in creation order, for scanning
+  fileentry_t **entries;
+  int entries_cap;
 };
 
 static const char *normalize_path(const char *path)
@@ -89,21 +89,21 @@ filesystem_t *filesystem_new(fz_context *ctx)
 
 void filesystem_free(fz_context *ctx, filesystem_t *fs)
 {
-  int cap = fs->cap;
-  for (int i = 0; i < cap; ++i)
+  for (int i = 0; i < fs->count; ++i)
   {
-    fileentry_t *e = fs->table[i].entry;
-    if (!e)
-      continue;
+    fileentry_t *e = fs->entries[i];
     if (e->fs_data)
       fz_drop_buffer(ctx, e->fs_data);
+    fz_free(ctx, e->fs_hashes);
+    fz_free(ctx, e->pics.entries);
     if (e->edit_data)
-      fz_drop_buffer(ctx, e->edit_data);
+      textbuf_free(ctx, e->edit_data);
     if (e->saved.data)
       fz_drop_buffer(ctx, e->saved.data);
     fz_free(ctx, (void *)e->path);
-    fz_free(ctx, fs->table[i].entry);
+    fz_free(ctx, e);
   }
+  fz_free(ctx, fs->entries);
   fz_free(ctx, fs->table);
   fz_free(ctx, fs);
 }
@@ -111,17 +111,20 @@ void filesystem_free(fz_context *ctx, filesystem_t *fs)
 static tablecell *table_get(int cap, tablecell *table, const char *path)
 {
   unsigned long mask = cap - 1;
-  unsigned long hash = str_hash((const unsigned char*)path);
+  int len;
+  unsigned long hash = sdbm_hash_string(path, &len);
 
-  int index = hash & mask;
+  int index = hash_bucket(hash, cap);
 
   while (table[index].entry)
   {
-    if (table[index].hash == hash && strcmp(table[index].entry->path, path) == 0)
+    if (table[index].hash == hash && table[index].len == len &&
+        memcmp(table[index].entry->path, path, len) == 0)
       break;
     index = (index + 1) & mask;
   }
   table[index].hash = hash;
+  table[index].len = len;
   return &table[index];
 }
 
@@ -134,10 +137,10 @@ static tablecell *table_resize(fz_context *ctx, int oldcap, tablecell *oldtab, i
     if (!oldtab[i].entry)
       continue;
     tablecell cell = oldtab[i];
-    int index = cell.hash & mask;
+    int index = hash_bucket(cell.hash, newcap);
     while (newtab[index].entry)
     {
-      if ((cell.hash & mask) < (newtab[index].hash & mask))
+      if (hash_bucket(cell.hash, newcap) < hash_bucket(newtab[index].hash, newcap))
       {
         tablecell tmp = newtab[index];
         newtab[index] = cell;
@@ -167,10 +170,17 @@ fileentry_t *filesystem_lookup_or_create(fz_context *ctx, filesystem_t *fs, cons
   entry->path = fz_strdup(ctx, path);
   entry->saved.level = FILE_NONE;
   entry->seen = -1;
-  entry->pic_cache.type = -1;
   entry->fs_stat.st_ino = 0;
   cell->entry = entry;
 
+  if (fs->count == fs->entries_cap)
+  {
+    fs->entries_cap = fs->entries_cap == 0 ? 64 : fs->entries_cap * 2;
+    fs->entries = (fileentry_t **)
+      fz_realloc(ctx, fs->entries, fs->entries_cap * sizeof(fileentry_t *));
+  }
+  fs->entries[fs->count] = entry;
+
   fs->count += 1;
   if (fs->count * 4 >= fs->cap * 3)
   {
@@ -186,12 +196,195 @@ fileentry_t *filesystem_lookup_or_create(fz_context *ctx, filesystem_t *fs, cons
 
 fileentry_t *filesystem_scan(filesystem_t *fs, int *index)
 {
-  while (*index < fs->cap)
+  if (*index >= fs->count)
+    return NULL;
+  return fs->entries[(*index)++];
+}
+
+// Hash one chunk of data, eight bytes at a time. The length is part of the
+// seed, so a truncated chunk never matches the full one.
+static uint64_t chunk_hash(const unsigned char *data, size_t len)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8)
   {
-    int i = *index;
-    *index += 1;
-    if (fs->table[i].entry)
-      return fs->table[i].entry;
+    uint64_t w;
+    memcpy(&w, data + i, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  for (; i < len; ++i)
+    h = (h ^ data[i]) * 0x100000001b3ULL;
+
+  return h ^ (h >> 29);
+}
+
+static int chunk_count(size_t len)
+{
+  return (len + FS_HASH_CHUNK - 1) / FS_HASH_CHUNK;
+}
+
+static uint64_t *hash_buffer(fz_context *ctx, fz_buffer *buf)
+{
+  int count = chunk_count(buf->len);
+  uint64_t *hashes = fz_malloc_struct_array(ctx, count + 1, uint64_t);
+  for (int i = 0; i < count; ++i)
+  {
+    size_t start = (size_t)i * FS_HASH_CHUNK;
+    size_t len = fz_mini(FS_HASH_CHUNK, buf->len - start);
+    hashes[i] = chunk_hash(buf->data + start, len);
+  }
+  return hashes;
+}
+
+// Read a whole chunk, unless the end of file is reached
+static ssize_t read_chunk(int fd, unsigned char *data)
+{
+  ssize_t total = 0;
+  while (total < FS_HASH_CHUNK)
+  {
+    ssize_t n = read(fd, data + total, FS_HASH_CHUNK - total);
+    if (n == 0)
+      break;
+    if (n < 0)
+      return -1;
+    total += n;
+  }
+  return total;
+}
+
+int fileentry_reload(fz_context *ctx, fileentry_t *e, const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    st.st_size = 0;
+
+  fz_ptr(fz_buffer, buf);
+  fz_ptr(uint64_t, hashes);
+  int first = -1, count = 0, failed = 0;
+  int tag = txp_mem_enter(TXP_MEM_FILES);
+
+  fz_try(ctx)
+  {
+    // Hashes of the previous contents are computed the first time a file
+    // changes, so that files that are never modified do not pay for them
+    if (!e->fs_hashes)
+      e->fs_hashes = hash_buffer(ctx, e->fs_data);
+
+    int old_count = chunk_count(e->fs_data->len);
+    int cap = chunk_count(st.st_size) + 1;
+    buf = fz_new_buffer(ctx, (size_t)cap * FS_HASH_CHUNK);
+    hashes = fz_malloc_struct_array(ctx, cap, uint64_t);
+
+    // Hash each chunk while it is still hot, and compare hashes rather
+    // than contents
+    while (1)
+    {
+      if (buf->cap - buf->len < FS_HASH_CHUNK)
+        fz_resize_buffer(ctx, buf, buf->cap * 2);
+      if (count == cap)
+      {
+        cap *= 2;
+        hashes = (uint64_t *)fz_realloc(ctx, hashes, cap * sizeof(uint64_t));
+      }
+
+      ssize_t n = read_chunk(fd, buf->data + buf->len);
+      if (n < 0)
+      {
+        failed = 1;
+        break;
+      }
+      if (n == 0)
+        break;
+
+      hashes[count] = chunk_hash(buf->data + buf->len, n);
+      if (first == -1 &&
+          (count >= old_count || hashes[count] != e->fs_hashes[count]))
+        first = count;
+      buf->len += n;
+      count += 1;
+    }
+  }
+  fz_always(ctx)
+  {
+    txp_mem_leave(tag);
+  }
+  fz_catch(ctx)
+  {
+    failed = 1;
+  }
+
+  close(fd);
+
+  size_t olen = e->fs_data->len, nlen = buf ? buf->len : 0;
+  if (!failed && first == -1 && olen == nlen)
+  {
+    txp_debug(TXP_LOG_ENGINE, "[scan] but content has not changed\n");
+    failed = 1;
+  }
+
+  if (failed)
+  {
+    fz_drop_buffer(ctx, buf);
+    fz_free(ctx, hashes);
+    return -1;
+  }
+
+  // Locate the first changed byte in the first changed chunk, or where the
+  // contents were truncated
+  size_t len = fz_mini(olen, nlen);
+  size_t i = first == -1 ? len : (size_t)first * FS_HASH_CHUNK;
+  if (i < len)
+    i += txp_memdiff(e->fs_data->data + i, buf->data + i, len - i);
+
+  if (i != len)
+    txp_debug(TXP_LOG_ENGINE, "[scan] first changed byte is %d\n", (int)i);
+  else if (olen < nlen)
+    txp_debug(TXP_LOG_ENGINE, "[scan] content has grown from %d to %d bytes\n",
+              (int)olen, (int)nlen);
+  else
+    txp_debug(TXP_LOG_ENGINE, "[scan] content was shrinked from %d to %d bytes\n",
+              (int)olen, (int)nlen);
+
+  fz_drop_buffer(ctx, e->fs_data);
+  fz_free(ctx, e->fs_hashes);
+  e->fs_data = buf;
+  e->fs_hashes = hashes;
+
+  return i;
+}
+
+const pic_cache *fileentry_find_pic(fileentry_t *e, int type, int page)
+{
+  for (int i = 0; i < e->pics.len; ++i)
+  {
+    pic_cache *pic = &e->pics.entries[i];
+    if (pic->type == type && pic->page == page)
+      return pic;
   }
   return NULL;
 }
+
+void fileentry_add_pic(fz_context *ctx, fileentry_t *e, const pic_cache *pic)
+{
+  pic_cache *old = (pic_cache *)fileentry_find_pic(e, pic->type, pic->page);
+  if (old)
+  {
+    *old = *pic;
+    return;
+  }
+
+  if (e->pics.len == e->pics.cap)
+  {
+    e->pics.cap = e->pics.cap ? e->pics.cap * 2 : 4;
+    e->pics.entries = (pic_cache *)
+      fz_realloc(ctx, e->pics.entries, e->pics.cap * sizeof(pic_cache));
+  }
+  e->pics.entries[e->pics.len++] = *pic;
+}
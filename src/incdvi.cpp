@@ -28,6 +28,23 @@
 #include "mydvi.h"
 #include "mydvi_interp.h"
 #include "mydvi_opcodes.h"
+#include "txp_memstat.h"
+#include "dvi/fz_util.h"
+
+// Display lists are cached up to an estimated memory budget.
+// Their actual size is not exposed by mupdf, it is approximated from the
+// length of the DVI code of the page.
+#define INCDVI_CACHE_BUDGET (64 * 1024 * 1024)
+#define INCDVI_CACHE_COST(bop, eop) (1024 + 8 * (size_t)((eop) - (bop)))
+
+typedef struct
+{
+  int page, bop, eop;
+  unsigned long hash;
+  fz_display_list *dl;
+  size_t size;
+  unsigned long last_use;
+} dlcache_entry;
 
 struct incdvi_s
 {
@@ -35,7 +52,29 @@ struct incdvi_s
   int fontdef_offset;
   int page_len, page_cap;
   int *pages;
+
+  // Hash of the font definitions that precede each entry of pages
+  unsigned long *fonthashes;
+  unsigned long fonthash;
+
+  // Hash of the DVI bytes between the previous entry of pages and this one.
+  // Entries between page_len and page_known were indexed before a
+  // truncation: if the new output hashes the same, they are reused without
+  // scanning the instructions again.
+  unsigned long *spanhashes;
+  int page_known;
+
   dvi_context *dc;
+
+  // Display lists of rendered pages, keyed by the hash of the DVI code.
+  // Pages that are output again with the same contents after a rollback are
+  // not interpreted again.
+  struct {
+    dlcache_entry *entries;
+    int len, cap;
+    size_t size, budget;
+    unsigned long clock;
+  } cache;
 };
 
 static int add_page(fz_context *ctx, incdvi_t *d)
@@ -43,19 +82,23 @@ static int add_page(fz_context *ctx, incdvi_t *d)
   int result = d->page_len;
   if (result == d->page_cap)
   {
-    if (d->page_cap == 0)
+    int cap = d->page_cap == 0 ? 8 : d->page_cap * 2;
+    int *pages = fz_malloc_struct_array(ctx, cap, int);
+    unsigned long *fonthashes = fz_malloc_struct_array(ctx, cap, unsigned long);
+    unsigned long *spanhashes = fz_malloc_struct_array(ctx, cap, unsigned long);
+    if (d->page_cap > 0)
     {
-      d->pages = fz_malloc_struct_array(ctx, 8, int);
-      d->page_cap = 8;
-    }
-    else
-    {
-      int *pages = fz_malloc_struct_array(ctx, d->page_cap * 2, int);
       memcpy(pages, d->pages, sizeof(int) * d->page_cap);
+      memcpy(fonthashes, d->fonthashes, sizeof(unsigned long) * d->page_cap);
+      memcpy(spanhashes, d->spanhashes, sizeof(unsigned long) * d->page_cap);
       fz_free(ctx, d->pages);
-      d->pages = pages;
-      d->page_cap = d->page_cap * 2;
+      fz_free(ctx, d->fonthashes);
+      fz_free(ctx, d->spanhashes);
     }
+    d->pages = pages;
+    d->fonthashes = fonthashes;
+    d->spanhashes = spanhashes;
+    d->page_cap = cap;
   }
   d->page_len += 1;
   return result;
@@ -65,6 +108,7 @@ incdvi_t *incdvi_new(fz_context *ctx, dvi_reshooks hooks)
 {
   incdvi_t *d = fz_malloc_struct(ctx, incdvi_t);
   d->dc = dvi_context_new(ctx, hooks);
+  d->cache.budget = INCDVI_CACHE_BUDGET;
   return d;
 }
 
@@ -72,6 +116,14 @@ void incdvi_free(fz_context *ctx, incdvi_t *d)
 {
   if (d->pages)
     fz_free(ctx, d->pages);
+  if (d->fonthashes)
+    fz_free(ctx, d->fonthashes);
+  if (d->spanhashes)
+    fz_free(ctx, d->spanhashes);
+  for (int i = 0; i < d->cache.len; ++i)
+    fz_drop_display_list(ctx, d->cache.entries[i].dl);
+  if (d->cache.entries)
+    fz_free(ctx, d->cache.entries);
   dvi_context_free(ctx, d->dc);
   fz_free(ctx, d);
 }
@@ -81,6 +133,81 @@ void incdvi_reset(incdvi_t *d)
   d->offset = 0;
   d->fontdef_offset = 0;
   d->page_len = 0;
+  d->page_known = 0;
+  d->fonthash = 0;
+}
+
+// Record the page boundary (BOP or EOP) at d->offset.
+// Return true if it matches the entry indexed before the last truncation.
+static bool index_boundary(fz_context *ctx, incdvi_t *d, fz_buffer *buf)
+{
+  int page = add_page(ctx, d);
+  if (!(page & 1) != (buf->data[d->offset] == BOP))
+    abort();
+
+  unsigned long span = 0;
+  if (page > 0)
+  {
+    int prev = d->pages[page - 1];
+    span = sdbm_hash(0, buf->data + prev, d->offset - prev);
+  }
+
+  bool known = page < d->page_known &&
+               d->pages[page] == d->offset &&
+               d->fonthashes[page] == d->fonthash &&
+               d->spanhashes[page] == span;
+  if (!known)
+    d->page_known = page + 1;
+
+  d->pages[page] = d->offset;
+  d->fonthashes[page] = d->fonthash;
+  d->spanhashes[page] = span;
+  return known;
+}
+
+// Reuse the entries following a known one as long as the bytes that lead
+// to them are present and unchanged.
+static void skip_known_pages(incdvi_t *d, fz_buffer *buf)
+{
+  int len = buf->len;
+  while (d->page_len < d->page_known)
+  {
+    int prev = d->pages[d->page_len - 1];
+    int next = d->pages[d->page_len];
+    int size = (d->page_len & 1) ? 1 : 45;
+    if (next + size > len)
+      break;
+    if (buf->data[next] != ((d->page_len & 1) ? EOP : BOP))
+      break;
+    if (sdbm_hash(0, buf->data + prev, next - prev) != d->spanhashes[d->page_len])
+      break;
+    d->fonthash = d->fonthashes[d->page_len];
+    d->page_len += 1;
+    d->offset = next + size;
+  }
+}
+
+void incdvi_truncate(incdvi_t *d, int len)
+{
+  if (d->offset <= len)
+    return;
+
+  while (d->page_len > 0 && d->pages[d->page_len - 1] >= len)
+    d->page_len -= 1;
+  if (d->page_len == 0)
+  {
+    d->offset = 0;
+    d->fonthash = 0;
+  }
+  else
+  {
+    d->page_len -= 1;
+    d->offset = d->pages[d->page_len];
+    d->fonthash = d->fonthashes[d->page_len];
+  }
+
+  if (d->fontdef_offset > d->offset)
+    d->fontdef_offset = d->offset;
 }
 
 void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf)
@@ -94,17 +221,7 @@ void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf)
   int len = buf->len;
 
   if (d->offset > len)
-  {
-    while (d->page_len > 0 && d->pages[d->page_len - 1] >= len)
-      d->page_len -= 1;
-    if (d->page_len == 0)
-      d->offset = 0;
-    else
-    {
-      d->page_len -= 1;
-      d->offset = d->pages[d->page_len];
-    }
-  }
+    incdvi_truncate(d, len);
 
   if (d->offset == 0)
   {
@@ -127,11 +244,14 @@ void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf)
         break;
       if (buf->data[d->offset] == BOP || buf->data[d->offset] == EOP)
       {
-        int page = add_page(ctx, d);
-        if (!(page & 1) != (buf->data[d->offset] == BOP))
-          abort();
-        d->pages[page] = d->offset;
+        bool known = index_boundary(ctx, d, buf);
+        d->offset += ilen;
+        if (known)
+          skip_known_pages(d, buf);
+        continue;
       }
+      if (dvi_is_fontdef(buf->data[d->offset]))
+        d->fonthash = sdbm_hash(d->fonthash, buf->data + d->offset, ilen);
       d->offset += ilen;
     }
   }
@@ -150,9 +270,42 @@ int incdvi_page_count(incdvi_t *d)
   return (d->page_len / 2);
 }
 
+#define PREFETCH_FONTS 64
+
+// Ask the resource manager for the files of the fonts defined before
+// offset, so that they are fetched in one batch rather than one by one
+static void incdvi_prefetch_fonts(fz_context *ctx, incdvi_t *__restrict__ d, fz_buffer *buf, int offset)
+{
+  enum dvi_version version = dvi_context_state(d->dc)->version;
+  const char *names[PREFETCH_FONTS];
+  int lens[PREFETCH_FONTS];
+  int count = 0;
+
+  for (int pos = d->fontdef_offset; pos < offset && count < PREFETCH_FONTS; )
+  {
+    int ilen = dvi_instr_size(buf->data + pos, offset - pos, version);
+    if (ilen <= 0)
+      break;
+    uint8_t op = buf->data[pos];
+    if (op >= FNT_DEF1 && op <= FNT_DEF4)
+    {
+      // op, k[1..4], c[4], s[4], d[4], a[1], l[1], area[a], name[l]
+      const uint8_t *p = buf->data + pos + 14 + op - FNT_DEF1;
+      names[count] = (const char *)p + 2 + p[0];
+      lens[count] = p[1];
+      count += 1;
+    }
+    pos += ilen;
+  }
+
+  if (count > 1)
+    dvi_resmanager_prefetch_tex_fonts(ctx, d->dc->resmanager, count, names, lens);
+}
+
 static void incdvi_parse_fontdef(fz_context *ctx, incdvi_t *__restrict__ d, fz_buffer *buf, int offset)
 {
   if (offset > buf->len) abort();
+  incdvi_prefetch_fonts(ctx, d, buf, offset);
   enum dvi_version version = dvi_context_state(d->dc)->version;
   while (d->fontdef_offset < offset)
   {
@@ -190,6 +343,13 @@ void incdvi_page_dim(incdvi_t *d, fz_buffer *buf, int page, float *width, float
   }
 }
 
+void incdvi_page_offsets(incdvi_t *d, int page, int *bop, int *eop)
+{
+  if (page < 0 || page >= incdvi_page_count(d)) abort();
+  *bop = d->pages[page * 2];
+  *eop = d->pages[page * 2 + 1];
+}
+
 void incdvi_render_page(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page, fz_device *dev)
 {
   if (page < 0 || page >= incdvi_page_count(d)) abort();
@@ -210,6 +370,158 @@ void incdvi_render_page(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page,
   dvi_context_end_frame(ctx, dc);
 }
 
+// Display list cache
+
+static unsigned long page_hash(incdvi_t *d, fz_buffer *buf, int page)
+{
+  int bop = d->pages[page * 2], eop = d->pages[page * 2 + 1];
+  return sdbm_hash(d->fonthashes[page * 2], buf->data + bop, eop - bop + 1);
+}
+
+static dlcache_entry *cache_find(incdvi_t *d, fz_buffer *buf, int page)
+{
+  if (d->cache.len == 0)
+    return NULL;
+
+  int bop = d->pages[page * 2], eop = d->pages[page * 2 + 1];
+  unsigned long hash = page_hash(d, buf, page);
+
+  for (int i = 0; i < d->cache.len; ++i)
+  {
+    dlcache_entry *e = &d->cache.entries[i];
+    if (e->page == page && e->bop == bop && e->eop == eop && e->hash == hash)
+      return e;
+  }
+  return NULL;
+}
+
+static void cache_evict(fz_context *ctx, incdvi_t *d, int index)
+{
+  dlcache_entry *e = &d->cache.entries[index];
+  fz_drop_display_list(ctx, e->dl);
+  d->cache.size -= e->size;
+  d->cache.len -= 1;
+  *e = d->cache.entries[d->cache.len];
+}
+
+// Drop least recently used entries until the cache fits in the budget
+static void cache_trim(fz_context *ctx, incdvi_t *d)
+{
+  while (d->cache.len > 0 && d->cache.size > d->cache.budget)
+  {
+    int lru = 0;
+    for (int i = 1; i < d->cache.len; ++i)
+      if (d->cache.entries[i].last_use < d->cache.entries[lru].last_use)
+        lru = i;
+    cache_evict(ctx, d, lru);
+  }
+}
+
+void incdvi_set_cache_budget(fz_context *ctx, incdvi_t *d, size_t budget)
+{
+  d->cache.budget = budget;
+  cache_trim(ctx, d);
+}
+
+bool incdvi_is_cached(incdvi_t *d, fz_buffer *buf, int page)
+{
+  if (page < 0 || page >= incdvi_page_count(d)) abort();
+  return cache_find(d, buf, page) != NULL;
+}
+
+fz_display_list *incdvi_cached_display_list(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page)
+{
+  if (page < 0 || page >= incdvi_page_count(d)) abort();
+  dlcache_entry *e = cache_find(d, buf, page);
+  if (!e)
+    return NULL;
+  e->last_use = ++d->cache.clock;
+  return fz_keep_display_list(ctx, e->dl);
+}
+
+void incdvi_cache_display_list(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page, fz_display_list *dl)
+{
+  if (page < 0 || page >= incdvi_page_count(d)) abort();
+
+  int bop = d->pages[page * 2], eop = d->pages[page * 2 + 1];
+  size_t size = INCDVI_CACHE_COST(bop, eop);
+  if (size > d->cache.budget)
+    return;
+
+  dlcache_entry *e = cache_find(d, buf, page);
+  if (e)
+  {
+    fz_drop_display_list(ctx, e->dl);
+    e->dl = fz_keep_display_list(ctx, dl);
+    e->last_use = ++d->cache.clock;
+    return;
+  }
+
+  if (d->cache.len == d->cache.cap)
+  {
+    int cap = d->cache.cap == 0 ? 16 : d->cache.cap * 2;
+    dlcache_entry *entries = fz_malloc_struct_array(ctx, cap, dlcache_entry);
+    if (d->cache.entries)
+    {
+      memcpy(entries, d->cache.entries, sizeof(dlcache_entry) * d->cache.len);
+      fz_free(ctx, d->cache.entries);
+    }
+    d->cache.entries = entries;
+    d->cache.cap = cap;
+  }
+
+  d->cache.entries[d->cache.len] = (dlcache_entry){
+    .page = page,
+    .bop = bop,
+    .eop = eop,
+    .hash = page_hash(d, buf, page),
+    .dl = fz_keep_display_list(ctx, dl),
+    .size = size,
+    .last_use = ++d->cache.clock,
+  };
+  d->cache.len += 1;
+  d->cache.size += size;
+  cache_trim(ctx, d);
+}
+
+fz_display_list *incdvi_display_list(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page)
+{
+  fz_display_list *dl = incdvi_cached_display_list(ctx, d, buf, page);
+  if (dl)
+    return dl;
+
+  float pw, ph;
+  bool landscape;
+  incdvi_page_dim(d, buf, page, &pw, &ph, &landscape);
+
+  fz_rect box = fz_make_rect(0, 0, pw, ph);
+  fz_device *dev = NULL;
+  fz_var(dl);
+  fz_var(dev);
+  int tag = txp_mem_enter(TXP_MEM_DISPLAY);
+  fz_try(ctx)
+  {
+    dl = fz_new_display_list(ctx, box);
+    dev = fz_new_list_device(ctx, dl);
+    incdvi_render_page(ctx, d, buf, page, dev);
+    fz_close_device(ctx, dev);
+  }
+  fz_always(ctx)
+  {
+    if (dev)
+      fz_drop_device(ctx, dev);
+    txp_mem_leave(tag);
+  }
+  fz_catch(ctx)
+  {
+    fz_drop_display_list(ctx, dl);
+    fz_rethrow(ctx);
+  }
+
+  incdvi_cache_display_list(ctx, d, buf, page, dl);
+  return dl;
+}
+
 float incdvi_tex_scale_factor(incdvi_t *d)
 {
   if (d->page_len == 0)
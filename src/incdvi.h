@@ -38,10 +38,21 @@ incdvi_t *incdvi_new(fz_context *ctx, dvi_reshooks hooks);
 void incdvi_free(fz_context *ctx, incdvi_t *d);
 void incdvi_reset(incdvi_t *d);
 void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf);
+void incdvi_truncate(incdvi_t *d, int len);
 bool incdvi_output_started(incdvi_t *d);
 int incdvi_page_count(incdvi_t *d);
 void incdvi_page_dim(incdvi_t *d, fz_buffer *buf, int page, float *width, float *height, bool *landscape);
+void incdvi_page_offsets(incdvi_t *d, int page, int *bop, int *eop);
 void incdvi_render_page(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page, fz_device *dev);
+
+// Render a page to a display list, reusing the cached one if the DVI code of
+// the page did not change since it was last rendered.
+fz_display_list *incdvi_display_list(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page);
+fz_display_list *incdvi_cached_display_list(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page);
+void incdvi_cache_display_list(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page, fz_display_list *dl);
+bool incdvi_is_cached(incdvi_t *d, fz_buffer *buf, int page);
+void incdvi_set_cache_budget(fz_context *ctx, incdvi_t *d, size_t budget);
+
 void incdvi_find_page_loc(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page);
 float incdvi_tex_scale_factor(incdvi_t *d);
 
@@ -0,0 +1,195 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "latency.h"
+
+// Histogram buckets: bucket i counts latencies in [2^i, 2^(i+1)) ms
+#define LATENCY_BUCKETS 14
+
+static struct {
+  bool enabled;
+  FILE *trace;
+  bool first_event;
+  uint64_t origin;
+  pthread_mutex_t lock;
+  int thread_count;
+
+  // Oldest edit not displayed yet (0 if none), and whether contents have
+  // been rendered since
+  uint64_t edit_time;
+  bool edit_rendered;
+  int edit_serial;
+
+  int histogram[LATENCY_BUCKETS];
+  int count;
+  uint64_t total, max;
+} lat = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread int thread_id;
+
+static uint64_t clock_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void latency_init(const char *path)
+{
+  if (lat.enabled || !path)
+    return;
+
+  lat.trace = fopen(path, "w");
+  if (!lat.trace)
+  {
+    perror("[latency] cannot open trace file");
+    return;
+  }
+  fputs("[\n", lat.trace);
+  lat.first_event = 1;
+  lat.origin = clock_us() - 1;
+  lat.enabled = 1;
+}
+
+uint64_t latency_now(void)
+{
+  if (!lat.enabled)
+    return 0;
+  return clock_us() - lat.origin;
+}
+
+// Write an event, lat.lock must be held.
+// The unlocked checks of lat.enabled are only a fast path: latency_finish
+// may have closed the trace since, so it is checked again here.
+static void write_event(const char *name, const char *phase,
+                        uint64_t start, uint64_t end)
+{
+  if (!lat.enabled)
+    return;
+  if (thread_id == 0)
+    thread_id = ++lat.thread_count;
+
+  fprintf(lat.trace,
+          "%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":1,\"tid\":%d,"
+          "\"ts\":%llu,\"dur\":%llu,\"args\":{\"edit\":%d}}",
+          lat.first_event ? "" : ",\n", name, phase, thread_id,
+          (unsigned long long)start, (unsigned long long)(end - start),
+          lat.edit_serial);
+  lat.first_event = 0;
+}
+
+void latency_span(const char *name, uint64_t start)
+{
+  if (!lat.enabled || start == 0)
+    return;
+  uint64_t now = latency_now();
+  pthread_mutex_lock(&lat.lock);
+  write_event(name, "X", start, now);
+  pthread_mutex_unlock(&lat.lock);
+}
+
+void latency_edit(void)
+{
+  if (!lat.enabled)
+    return;
+  uint64_t now = latency_now();
+  pthread_mutex_lock(&lat.lock);
+  lat.edit_serial += 1;
+  if (lat.edit_time == 0)
+    lat.edit_time = now;
+  lat.edit_rendered = 0;
+  write_event("edit", "i", now, now);
+  pthread_mutex_unlock(&lat.lock);
+}
+
+void latency_contents(void)
+{
+  if (!lat.enabled)
+    return;
+  pthread_mutex_lock(&lat.lock);
+  if (lat.edit_time != 0)
+    lat.edit_rendered = 1;
+  pthread_mutex_unlock(&lat.lock);
+}
+
+void latency_frame(void)
+{
+  if (!lat.enabled)
+    return;
+  uint64_t now = latency_now();
+  pthread_mutex_lock(&lat.lock);
+  if (lat.enabled && lat.edit_time != 0 && lat.edit_rendered)
+  {
+    uint64_t us = now - lat.edit_time;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (us / 1000) >> (bucket + 1))
+      bucket++;
+    lat.histogram[bucket] += 1;
+    lat.count += 1;
+    lat.total += us;
+    if (us > lat.max)
+      lat.max = us;
+    write_event("edit to frame", "X", lat.edit_time, now);
+    lat.edit_time = 0;
+  }
+  pthread_mutex_unlock(&lat.lock);
+}
+
+void latency_finish(void)
+{
+  if (!lat.enabled)
+    return;
+
+  pthread_mutex_lock(&lat.lock);
+  lat.enabled = 0;
+  fputs("\n]\n", lat.trace);
+  fclose(lat.trace);
+  lat.trace = NULL;
+
+  fprintf(stderr, "[latency] %d edits displayed", lat.count);
+  if (lat.count > 0)
+    fprintf(stderr, ", average %dms, max %dms",
+            (int)(lat.total / lat.count / 1000), (int)(lat.max / 1000));
+  fprintf(stderr, "\n");
+
+  for (int i = 0; i < LATENCY_BUCKETS; ++i)
+  {
+    if (lat.histogram[i] == 0)
+      continue;
+    if (i == 0)
+      fprintf(stderr, "[latency]     <2ms: %d\n", lat.histogram[i]);
+    else if (i == LATENCY_BUCKETS - 1)
+      fprintf(stderr, "[latency] >=%5dms: %d\n", 1 << i, lat.histogram[i]);
+    else
+      fprintf(stderr, "[latency] %5d-%dms: %d\n", 1 << i, 2 << i, lat.histogram[i]);
+  }
+  pthread_mutex_unlock(&lat.lock);
+}
@@ -0,0 +1,69 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tracing of the latency from edits to pixels.
+//
+// Phases (rollback, TeX replay, DVI updates, rendering, uploads) are
+// recorded as spans, written in the Chrome trace-event JSON format when a
+// trace file is set (open it with chrome://tracing or ui.perfetto.dev).
+// The time from an edit to the first frame showing contents rendered after
+// it is collected in a histogram, printed by latency_finish.
+// Until latency_init is called, recording costs a test and nothing else.
+
+// Start tracing to a JSON file (no-op if already started or path is NULL)
+void latency_init(const char *path);
+
+// Complete the trace file and print the summary
+void latency_finish(void);
+
+// Microseconds on a monotonic clock, 0 if tracing is not enabled
+uint64_t latency_now(void);
+
+// Record a span of phase `name' from start (given by latency_now) to now
+void latency_span(const char *name, uint64_t start);
+
+// An edit was received from the editor
+void latency_edit(void);
+
+// The contents displayed have been rendered again
+void latency_contents(void);
+
+// A frame has been presented
+void latency_frame(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*!LATENCY_H*/
@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include "incdvi.h"
 #include "renderer.h"
 #include "sprotocol.h"
@@ -39,6 +40,11 @@
 #include "vstack.h"
 #include "prot_parser.h"
 #include "editor.h"
+#include "latency.h"
+#include "reactor.h"
+#include "txp_log.h"
+#include "txp_memstat.h"
+#include "txp_memdiff.h"
 #include "mupdf_compat.h"
 
 struct persistent_state *pstate;
@@ -99,8 +105,20 @@ enum ui_mouse_status {
   UI_MOUSE_MOVE,
 };
 
+// Renderers of the continuous view, one per page visible in the window
+#define PAGE_SLOTS 6
+// Vertical space between pages of the continuous view, in pixels
+#define PAGE_GAP 8
+
+typedef struct {
+  txp_renderer *renderer;
+  // Page displayed by the renderer, or -1
+  int page;
+} page_slot;
+
 typedef struct {
   txp::Engine *eng;
+  // Renderer of ui->page, the one whose configuration is authoritative
   txp_renderer *doc_renderer;
   SDL_Renderer *sdl_renderer;
   SDL_Window *window;
@@ -109,11 +127,38 @@ typedef struct {
   int need_synctex;
   int zoom;
 
+  // Continuous view: pages are stacked vertically, ui->page is the one at
+  // the top of the window and scroll the distance from its top to the top of
+  // the window. Pages from ui->page to last_page are visible, want_page is
+  // the last one needed to fill the window.
+  bool continuous;
+  float scroll;
+  int last_page, want_page;
+  page_slot slots[PAGE_SLOTS];
+
   // Mouse input state
   int last_mouse_x, last_mouse_y;
   uint32_t last_click_ticks;
   enum ui_mouse_status mouse_status;
+  txp_renderer *mouse_renderer;
   bool advancing;
+
+  // Time of the last input from the user or the editor, see idle_delay
+  uint32_t last_activity;
+
+  // TeX is advanced by a dedicated thread. The engine and the state it owns
+  // are protected by engine_lock: the UI thread holds it while processing
+  // events and releases it while waiting for the next one and while drawing.
+  // The engine runs in its own engine_ctx so that drawing with the UI
+  // context does not race with it.
+  // The engine thread sleeps in the reactor, which also watches stdin for the
+  // UI, until TeX sends a query, stdin has input or the UI wakes it up.
+  fz_context *engine_ctx;
+  SDL_Thread *engine_thread;
+  SDL_mutex *engine_lock;
+  reactor_t *reactor;
+  SDL_atomic_t ui_waiting;
+  bool engine_quit;
 } ui_state;
 
 /* UI rendering */
@@ -123,12 +168,287 @@ static float zoom_factor(int count)
   return expf((float)count / 5000.0f);
 }
 
+static fz_point get_scale_factor(SDL_Window *window)
+{
+  int ww, wh, pw, ph;
+  SDL_GetWindowSize(window, &ww, &wh);
+
+#if SDL_VERSION_ATLEAST(2, 0, 26)
+  SDL_GetWindowSizeInPixels(window, &pw, &ph);
+#else
+  SDL_GetRendererOutputSize(SDL_GetRenderer(window), &pw, &ph);
+#endif
+
+  return fz_make_point(ww != 0 ? (float)pw / ww : 1,
+                       wh != 0 ? (float)ph / wh : 1);
+}
+
+/* Continuous view */
+
+static page_slot *find_slot(ui_state *ui, txp_renderer *r)
+{
+  for (int i = 0; i < PAGE_SLOTS; i++)
+    if (ui->slots[i].renderer == r)
+      return &ui->slots[i];
+  return NULL;
+}
+
+// The renderer of a page already placed in a slot
+static txp_renderer *find_slot_page(ui_state *ui, int page)
+{
+  for (int i = 0; i < PAGE_SLOTS; i++)
+    if (ui->slots[i].renderer && ui->slots[i].page == page)
+      return ui->slots[i].renderer;
+  return NULL;
+}
+
+// Slots with the highest distance are recycled first: the empty ones, then
+// the pages above ui->page, then the ones furthest below
+static int slot_distance(ui_state *ui, page_slot *slot)
+{
+  if (!slot->renderer || slot->page < 0)
+    return INT_MAX;
+  if (slot->page < ui->page)
+    return ui->page - slot->page + PAGE_SLOTS;
+  return slot->page - ui->page;
+}
+
+// A renderer displaying the page, or NULL if the page is not available.
+// The contents of a slot are only updated by refresh_slots, a page that has
+// just been rolled back keeps displaying its previous version.
+static txp_renderer *slot_renderer(fz_context *ctx, ui_state *ui, int page)
+{
+  page_slot *slot = NULL;
+  for (int i = 0; i < PAGE_SLOTS; i++)
+  {
+    page_slot *s = &ui->slots[i];
+    if (s->renderer && s->page == page)
+      return s->renderer;
+    if (s->renderer != ui->doc_renderer &&
+        (!slot || slot_distance(ui, s) > slot_distance(ui, slot)))
+      slot = s;
+  }
+
+  if (page < 0 || page >= ui->eng->page_count())
+    return NULL;
+
+  if (!slot->renderer)
+    slot->renderer = txp_renderer_new_sibling(ctx, ui->doc_renderer);
+  fz_display_list *dl = ui->eng->render_page(page);
+  txp_renderer_set_contents(ctx, slot->renderer, dl);
+  fz_drop_display_list(ctx, dl);
+  slot->page = page;
+  return slot->renderer;
+}
+
+// Update the slots after the document changed. Unchanged pages keep their
+// display list, and their texture.
+static void refresh_slots(fz_context *ctx, ui_state *ui)
+{
+  int page_count = ui->eng->page_count();
+  bool terminated = ui->eng->get_status() == DOC_TERMINATED;
+
+  for (int i = 0; i < PAGE_SLOTS; i++)
+  {
+    page_slot *slot = &ui->slots[i];
+    if (!slot->renderer || slot->page < 0)
+      continue;
+    if (slot->page < page_count)
+    {
+      fz_display_list *dl = ui->eng->render_page(slot->page);
+      txp_renderer_set_contents(ctx, slot->renderer, dl);
+      fz_drop_display_list(ctx, dl);
+    }
+    else if (terminated)
+    {
+      slot->page = -1;
+      txp_renderer_set_contents(ctx, slot->renderer, NULL);
+    }
+  }
+}
+
+// Make the other renderers follow the configuration of ui->doc_renderer
+static void sync_slot(fz_context *ctx, ui_state *ui, txp_renderer *r)
+{
+  if (r == ui->doc_renderer)
+    return;
+  *txp_renderer_get_config(ctx, r) = *txp_renderer_get_config(ctx, ui->doc_renderer);
+  txp_renderer_set_scale_factor(ctx, r, get_scale_factor(ui->window));
+}
+
+static void focus_slot(fz_context *ctx, ui_state *ui, txp_renderer *r)
+{
+  sync_slot(ctx, ui, r);
+  ui->doc_renderer = r;
+}
+
+static float page_height(fz_context *ctx, txp_renderer *r)
+{
+  txp_renderer_bounds bounds;
+  if (!txp_renderer_page_bounds(ctx, r, &bounds))
+    return 0;
+  return bounds.document_size.y;
+}
+
+// Normalize ui->page and ui->scroll so that ui->page is the page at the top
+// of the window, then place the pages filling the window.
+static void continuous_layout(fz_context *ctx, ui_state *ui)
+{
+  ui->last_page = ui->page - 1;
+  ui->want_page = ui->page;
+
+  txp_renderer *r = slot_renderer(ctx, ui, ui->page);
+  if (!r)
+    return;
+  focus_slot(ctx, ui, r);
+
+  while (ui->scroll < 0)
+  {
+    txp_renderer *prev = slot_renderer(ctx, ui, ui->page - 1);
+    if (!prev)
+    {
+      ui->scroll = 0;
+      break;
+    }
+    focus_slot(ctx, ui, prev);
+    ui->page -= 1;
+    ui->scroll += page_height(ctx, prev) + PAGE_GAP;
+  }
+
+  float height;
+  while (ui->scroll >= (height = page_height(ctx, ui->doc_renderer) + PAGE_GAP))
+  {
+    txp_renderer *next = slot_renderer(ctx, ui, ui->page + 1);
+    if (!next)
+      break;
+    focus_slot(ctx, ui, next);
+    ui->page += 1;
+    ui->scroll -= height;
+  }
+
+  float y = -ui->scroll, window_h = 0;
+  int page = ui->page;
+  bool at_end = 0;
+  r = ui->doc_renderer;
+  txp_renderer_bounds bounds;
+  while (page < ui->page + PAGE_SLOTS && txp_renderer_page_bounds(ctx, r, &bounds))
+  {
+    txp_renderer_place_page(ctx, r, 1, y);
+    ui->last_page = page;
+    y += bounds.document_size.y + PAGE_GAP;
+    window_h = bounds.window_size.y;
+    if (y >= window_h)
+      break;
+    page += 1;
+    r = slot_renderer(ctx, ui, page);
+    if (!r)
+    {
+      ui->want_page = page;
+      at_end = 1;
+      break;
+    }
+    sync_slot(ctx, ui, r);
+  }
+  if (!at_end)
+    ui->want_page = ui->last_page;
+
+  // Don't scroll past the bottom of the last page
+  float shift = fz_min(ui->scroll, window_h - (y - PAGE_GAP));
+  if (at_end && shift > 0)
+  {
+    ui->scroll -= shift;
+    for (page = ui->page; page <= ui->last_page; page++)
+    {
+      SDL_FRect rect;
+      r = slot_renderer(ctx, ui, page);
+      if (txp_renderer_page_position(ctx, r, &rect, NULL, NULL))
+        txp_renderer_place_page(ctx, r, 1, rect.y + shift);
+    }
+  }
+}
+
+// The renderer displaying a point of the window, and its page
+static txp_renderer *renderer_at(fz_context *ctx, ui_state *ui, fz_point p, int *page)
+{
+  *page = ui->page;
+  if (!ui->continuous)
+    return ui->doc_renderer;
+
+  for (int i = ui->page; i <= ui->last_page; i++)
+  {
+    txp_renderer *r = slot_renderer(ctx, ui, i);
+    SDL_FRect rect;
+    if (r && txp_renderer_page_position(ctx, r, &rect, NULL, NULL) &&
+        p.y < rect.y + rect.h + PAGE_GAP)
+    {
+      *page = i;
+      return r;
+    }
+  }
+  return ui->doc_renderer;
+}
+
+static void toggle_continuous(fz_context *ctx, ui_state *ui)
+{
+  txp_renderer_config *config = txp_renderer_get_config(ctx, ui->doc_renderer);
+  txp_renderer_bounds bounds;
+  bool has_bounds = txp_renderer_page_bounds(ctx, ui->doc_renderer, &bounds);
+
+  // Keep the top of the page at the same position
+  ui->continuous = !ui->continuous;
+  if (ui->continuous)
+  {
+    ui->scroll = has_bounds ? bounds.pan_interval.y - config->pan.y : 0;
+    // Slots left from a previous use of the view might be outdated
+    refresh_slots(ctx, ui);
+  }
+  else
+  {
+    if (has_bounds)
+      config->pan.y = bounds.pan_interval.y - ui->scroll;
+    txp_renderer_place_page(ctx, ui->doc_renderer, 0, 0);
+  }
+  schedule_event(RENDER_EVENT);
+}
+
+static void engine_lock(ui_state *ui)
+{
+  SDL_AtomicIncRef(&ui->ui_waiting);
+  SDL_LockMutex(ui->engine_lock);
+  SDL_AtomicDecRef(&ui->ui_waiting);
+}
+
+static void engine_unlock(ui_state *ui)
+{
+  reactor_wakeup(ui->reactor);
+  SDL_UnlockMutex(ui->engine_lock);
+}
+
+// Called with the engine lock held. Placing the pages may ask the engine for
+// display lists, drawing them only needs the renderers: the engine keeps
+// running meanwhile.
 static void render(fz_context *ctx, ui_state *ui)
 {
+  if (ui->continuous)
+    continuous_layout(ctx, ui);
+
+  engine_unlock(ui);
   SDL_SetRenderDrawColor(ui->sdl_renderer, 0, 0, 0, 255);
   SDL_RenderClear(ui->sdl_renderer);
-  txp_renderer_render(ctx, ui->doc_renderer);
+  uint64_t start = latency_now();
+  if (ui->continuous)
+  {
+    for (int page = ui->page; page <= ui->last_page; page++)
+      txp_renderer_render(ctx, find_slot_page(ui, page));
+  }
+  else
+    txp_renderer_render(ctx, ui->doc_renderer);
+  latency_span("render", start);
+  start = latency_now();
   SDL_RenderPresent(ui->sdl_renderer);
+  latency_span("present", start);
+  latency_frame();
+  engine_lock(ui);
 }
 
 struct repaint_on_resize_env
@@ -144,16 +464,24 @@ static int repaint_on_resize(void *data, SDL_Event *event)
       event->window.event == SDL_WINDOWEVENT_RESIZED &&
       SDL_GetWindowFromID(event->window.windowID) == env->ui->window)
   {
+    engine_lock(env->ui);
     render(env->ctx, env->ui);
+    engine_unlock(env->ui);
   }
   return 0;
 }
 
 /* Document processing */
 
+// The last page that should be typeset to fill the window
+static int last_wanted_page(ui_state *ui)
+{
+  return ui->continuous ? fz_maxi(ui->page, ui->want_page) : ui->page;
+}
+
 static bool need_advance(fz_context *ctx, ui_state *ui)
 {
-  int need = ui->eng->page_count() <= ui->page;
+  int need = ui->eng->page_count() <= last_wanted_page(ui);
 
   if (!need)
   {
@@ -167,54 +495,124 @@ static bool need_advance(fz_context *ctx, ui_state *ui)
   return (need && ui->eng->get_status() == DOC_RUNNING);
 }
 
-static bool advance_engine(fz_context *ctx, ui_state *ui)
+// Reactor slots
+enum { WATCH_STDIN, WATCH_TEX };
+
+// When there was no input for IDLE_DELAY ms, the engine thread keeps
+// typesetting the rest of the document in the background so that jumping to
+// a late page or a forward search does not have to wait for TeX.
+// It answers queries for IDLE_SLICE ms, then pauses for IDLE_PAUSE ms, and
+// stops as soon as input arrives.
+#define IDLE_DELAY 1000
+#define IDLE_SLICE 20
+#define IDLE_PAUSE 20
+
+// Delay between steps of a running engine that has no query descriptor
+#define ENGINE_POLL 100
+
+// Milliseconds before idle completion can start, 0 if it can, -1 if the
+// document is complete
+static int idle_delay(ui_state *ui)
 {
-  bool need = need_advance(ctx, ui);
-  if (!need && ui->advancing) editor_flush();
-  ui->advancing = need;
-  if (!need) return false;
+  if (ui->eng->get_status() != DOC_RUNNING)
+    return -1;
+  uint32_t elapsed = SDL_GetTicks() - ui->last_activity;
+  return elapsed >= IDLE_DELAY ? 0 : IDLE_DELAY - elapsed;
+}
 
-  struct timespec start;
-  clock_gettime(CLOCK_MONOTONIC, &start);
+static int engine_thread_main(void *data)
+{
+  ui_state *ui = (ui_state *)data;
+  fz_context *ctx = ui->engine_ctx;
 
-  int steps = 10;
-  while (need)
+  SDL_LockMutex(ui->engine_lock);
+  while (!ui->engine_quit)
   {
-    if (!ui->eng->step(false)) break;
+    bool need = need_advance(ctx, ui);
+    int idle = need ? -1 : idle_delay(ui);
+    if (!need && ui->advancing) editor_flush();
+    else if (!need) editor_sync(1);
+    ui->advancing = need;
 
-    steps -= 1;
-    need = need_advance(ctx, ui);
+    int timeout = -1;
 
-    if (steps == 0)
+    if ((need || idle == 0) && SDL_AtomicGet(&ui->ui_waiting) == 0)
     {
-      steps = 10;
+      int before_page_count = ui->eng->page_count();
+      uint64_t start = latency_now();
+      uint32_t deadline = SDL_GetTicks() + IDLE_SLICE;
+      while (!ui->engine_quit && SDL_AtomicGet(&ui->ui_waiting) == 0)
+      {
+        bool wanted = need_advance(ctx, ui);
+        if (!wanted && (idle != 0 || SDL_TICKS_PASSED(SDL_GetTicks(), deadline)))
+          break;
+        if (!ui->eng->step(false))
+          break;
+        // Background work gives way to commands as soon as they arrive
+        if (!wanted && (reactor_wait(ui->reactor, 0) & (1 << WATCH_STDIN)))
+        {
+          schedule_event(STDIN_EVENT);
+          break;
+        }
+      }
+      latency_span(need ? "tex" : "tex-idle", start);
+      int after_page_count = ui->eng->page_count();
+      editor_sync(0);
+      fflush(stdout);
+      txp_log_flush();
 
-      struct timespec curr;
-      clock_gettime(CLOCK_MONOTONIC, &curr);
+      if (last_wanted_page(ui) >= before_page_count && ui->page < after_page_count)
+        schedule_event(RELOAD_EVENT);
 
-      int delta =
-        (curr.tv_sec - start.tv_sec) * 1000 * 1000 * 1000 +
-        (curr.tv_nsec - start.tv_nsec);
+      // Let the UI look for a pending forward synchronization
+      if (synctex_has_target(ui->eng->synctex(NULL)))
+        schedule_event(STDIN_EVENT);
 
-      if (delta > 5000000) break;
+      if (!ui->engine_quit && SDL_AtomicGet(&ui->ui_waiting) == 0)
+      {
+        // All received queries were answered: wait for the next one
+        if (need_advance(ctx, ui))
+        {
+          int fd = ui->eng->query_fd();
+          reactor_arm(ui->reactor, WATCH_TEX, fd);
+          // Without a descriptor to wait on, poll the engine
+          if (fd == -1)
+            timeout = ENGINE_POLL;
+        }
+        else if (idle_delay(ui) == 0)
+          timeout = IDLE_PAUSE;
+      }
+    }
+    else if (idle > 0)
+      // Wake up when idle completion can start
+      timeout = idle;
+
+    // A complete output can still change (a DVI or PDF rebuilt by an
+    // external tool): keep waiting on the watcher of the engine
+    bool watching = 0;
+    if (ui->eng->get_status() != DOC_RUNNING)
+    {
+      int fd = ui->eng->query_fd();
+      reactor_arm(ui->reactor, WATCH_TEX, fd);
+      watching = fd != -1;
     }
-  }
-  return need;
-}
-
-static fz_point get_scale_factor(SDL_Window *window)
-{
-  int ww, wh, pw, ph;
-  SDL_GetWindowSize(window, &ww, &wh);
 
-#if SDL_VERSION_ATLEAST(2, 0, 26)
-  SDL_GetWindowSizeInPixels(window, &pw, &ph);
-#else
-  SDL_GetRendererOutputSize(SDL_GetRenderer(window), &pw, &ph);
-#endif
+    // Sleep without holding the lock until TeX answers, stdin has input or
+    // the UI changes something. This also steps aside when the UI is waiting
+    // for the lock: it wakes us up when releasing it.
+    SDL_UnlockMutex(ui->engine_lock);
+    int ready = reactor_wait(ui->reactor, timeout);
+    if (ready & (1 << WATCH_STDIN))
+      schedule_event(STDIN_EVENT);
+    SDL_LockMutex(ui->engine_lock);
+
+    if (watching && (ready & (1 << WATCH_TEX)) && !ui->engine_quit &&
+        ui->eng->step(false))
+      schedule_event(RELOAD_EVENT);
+  }
+  SDL_UnlockMutex(ui->engine_lock);
 
-  return fz_make_point(ww != 0 ? (float)pw / ww : 1,
-                       wh != 0 ? (float)ph / wh : 1);
+  return 0;
 }
 
 /* UI events */
@@ -235,28 +633,31 @@ static void ui_mouse_down(struct persistent_state *ps, ui_state *ui, int x, int
                         abs(ui->last_mouse_x - x) < 30 && abs(ui->last_mouse_y - y) < 30;
 
     bool diff;
+    int page;
+    txp_renderer *r = renderer_at(ps->ctx, ui, p, &page);
+    ui->mouse_renderer = r;
 
     if (double_click)
     {
-      diff = txp_renderer_select_word(ps->ctx, ui->doc_renderer, p);
+      diff = txp_renderer_select_word(ps->ctx, r, p);
     }
     else
     {
-      diff = txp_renderer_start_selection(ps->ctx, ui->doc_renderer, p);
-      diff = txp_renderer_select_char(ps->ctx, ui->doc_renderer, p) || diff;
+      diff = txp_renderer_start_selection(ps->ctx, r, p);
+      diff = txp_renderer_select_char(ps->ctx, r, p) || diff;
       ui->last_click_ticks = ticks;
 
       fz_buffer *buf;
       synctex_t *stx = ui->eng->synctex(&buf);
       if (stx && buf)
       {
-        fz_point pt = txp_renderer_screen_to_document(ps->ctx, ui->doc_renderer, p);
+        fz_point pt = txp_renderer_screen_to_document(ps->ctx, r, p);
         float f = 1 / ui->eng->scale_factor();
         // pt.x -= 72;
         // pt.y -= 72;
-        fprintf(stderr, "click: (%f,%f) mapped:(%f,%f)\n",
-                pt.x, pt.y, f * pt.x, f * pt.y);
-        synctex_scan(ps->ctx, stx, buf, ps->doc_path, ui->page, f * pt.x, f * pt.y);
+        txp_debug(TXP_LOG_MAIN, "click: (%f,%f) mapped:(%f,%f)\n",
+                  pt.x, pt.y, f * pt.x, f * pt.y);
+        synctex_scan(ps->ctx, stx, buf, ps->doc_path, page, f * pt.x, f * pt.y);
       }
     }
 
@@ -284,7 +685,7 @@ static void ui_mouse_move(fz_context *ctx, ui_state *ui, int x, int y)
     {
       fz_point p = fz_make_point(scale.x * x, scale.y * y);
       // fprintf(stderr, "drag sel\n");
-      if (txp_renderer_drag_selection(ctx, ui->doc_renderer, p))
+      if (txp_renderer_drag_selection(ctx, ui->mouse_renderer, p))
         schedule_event(RENDER_EVENT);
       break;
     }
@@ -297,7 +698,10 @@ static void ui_mouse_move(fz_context *ctx, ui_state *ui, int x, int y)
       if (dx != 0 || dy != 0)
       {
         config->pan.x += scale.x * dx;
-        config->pan.y += scale.y * dy;
+        if (ui->continuous)
+          ui->scroll -= scale.y * dy;
+        else
+          config->pan.y += scale.y * dy;
         ui->last_mouse_x = x;
         ui->last_mouse_y = y;
         schedule_event(RENDER_EVENT);
@@ -327,7 +731,13 @@ static void ui_mouse_wheel(fz_context *ctx, ui_state *ui, float dx, float dy, in
       float my = (mousey - wh / 2.0f) * scale.y;
       float of = config->zoom, nf = zoom_factor(ui->zoom);
       config->pan.x = mx + nf * ((config->pan.x - mx) / of);
-      config->pan.y = my + nf * ((config->pan.y - my) / of);
+      if (ui->continuous)
+      {
+        float top = mousey * scale.y;
+        ui->scroll = nf * ((ui->scroll + top) / of) - top;
+      }
+      else
+        config->pan.y = my + nf * ((config->pan.y - my) / of);
       config->zoom = nf;
       schedule_event(RENDER_EVENT);
     }
@@ -338,7 +748,10 @@ static void ui_mouse_wheel(fz_context *ctx, ui_state *ui, float dx, float dy, in
     float x = scale.x * dx * 5;
     float y = scale.y * dy * 5;
     config->pan.x -= x;
-    config->pan.y += y;
+    if (ui->continuous)
+      ui->scroll -= y;
+    else
+      config->pan.y += y;
     // fprintf(stderr, "wheel pan: (%.02f, %.02f) raw:(%.02f, %.02f)\n", x, y, dx, dy);
     schedule_event(RENDER_EVENT);
   }
@@ -346,55 +759,6 @@ static void ui_mouse_wheel(fz_context *ctx, ui_state *ui, float dx, float dy, in
 
 /* Stdin polling */
 
-static int SDLCALL poll_stdin_thread_main(void *data)
-{
-  int *pipes = data;
-  char c;
-  int n;
-
-  while (1)
-  {
-    n = read(pipes[0], &c, 1);
-    if (n == -1)
-    {
-      if (errno == EINTR)
-        continue;
-      return 1;
-    }
-
-    if (n == 0)
-      return 1;
-
-    if (c == 'q')
-      return 0;
-
-    if (c != 'c')
-      abort();
-
-    struct pollfd fds[2];
-    fds[0].fd = STDIN_FILENO;
-    fds[0].events = POLLRDNORM;
-    fds[0].revents = 0;
-    fds[1].fd = pipes[0];
-    fds[1].events = POLLRDNORM;
-    fds[1].revents = 0;
-
-    while (1)
-    {
-      n = poll(fds, 2, -1);
-      if (n == -1)
-      {
-        if (errno == EINTR)
-          continue;
-        return 1;
-      }
-      if ((fds[0].revents & POLLRDNORM) != 0)
-        schedule_event(STDIN_EVENT);
-      break;
-    }
-  }
-}
-
 static bool poll_stdin(void)
 {
   struct pollfd fd;
@@ -404,20 +768,6 @@ static bool poll_stdin(void)
   return (poll(&fd, 1, 0) == 1) && ((fd.revents & POLLRDNORM) != 0);
 }
 
-static void wakeup_poll_thread(int poll_stdin_pipe[2], char c)
-{
-  while (1)
-  {
-    int n = write(poll_stdin_pipe[1], &c, 1);
-    if (n == 1)
-      break;
-    if (n == -1 && errno == EINTR)
-      continue;
-    perror("write(poll_stdin_pipe, _, _)");
-    break;
-  }
-}
-
 /* Command interpreter */
 
 enum pan_to { PAN_TO_TOP, PAN_TO_BOTTOM };
@@ -446,7 +796,9 @@ static void previous_page(fz_context *ctx, ui_state *ui, bool pan)
     // The new page has not been loaded yet, so we compute the coordinate with
     // respect to the page currently displayed. Most of the time, pages have the
     // same dimension, so this is fine.
-    if (pan)
+    if (ui->continuous)
+      ui->scroll = 0;
+    else if (pan)
       pan_to(ctx, ui, PAN_TO_BOTTOM);
 
     schedule_event(RELOAD_EVENT);
@@ -458,7 +810,8 @@ static void next_page(fz_context *ctx, ui_state *ui, bool pan)
   synctex_set_target(ui->eng->synctex(__null), 0, NULL, 0);
   ui->page += 1;
   // FIXME: Same remark as in previous_page.
-  if (pan) pan_to(ctx, ui, PAN_TO_TOP);
+  if (ui->continuous) ui->scroll = 0;
+  else if (pan) pan_to(ctx, ui, PAN_TO_TOP);
   schedule_event(RELOAD_EVENT);
 }
 
@@ -478,6 +831,14 @@ static void ui_pan(fz_context *ctx, ui_state *ui, float factor)
   //fprintf(stderr, "ui_pan: factor:%.02f delta:%.02f current:%.02f range:%.02f\n",
   //        factor, delta, config->pan.y, range);
 
+  // Pages follow each other, there is no need to turn them
+  if (ui->continuous)
+  {
+    ui->scroll -= delta;
+    schedule_event(RENDER_EVENT);
+    return;
+  }
+
   if (config->pan.y == -range && factor < 0)
   {
     next_page(ctx, ui, 1);
@@ -557,87 +918,12 @@ static const char *relative_path(const char *path, const char *dir, int *go_up)
 
 static int find_diff(const fz_buffer *buf, const void *data, int size)
 {
-  const unsigned char *ptr = data;
-  int i, len = fz_mini(buf->len, size);
-  for (i = 0; i < len && buf->data[i] == ptr[i]; ++i);
-  fprintf(stderr, "i:%d len:%d size:%d\n", i, (int)buf->len, size);
+  int i = txp_memdiff(buf->data, data, fz_mini(buf->len, size));
+  txp_debug(TXP_LOG_MAIN, "[command] first difference at %d (known %d bytes, new %d bytes)\n",
+            i, (int)buf->len, size);
   return i;
 }
 
-static int utf16_to_utf8_index(const uint8_t *utf8, size_t utf8_len, size_t utf16_pos)
-{
-  size_t utf16_count = 0;
-  for (size_t i = 0; i < utf8_len;)
-  {
-    uint8_t byte = utf8[i];
-    if ((byte & 0x80) == 0)
-    {
-      // 1-byte UTF-8 character
-      utf16_count++;
-      i++;
-    }
-    else if ((byte & 0xE0) == 0xC0)
-    {
-      // 2-byte UTF-8 character
-      utf16_count++;
-      i += 2;
-    }
-    else if ((byte & 0xF0) == 0xE0)
-    {
-      // 3-byte UTF-8 character
-      utf16_count++;
-      i += 3;
-    }
-    else if ((byte & 0xF8) == 0xF0)
-    {
-      // 4-byte UTF-8 character
-      utf16_count += 2;  // surrogate pair in UTF-16
-      i += 4;
-    }
-    if (utf16_count > utf16_pos)
-    {
-      return i - (utf16_count > utf16_pos + 1
-                      ? (utf16_count == utf16_pos + 2 ? 4 : 2)
-                      : 1);
-    }
-    if (byte == '\n') return -1;
-  }
-  return -1;  // position out of bounds
-}
-
-static int utf8_index_to_offset(const uint8_t *utf8, size_t boundary_offset, size_t utf8_pos)
-{
-  size_t utf16_count = 0;
-  size_t offset = 0;
-  for (size_t i = 0; i < utf8_pos; ++i)
-  {
-    uint8_t byte = utf8[offset];
-    if ((byte & 0x80) == 0)
-    {
-      // 1-byte UTF-8 character
-      offset++;
-    }
-    else if ((byte & 0xE0) == 0xC0)
-    {
-      // 2-byte UTF-8 character
-      offset += 2;
-    }
-    else if ((byte & 0xF0) == 0xE0)
-    {
-      // 3-byte UTF-8 character
-      offset += 3;
-    }
-    else if ((byte & 0xF8) == 0xF0)
-    {
-      // 4-byte UTF-8 character
-      offset += 4;
-    }
-    if (byte == '\n') return -1; // these operations are intended to only run on a single line
-    if (offset >= boundary_offset) return -1; // out of bounds
-  }
-  return offset;
-}
-
 static void realize_change(struct persistent_state *ps,
                            ui_state *ui,
                            struct editor_change *op)
@@ -646,156 +932,127 @@ static void realize_change(struct persistent_state *ps,
   const char *path = relative_path(op->path, ps->doc_path, &go_up);
   if (go_up > 0)
   {
-    fprintf(stderr, "[command] change %s: file has a different root, skipping\n", path);
+    txp_info(TXP_LOG_MAIN, "[command] change %s: file has a different root, skipping\n", path);
     return;
   }
 
   fileentry_t *e = ui->eng->find_file(path);
   if (!e)
   {
-    fprintf(stderr, "[command] change %s: file not found, skipping\n", path);
+    txp_info(TXP_LOG_MAIN, "[command] change %s: file not found, skipping\n", path);
     return;
   }
 
-  fz_buffer *b = e->edit_data;
+  textbuf_t *b = e->edit_data;
   if (!b)
   {
-    fprintf(stderr, "[command] change %s: file not opened, skipping\n", path);
+    txp_info(TXP_LOG_MAIN, "[command] change %s: file not opened, skipping\n", path);
     return;
   }
 
   int offset = op->span.offset, remove = op->span.remove, length = op->length;
+  int len = textbuf_length(b);
 
   if (op->base == editor_change::BASE_LINE)
   {
     // Compute byte offsets from line offsets
     int line = offset, count = remove;
 
-    offset = remove = 0;
-
-    uint8_t *p = b->data;
-    size_t len = b->len;
-
-    while (line > 0 && offset < len)
-    {
-      if (p[offset] == '\n')
-        line -= 1;
-      offset++;
-    }
-
-    if (line > 0)
+    offset = textbuf_line_offset(b, line);
+    if (offset == -1)
     {
-      fprintf(stderr, "[command] change line %s: invalid line number, skipping\n", path);
+      txp_info(TXP_LOG_MAIN, "[command] change line %s: invalid line number, skipping\n", path);
       return;
     }
 
-    remove = offset;
-    while (count > 0 && remove < len)
+    // The last line might not be terminated by '\n'
+    remove = textbuf_line_offset(b, line + count);
+    if (remove == -1)
     {
-      if (p[remove] == '\n')
-        count -= 1;
-      remove++;
-    }
-
-    if (count > 1)
-    {
-      fprintf(stderr, "[command] change line %s: invalid line count, skipping\n", path);
-      return;
+      if (line + count - textbuf_line_count(b) > 1)
+      {
+        txp_info(TXP_LOG_MAIN, "[command] change line %s: invalid line count, skipping\n", path);
+        return;
+      }
+      remove = len;
     }
 
     remove -= offset;
   }
   else if (op->base == editor_change::BASE_RANGE)
   {
-    // Compute byte offsets from line offsets
-    int line = op->range.start_line;
-    offset = remove = 0;
-
-    uint8_t *p = b->data;
-    size_t len = b->len;
-
-    while (line > 0 && offset < len)
-    {
-      if (p[offset] == '\n') line -= 1;
-      offset++;
-    }
-
-    if (line > 0)
+    // Compute byte offsets from line and column offsets
+    if (op->range.start_line > textbuf_line_count(b))
     {
-      fprintf(stderr, "[command] change range %s: invalid start line, skipping\n", path);
+      txp_info(TXP_LOG_MAIN, "[command] change range %s: invalid start line, skipping\n", path);
       return;
     }
 
-    int start_char_offset = utf8_index_to_offset(p + offset, len - offset, op->range.start_char);
-    if (start_char_offset == -1)
+    offset = textbuf_column_offset(b, op->range.start_line,
+                                   op->range.start_char);
+    if (offset == -1)
     {
-      fprintf(stderr, "[command] change range %s: invalid start char, skipping\n", path);
+      txp_info(TXP_LOG_MAIN, "[command] change range %s: invalid start char, skipping\n", path);
       return;
     }
 
-    remove = offset;
-    offset += start_char_offset;
-
-    line = op->range.end_line - op->range.start_line;
-    if (line < 0)
+    if (op->range.end_line < op->range.start_line ||
+        op->range.end_line > textbuf_line_count(b))
     {
-      fprintf(stderr, "[command] change range %s: invalid end line, skipping\n", path);
+      txp_info(TXP_LOG_MAIN, "[command] change range %s: invalid end line, skipping\n", path);
       return;
     }
 
-    while (line > 0 && remove < len)
-    {
-      if (p[remove] == '\n') line -= 1;
-      remove++;
-    }
-
-    if (line > 0)
+    remove = textbuf_column_offset(b, op->range.end_line,
+                                   op->range.end_char);
+    if (remove == -1)
     {
-      fprintf(stderr, "[command] change range %s: invalid end line, skipping\n", path);
+      txp_info(TXP_LOG_MAIN, "[command] change range %s: invalid end char, skipping\n", path);
       return;
     }
 
-    int end_char_offset = utf8_index_to_offset(p + remove, len - remove, op->range.end_char);
-    if (end_char_offset == -1)
-    {
-      fprintf(stderr, "[command] change range %s: invalid end char, skipping\n", path);
-      return;
-    }
-
-    remove += end_char_offset;
     remove -= offset;
   }
 
-  if (remove < 0 || offset < 0 || offset + remove > b->len)
+  if (remove < 0 || offset < 0 || offset + remove > len)
   {
-    fprintf(stderr, "[command] change %s: invalid range, skipping\n", path);
+    txp_info(TXP_LOG_MAIN, "[command] change %s: invalid range, skipping\n", path);
     return;
   }
 
-  if (b->len - remove + length > b->cap)
-    fz_resize_buffer(ps->ctx, b, b->len - remove + length + 128);
-
-  memmove(b->data + offset + length, b->data + offset + remove,
-          b->len - offset - remove);
+  textbuf_replace(ps->ctx, b, offset, remove, op->data, length);
 
-  b->len = b->len - remove + length;
-
-  memmove(b->data + offset, op->data, length);
-
-  fprintf(stderr, "[command] change %s: changed offset %d\n", path, offset);
+  txp_debug(TXP_LOG_MAIN, "[command] change %s: changed offset %d\n", path, offset);
   ui->eng->notify_file_changes(e, offset);
 }
 
 #define BUFFERED_OPS 64
 #define BUFFERED_CHARS 4096
 
+// Changes are delayed while TeX completes the page being viewed, so that it
+// is not restarted at each keystroke. Once typing pauses for SPECULATE_DELAY
+// milliseconds, they are applied without waiting for the page: TeX starts
+// typesetting the edit right away from the snapshot at the fence, and a newer
+// edit just rolls it back again.
+#define SPECULATE_DELAY 120
+
 struct {
   char buffer[BUFFERED_CHARS];
   int cursor;
   struct editor_change op[BUFFERED_OPS];
   int count;
+  uint32_t ticks;
 } delayed_changes = {0,};
 
+// Milliseconds left before delayed changes should be applied, -1 if none
+static int pending_changes_delay(void)
+{
+  if (delayed_changes.count == 0)
+    return -1;
+  uint32_t elapsed = SDL_GetTicks() - delayed_changes.ticks;
+  return elapsed >= SPECULATE_DELAY ? 0 : SPECULATE_DELAY - elapsed;
+}
+
 static void flush_changes(struct persistent_state *ps,
                           ui_state *ui)
 {
@@ -816,6 +1073,7 @@ static void interpret_change(struct persistent_state *ps,
                              ui_state *ui,
                              struct editor_change *op)
 {
+  latency_edit();
   int plen = strlen(op->path);
   int page_count = ui->eng->page_count();
   int cursor = delayed_changes.cursor;
@@ -837,6 +1095,7 @@ static void interpret_change(struct persistent_state *ps,
     delayed_changes.op[delayed_changes.count].path = op_path;
     delayed_changes.op[delayed_changes.count].data = op_data;
     delayed_changes.count += 1;
+    delayed_changes.ticks = SDL_GetTicks();
   }
   else
   {
@@ -845,24 +1104,26 @@ static void interpret_change(struct persistent_state *ps,
   }
 }
 
+// If buffer is not NULL, it holds data and is shared with the new text
 static void interpret_open(struct persistent_state *ps,
                            ui_state *ui,
                            const char *path,
                            const void *data,
-                           int size)
+                           int size,
+                           fz_buffer *buffer)
 {
   int go_up = 0;
   path = relative_path(path, ps->doc_path, &go_up);
   if (go_up > 0)
   {
-    fprintf(stderr, "[command] open %s: file has a different root, skipping\n", path);
+    txp_info(TXP_LOG_MAIN, "[command] open %s: file has a different root, skipping\n", path);
     return;
   }
 
   fileentry_t *e = ui->eng->find_file(path);
   if (!e)
   {
-    fprintf(stderr, "[command] open %s: file not found, skipping\n", path);
+    txp_info(TXP_LOG_MAIN, "[command] open %s: file not found, skipping\n", path);
     return;
   }
 
@@ -872,24 +1133,24 @@ static void interpret_open(struct persistent_state *ps,
 
   if (e->edit_data)
   {
-    fprintf(stderr, "[command] open %s: known file, updating\n", path);
-    changed = find_diff(e->edit_data, data, size);
-    if (e->edit_data->cap < size)
-      fz_resize_buffer(ps->ctx, e->edit_data, size + 128);
-    e->edit_data->len = size;
-    memcpy(e->edit_data->data, data, size);
+    txp_info(TXP_LOG_MAIN, "[command] open %s: known file, updating\n", path);
+    changed = find_diff(textbuf_buffer(ps->ctx, e->edit_data), data, size);
+    textbuf_free(ps->ctx, e->edit_data);
+    e->edit_data = buffer ? textbuf_new_from_buffer(ps->ctx, buffer)
+                          : textbuf_new(ps->ctx, data, size);
   }
   else
   {
-    fprintf(stderr, "[command] open %s: new file\n", path);
-    e->edit_data = fz_new_buffer_from_copied_data(ps->ctx, data, size);
+    txp_info(TXP_LOG_MAIN, "[command] open %s: new file\n", path);
+    e->edit_data = buffer ? textbuf_new_from_buffer(ps->ctx, buffer)
+                          : textbuf_new(ps->ctx, data, size);
     if (e->fs_data)
       changed = find_diff(e->fs_data, data, size);
   }
 
   if (changed >= 0)
   {
-    fprintf(stderr, "[command] open %s: changed offset is %d\n", path, changed);
+    txp_info(TXP_LOG_MAIN, "[command] open %s: changed offset is %d\n", path, changed);
     ui->eng->notify_file_changes(e, changed);
   }
 }
@@ -902,20 +1163,20 @@ static void interpret_close(struct persistent_state *ps,
   path = relative_path(path, ps->doc_path, &go_up);
   if (go_up > 0)
   {
-    fprintf(stderr, "[command] close %s: file has a different root, skipping\n", path);
+    txp_info(TXP_LOG_MAIN, "[command] close %s: file has a different root, skipping\n", path);
     return;
   }
 
   fileentry_t *e = ui->eng->find_file(path);
   if (!e)
   {
-    fprintf(stderr, "[command] close %s: file not found, skipping\n", path);
+    txp_info(TXP_LOG_MAIN, "[command] close %s: file not found, skipping\n", path);
     return;
   }
 
   if (!e->edit_data)
   {
-    fprintf(stderr, "[command] close %s: file not opened, skipping\n", path);
+    txp_info(TXP_LOG_MAIN, "[command] close %s: file not opened, skipping\n", path);
     return;
   }
 
@@ -924,15 +1185,21 @@ static void interpret_close(struct persistent_state *ps,
   int changed = 0;
 
   if (e->fs_data)
-    changed = find_diff(e->fs_data, e->edit_data->data, e->edit_data->len);
+  {
+    fz_buffer *b = textbuf_buffer(ps->ctx, e->edit_data);
+    changed = find_diff(e->fs_data, b->data, b->len);
+  }
 
-  fz_drop_buffer(ps->ctx, e->edit_data);
+  textbuf_free(ps->ctx, e->edit_data);
   e->edit_data = NULL;
 
-  fprintf(stderr, "[command] close %s: closing, changed offset %d\n", path,
-          changed);
+  txp_info(TXP_LOG_MAIN, "[command] close %s: closing, changed offset %d\n", path,
+           changed);
 
   ui->eng->notify_file_changes(e, changed);
+
+  // Changes saved to disk while the file was open were not scanned
+  ui->eng->detect_changes();
 }
 
 static uint32_t convert_color(fz_context *ctx, vstack *stack, float frgb[3])
@@ -947,9 +1214,21 @@ static uint32_t convert_color(fz_context *ctx, vstack *stack, float frgb[3])
 
 static void display_page(struct persistent_state *ps, ui_state *ui)
 {
-  fz_display_list *dl = ui->eng->render_page(ui->page);
-  txp_renderer_set_contents(ps->ctx, ui->doc_renderer, dl);
-  fz_drop_display_list(ps->ctx, dl);
+  uint64_t start = latency_now();
+  if (ui->continuous)
+  {
+    refresh_slots(ps->ctx, ui);
+    latency_span("render_page", start);
+  }
+  else
+  {
+    fz_display_list *dl = ui->eng->render_page(ui->page);
+    latency_span("render_page", start);
+    txp_renderer_set_contents(ps->ctx, ui->doc_renderer, dl);
+    fz_drop_display_list(ps->ctx, dl);
+    find_slot(ui, ui->doc_renderer)->page = ui->page;
+  }
+  latency_contents();
   schedule_event(RENDER_EVENT);
 }
 
@@ -959,8 +1238,8 @@ SDL_SetWindowAlwaysOnTop(SDL_Window *window, SDL_bool state)
 {
   (void)window;
   (void)state;
-  fprintf(stderr, "[info] stay-on-top feature is not available with "
-                  "SDL older than 2.16.0\n");
+  txp_info(TXP_LOG_MAIN, "[info] stay-on-top feature is not available with "
+                          "SDL older than 2.16.0\n");
 }
 #endif
 
@@ -977,16 +1256,46 @@ static void interpret_command(struct persistent_state *ps,
   switch (cmd.tag)
   {
     case EDIT_OPEN:
-      interpret_open(ps, ui, cmd.open.path, cmd.open.data, cmd.open.length);
-      break;
+    {
+      // Text buffers created here are accounted as file contents
+      int tag = txp_mem_enter(TXP_MEM_FILES);
+      fz_try(ps->ctx)
+      {
+        interpret_open(ps, ui, cmd.open.path, cmd.open.data, cmd.open.length,
+                       cmd.open.buffer);
+      }
+      fz_always(ps->ctx)
+      {
+        txp_mem_leave(tag);
+      }
+      fz_catch(ps->ctx)
+      {
+        fz_rethrow(ps->ctx);
+      }
+    }
+    break;
 
     case EDIT_CLOSE:
       interpret_close(ps, ui, cmd.close.path);
       break;
 
     case EDIT_CHANGE:
-      interpret_change(ps, ui, &cmd.change);
-      break;
+    {
+      int tag = txp_mem_enter(TXP_MEM_FILES);
+      fz_try(ps->ctx)
+      {
+        interpret_change(ps, ui, &cmd.change);
+      }
+      fz_always(ps->ctx)
+      {
+        txp_mem_leave(tag);
+      }
+      fz_catch(ps->ctx)
+      {
+        fz_rethrow(ps->ctx);
+      }
+    }
+    break;
 
     case EDIT_THEME:
     {
@@ -996,8 +1305,8 @@ static void interpret_command(struct persistent_state *ps,
       config->foreground_color = convert_color(ps->ctx, stack, cmd.theme.fg);
       config->themed_color = 1;
       schedule_event(RENDER_EVENT);
-      fprintf(stderr, "[command] theme %x %x\n",
-              config->background_color, config->foreground_color);
+      txp_info(TXP_LOG_MAIN, "[command] theme %x %x\n",
+               config->background_color, config->foreground_color);
     }
     break;
 
@@ -1017,8 +1326,8 @@ static void interpret_command(struct persistent_state *ps,
       SDL_SetWindowPosition(ui->window, x, y);
       SDL_GetWindowPosition(ui->window, &x0, &y0);
       SDL_SetWindowSize(ui->window, w + x - x0, h + y - y0);
-      fprintf(stderr, "[command] move-window %f %f %f %f (pos: %d %d)\n",
-              x, y, w, h, x0, y0);
+      txp_info(TXP_LOG_MAIN, "[command] move-window %f %f %f %f (pos: %d %d)\n",
+               x, y, w, h, x0, y0);
     }
     break;
 
@@ -1032,8 +1341,8 @@ static void interpret_command(struct persistent_state *ps,
       SDL_SetWindowPosition(ui->window, x, y);
       SDL_GetWindowPosition(ui->window, &x0, &y0);
       SDL_SetWindowSize(ui->window, w + x - x0, h + y - y0);
-      fprintf(stderr, "[command] map-window %f %f %f %f (pos: %d %d)\n",
-              x, y, w, h, x0, y0);
+      txp_info(TXP_LOG_MAIN, "[command] map-window %f %f %f %f (pos: %d %d)\n",
+               x, y, w, h, x0, y0);
     }
     break;
 
@@ -1042,7 +1351,7 @@ static void interpret_command(struct persistent_state *ps,
       if (!(SDL_GetWindowFlags(ui->window) & SDL_WINDOW_INPUT_FOCUS))
         SDL_SetWindowBordered(ui->window, SDL_TRUE);
       SDL_SetWindowAlwaysOnTop(ui->window, SDL_FALSE);
-      fprintf(stderr, "[command] unmap-window\n");
+      txp_info(TXP_LOG_MAIN, "[command] unmap-window\n");
     }
 
     case EDIT_RESCAN:
@@ -1051,7 +1360,7 @@ static void interpret_command(struct persistent_state *ps,
 
     case EDIT_STAY_ON_TOP:
       SDL_SetWindowAlwaysOnTop(ui->window, (SDL_bool) cmd.stay_on_top.status);
-      fprintf(stderr, "[command] stay-on-top %d\n", cmd.stay_on_top.status);
+      txp_info(TXP_LOG_MAIN, "[command] stay-on-top %d\n", cmd.stay_on_top.status);
       break;
 
     case EDIT_SYNCTEX_FORWARD:
@@ -1062,9 +1371,9 @@ static void interpret_command(struct persistent_state *ps,
       const char *path = relative_path(cmd.synctex_forward.path, ps->doc_path, &go_up);
       if (go_up > 0)
       {
-        fprintf(stderr,
-                "[command] synctex-forward %s: file has a different root, skipping\n",
-                path);
+        txp_info(TXP_LOG_MAIN,
+                 "[command] synctex-forward %s: file has a different root, skipping\n",
+                 path);
       }
       else
       {
@@ -1090,6 +1399,15 @@ static void interpret_command(struct persistent_state *ps,
       schedule_event(RENDER_EVENT);
     }
     break;
+    case EDIT_MEMORY:
+    {
+      // Rates are measured since the previous query
+      static struct txp_mem_window window;
+      struct txp_mem_sample samples[TXP_MEM_TAGS];
+      bool ok = txp_memstat_sample(&window, samples);
+      editor_memory(ok ? samples : NULL);
+    }
+    break;
   }
 }
 
@@ -1099,6 +1417,9 @@ bool texpresso_main(struct persistent_state *ps)
 {
   editor_set_protocol(ps->protocol);
   editor_set_line_output(ps->line_output);
+  latency_init(ps->trace_path);
+  txp_log_init();
+  txp_memstat_attach(ps->memstat, ps->memory_summary);
   pstate = ps;
 
   ui_state raw_ui, *ui = &raw_ui;
@@ -1112,16 +1433,21 @@ bool texpresso_main(struct persistent_state *ps)
 
   char tectonic_path[4096];
   find_tectonic(tectonic_path, ps->exe_path);
-  fprintf(stderr, "[info] tectonic path: %s\n", tectonic_path);
+  txp_info(TXP_LOG_MAIN, "[info] tectonic path: %s\n", tectonic_path);
 
-  // Disable other engines for now
-  // if (doc_ext && strcmp(doc_ext, "pdf") == 0)
-  //   ui->eng = txp_create_pdf_engine(ps->ctx, ps->doc_name);
-  // else if (doc_ext && (strcmp(doc_ext, "dvi") == 0 || strcmp(doc_ext, "xdv") == 0))
-  //   ui->eng = txp_create_dvi_engine(ps->ctx, tectonic_path, ps->doc_path, ps->doc_name);
-  // else
-  ui->eng = new txp::TexEngine(*ps->ctx, tectonic_path, ps->inclusion_path,
-                               ps->doc_path, ps->doc_name);
+  // Like the engine, its context lives until the process exits
+  ui->engine_ctx = fz_clone_context(ps->ctx);
+  if (!ui->engine_ctx)
+    abort();
+
+  if (doc_ext && strcmp(doc_ext, "pdf") == 0)
+    ui->eng = new txp::PDFEngine(*ui->engine_ctx, ps->doc_name);
+  else if (doc_ext && (strcmp(doc_ext, "dvi") == 0 || strcmp(doc_ext, "xdv") == 0))
+    ui->eng = new txp::DVIEngine(*ui->engine_ctx, tectonic_path, ps->doc_path, ps->doc_name);
+  else
+    ui->eng = new txp::TexEngine(*ui->engine_ctx, tectonic_path, ps->inclusion_path,
+                                 ps->doc_path, ps->doc_name,
+                                 ps->snapshot_budget);
 
   ui->sdl_renderer = ps->renderer;
   ui->doc_renderer = txp_renderer_new(ps->ctx, ui->sdl_renderer);
@@ -1131,6 +1457,8 @@ bool texpresso_main(struct persistent_state *ps)
     ui->page = ps->initial.page;
     ui->zoom = ps->initial.zoom;
     ui->need_synctex = ps->initial.need_synctex;
+    ui->continuous = ps->initial.continuous;
+    ui->scroll = ps->initial.scroll;
     *txp_renderer_get_config(ps->ctx, ui->doc_renderer) = ps->initial.config;
     txp_renderer_set_contents(ps->ctx, ui->doc_renderer, ps->initial.display_list);
     editor_reset_sync();
@@ -1140,18 +1468,42 @@ bool texpresso_main(struct persistent_state *ps)
     ui->page = 0;
     ui->zoom = 0;
     ui->need_synctex = 1;
+    ui->continuous = 0;
+    ui->scroll = 0;
   }
 
+  ui->last_page = ui->want_page = ui->page;
+  for (int i = 0; i < PAGE_SLOTS; i++)
+    ui->slots[i] = (page_slot){.renderer = NULL, .page = -1};
+  ui->slots[0].renderer = ui->doc_renderer;
+  if (ps->initial.initialized)
+    ui->slots[0].page = ui->page;
+
   ui->mouse_status = UI_MOUSE_NONE;
   ui->last_mouse_x = -1000;
   ui->last_mouse_y = -1000;
   ui->last_click_ticks = SDL_GetTicks() - 200000000;
+  ui->mouse_renderer = ui->doc_renderer;
+  ui->advancing = 0;
+  ui->last_activity = SDL_GetTicks();
+
+  // The lock is held by the UI outside of waits and drawing
+  ui->engine_lock = SDL_CreateMutex();
+  ui->reactor = reactor_new(ps->ctx);
+  if (!ui->engine_lock)
+    abort();
+  SDL_AtomicSet(&ui->ui_waiting, 0);
+  ui->engine_quit = 0;
+  SDL_LockMutex(ui->engine_lock);
 
   bool quit = 0, reload = 0;
   ui->eng->step(true);
   render(ps->ctx, ui);
   schedule_event(RELOAD_EVENT);
 
+  // Start the engine thread
+  ui->engine_thread = SDL_CreateThread(engine_thread_main, "engine_thread", ui);
+
   struct repaint_on_resize_env repaint_on_resize_env = {.ctx = ps->ctx, .ui = ui};
   SDL_AddEventWatch(repaint_on_resize, &repaint_on_resize_env);
 
@@ -1159,16 +1511,6 @@ bool texpresso_main(struct persistent_state *ps)
   prot_parser cmd_parser;
   prot_initialize(&cmd_parser, (ps->protocol == EDITOR_JSON));
 
-  // Start watching stdin
-  int poll_stdin_pipe[2];
-  if (pipe(poll_stdin_pipe) == -1)
-  {
-    perror("pipe");
-    abort();
-  }
-
-  SDL_Thread *poll_stdin_thread =
-    SDL_CreateThread(poll_stdin_thread_main, "poll_stdin_thread", poll_stdin_pipe);
   bool stdin_eof = 0;
 
   while (!quit)
@@ -1178,9 +1520,9 @@ bool texpresso_main(struct persistent_state *ps)
 
     // Process stdin
     ui->eng->begin_changes();
-    char buffer[4096];
+    char buffer[65536];
     int n = -1;
-    while (!stdin_eof && poll_stdin() && (n = read(STDIN_FILENO, buffer, 4096)) != 0)
+    while (!stdin_eof && poll_stdin() && (n = read(STDIN_FILENO, buffer, sizeof(buffer))) != 0)
     {
       if (n == -1)
       {
@@ -1190,7 +1532,11 @@ bool texpresso_main(struct persistent_state *ps)
         break;
       }
 
-      fprintf(stderr, "stdin: %.*s\n", n, buffer);
+      ui->last_activity = SDL_GetTicks();
+
+      // Don't echo whole files sent by open commands
+      txp_debug(TXP_LOG_MAIN, "stdin: %.*s%s\n", fz_mini(n, 256), buffer,
+                n > 256 ? "..." : "");
 
       const char *ptr = buffer, *lim = buffer + n;
       fz_try(ps->ctx)
@@ -1208,39 +1554,60 @@ bool texpresso_main(struct persistent_state *ps)
       }
       fz_catch(ps->ctx)
       {
-        fprintf(stderr, "error while reading stdin commands: %s\n",
-                fz_caught_message(ps->ctx));
+        txp_error(TXP_LOG_MAIN, "error while reading stdin commands: %s\n",
+                  fz_caught_message(ps->ctx));
         vstack_reset(ps->ctx, cmd_stack);
         prot_reinitialize(&cmd_parser);
       }
     }
     if (n == 0) stdin_eof = 1;
 
+    if (pending_changes_delay() == 0)
+      flush_changes(ps, ui);
+
     if (ui->eng->end_changes())
     {
       ui->eng->step(true);
       schedule_event(RELOAD_EVENT);
     }
+    editor_sync(0);
+    txp_memstat_tick();
+    fflush(stdout);
+    txp_log_flush();
 
     // Process document
     {
-      int before_page_count = ui->eng->page_count();
-      bool advance = advance_engine(ps->ctx, ui);
-      int after_page_count = ui->eng->page_count();
-      fflush(stdout);
-
-      if (ui->page >= before_page_count && ui->page < after_page_count)
-        schedule_event(RELOAD_EVENT);
-
       if (!has_event)
       {
-        if (advance) continue;
+        // Stdin was drained, be notified of the next input
         if (!stdin_eof)
-          wakeup_poll_thread(poll_stdin_pipe, 'c');
-        has_event = SDL_WaitEvent(&e);
+          reactor_arm(ui->reactor, WATCH_STDIN, STDIN_FILENO);
+        int delay = pending_changes_delay();
+        bool refining = txp_renderer_is_refining(ps->ctx, ui->doc_renderer);
+
+        // The engine thread advances TeX while the UI is waiting
+        engine_unlock(ui);
+        if (delay > 0)
+          // Wake up to apply the delayed changes
+          has_event = SDL_WaitEventTimeout(&e, delay);
+        else if (refining)
+          // A progressive zoom is pending: refine it when input is idle
+          has_event = SDL_WaitEventTimeout(&e, 30);
+        else
+          has_event = SDL_WaitEvent(&e);
+        engine_lock(ui);
+
         if (!has_event)
         {
-          fprintf(stderr, "SDL_WaitEvent error: %s\n", SDL_GetError());
+          if (delay > 0)
+            continue;
+          if (refining)
+          {
+            txp_renderer_refine(ps->ctx, ui->doc_renderer);
+            render(ps->ctx, ui);
+            continue;
+          }
+          txp_error(TXP_LOG_MAIN, "SDL_WaitEvent error: %s\n", SDL_GetError());
           break;
         }
       }
@@ -1250,21 +1617,24 @@ bool texpresso_main(struct persistent_state *ps)
       int page = -1, x = -1, y = -1;
       if (synctex_find_target(ps->ctx, stx, buf, &page, &x, &y))
       {
-        fprintf(stderr, "[synctex forward] sync: hit page %d, coordinates (%d, %d)\n",
-                page, x, y);
+        txp_debug(TXP_LOG_MAIN, "[synctex forward] sync: hit page %d, coordinates (%d, %d)\n",
+                  page, x, y);
 
         if (page != ui->page)
         {
           ui->page = page;
+          ui->scroll = 0;
           display_page(ps, ui);
         }
+        if (ui->continuous)
+          continuous_layout(ps->ctx, ui);
 
         // FIXME: Scroll to point
         float f = ui->eng->scale_factor();
         fz_point p = fz_make_point(f * x, f * y);
         fz_point pt = txp_renderer_document_to_screen(ps->ctx, ui->doc_renderer, p);
-        fprintf(stderr, "[synctex forward] position on screen: (%.02f, %.02f)\n",
-                pt.x, pt.y);
+        txp_debug(TXP_LOG_MAIN, "[synctex forward] position on screen: (%.02f, %.02f)\n",
+                  pt.x, pt.y);
         int w, h;
         txp_renderer_screen_size(ps->ctx, ui->doc_renderer, &w, &h);
         float margin_lo = h / 4.0;
@@ -1278,9 +1648,12 @@ bool texpresso_main(struct persistent_state *ps)
           delta = - pt.y + margin_hi;
         else if (pt.y >= h - margin_lo)
           delta = h - pt.y - margin_hi;
-        fprintf(stderr, "[synctex forward] pan.y = %.02f + %.02f = %.02f\n",
-                config->pan.y, delta, config->pan.y + delta);
-        config->pan.y += delta;
+        txp_debug(TXP_LOG_MAIN, "[synctex forward] pan.y = %.02f + %.02f = %.02f\n",
+                  config->pan.y, delta, config->pan.y + delta);
+        if (ui->continuous)
+          ui->scroll -= delta;
+        else
+          config->pan.y += delta;
         if (delta != 0.0)
           schedule_event(RENDER_EVENT);
       }
@@ -1291,6 +1664,11 @@ bool texpresso_main(struct persistent_state *ps)
     txp_renderer_config *config =
         txp_renderer_get_config(ps->ctx, ui->doc_renderer);
 
+    if (e.type == SDL_KEYDOWN || e.type == SDL_TEXTINPUT ||
+        e.type == SDL_MOUSEWHEEL || e.type == SDL_MOUSEMOTION ||
+        e.type == SDL_MOUSEBUTTONDOWN || e.type == SDL_MOUSEBUTTONUP)
+      ui->last_activity = SDL_GetTicks();
+
     // Process event
     switch (e.type)
     {
@@ -1319,6 +1697,10 @@ bool texpresso_main(struct persistent_state *ps)
             next_page(ps->ctx, ui, 0);
             break;
 
+          case SDLK_s:
+            toggle_continuous(ps->ctx, ui);
+            break;
+
           case SDLK_p:
             config->fit = (config->fit == FIT_PAGE) ? FIT_WIDTH : FIT_PAGE;
             schedule_event(RENDER_EVENT);
@@ -1466,11 +1848,11 @@ bool texpresso_main(struct persistent_state *ps)
   }
 
   {
-    int status = 0;
-    wakeup_poll_thread(poll_stdin_pipe, 'q');
-    SDL_WaitThread(poll_stdin_thread, &status);
-    close(poll_stdin_pipe[0]);
-    close(poll_stdin_pipe[1]);
+    ui->engine_quit = 1;
+    engine_unlock(ui);
+    SDL_WaitThread(ui->engine_thread, NULL);
+    SDL_DestroyMutex(ui->engine_lock);
+    reactor_free(ps->ctx, ui->reactor);
   }
 
   SDL_DelEventWatch(repaint_on_resize, &repaint_on_resize_env);
@@ -1481,13 +1863,26 @@ bool texpresso_main(struct persistent_state *ps)
   ps->initial.page = ui->page;
   ps->initial.need_synctex = ui->need_synctex;
   ps->initial.zoom = ui->zoom;
+  ps->initial.continuous = ui->continuous;
+  ps->initial.scroll = ui->scroll;
   ps->initial.config = *txp_renderer_get_config(ps->ctx, ui->doc_renderer);
   ps->initial.display_list = txp_renderer_get_contents(ps->ctx, ui->doc_renderer);
   if (ps->initial.display_list)
     fz_keep_display_list(ps->ctx, ps->initial.display_list);
 
-  txp_renderer_free(ps->ctx, ui->doc_renderer);
+  for (int i = 0; i < PAGE_SLOTS; i++)
+    if (ui->slots[i].renderer)
+      txp_renderer_free(ps->ctx, ui->slots[i].renderer);
   // delete ui->eng; // Come back to try see if destructor could be called implicitly
 
+  // The engine thread is stopped: caches for the next session can be
+  // written from here. There is no next session to prepare on a reload.
+  if (!reload)
+  {
+    ui->eng->save_session();
+    latency_finish();
+  }
+  txp_log_flush();
+
   return reload;
 }
@@ -23,6 +23,7 @@
  */
 
 #include "myabort.h"
+#include "txp_log.h"
 #include <execinfo.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -56,6 +57,7 @@ void print_backtrace(void)
 
 void myabort_(const char *file, int line, const char *msg, uint32_t code)
 {
+  txp_log_flush();
   if (code == 42424242)
     fprintf(stderr, "Aborting from %s:%d (%s)\n", file, line, msg);
   else
@@ -0,0 +1,467 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "prerender.h"
+#include "latency.h"
+#include "txp_log.h"
+
+// Number of pages rendered ahead, before and after the current one
+#define PRERENDER_RADIUS 2
+#define PRERENDER_SLOTS (4 * PRERENDER_RADIUS + 1)
+#define PRERENDER_MAX_WORKERS 4
+
+enum slot_status {
+  SLOT_FREE,
+  SLOT_QUEUED,
+  SLOT_RUNNING,
+  SLOT_DONE,
+};
+
+struct slot {
+  enum slot_status status;
+  int page, bop, eop;
+
+  // Bytes after this offset have been invalidated while the slot was running
+  int valid;
+
+  // Input of a queued job, result of a finished one.
+  // The snapshot is a view on the first bytes of store.
+  fz_buffer *store, *snapshot;
+  fz_display_list *dl;
+};
+
+struct worker {
+  prerender_t *pr;
+  pthread_t thread;
+  fz_context *ctx;
+  incdvi_t *dvi;
+
+  // Lowest invalidated offset since the worker last synchronized its
+  // interpreter, INT_MAX if none
+  int invalid;
+};
+
+struct prerender_s {
+  pthread_mutex_t mutex;
+  pthread_cond_t queued, finished;
+  bool quit;
+
+  dvi_reshooks hooks;
+  int current;
+
+  // Copy of the DVI output shared by the jobs.
+  // Bytes below the length are never changed once the store has been handed
+  // to a job: later output is appended in place when the capacity allows,
+  // otherwise a bigger store is allocated and the old one is released by the
+  // last job using it.
+  fz_buffer *store;
+
+  struct slot slots[PRERENDER_SLOTS];
+
+  int worker_count;
+  struct worker workers[PRERENDER_MAX_WORKERS];
+};
+
+static int distance(prerender_t *pr, int page)
+{
+  return abs(page - pr->current);
+}
+
+static void release_slot(fz_context *ctx, struct slot *s)
+{
+  if (s->snapshot)
+    fz_drop_buffer(ctx, s->snapshot);
+  if (s->store)
+    fz_drop_buffer(ctx, s->store);
+  if (s->dl)
+    fz_drop_display_list(ctx, s->dl);
+  s->snapshot = NULL;
+  s->store = NULL;
+  s->dl = NULL;
+  s->status = SLOT_FREE;
+}
+
+static struct slot *find_slot(prerender_t *pr, int page, int bop, int eop)
+{
+  for (int i = 0; i < PRERENDER_SLOTS; ++i)
+  {
+    struct slot *s = &pr->slots[i];
+    if (s->status != SLOT_FREE &&
+        s->page == page && s->bop == bop && s->eop == eop)
+      return s;
+  }
+  return NULL;
+}
+
+// Find room for a page: a free slot, or the finished page that is the
+// farthest from the current one.
+static struct slot *alloc_slot(fz_context *ctx, prerender_t *pr, int page)
+{
+  struct slot *victim = NULL;
+
+  for (int i = 0; i < PRERENDER_SLOTS; ++i)
+  {
+    struct slot *s = &pr->slots[i];
+    if (s->status == SLOT_FREE)
+      return s;
+    if (s->status == SLOT_DONE &&
+        (!victim || distance(pr, s->page) > distance(pr, victim->page)))
+      victim = s;
+  }
+
+  if (!victim || distance(pr, victim->page) <= distance(pr, page))
+    return NULL;
+
+  release_slot(ctx, victim);
+  return victim;
+}
+
+static struct slot *next_job(prerender_t *pr)
+{
+  struct slot *job = NULL;
+  for (int i = 0; i < PRERENDER_SLOTS; ++i)
+  {
+    struct slot *s = &pr->slots[i];
+    if (s->status == SLOT_QUEUED &&
+        (!job || distance(pr, s->page) < distance(pr, job->page)))
+      job = s;
+  }
+  return job;
+}
+
+// Worker threads
+
+static void *worker_main(void *data)
+{
+  struct worker *w = (struct worker *)data;
+  prerender_t *pr = w->pr;
+  fz_context *ctx = w->ctx;
+
+  fz_try(ctx)
+  {
+    w->dvi = incdvi_new(ctx, dvi_borrow_hooks(pr->hooks));
+    // Results are cached by the incdvi of the engine
+    incdvi_set_cache_budget(ctx, w->dvi, 0);
+  }
+  fz_catch(ctx)
+  {
+    txp_error(TXP_LOG_RENDER, "[prerender] cannot start worker: %s\n",
+              fz_caught_message(ctx));
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pr->mutex);
+
+  while (1)
+  {
+    struct slot *s = NULL;
+    while (!pr->quit && !(s = next_job(pr)))
+      pthread_cond_wait(&pr->queued, &pr->mutex);
+    if (pr->quit)
+      break;
+
+    s->status = SLOT_RUNNING;
+    s->valid = INT_MAX;
+    int page = s->page;
+    fz_buffer *snapshot = s->snapshot;
+    fz_buffer *store = s->store;
+    s->snapshot = NULL;
+    s->store = NULL;
+    int invalid = w->invalid;
+    w->invalid = INT_MAX;
+
+    pthread_mutex_unlock(&pr->mutex);
+
+    if (invalid != INT_MAX)
+      incdvi_truncate(w->dvi, invalid);
+
+    fz_display_list *dl = NULL;
+    fz_var(dl);
+    uint64_t start = latency_now();
+    fz_try(ctx)
+    {
+      incdvi_update(ctx, w->dvi, snapshot);
+      if (page < incdvi_page_count(w->dvi))
+        dl = incdvi_display_list(ctx, w->dvi, snapshot, page);
+    }
+    fz_catch(ctx)
+    {
+      txp_error(TXP_LOG_RENDER, "[prerender] failed to render page %d: %s\n",
+                page, fz_caught_message(ctx));
+      incdvi_reset(w->dvi);
+    }
+    latency_span("prerender", start);
+    fz_drop_buffer(ctx, snapshot);
+    fz_drop_buffer(ctx, store);
+
+    pthread_mutex_lock(&pr->mutex);
+
+    if (dl && s->eop < s->valid)
+    {
+      s->dl = dl;
+      s->status = SLOT_DONE;
+    }
+    else
+    {
+      if (dl)
+        fz_drop_display_list(ctx, dl);
+      release_slot(ctx, s);
+    }
+
+    pthread_cond_broadcast(&pr->finished);
+  }
+
+  pthread_mutex_unlock(&pr->mutex);
+  return NULL;
+}
+
+static int worker_count(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  // Leave one core for the UI and one for TeX
+  cpus -= 2;
+  if (cpus < 1)
+    return 1;
+  if (cpus > PRERENDER_MAX_WORKERS)
+    return PRERENDER_MAX_WORKERS;
+  return cpus;
+}
+
+// Public API
+
+prerender_t *prerender_new(fz_context *ctx, dvi_reshooks hooks)
+{
+  prerender_t *pr = fz_malloc_struct(ctx, prerender_t);
+  pthread_mutex_init(&pr->mutex, NULL);
+  pthread_cond_init(&pr->queued, NULL);
+  pthread_cond_init(&pr->finished, NULL);
+  pr->hooks = hooks;
+
+  int count = worker_count();
+  for (int i = 0; i < count; ++i)
+  {
+    struct worker *w = &pr->workers[pr->worker_count];
+    w->pr = pr;
+    w->invalid = INT_MAX;
+    w->ctx = fz_clone_context(ctx);
+    if (!w->ctx)
+    {
+      txp_info(TXP_LOG_RENDER, "[prerender] context cannot be cloned, "
+                                "rendering on the main thread\n");
+      break;
+    }
+    if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+    {
+      perror("prerender: pthread_create");
+      fz_drop_context(w->ctx);
+      break;
+    }
+    pr->worker_count += 1;
+  }
+
+  txp_info(TXP_LOG_RENDER, "[prerender] %d render workers\n", pr->worker_count);
+  return pr;
+}
+
+void prerender_free(fz_context *ctx, prerender_t *pr)
+{
+  pthread_mutex_lock(&pr->mutex);
+  pr->quit = 1;
+  pthread_cond_broadcast(&pr->queued);
+  pthread_mutex_unlock(&pr->mutex);
+
+  for (int i = 0; i < pr->worker_count; ++i)
+  {
+    struct worker *w = &pr->workers[i];
+    pthread_join(w->thread, NULL);
+    if (w->dvi)
+      incdvi_free(w->ctx, w->dvi);
+    fz_drop_context(w->ctx);
+  }
+
+  for (int i = 0; i < PRERENDER_SLOTS; ++i)
+    release_slot(ctx, &pr->slots[i]);
+  if (pr->store)
+    fz_drop_buffer(ctx, pr->store);
+
+  pthread_cond_destroy(&pr->finished);
+  pthread_cond_destroy(&pr->queued);
+  pthread_mutex_destroy(&pr->mutex);
+  fz_free(ctx, pr);
+}
+
+void prerender_invalidate(fz_context *ctx, prerender_t *pr, int offset)
+{
+  pthread_mutex_lock(&pr->mutex);
+
+  // Running jobs may still read the bytes past offset: never rewrite them,
+  // start again from a new store.
+  if (pr->store && (int)pr->store->len > offset)
+  {
+    fz_drop_buffer(ctx, pr->store);
+    pr->store = NULL;
+  }
+
+  for (int i = 0; i < pr->worker_count; ++i)
+    if (pr->workers[i].invalid > offset)
+      pr->workers[i].invalid = offset;
+
+  for (int i = 0; i < PRERENDER_SLOTS; ++i)
+  {
+    struct slot *s = &pr->slots[i];
+    switch (s->status)
+    {
+      case SLOT_FREE:
+        break;
+      case SLOT_QUEUED:
+        // The snapshot of a queued job is stale, it will be rescheduled
+        if ((int)s->snapshot->len > offset)
+          release_slot(ctx, s);
+        break;
+      case SLOT_RUNNING:
+        if (s->valid > offset)
+          s->valid = offset;
+        break;
+      case SLOT_DONE:
+        if (s->eop >= offset)
+          release_slot(ctx, s);
+        break;
+    }
+  }
+
+  pthread_mutex_unlock(&pr->mutex);
+}
+
+fz_display_list *prerender_take(fz_context *ctx, prerender_t *pr,
+                                incdvi_t *d, int page)
+{
+  int bop, eop;
+  incdvi_page_offsets(d, page, &bop, &eop);
+
+  fz_display_list *dl = NULL;
+
+  pthread_mutex_lock(&pr->mutex);
+  pr->current = page;
+
+  struct slot *s = find_slot(pr, page, bop, eop);
+  if (s)
+  {
+    while (s->status == SLOT_RUNNING)
+      pthread_cond_wait(&pr->finished, &pr->mutex);
+    if (s->status == SLOT_DONE)
+    {
+      dl = fz_keep_display_list(ctx, s->dl);
+      release_slot(ctx, s);
+    }
+  }
+
+  pthread_mutex_unlock(&pr->mutex);
+  return dl;
+}
+
+void prerender_schedule(fz_context *ctx, prerender_t *pr,
+                        incdvi_t *d, fz_buffer *buf, int page)
+{
+  if (pr->worker_count == 0)
+    return;
+
+  int count = incdvi_page_count(d);
+  int last = fz_mini(page + PRERENDER_RADIUS, count - 1);
+  if (last < 0)
+    return;
+
+  int bop, eop;
+  incdvi_page_offsets(d, last, &bop, &eop);
+  // The snapshot has to cover the EOP of the last page
+  size_t need = eop + 1;
+
+  pthread_mutex_lock(&pr->mutex);
+  pr->current = page;
+
+  fz_try(ctx)
+  {
+    if (pr->store && pr->store->cap < need)
+    {
+      fz_drop_buffer(ctx, pr->store);
+      pr->store = NULL;
+    }
+    // Leave room for the output to grow before copying again
+    if (!pr->store)
+      pr->store = fz_new_buffer(ctx, need * 2);
+    if (pr->store->len < need)
+    {
+      size_t len = pr->store->len;
+      memcpy(pr->store->data + len, buf->data + len, need - len);
+      pr->store->len = need;
+    }
+  }
+  fz_catch(ctx)
+  {
+    pthread_mutex_unlock(&pr->mutex);
+    fz_rethrow(ctx);
+  }
+
+  bool queued = 0;
+  for (int delta = 1; delta <= PRERENDER_RADIUS; ++delta)
+  {
+    for (int side = 0; side < 2; ++side)
+    {
+      int p = side ? page - delta : page + delta;
+      if (p < 0 || p >= count)
+        continue;
+      incdvi_page_offsets(d, p, &bop, &eop);
+      if (find_slot(pr, p, bop, eop) || incdvi_is_cached(d, buf, p))
+        continue;
+      struct slot *s = alloc_slot(ctx, pr, p);
+      if (!s)
+        continue;
+      s->page = p;
+      s->bop = bop;
+      s->eop = eop;
+      fz_try(ctx)
+      {
+        s->snapshot =
+          fz_new_buffer_from_shared_data(ctx, pr->store->data, need);
+      }
+      fz_catch(ctx)
+      {
+        pthread_mutex_unlock(&pr->mutex);
+        fz_rethrow(ctx);
+      }
+      s->store = fz_keep_buffer(ctx, pr->store);
+      s->status = SLOT_QUEUED;
+      queued = 1;
+    }
+  }
+
+  if (queued)
+    pthread_cond_broadcast(&pr->queued);
+
+  pthread_mutex_unlock(&pr->mutex);
+}
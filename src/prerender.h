@@ -0,0 +1,65 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef PRERENDER_H
+#define PRERENDER_H
+
+#include <mupdf/fitz.h>
+#include "incdvi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Background construction of page display lists.
+//
+// A pool of worker threads, each with a cloned fz_context and its own DVI
+// interpreter, renders the pages around the one being displayed from a
+// read-only copy of the DVI output. Turning pages then only needs to pick up
+// a finished display list.
+
+typedef struct prerender_s prerender_t;
+
+prerender_t *prerender_new(fz_context *ctx, dvi_reshooks hooks);
+void prerender_free(fz_context *ctx, prerender_t *pr);
+
+// DVI bytes starting from offset are no longer valid (output was rolled back
+// or overwritten): drop display lists that depended on them.
+void prerender_invalidate(fz_context *ctx, prerender_t *pr, int offset);
+
+// Return a display list for the page if one is ready or being built (in this
+// case, wait for it), or NULL. The caller owns the returned reference.
+fz_display_list *prerender_take(fz_context *ctx, prerender_t *pr,
+                                incdvi_t *d, int page);
+
+// Queue the pages around `page' for background rendering, skipping those
+// that are already in the display list cache of d.
+void prerender_schedule(fz_context *ctx, prerender_t *pr,
+                        incdvi_t *d, fz_buffer *buf, int page);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*!PRERENDER_H*/
@@ -0,0 +1,201 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "reactor.h"
+
+#if defined(__linux__)
+#define REACTOR_EPOLL
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#define REACTOR_KQUEUE
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#error "reactor: neither epoll nor kqueue are available on this platform"
+#endif
+
+// Identifies the wakeup pipe among the events
+#define WAKEUP_SLOT REACTOR_SLOTS
+
+struct reactor_s
+{
+  // epoll or kqueue descriptor
+  int fd;
+
+  // Written by reactor_wakeup, always watched
+  int wakeup[2];
+
+  // Descriptor watched by each slot, -1 if none
+  int fds[REACTOR_SLOTS];
+};
+
+static void set_flags(int fd)
+{
+  fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+reactor_t *reactor_new(fz_context *ctx)
+{
+  reactor_t *r = fz_malloc_struct(ctx, reactor_t);
+  for (int i = 0; i < REACTOR_SLOTS; ++i)
+    r->fds[i] = -1;
+
+#ifdef REACTOR_EPOLL
+  r->fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+  r->fd = kqueue();
+#endif
+  if (r->fd == -1)
+  {
+    perror("[reactor] cannot create event queue");
+    abort();
+  }
+
+  if (pipe(r->wakeup) == -1)
+  {
+    perror("[reactor] pipe");
+    abort();
+  }
+  set_flags(r->wakeup[0]);
+  set_flags(r->wakeup[1]);
+
+#ifdef REACTOR_EPOLL
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = WAKEUP_SLOT;
+  if (epoll_ctl(r->fd, EPOLL_CTL_ADD, r->wakeup[0], &ev) == -1)
+#else
+  struct kevent ev;
+  EV_SET(&ev, r->wakeup[0], EVFILT_READ, EV_ADD, 0, 0, (void *)(intptr_t)WAKEUP_SLOT);
+  if (kevent(r->fd, &ev, 1, NULL, 0, NULL) == -1)
+#endif
+  {
+    perror("[reactor] cannot watch wakeup pipe");
+    abort();
+  }
+
+  return r;
+}
+
+void reactor_free(fz_context *ctx, reactor_t *r)
+{
+  close(r->wakeup[0]);
+  close(r->wakeup[1]);
+  close(r->fd);
+  fz_free(ctx, r);
+}
+
+void reactor_arm(reactor_t *r, int slot, int fd)
+{
+  int old = r->fds[slot];
+  r->fds[slot] = fd;
+
+  // Errors when forgetting the previous descriptor are expected: closing a
+  // descriptor already removes it from the queue.
+#ifdef REACTOR_EPOLL
+  if (old != -1 && old != fd)
+    epoll_ctl(r->fd, EPOLL_CTL_DEL, old, NULL);
+  if (fd == -1)
+    return;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.u32 = slot;
+  if (epoll_ctl(r->fd, EPOLL_CTL_MOD, fd, &ev) == -1 &&
+      (errno != ENOENT || epoll_ctl(r->fd, EPOLL_CTL_ADD, fd, &ev) == -1))
+    perror("[reactor] epoll_ctl");
+#else
+  struct kevent ev;
+  if (old != -1 && old != fd)
+  {
+    EV_SET(&ev, old, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(r->fd, &ev, 1, NULL, 0, NULL);
+  }
+  if (fd == -1)
+    return;
+
+  EV_SET(&ev, fd, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, (void *)(intptr_t)slot);
+  if (kevent(r->fd, &ev, 1, NULL, 0, NULL) == -1)
+    perror("[reactor] kevent");
+#endif
+}
+
+void reactor_wakeup(reactor_t *r)
+{
+  char c = 0;
+  // The pipe being full (EAGAIN) means that a wakeup is already pending
+  while (write(r->wakeup[1], &c, 1) == -1 && errno == EINTR);
+}
+
+int reactor_wait(reactor_t *r, int timeout)
+{
+  int slots[REACTOR_SLOTS + 1];
+  int n;
+
+#ifdef REACTOR_EPOLL
+  struct epoll_event evs[REACTOR_SLOTS + 1];
+  n = epoll_wait(r->fd, evs, REACTOR_SLOTS + 1, timeout);
+  for (int i = 0; i < n; ++i)
+    slots[i] = evs[i].data.u32;
+#else
+  struct kevent evs[REACTOR_SLOTS + 1];
+  struct timespec ts, *pts = NULL;
+  if (timeout >= 0)
+  {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    pts = &ts;
+  }
+  n = kevent(r->fd, NULL, 0, evs, REACTOR_SLOTS + 1, pts);
+  for (int i = 0; i < n; ++i)
+    slots[i] = (intptr_t)evs[i].udata;
+#endif
+
+  if (n == -1)
+  {
+    if (errno != EINTR)
+      perror("[reactor] wait");
+    return 0;
+  }
+
+  int ready = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    if (slots[i] == WAKEUP_SLOT)
+    {
+      char buf[64];
+      while (read(r->wakeup[0], buf, sizeof(buf)) > 0);
+    }
+    else
+      ready |= 1 << slots[i];
+  }
+  return ready;
+}
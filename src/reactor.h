@@ -0,0 +1,69 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <mupdf/fitz.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Wait for several file descriptors at once (epoll on Linux, kqueue on macOS
+// and BSDs).
+//
+// A reactor has a fixed number of slots, each watching at most one
+// descriptor for readability. Slots are one-shot: once a slot is reported by
+// reactor_wait, it has to be armed again to be reported another time. This
+// lets the thread consuming the input (e.g. the UI for stdin) decide when it
+// is interested again, without having the waiting thread spin on unread data.
+// Each slot should be armed from a single thread, reactor_wait can run on
+// another one.
+
+#define REACTOR_SLOTS 8
+
+typedef struct reactor_s reactor_t;
+
+reactor_t *reactor_new(fz_context *ctx);
+void reactor_free(fz_context *ctx, reactor_t *r);
+
+// Watch fd in slot, replacing the descriptor it was watching before.
+// An fd of -1 disarms the slot. A descriptor can be watched by only one slot.
+void reactor_arm(reactor_t *r, int slot, int fd);
+
+// Make the current or the next reactor_wait return, from any thread.
+void reactor_wakeup(reactor_t *r);
+
+// Wait until a slot is ready, reactor_wakeup is called or timeout
+// milliseconds elapsed (-1 to wait forever). Return a mask with bit (1 << slot)
+// set for each slot that became ready.
+int reactor_wait(reactor_t *r, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*!REACTOR_H*/
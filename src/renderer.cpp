@@ -24,10 +24,19 @@
 
 #include "renderer.h"
 #include "mupdf_compat.h"
+#include "latency.h"
+#include "txp_log.h"
+#include "txp_memstat.h"
+#include "tile_hash.h"
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 static float clampf(float x, float min, float max)
 {
@@ -40,6 +49,11 @@ static float clampf(float x, float min, float max)
   return x;
 }
 
+static int fz_irect_area(fz_irect r)
+{
+  return (r.x1 - r.x0) * (r.y1 - r.y0);
+}
+
 typedef struct
 {
   int w, h;
@@ -50,6 +64,101 @@ typedef struct
 
 #define SELECTION_RECT_COUNT 400
 
+// Progressive zoom: when the scale changes, the current texture is first
+// stretched by the GPU, then refined by a pass at 1/ZOOM_LOW_FACTOR of the
+// resolution and finally by a full resolution pass, while the UI is idle.
+#define ZOOM_LOW_FACTOR 4
+
+enum zoom_stage
+{
+  ZOOM_NONE,
+  ZOOM_SCALED,
+  ZOOM_LOW,
+};
+
+// Large redraws are split in tiles rasterized in parallel
+#define TILE_SIZE 256
+#define TILE_MAX_WORKERS 8
+
+enum tile_status
+{
+  TILE_PENDING,
+  TILE_RENDERING,
+  TILE_RENDERED,
+  TILE_UPLOADED,
+};
+
+typedef struct
+{
+  // Destination in texture space
+  fz_irect rect;
+  // Origin of the tile in page space
+  int x, y;
+  // Offset of the tile pixels in the scratch buffer
+  size_t offset;
+  enum tile_status status;
+} tile_job;
+
+// A rectangle of the texture and the position of its top-left corner on the
+// page
+typedef struct
+{
+  fz_irect rect;
+  int x, y;
+} texture_region;
+
+// Structured text is extracted lazily, only for a horizontal band of the
+// page around the selection, grown as the selection is extended.
+// It is kept for the last few display lists shown by the renderers sharing
+// a tile pool, so that coming back to a page does not extract it again.
+#define STEXT_MARGIN 72
+#define STEXT_CACHE_SIZE 8
+
+typedef struct
+{
+  fz_display_list *dl;
+  fz_stext_page *page;
+  fz_rect band;
+  unsigned last_use;
+} stext_entry;
+
+typedef struct tile_pool_s tile_pool;
+
+typedef struct
+{
+  tile_pool *pool;
+  fz_context *ctx;
+  SDL_Thread *thread;
+} tile_worker;
+
+struct tile_pool_s
+{
+  // Renderers sharing the pool, see txp_renderer_new_sibling
+  int refcount;
+
+  SDL_mutex *lock;
+  SDL_cond *wakeup, *rendered;
+  bool quit;
+
+  int worker_count;
+  tile_worker workers[TILE_MAX_WORKERS];
+
+  // Batch being rendered
+  txp_renderer *self;
+  fz_rect bounds;
+  float scale;
+  unsigned char *pixels;
+  tile_job *jobs;
+  int job_count, job_cap, next_job;
+  // The batch is a prediction: nobody waits for it, the tiles are uploaded
+  // when the renderer polls, see prefetch_collect
+  bool async;
+
+  // Not used by the workers, shared by the renderers
+  stext_entry stext[STEXT_CACHE_SIZE];
+  unsigned stext_clock;
+};
+
 struct txp_renderer_s
 {
   SDL_Renderer *sdl;
@@ -57,7 +166,6 @@ struct txp_renderer_s
 
   fz_buffer *scratch;
   fz_display_list *contents;
-  fz_stext_page *stext;
   int contents_bounds_valid;
   fz_rect contents_bounds;
   txp_renderer_config config;
@@ -70,6 +178,71 @@ struct txp_renderer_s
   fz_point scale_factor;
 
   uint32_t cached_bg, cached_fg;
+
+  tile_pool *tiles;
+
+  // Content hashes of the TILE_SIZE tiles of the page covering the texture,
+  // and the drawing operations touching them, for the current contents at
+  // st.scale (see tile_hash.h). When the contents change, only the tiles
+  // whose hash changed are marked dirty, and only their damaged part is
+  // rendered again.
+  struct {
+    bool valid;
+    float scale;
+    fz_irect tiles;
+    int cap, dirty_count;
+    uint64_t *hashes;
+    bool *dirty;
+    fz_irect *damage;
+    tile_hash_ops ops;
+  } cache;
+
+  // The contents partitioned in a grid of overlapping cells, see
+  // prepare_cells. Built on the main thread between batches, read by the
+  // workers.
+  struct {
+    fz_display_list *dl;
+    float scale, step;
+    fz_rect area;
+    int cols, rows;
+    fz_display_list **lists;
+    // Renders of the contents at a scale the grid does not fit
+    float pending_scale;
+    int pending;
+  } cells;
+
+  struct {
+    enum zoom_stage stage;
+    float target;
+  } zoom;
+
+  // Scroll prediction: a strip of the page in the direction of motion is
+  // rendered by the tile workers into the spare area of the texture, and
+  // becomes part of the texture once all its tiles are uploaded.
+  struct {
+    Uint32 time;
+    int x, y;
+    float scale;
+    // Smoothed velocity of the view, in pixels per millisecond
+    float vx, vy;
+  } motion;
+
+  struct {
+    bool active;
+    // Texture state the strip extends, the prediction is dropped if it
+    // changed meanwhile
+    texture_state st;
+    fz_display_list *dl;
+    fz_irect strip;
+    fz_buffer *scratch;
+  } prefetch;
+
+  // Position of the top of the page in window space, when it is placed by
+  // the caller rather than panned
+  struct {
+    bool enabled;
+    float y;
+  } placement;
 };
 
 static void txp_get_colors(txp_renderer_config *config, uint32_t *bg, uint32_t *fg)
@@ -93,6 +266,162 @@ static void txp_get_colors(txp_renderer_config *config, uint32_t *bg, uint32_t *
   *bg = cbg;
 }
 
+static void render_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, void *pixels, int pitch,
+                        int x, int y, fz_irect r, float scale);
+
+/* Tile workers */
+
+static void render_tile(fz_context *ctx, tile_pool *pool, tile_job *job)
+{
+  unsigned char *pixels = pool->pixels + job->offset;
+  fz_try(ctx)
+  {
+    render_rect(ctx, pool->self, pool->bounds, pixels, 0,
+                job->x, job->y, job->rect, pool->scale);
+  }
+  fz_catch(ctx)
+  {
+    txp_error(TXP_LOG_RENDER, "[render] tile failed: %s\n", fz_caught_message(ctx));
+    memset(pixels, 0xFF, fz_irect_area(job->rect) * 3);
+  }
+}
+
+static int SDLCALL tile_worker_main(void *data)
+{
+  tile_worker *w = data;
+  tile_pool *pool = w->pool;
+
+  SDL_LockMutex(pool->lock);
+  while (!pool->quit)
+  {
+    if (pool->next_job == pool->job_count)
+    {
+      SDL_CondWait(pool->wakeup, pool->lock);
+      continue;
+    }
+
+    tile_job *job = &pool->jobs[pool->next_job];
+    pool->next_job += 1;
+    job->status = TILE_RENDERING;
+    SDL_UnlockMutex(pool->lock);
+
+    render_tile(w->ctx, pool, job);
+
+    SDL_LockMutex(pool->lock);
+    job->status = TILE_RENDERED;
+    SDL_CondBroadcast(pool->rendered);
+  }
+  SDL_UnlockMutex(pool->lock);
+
+  return 0;
+}
+
+static tile_pool *tile_pool_new(fz_context *ctx)
+{
+  tile_pool *pool = fz_malloc_struct(ctx, tile_pool);
+  pool->refcount = 1;
+  pool->lock = SDL_CreateMutex();
+  pool->wakeup = SDL_CreateCond();
+  pool->rendered = SDL_CreateCond();
+  if (!pool->lock || !pool->wakeup || !pool->rendered)
+  {
+    txp_error(TXP_LOG_RENDER, "[render] cannot create tile pool: %s\n", SDL_GetError());
+    return pool;
+  }
+
+  int count = fz_clampi(SDL_GetCPUCount() - 1, 0, TILE_MAX_WORKERS);
+
+  for (int i = 0; i < count; ++i)
+  {
+    tile_worker *w = &pool->workers[pool->worker_count];
+    w->pool = pool;
+    w->ctx = fz_clone_context(ctx);
+    if (!w->ctx)
+      break;
+    w->thread = SDL_CreateThread(tile_worker_main, "tile_worker", w);
+    if (!w->thread)
+    {
+      fz_drop_context(w->ctx);
+      break;
+    }
+    pool->worker_count += 1;
+  }
+
+  txp_info(TXP_LOG_RENDER, "[render] %d tile workers\n", pool->worker_count);
+  return pool;
+}
+
+static void tile_pool_drop(fz_context *ctx, tile_pool *pool)
+{
+  pool->refcount -= 1;
+  if (pool->refcount > 0)
+    return;
+
+  if (pool->lock)
+  {
+    SDL_LockMutex(pool->lock);
+    pool->quit = 1;
+    SDL_CondBroadcast(pool->wakeup);
+    SDL_UnlockMutex(pool->lock);
+  }
+
+  for (int i = 0; i < pool->worker_count; ++i)
+  {
+    SDL_WaitThread(pool->workers[i].thread, NULL);
+    fz_drop_context(pool->workers[i].ctx);
+  }
+
+  if (pool->jobs)
+    fz_free(ctx, pool->jobs);
+  for (int i = 0; i < STEXT_CACHE_SIZE; ++i)
+  {
+    if (pool->stext[i].dl)
+      fz_drop_display_list(ctx, pool->stext[i].dl);
+    if (pool->stext[i].page)
+      fz_drop_stext_page(ctx, pool->stext[i].page);
+  }
+  if (pool->rendered)
+    SDL_DestroyCond(pool->rendered);
+  if (pool->wakeup)
+    SDL_DestroyCond(pool->wakeup);
+  if (pool->lock)
+    SDL_DestroyMutex(pool->lock);
+  fz_free(ctx, pool);
+}
+
+// Stop the predictive batch being rendered, if any, and wait for the tiles
+// already started
+static void tile_pool_cancel(tile_pool *pool)
+{
+  if (!pool->lock)
+    return;
+
+  SDL_LockMutex(pool->lock);
+  if (pool->async)
+  {
+    pool->next_job = pool->job_count;
+    for (;;)
+    {
+      bool busy = 0;
+      for (int i = 0; i < pool->job_count && !busy; ++i)
+        busy = pool->jobs[i].status == TILE_RENDERING;
+      if (!busy)
+        break;
+      SDL_CondWait(pool->rendered, pool->lock);
+    }
+    pool->job_count = pool->next_job = 0;
+    pool->async = 0;
+    pool->self->prefetch.active = 0;
+  }
+  SDL_UnlockMutex(pool->lock);
+}
+
+static void prefetch_cancel(txp_renderer *self)
+{
+  if (self->prefetch.active)
+    tile_pool_cancel(self->tiles);
+}
+
 txp_renderer *txp_renderer_new(fz_context *ctx, SDL_Renderer *sdl)
 {
   txp_renderer *self;
@@ -112,19 +441,43 @@ txp_renderer *txp_renderer_new(fz_context *ctx, SDL_Renderer *sdl)
       fz_free(ctx, self);
     fz_rethrow(ctx);
   }
+  self->tiles = tile_pool_new(ctx);
+  return self;
+}
+
+txp_renderer *txp_renderer_new_sibling(fz_context *ctx, txp_renderer *other)
+{
+  txp_renderer *self = fz_malloc_struct(ctx, txp_renderer);
+  self->sdl = other->sdl;
+  self->config = other->config;
+  self->scale_factor = other->scale_factor;
+  self->tiles = other->tiles;
+  self->tiles->refcount += 1;
   return self;
 }
 
+static void drop_cells(fz_context *ctx, txp_renderer *self);
+
 void txp_renderer_free(fz_context *ctx, txp_renderer *self)
 {
+  prefetch_cancel(self);
+  tile_pool_drop(ctx, self->tiles);
+  drop_cells(ctx, self);
+  if (self->prefetch.scratch)
+    fz_drop_buffer(ctx, self->prefetch.scratch);
   if (self->contents)
     fz_drop_display_list(ctx, self->contents);
-  if (self->stext)
-    fz_drop_stext_page(ctx, self->stext);
   if (self->tex)
     SDL_DestroyTexture(self->tex);
   if (self->scratch)
     fz_drop_buffer(ctx, self->scratch);
+  if (self->cache.hashes)
+    fz_free(ctx, self->cache.hashes);
+  if (self->cache.dirty)
+    fz_free(ctx, self->cache.dirty);
+  if (self->cache.damage)
+    fz_free(ctx, self->cache.damage);
+  tile_hash_ops_free(ctx, &self->cache.ops);
   fz_free(ctx, self);
 }
 
@@ -133,27 +486,44 @@ static void update_renderer_size(txp_renderer *self)
   SDL_GetRendererOutputSize(self->sdl, &self->output_w, &self->output_h);
 }
 
+static void drop_tile_cache(txp_renderer *self)
+{
+  self->cache.valid = 0;
+  if (self->cache.dirty_count > 0)
+    memset(self->cache.dirty, 0, self->cache.cap * sizeof(bool));
+  self->cache.dirty_count = 0;
+}
+
 static void clear_texture(txp_renderer *self)
 {
   self->st.x = 0;
   self->st.y = 0;
   self->st.rect = fz_make_irect(0, 0, 0, 0);
+  self->zoom.stage = ZOOM_NONE;
+  drop_tile_cache(self);
 }
 
+static fz_rect get_bounds(fz_context *ctx, txp_renderer *self);
+static bool reuse_tiles(fz_context *ctx, txp_renderer *self,
+                        fz_display_list *old, fz_rect old_bounds);
+
 void txp_renderer_set_contents(fz_context *ctx, txp_renderer *self, fz_display_list *dl)
 {
   if (self->contents == dl)
     return;
+  // The workers may be drawing the old contents
+  prefetch_cancel(self);
+  fz_display_list *old = self->contents;
+  fz_rect old_bounds = old ? get_bounds(ctx, self) : fz_empty_rect;
   fz_keep_display_list(ctx, dl);
-  if (self->contents)
-    fz_drop_display_list(ctx, self->contents);
-  if (self->stext)
-    fz_drop_stext_page(ctx, self->stext);
-  self->stext = NULL;
   self->contents = dl;
-  clear_texture(self);
   self->contents_bounds_valid = 0;
   self->selection_count = 0;
+  drop_cells(ctx, self);
+  if (!old || !dl || !reuse_tiles(ctx, self, old, old_bounds))
+    clear_texture(self);
+  if (old)
+    fz_drop_display_list(ctx, old);
 }
 
 fz_display_list *txp_renderer_get_contents(fz_context *ctx, txp_renderer *self)
@@ -191,20 +561,95 @@ static fz_rect get_bounds(fz_context *ctx, txp_renderer *self)
   return self->contents_bounds;
 }
 
-static fz_stext_page *get_stext(fz_context *ctx, txp_renderer *self)
+// Structured text of the contents covering at least the band y0..y1 of the
+// page (in page coordinates), or NULL if there are no contents.
+// The result is owned by the cache and valid until the next call.
+static fz_stext_page *get_stext(fz_context *ctx, txp_renderer *self,
+                                float y0, float y1)
 {
-  if (self->stext == NULL)
+  if (self->contents == NULL)
+    return NULL;
+
+  tile_pool *pool = self->tiles;
+  stext_entry *e = NULL, *victim = &pool->stext[0];
+
+  for (int i = 0; i < STEXT_CACHE_SIZE; ++i)
   {
-    if (self->contents == NULL)
-      return NULL;
-    fz_rect bounds = fz_bound_display_list(ctx, self->contents);
-    self->stext = fz_new_stext_page(ctx, bounds);
-    fz_device *dev = fz_new_stext_device(ctx, self->stext, NULL);
-    fz_run_display_list(ctx, self->contents, dev, fz_identity, bounds, NULL);
+    stext_entry *c = &pool->stext[i];
+    if (c->dl == self->contents)
+      e = c;
+    else if (c->last_use < victim->last_use)
+      victim = c;
+  }
+
+  pool->stext_clock += 1;
+
+  // Bands are clipped to the page: so are the requests, otherwise pointers
+  // above or below the page would never be covered
+  fz_rect bounds = fz_bound_display_list(ctx, self->contents);
+  y0 = clampf(y0, bounds.y0, bounds.y1);
+  y1 = clampf(y1, bounds.y0, bounds.y1);
+
+  if (e && e->band.y0 <= y0 && e->band.y1 >= y1)
+  {
+    e->last_use = pool->stext_clock;
+    return e->page;
+  }
+
+  fz_rect band = fz_make_rect(bounds.x0, y0 - STEXT_MARGIN,
+                              bounds.x1, y1 + STEXT_MARGIN);
+
+  if (e)
+  {
+    // Grow geometrically so that dragging across a page extracts the text
+    // a logarithmic number of times
+    float margin = fz_max(STEXT_MARGIN, (e->band.y1 - e->band.y0) / 2);
+    band.y0 = fz_min(e->band.y0, y0 - margin);
+    band.y1 = fz_max(e->band.y1, y1 + margin);
+  }
+  else
+  {
+    e = victim;
+    if (e->dl)
+      fz_drop_display_list(ctx, e->dl);
+    if (e->page)
+      fz_drop_stext_page(ctx, e->page);
+    e->dl = fz_keep_display_list(ctx, self->contents);
+    e->page = NULL;
+  }
+
+  band = fz_intersect_rect(band, bounds);
+
+  fz_stext_page *page = NULL;
+  fz_var(page);
+  int tag = txp_mem_enter(TXP_MEM_STEXT);
+  fz_try(ctx)
+  {
+    page = fz_new_stext_page(ctx, bounds);
+    fz_device *dev = fz_new_stext_device(ctx, page, NULL);
+    fz_run_display_list(ctx, self->contents, dev, fz_identity, band, NULL);
     fz_close_device(ctx, dev);
     fz_drop_device(ctx, dev);
   }
-  return self->stext;
+  fz_always(ctx)
+  {
+    txp_mem_leave(tag);
+  }
+  fz_catch(ctx)
+  {
+    fz_drop_stext_page(ctx, page);
+    fz_rethrow(ctx);
+  }
+
+  txp_debug(TXP_LOG_RENDER, "[render] structured text for %.0f-%.0f of %.0f-%.0f\n",
+            band.y0, band.y1, bounds.y0, bounds.y1);
+
+  if (e->page)
+    fz_drop_stext_page(ctx, e->page);
+  e->page = page;
+  e->band = band;
+  e->last_use = pool->stext_clock;
+  return page;
 }
 
 bool txp_renderer_page_bounds(fz_context *ctx, txp_renderer *self, txp_renderer_bounds *result)
@@ -253,7 +698,8 @@ bool txp_renderer_page_position(fz_context *ctx, txp_renderer *self, SDL_FRect *
   float cx = bounds.pan_interval.x, cy = bounds.pan_interval.y;
 
   self->config.pan.x = clampf(self->config.pan.x, -cx, cx);
-  self->config.pan.y = clampf(self->config.pan.y, -cy, cy);
+  if (!self->placement.enabled)
+    self->config.pan.y = clampf(self->config.pan.y, -cy, cy);
   // fprintf(stderr, "after clamp: %.02f, %.02f\n", r->vp.pan.x, r->vp.pan.y);
 
   // fprintf(stderr, "doc size: (%.02f, %.02f), out size: (%d, %d)\n",
@@ -263,7 +709,7 @@ bool txp_renderer_page_position(fz_context *ctx, txp_renderer *self, SDL_FRect *
 
   float scale = bounds.document_size.x / (bounds.page_bounds.x1 - bounds.page_bounds.x0);
   float tx = self->config.pan.x - cx;
-  float ty = self->config.pan.y - cy;
+  float ty = self->placement.enabled ? self->placement.y : self->config.pan.y - cy;
 
   if (prect)
     *prect = (SDL_FRect){.x = tx, .y = ty, .w = bounds.document_size.x, .h = bounds.document_size.y};
@@ -304,20 +750,139 @@ static void prepare_texture(fz_context *ctx, txp_renderer *self)
   {
     self->tex = SDL_CreateTexture(self->sdl, SDL_PIXELFORMAT_BGR24,
                                   SDL_TEXTUREACCESS_STREAMING, pw, ph);
+#if SDL_VERSION_ATLEAST(2, 0, 12)
+    // Smooth the texture while it is stretched during progressive zoom
+    SDL_SetTextureScaleMode(self->tex, SDL_ScaleModeLinear);
+#endif
     self->st = (texture_state){
         .w = pw,
         .h = ph,
         // 0,
     };
+    drop_tile_cache(self);
   }
 }
 
-static int fz_irect_area(fz_irect r)
+// Map each channel linearly from [0, 255] to [black, white].
+// Scalar and vectorized versions compute exactly
+// black + v * (white - black) / 255, rounding towards zero like C does.
+
+struct remap_channel
 {
-  return (r.x1 - r.x0) * (r.y1 - r.y0);
+  uint8_t base, mag, neg;
+};
+
+static struct remap_channel remap_channel(uint8_t bp, uint8_t wp)
+{
+  if (wp >= bp)
+    return (struct remap_channel){.base = bp, .mag = (uint8_t)(wp - bp), .neg = 0};
+  else
+    return (struct remap_channel){.base = bp, .mag = (uint8_t)(bp - wp), .neg = 1};
+}
+
+static void invert_row_scalar(uint8_t *data, int count, const uint8_t lut[3][256])
+{
+  for (int x = 0; x < count; ++x, data += 3)
+  {
+    data[0] = lut[0][data[0]];
+    data[1] = lut[1][data[1]];
+    data[2] = lut[2][data[2]];
+  }
+}
+
+#if defined(__SSE2__)
+
+// x / 255 for 0 <= x <= 255 * 255
+static inline __m128i div255_epu16(__m128i x)
+{
+  __m128i one = _mm_set1_epi16(1);
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, one), _mm_srli_epi16(x, 8)), 8);
+}
+
+static inline __m128i remap_epu8(__m128i v, __m128i base, __m128i mag, __m128i neg)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpacklo_epi8(mag, zero));
+  __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), _mm_unpackhi_epi8(mag, zero));
+  __m128i t = _mm_packus_epi16(div255_epu16(lo), div255_epu16(hi));
+  // Negate t where neg is 0xFF: (t ^ neg) - neg
+  t = _mm_sub_epi8(_mm_xor_si128(t, neg), neg);
+  return _mm_add_epi8(base, t);
+}
+
+// Process 16 pixels (48 bytes, three vectors) per iteration.
+// Channels of the BGR data rotate from one vector to the next, so each of
+// the three vectors gets its own constants.
+static int invert_row_simd(uint8_t *data, int count, const struct remap_channel ch[3])
+{
+  uint8_t base[48], mag[48], neg[48];
+  for (int i = 0; i < 48; ++i)
+  {
+    base[i] = ch[i % 3].base;
+    mag[i] = ch[i % 3].mag;
+    neg[i] = ch[i % 3].neg ? 0xFF : 0x00;
+  }
+
+  __m128i b[3], m[3], n[3];
+  for (int k = 0; k < 3; ++k)
+  {
+    b[k] = _mm_loadu_si128((const __m128i *)(base + 16 * k));
+    m[k] = _mm_loadu_si128((const __m128i *)(mag + 16 * k));
+    n[k] = _mm_loadu_si128((const __m128i *)(neg + 16 * k));
+  }
+
+  int x = 0;
+  for (; x + 16 <= count; x += 16, data += 48)
+  {
+    for (int k = 0; k < 3; ++k)
+    {
+      __m128i *p = (__m128i *)(data + 16 * k);
+      _mm_storeu_si128(p, remap_epu8(_mm_loadu_si128(p), b[k], m[k], n[k]));
+    }
+  }
+  return x;
+}
+
+#elif defined(__ARM_NEON)
+
+static inline uint16x8_t div255_u16(uint16x8_t x)
+{
+  return vshrq_n_u16(vaddq_u16(vaddq_u16(x, vdupq_n_u16(1)), vshrq_n_u16(x, 8)), 8);
+}
+
+static inline uint8x16_t remap_u8(uint8x16_t v, const struct remap_channel *ch)
+{
+  uint8x8_t mag = vdup_n_u8(ch->mag);
+  uint16x8_t lo = div255_u16(vmull_u8(vget_low_u8(v), mag));
+  uint16x8_t hi = div255_u16(vmull_u8(vget_high_u8(v), mag));
+  uint8x16_t t = vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+  uint8x16_t base = vdupq_n_u8(ch->base);
+  return ch->neg ? vsubq_u8(base, t) : vaddq_u8(base, t);
+}
+
+// Process 16 pixels per iteration, deinterleaving the channels
+static int invert_row_simd(uint8_t *data, int count, const struct remap_channel ch[3])
+{
+  int x = 0;
+  for (; x + 16 <= count; x += 16, data += 48)
+  {
+    uint8x16x3_t v = vld3q_u8(data);
+    v.val[0] = remap_u8(v.val[0], &ch[0]);
+    v.val[1] = remap_u8(v.val[1], &ch[1]);
+    v.val[2] = remap_u8(v.val[2], &ch[2]);
+    vst3q_u8(data, v);
+  }
+  return x;
+}
+
+#else
+
+static int invert_row_simd(uint8_t *data, int count, const struct remap_channel ch[3])
+{
+  return 0;
 }
 
-#define remap(v, bp, wp) (bp) + ((v) * (wp - bp)) / 255
+#endif
 
 static void invert_pixmap(fz_context *ctx, fz_pixmap *pix, uint32_t black, uint32_t white)
 {
@@ -327,67 +892,613 @@ static void invert_pixmap(fz_context *ctx, fz_pixmap *pix, uint32_t black, uint3
   int height = fz_pixmap_height(ctx, pix);
 
   // 0x282c34
-  uint8_t dark[3] = {
-      (black >> 0) & 0xFF,
-      (black >> 8) & 0xFF,
-      (black >> 16) & 0xFF,
-  };
-  uint8_t light[3] = {
-      (white >> 0) & 0xFF,
-      (white >> 8) & 0xFF,
-      (white >> 16) & 0xFF,
-  };
+  struct remap_channel ch[3];
+  uint8_t lut[3][256];
+  for (int c = 0; c < 3; ++c)
+  {
+    ch[c] = remap_channel((black >> (8 * c)) & 0xFF, (white >> (8 * c)) & 0xFF);
+    for (int v = 0; v < 256; ++v)
+    {
+      int t = (v * ch[c].mag) / 255;
+      lut[c][v] = ch[c].neg ? ch[c].base - t : ch[c].base + t;
+    }
+  }
+
+  for (int y = 0; y < height; ++y)
+  {
+    uint8_t *data = data0 + stride * y;
+    int x = invert_row_simd(data, width, ch);
+    invert_row_scalar(data + x * 3, width - x, lut);
+  }
+}
+
+/* Cells */
+
+// Running a display list with a scissor still visits each of its nodes to
+// cull them. When a page keeps being drawn a few tiles at a time (scrolling
+// exposes thin strips and corners), the contents are partitioned into a grid
+// of display lists, each holding the nodes intersecting one cell, so that a
+// tile only visits the nodes near it.
+//
+// Cells are two steps wide and high and start every step, a step being a bit
+// more than a tile: any tile is contained in a single cell, so it is drawn
+// from one list, in the original order, without drawing an object twice.
+// Cells on the border of the grid extend to infinity.
+#define CELL_MIN_RENDERS 3
+#define CELL_MAX_COUNT 512
+
+static void drop_cells(fz_context *ctx, txp_renderer *self)
+{
+  if (self->cells.lists)
+  {
+    for (int i = 0; i < self->cells.cols * self->cells.rows; ++i)
+      fz_drop_display_list(ctx, self->cells.lists[i]);
+    fz_free(ctx, self->cells.lists);
+  }
+  self->cells.dl = NULL;
+  self->cells.lists = NULL;
+  self->cells.cols = self->cells.rows = 0;
+  self->cells.pending = 0;
+}
+
+static fz_rect cell_rect(txp_renderer *self, int col, int row)
+{
+  fz_rect area = self->cells.area;
+  float step = self->cells.step;
+  fz_rect r = fz_make_rect(area.x0 + col * step, area.y0 + row * step,
+                           area.x0 + (col + 2) * step, area.y0 + (row + 2) * step);
+  if (col == 0)
+    r.x0 = fz_infinite_rect.x0;
+  if (row == 0)
+    r.y0 = fz_infinite_rect.y0;
+  if (col == self->cells.cols - 1)
+    r.x1 = fz_infinite_rect.x1;
+  if (row == self->cells.rows - 1)
+    r.y1 = fz_infinite_rect.y1;
+  return r;
+}
+
+static fz_display_list *record_list(fz_context *ctx, fz_display_list *src,
+                                    fz_rect mediabox, fz_rect scissor)
+{
+  fz_display_list *dl = fz_new_display_list(ctx, mediabox);
+  fz_device *dev = NULL;
+  fz_var(dev);
+  fz_try(ctx)
+  {
+    dev = fz_new_list_device(ctx, dl);
+    fz_run_display_list(ctx, src, dev, fz_identity, scissor, NULL);
+    fz_close_device(ctx, dev);
+  }
+  fz_always(ctx)
+    fz_drop_device(ctx, dev);
+  fz_catch(ctx)
+  {
+    fz_drop_display_list(ctx, dl);
+    fz_rethrow(ctx);
+  }
+  return dl;
+}
+
+static void build_cells(fz_context *ctx, txp_renderer *self, float scale)
+{
+  fz_display_list *contents = self->contents;
+  fz_rect area = fz_bound_display_list(ctx, contents);
+  // One pixel of slack on each side of a tile
+  float step = (TILE_SIZE + 2) / scale;
+  int cols = fz_maxi(1, (int)ceilf((area.x1 - area.x0) / step));
+  int rows = fz_maxi(1, (int)ceilf((area.y1 - area.y0) / step));
+
+  drop_cells(ctx, self);
+  if (cols * rows > CELL_MAX_COUNT)
+    return;
+
+  self->cells.area = area;
+  self->cells.step = step;
+  self->cells.scale = scale;
+  self->cells.cols = cols;
+  self->cells.rows = rows;
+
+  fz_display_list **lists = NULL, *band = NULL;
+  fz_var(lists);
+  fz_var(band);
+  int tag = txp_mem_enter(TXP_MEM_DISPLAY);
+  fz_try(ctx)
+  {
+    lists = fz_malloc_struct_array(ctx, cols * rows, fz_display_list *);
+    // Split in rows first, so that only the row lists have to walk the
+    // whole contents
+    for (int row = 0; row < rows; ++row)
+    {
+      fz_rect r = cell_rect(self, 0, row);
+      r.x1 = fz_infinite_rect.x1;
+      band = record_list(ctx, contents, area, r);
+      for (int col = 0; col < cols; ++col)
+        lists[row * cols + col] =
+          record_list(ctx, band, area, cell_rect(self, col, row));
+      fz_drop_display_list(ctx, band);
+      band = NULL;
+    }
+  }
+  fz_always(ctx)
+  {
+    txp_mem_leave(tag);
+  }
+  fz_catch(ctx)
+  {
+    fz_drop_display_list(ctx, band);
+    if (lists)
+    {
+      for (int i = 0; i < cols * rows; ++i)
+        fz_drop_display_list(ctx, lists[i]);
+      fz_free(ctx, lists);
+    }
+    self->cells.cols = self->cells.rows = 0;
+    txp_warn(TXP_LOG_RENDER, "[render] cannot partition contents: %s\n",
+             fz_caught_message(ctx));
+    return;
+  }
+
+  self->cells.lists = lists;
+  self->cells.dl = contents;
+  txp_debug(TXP_LOG_RENDER, "[render] contents partitioned in %dx%d cells\n",
+            cols, rows);
+}
+
+// Called before rendering parts of the contents at the given scale.
+// The grid is built only once the same page has been drawn piecewise a few
+// times at a scale it does not fit: a page shown once, or the low
+// resolution pass of a zoom, keeps using the full list.
+static void prepare_cells(fz_context *ctx, txp_renderer *self, float scale)
+{
+  if (!self->contents)
+    return;
+
+  // Tiles must fit in a step, and cells should not be much larger
+  if (self->cells.dl == self->contents &&
+      scale >= self->cells.scale && scale < self->cells.scale * 2)
+    return;
+
+  if (self->cells.pending_scale != scale)
+  {
+    self->cells.pending_scale = scale;
+    self->cells.pending = 0;
+  }
+  self->cells.pending += 1;
+  if (self->cells.pending < CELL_MIN_RENDERS)
+    return;
+
+  build_cells(ctx, self, scale);
+}
+
+// The display list to draw the part r (in page space) of the contents from
+static fz_display_list *cell_list(txp_renderer *self, fz_rect r)
+{
+  if (self->cells.dl != self->contents)
+    return self->contents;
+
+  float step = self->cells.step;
+  int col = (int)floorf((r.x0 - self->cells.area.x0) / step);
+  int row = (int)floorf((r.y0 - self->cells.area.y0) / step);
+  col = fz_clampi(col, 0, self->cells.cols - 1);
+  row = fz_clampi(row, 0, self->cells.rows - 1);
+
+  if (!fz_contains_rect(cell_rect(self, col, row), r))
+    return self->contents;
+  return self->cells.lists[row * self->cells.cols + col];
+}
+
+static void draw_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, void *pixels, int pitch,
+                      int x, int y, fz_irect r, float scale)
+{
+  fz_colorspace *csp = fz_device_bgr(ctx);
+  if (pitch == 0)
+    pitch = fz_irect_width(r) * 3;
+  fz_pixmap *pm = fz_new_pixmap_with_data(ctx, csp, fz_irect_width(r), fz_irect_height(r), NULL, 0, pitch, pixels);
+  fz_matrix ctm;
+  ctm = fz_translate(-x, -y);
+  ctm = fz_pre_scale(ctm, scale, scale);
+  ctm = fz_pre_translate(ctm, -bounds.x0, -bounds.y0);
+  fz_device *dev = fz_new_draw_device(ctx, ctm, pm);
+  fz_clear_pixmap_with_value(ctx, pm, 255);
+
+  bounds.x0 += x / scale;
+  bounds.y0 += y / scale;
+  bounds.x1 = bounds.x0 + (r.x1 - r.x0) / scale;
+  bounds.y1 = bounds.y0 + (r.y1 - r.y0) / scale;
+
+  fz_point p0 = fz_transform_point_xy(bounds.x0, bounds.y0, ctm);
+  fz_point p1 = fz_transform_point_xy(bounds.x1, bounds.y1, ctm);
+  txp_debug(TXP_LOG_RENDER, "[render] optimized bounds: %f,%f - %f,%f\n", p0.x, p0.y, p1.x, p1.y);
+
+  fz_run_display_list(ctx, cell_list(self, bounds), dev, fz_identity, bounds, NULL);
+  fz_close_device(ctx, dev);
+  fz_drop_device(ctx, dev);
+
+  uint32_t bg, fg;
+  txp_get_colors(&self->config, &bg, &fg);
+  // Black on white is the identity, skip the pass
+  if (bg != 0x00FFFFFF || fg != 0x00000000)
+    invert_pixmap(ctx, pm, fg, bg);
+  fz_drop_pixmap(ctx, pm);
+}
+
+// Glyphs, images and pixmaps allocated while drawing, possibly from a tile
+// worker, are accounted to rendering
+static void render_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, void *pixels, int pitch,
+                        int x, int y, fz_irect r, float scale)
+{
+  int tag = txp_mem_enter(TXP_MEM_RENDER);
+  fz_try(ctx)
+  {
+    draw_rect(ctx, self, bounds, pixels, pitch, x, y, r, scale);
+  }
+  fz_always(ctx)
+  {
+    txp_mem_leave(tag);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+}
+
+static void upload_texture_rect(SDL_Texture *tex, fz_irect rect, void *pixels);
+
+static void *scratch_pixels(fz_context *ctx, txp_renderer *self, int count)
+{
+  if (self->scratch == NULL)
+    self->scratch = fz_new_buffer(ctx, count * 3);
+  else if (self->scratch->len < count * 3)
+    fz_resize_buffer(ctx, self->scratch, count * 3);
+  return self->scratch->data;
+}
+
+// Number of tiles and pixels of a list of regions
+static int count_tiles(const texture_region *regions, int region_count, int *area)
+{
+  int count = 0;
+  *area = 0;
+  for (int i = 0; i < region_count; ++i)
+  {
+    int w = fz_irect_width(regions[i].rect), h = fz_irect_height(regions[i].rect);
+    *area += w * h;
+    count += ((w + TILE_SIZE - 1) / TILE_SIZE) * ((h + TILE_SIZE - 1) / TILE_SIZE);
+  }
+  return count;
+}
+
+// Split regions in count tiles (see count_tiles) in the job list of the pool
+static void split_jobs(fz_context *ctx, tile_pool *pool,
+                       const texture_region *regions, int region_count,
+                       int count)
+{
+  if (pool->job_cap < count)
+  {
+    if (pool->jobs)
+      fz_free(ctx, pool->jobs);
+    pool->jobs = NULL;
+    pool->job_cap = 0;
+    pool->jobs = fz_malloc_struct_array(ctx, count, tile_job);
+    pool->job_cap = count;
+  }
+
+  size_t offset = 0;
+  tile_job *next = pool->jobs;
+  for (int i = 0; i < region_count; ++i)
+  {
+    fz_irect r = regions[i].rect;
+    int x = regions[i].x, y = regions[i].y;
+    for (int y0 = r.y0; y0 < r.y1; y0 += TILE_SIZE)
+      for (int x0 = r.x0; x0 < r.x1; x0 += TILE_SIZE, ++next)
+      {
+        next->rect = fz_make_irect(x0, y0, fz_mini(x0 + TILE_SIZE, r.x1),
+                                   fz_mini(y0 + TILE_SIZE, r.y1));
+        next->x = x + x0 - r.x0;
+        next->y = y + y0 - r.y0;
+        next->offset = offset;
+        next->status = TILE_PENDING;
+        offset += fz_irect_area(next->rect) * 3;
+      }
+  }
+}
+
+// Render regions of the texture and upload them.
+// Large areas are split in tiles that are rendered by the workers and
+// uploaded as soon as they are finished.
+static void render_regions(fz_context *ctx, txp_renderer *self, fz_rect bounds,
+                           const texture_region *regions, int region_count,
+                           float scale)
+{
+  tile_pool *pool = self->tiles;
+  // Rendering what is needed now comes before predictions
+  tile_pool_cancel(pool);
+  prepare_cells(ctx, self, scale);
+
+  int area;
+  int count = count_tiles(regions, region_count, &area);
+  unsigned char *pixels = scratch_pixels(ctx, self, area);
+
+  if (pool->worker_count == 0 || area <= TILE_SIZE * TILE_SIZE)
+  {
+    for (int i = 0; i < region_count; ++i)
+    {
+      const texture_region *reg = &regions[i];
+      render_rect(ctx, self, bounds, pixels, 0, reg->x, reg->y, reg->rect, scale);
+      upload_texture_rect(self->tex, reg->rect, pixels);
+    }
+    return;
+  }
+
+  split_jobs(ctx, pool, regions, region_count, count);
+
+  SDL_LockMutex(pool->lock);
+  pool->self = self;
+  pool->bounds = bounds;
+  pool->scale = scale;
+  pool->pixels = pixels;
+  pool->next_job = 0;
+  pool->job_count = count;
+  SDL_CondBroadcast(pool->wakeup);
+
+  // Upload tiles as they come, SDL textures can only be updated from the
+  // main thread
+  int uploaded = 0;
+  while (uploaded < count)
+  {
+    tile_job *job = NULL;
+    for (int i = 0; i < count && !job; ++i)
+      if (pool->jobs[i].status == TILE_RENDERED)
+        job = &pool->jobs[i];
+
+    if (!job)
+    {
+      SDL_CondWait(pool->rendered, pool->lock);
+      continue;
+    }
+
+    job->status = TILE_UPLOADED;
+    SDL_UnlockMutex(pool->lock);
+    upload_texture_rect(self->tex, job->rect, pixels + job->offset);
+    SDL_LockMutex(pool->lock);
+    uploaded += 1;
+  }
+
+  pool->job_count = pool->next_job = 0;
+  SDL_UnlockMutex(pool->lock);
+}
+
+// Render rectangle r of the texture, (x, y) being the position of its
+// top-left corner on the page, and upload it.
+static void render_region(fz_context *ctx, txp_renderer *self, fz_rect bounds,
+                          int x, int y, fz_irect r, float scale)
+{
+  texture_region region = {.rect = r, .x = x, .y = y};
+  render_regions(ctx, self, bounds, &region, 1, scale);
+}
+
+/* Tile cache */
+
+static int floor_div(int a, int b)
+{
+  return (a >= 0 ? a : a - b + 1) / b;
+}
+
+// Area of the page held by the texture, in pixels at st.scale
+static fz_irect texture_area(txp_renderer *self)
+{
+  return fz_make_irect(self->st.x, self->st.y,
+                       self->st.x + fz_irect_width(self->st.rect),
+                       self->st.y + fz_irect_height(self->st.rect));
+}
+
+static fz_irect texture_tiles(txp_renderer *self)
+{
+  fz_irect area = texture_area(self);
+  return fz_make_irect(floor_div(area.x0, TILE_SIZE),
+                       floor_div(area.y0, TILE_SIZE),
+                       floor_div(area.x1 + TILE_SIZE - 1, TILE_SIZE),
+                       floor_div(area.y1 + TILE_SIZE - 1, TILE_SIZE));
+}
+
+static bool same_irect(fz_irect a, fz_irect b)
+{
+  return a.x0 == b.x0 && a.y0 == b.y0 && a.x1 == b.x1 && a.y1 == b.y1;
+}
+
+static void hash_tiles(fz_context *ctx, txp_renderer *self, fz_display_list *dl,
+                       fz_rect bounds, fz_irect tiles, uint64_t *hashes,
+                       tile_hash_ops *ops)
+{
+  float scale = self->st.scale;
+  fz_matrix ctm = fz_pre_translate(fz_scale(scale, scale), -bounds.x0, -bounds.y0);
+  tile_hash_display_list(ctx, dl, ctm, tiles, TILE_SIZE, hashes, ops);
+}
+
+static fz_irect union_irect(fz_irect a, fz_irect b)
+{
+  if (fz_is_empty_irect(a))
+    return b;
+  if (fz_is_empty_irect(b))
+    return a;
+  return fz_make_irect(fz_mini(a.x0, b.x0), fz_mini(a.y0, b.y0),
+                       fz_maxi(a.x1, b.x1), fz_maxi(a.y1, b.y1));
+}
+
+// The contents changed from old to self->contents: keep the texture and mark
+// the tiles that are drawn differently as dirty. Within a dirty tile, the
+// damage is the area covered by the operations that differ between the two
+// versions, or the whole tile if they only differ by their order.
+// Return 0 if the texture has to be rendered again entirely.
+static bool reuse_tiles(fz_context *ctx, txp_renderer *self,
+                        fz_display_list *old, fz_rect old_bounds)
+{
+  if (!self->tex || fz_is_empty_irect(self->st.rect) ||
+      self->zoom.stage != ZOOM_NONE)
+    return 0;
+
+  fz_rect bounds = get_bounds(ctx, self);
+  if (bounds.x0 != old_bounds.x0 || bounds.y0 != old_bounds.y0 ||
+      bounds.x1 != old_bounds.x1 || bounds.y1 != old_bounds.y1)
+    return 0;
+
+  fz_irect tiles = texture_tiles(self);
+  int count = fz_irect_width(tiles) * fz_irect_height(tiles);
+  bool cached = self->cache.valid && self->cache.scale == self->st.scale &&
+                same_irect(self->cache.tiles, tiles);
+
+  // Dirty tiles can only be tracked for a single position of the texture
+  if (!cached && self->cache.dirty_count > 0)
+    return 0;
+
+  uint64_t *hashes = NULL;
+  fz_irect *damage = NULL;
+  tile_hash_ops ops = {0,};
+  bool reused = 0;
+  fz_var(hashes);
+  fz_var(damage);
 
-  for (int y = 0; y < height; ++y)
+  fz_try(ctx)
   {
-    uint8_t *data = data0 + stride * y;
-    for (int x = 0; x < width; ++x, data += 3)
+    if (self->cache.cap < count)
+    {
+      drop_tile_cache(self);
+      if (self->cache.hashes)
+        fz_free(ctx, self->cache.hashes);
+      if (self->cache.dirty)
+        fz_free(ctx, self->cache.dirty);
+      if (self->cache.damage)
+        fz_free(ctx, self->cache.damage);
+      self->cache.hashes = NULL;
+      self->cache.dirty = NULL;
+      self->cache.damage = NULL;
+      self->cache.cap = 0;
+      self->cache.hashes = fz_malloc_array(ctx, count, uint64_t);
+      self->cache.dirty = fz_malloc_array(ctx, count, bool);
+      self->cache.damage = fz_malloc_array(ctx, count, fz_irect);
+      memset(self->cache.dirty, 0, count * sizeof(bool));
+      self->cache.cap = count;
+    }
+
+    if (!cached)
+      hash_tiles(ctx, self, old, bounds, tiles, self->cache.hashes,
+                 &self->cache.ops);
+
+    hashes = fz_malloc_array(ctx, count, uint64_t);
+    hash_tiles(ctx, self, self->contents, bounds, tiles, hashes, &ops);
+
+    damage = fz_malloc_array(ctx, count, fz_irect);
+    tile_hash_damage(&self->cache.ops, &ops, tiles, TILE_SIZE, damage);
+
+    int changed = 0, pixels = 0, cols = fz_irect_width(tiles);
+    for (int i = 0; i < count; ++i)
     {
-      data[0] = remap(data[0], dark[0], light[0]);
-      data[1] = remap(data[1], dark[1], light[1]);
-      data[2] = remap(data[2], dark[2], light[2]);
+      if (hashes[i] == self->cache.hashes[i])
+        continue;
+      changed += 1;
+      fz_irect d = damage[i];
+      if (fz_is_empty_irect(d))
+      {
+        int x = (tiles.x0 + i % cols) * TILE_SIZE;
+        int y = (tiles.y0 + i / cols) * TILE_SIZE;
+        d = fz_make_irect(x, y, x + TILE_SIZE, y + TILE_SIZE);
+      }
+      pixels += fz_irect_area(d);
+      if (self->cache.dirty[i])
+        self->cache.damage[i] = union_irect(self->cache.damage[i], d);
+      else
+      {
+        self->cache.dirty[i] = 1;
+        self->cache.damage[i] = d;
+        self->cache.dirty_count += 1;
+      }
     }
+
+    memcpy(self->cache.hashes, hashes, count * sizeof(uint64_t));
+    tile_hash_ops tmp = self->cache.ops;
+    self->cache.ops = ops;
+    ops = tmp;
+    self->cache.valid = 1;
+    self->cache.scale = self->st.scale;
+    self->cache.tiles = tiles;
+    reused = 1;
+    txp_debug(TXP_LOG_RENDER, "[render] tile cache: %d/%d tiles reused, %d pixels damaged\n",
+              count - changed, count, pixels);
+  }
+  fz_always(ctx)
+  {
+    if (hashes)
+      fz_free(ctx, hashes);
+    if (damage)
+      fz_free(ctx, damage);
+    tile_hash_ops_free(ctx, &ops);
+  }
+  fz_catch(ctx)
+  {
+    txp_warn(TXP_LOG_RENDER, "[render] cannot hash tiles: %s\n",
+             fz_caught_message(ctx));
+    drop_tile_cache(self);
   }
+
+  return reused;
 }
 
-static void render_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, void *pixels, int pitch,
-                        int x, int y, fz_irect r, float scale)
+// Render again the damaged parts of the dirty tiles
+static void render_dirty_tiles(fz_context *ctx, txp_renderer *self, fz_rect bounds)
 {
-  fz_colorspace *csp = fz_device_bgr(ctx);
-  if (pitch == 0)
-    pitch = fz_irect_width(r) * 3;
-  fz_pixmap *pm = fz_new_pixmap_with_data(ctx, csp, fz_irect_width(r), fz_irect_height(r), NULL, 0, pitch, pixels);
-  fz_matrix ctm;
-  ctm = fz_translate(-x, -y);
-  ctm = fz_pre_scale(ctm, scale, scale);
-  ctm = fz_pre_translate(ctm, -bounds.x0, -bounds.y0);
-  fz_device *dev = fz_new_draw_device(ctx, ctm, pm);
-  fz_clear_pixmap_with_value(ctx, pm, 255);
+  if (self->cache.dirty_count == 0)
+    return;
 
-  bounds.x0 += x / scale;
-  bounds.y0 += y / scale;
-  bounds.x1 = bounds.x0 + (r.x1 - r.x0) / scale;
-  bounds.y1 = bounds.y0 + (r.y1 - r.y0) / scale;
+  fz_irect tiles = self->cache.tiles;
+  if (!same_irect(tiles, texture_tiles(self)) ||
+      self->cache.scale != self->st.scale)
+  {
+    // The texture moved since the tiles were marked, nothing can be trusted
+    self->st.rect = fz_make_irect(0, 0, 0, 0);
+    drop_tile_cache(self);
+    return;
+  }
 
-  fz_point p0 = fz_transform_point_xy(bounds.x0, bounds.y0, ctm);
-  fz_point p1 = fz_transform_point_xy(bounds.x1, bounds.y1, ctm);
-  fprintf(stderr, "optimized bounds: %f,%f - %f,%f\n", p0.x, p0.y, p1.x, p1.y);
+  texture_region *regions =
+    fz_malloc_array(ctx, self->cache.dirty_count, texture_region);
+  fz_irect area = texture_area(self);
+  int cols = fz_irect_width(tiles), total = cols * fz_irect_height(tiles);
+  int count = 0;
 
-  fz_run_display_list(ctx, self->contents, dev, fz_identity, bounds, NULL);
-  fz_close_device(ctx, dev);
-  fz_drop_device(ctx, dev);
+  for (int i = 0; i < total; ++i)
+  {
+    if (!self->cache.dirty[i])
+      continue;
+    self->cache.dirty[i] = 0;
+    fz_irect r = fz_intersect_irect(self->cache.damage[i], area);
+    if (fz_is_empty_irect(r))
+      continue;
+    regions[count].x = r.x0;
+    regions[count].y = r.y0;
+    regions[count].rect = fz_translate_irect(r, self->st.rect.x0 - area.x0,
+                                             self->st.rect.y0 - area.y0);
+    count += 1;
+  }
+  self->cache.dirty_count = 0;
 
-  uint32_t bg, fg;
-  txp_get_colors(&self->config, &bg, &fg);
-  //if (bg != 0x00FFFFFF || fg != 0x00000000)
-    invert_pixmap(ctx, pm, fg, bg);
-  fz_drop_pixmap(ctx, pm);
+  fz_try(ctx)
+  {
+    render_regions(ctx, self, bounds, regions, count, self->st.scale);
+  }
+  fz_always(ctx)
+  {
+    fz_free(ctx, regions);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
 }
 
-static void render_inc_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, void *pixels,
-                        int x, int y, fz_irect n, fz_irect r, float scale)
+static void render_inc_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds,
+                            int x, int y, fz_irect n, fz_irect r, float scale)
 {
-  render_rect(ctx, self, bounds, pixels, 0, x + r.x0 - n.x0, y + r.y0 - n.y0, r, scale);
+  render_region(ctx, self, bounds, x + r.x0 - n.x0, y + r.y0 - n.y0, r, scale);
 }
 
 static void update_sdl_texture(SDL_Texture *t, int pitch, void *pixels,
@@ -465,7 +1576,7 @@ static void upload_texture_rect(SDL_Texture *tex, fz_irect rect, void *pixels)
 }
 
 static void render_sdl_texture(SDL_Renderer *r, SDL_Texture *t,
-                               int rx, int ry,
+                               float rx, float ry, float k,
                                int x0, int y0, int x1, int y1)
 {
   if (x0 < x1 && y0 < y1)
@@ -473,8 +1584,16 @@ static void render_sdl_texture(SDL_Renderer *r, SDL_Texture *t,
     int w = x1 - x0;
     int h = y1 - y0;
     SDL_Rect src = (SDL_Rect){.x=x0, .y=y0, .w=w, .h=h};
-    SDL_Rect dst = (SDL_Rect){.x=rx, .y=ry, .w=w, .h=h};
-    SDL_RenderCopy(r, t, &src, &dst);
+    if (k == 1)
+    {
+      SDL_Rect dst = (SDL_Rect){.x=(int)rx, .y=(int)ry, .w=w, .h=h};
+      SDL_RenderCopy(r, t, &src, &dst);
+    }
+    else
+    {
+      SDL_FRect dst = (SDL_FRect){.x=rx, .y=ry, .w=w*k, .h=h*k};
+      SDL_RenderCopyF(r, t, &src, &dst);
+    }
   }
 }
 
@@ -495,7 +1614,9 @@ static int stopclock_reset_us(stopclock_t *sc)
   return result;
 }
 
-static void render_texture_rect(SDL_Renderer *self, int rx, int ry, SDL_Texture *t, fz_irect rect)
+// Blit a rectangle of the texture at (rx,ry), magnified by k
+static void render_texture_rect(SDL_Renderer *self, float rx, float ry, float k,
+                                SDL_Texture *t, fz_irect rect)
 {
   // Size of source texture
   int tw, th;
@@ -539,16 +1660,267 @@ static void render_texture_rect(SDL_Renderer *self, int rx, int ry, SDL_Texture
   for (int i = 0; i < 3; ++i)
     for (int j = 0; j < 3; ++j)
       render_sdl_texture(self, t,
-                         rx + x[i].delta,
-                         ry + y[j].delta,
+                         rx + x[i].delta * k,
+                         ry + y[j].delta * k,
+                         k,
                          x[i].c0, y[j].c0, x[i].c1, y[j].c1);
 
 }
 
+/* Scroll prediction */
+
+// Distance rendered ahead of the view, as the time to scroll over it at the
+// current velocity
+#define PREDICT_AHEAD_MS 250
+// Pause after which the view is considered at rest
+#define PREDICT_IDLE_MS 150
+// Slower motions are not predicted (pixels per millisecond)
+#define PREDICT_MIN_SPEED 0.05f
+
+static bool same_texture_state(const texture_state *a, const texture_state *b)
+{
+  return a->w == b->w && a->h == b->h && a->x == b->x && a->y == b->y &&
+         a->scale == b->scale && same_irect(a->rect, b->rect);
+}
+
+// Update the velocity estimate with the position of the view, in pixels of
+// the page at the given scale
+static void track_motion(txp_renderer *self, int x, int y, float scale)
+{
+  Uint32 now = SDL_GetTicks();
+  if (now == self->motion.time && scale == self->motion.scale)
+    return;
+
+  if (scale != self->motion.scale ||
+      now - self->motion.time > PREDICT_IDLE_MS)
+  {
+    self->motion.vx = 0;
+    self->motion.vy = 0;
+  }
+  else
+  {
+    float dt = now - self->motion.time;
+    self->motion.vx = (self->motion.vx + (x - self->motion.x) / dt) / 2;
+    self->motion.vy = (self->motion.vy + (y - self->motion.y) / dt) / 2;
+  }
+
+  self->motion.time = now;
+  self->motion.x = x;
+  self->motion.y = y;
+  self->motion.scale = scale;
+}
+
+// Upload the rendered tiles of the predicted strip. When wait is set, block
+// until the strip is complete. Once all tiles are uploaded, the strip is
+// added to the texture.
+// Returns true while the prediction is in progress.
+static bool prefetch_collect(txp_renderer *self, bool wait)
+{
+  if (!self->prefetch.active)
+    return 0;
+
+  tile_pool *pool = self->tiles;
+  if (self->prefetch.dl != self->contents ||
+      !same_texture_state(&self->prefetch.st, &self->st))
+  {
+    tile_pool_cancel(pool);
+    return 0;
+  }
+
+  SDL_LockMutex(pool->lock);
+  int uploaded;
+  for (;;)
+  {
+    tile_job *job = NULL;
+    uploaded = 0;
+    for (int i = 0; i < pool->job_count; ++i)
+    {
+      if (pool->jobs[i].status == TILE_UPLOADED)
+        uploaded += 1;
+      else if (!job && pool->jobs[i].status == TILE_RENDERED)
+        job = &pool->jobs[i];
+    }
+
+    if (job)
+    {
+      job->status = TILE_UPLOADED;
+      SDL_UnlockMutex(pool->lock);
+      upload_texture_rect(self->tex, job->rect, pool->pixels + job->offset);
+      SDL_LockMutex(pool->lock);
+      continue;
+    }
+
+    if (uploaded == pool->job_count || !wait)
+      break;
+    SDL_CondWait(pool->rendered, pool->lock);
+  }
+
+  if (uploaded < pool->job_count)
+  {
+    SDL_UnlockMutex(pool->lock);
+    return 1;
+  }
+
+  pool->job_count = pool->next_job = 0;
+  pool->async = 0;
+  SDL_UnlockMutex(pool->lock);
+
+  fz_irect strip = self->prefetch.strip;
+  self->st.x -= fz_maxi(0, self->st.rect.x0 - strip.x0);
+  self->st.y -= fz_maxi(0, self->st.rect.y0 - strip.y0);
+  self->st.rect = union_irect(self->st.rect, strip);
+  self->prefetch.active = 0;
+  txp_debug(TXP_LOG_RENDER, "[render] predicted strip: %d pixels\n",
+            fz_irect_area(strip));
+  return 0;
+}
+
+// Range [*s0, *s1) to render ahead of the view v0..v1 along an axis, the
+// texture covering a0..a1 and being size pixels long, in direction dir.
+// The part of the texture kept once the strip is added is *k0..*k1.
+static bool predict_span(int a0, int a1, int v0, int v1, int size, int extent,
+                         int dir, int lead, int *s0, int *s1, int *k0, int *k1)
+{
+  *k0 = a0;
+  *k1 = a1;
+  if (dir > 0)
+  {
+    // Enough is already available ahead
+    if (a1 - v1 >= lead / 2)
+      return 0;
+    *s0 = a1;
+    *s1 = fz_mini(fz_mini(v1 + lead, v0 + size), extent);
+    *k0 = fz_maxi(a0, *s1 - size);
+  }
+  else
+  {
+    if (v0 - a0 >= lead / 2)
+      return 0;
+    *s1 = a0;
+    *s0 = fz_maxi(fz_maxi(v0 - lead, v1 - size), 0);
+    *k1 = fz_mini(a1, *s0 + size);
+  }
+  return *s0 < *s1;
+}
+
+// Start rendering the part of the page the view is moving towards
+static void predict_scroll(fz_context *ctx, txp_renderer *self, fz_rect bounds,
+                           int x, int y, int w, int h, float scale)
+{
+  tile_pool *pool = self->tiles;
+  if (self->prefetch.active || pool->worker_count == 0 ||
+      fz_is_empty_irect(self->st.rect))
+    return;
+
+  bool vertical = fabsf(self->motion.vy) >= fabsf(self->motion.vx);
+  float v = vertical ? self->motion.vy : self->motion.vx;
+  if (fabsf(v) < PREDICT_MIN_SPEED)
+    return;
+
+  int lead = fz_maxi(TILE_SIZE, fabsf(v) * PREDICT_AHEAD_MS);
+  int dir = v > 0 ? 1 : -1;
+
+  // Work on one axis, the other one is left as it is
+  int *pos = vertical ? &self->st.y : &self->st.x;
+  int *r0 = vertical ? &self->st.rect.y0 : &self->st.rect.x0;
+  int *r1 = vertical ? &self->st.rect.y1 : &self->st.rect.x1;
+  int v0 = vertical ? y : x;
+  int v1 = v0 + (vertical ? h : w);
+  int size = vertical ? self->st.h : self->st.w;
+  int extent = ceilf((vertical ? bounds.y1 - bounds.y0 : bounds.x1 - bounds.x0) * scale);
+
+  int a0 = *pos, a1 = *pos + (*r1 - *r0);
+  int s0, s1, k0, k1;
+  if (!predict_span(a0, a1, v0, v1, size, extent, dir, lead, &s0, &s1, &k0, &k1))
+    return;
+
+  // Drop the part of the texture behind the view that the strip will
+  // overwrite
+  *r0 += k0 - a0;
+  *r1 -= a1 - k1;
+  *pos = k0;
+
+  texture_region region;
+  region.rect = self->st.rect;
+  if (vertical)
+  {
+    region.rect.y0 = dir > 0 ? self->st.rect.y1 : self->st.rect.y0 - (s1 - s0);
+    region.rect.y1 = region.rect.y0 + (s1 - s0);
+    region.x = self->st.x;
+    region.y = s0;
+  }
+  else
+  {
+    region.rect.x0 = dir > 0 ? self->st.rect.x1 : self->st.rect.x0 - (s1 - s0);
+    region.rect.x1 = region.rect.x0 + (s1 - s0);
+    region.x = s0;
+    region.y = self->st.y;
+  }
+
+  int area;
+  int count = count_tiles(&region, 1, &area);
+  // The pool may be busy with the prediction of a sibling
+  tile_pool_cancel(pool);
+  fz_try(ctx)
+  {
+    if (self->prefetch.scratch == NULL)
+      self->prefetch.scratch = fz_new_buffer(ctx, area * 3);
+    else if (self->prefetch.scratch->len < (size_t)area * 3)
+      fz_resize_buffer(ctx, self->prefetch.scratch, area * 3);
+    prepare_cells(ctx, self, scale);
+    split_jobs(ctx, pool, &region, 1, count);
+  }
+  fz_catch(ctx)
+  {
+    txp_warn(TXP_LOG_RENDER, "[render] cannot predict scroll: %s\n",
+             fz_caught_message(ctx));
+    return;
+  }
+
+  self->prefetch.active = 1;
+  self->prefetch.st = self->st;
+  self->prefetch.dl = self->contents;
+  self->prefetch.strip = region.rect;
+
+  SDL_LockMutex(pool->lock);
+  pool->self = self;
+  pool->bounds = bounds;
+  pool->scale = scale;
+  pool->pixels = self->prefetch.scratch->data;
+  pool->next_job = 0;
+  pool->job_count = count;
+  pool->async = 1;
+  SDL_CondBroadcast(pool->wakeup);
+  SDL_UnlockMutex(pool->lock);
+
+  txp_debug(TXP_LOG_RENDER, "[render] predicting %s %d-%d at %.2f px/ms\n",
+            vertical ? "rows" : "columns", s0, s1, v);
+}
+
+// Interval of the texture along an axis, a0..a1, that can be kept for the
+// view v0..v1 in a texture size pixels long. False if they are disjoint.
+static bool keep_span(int a0, int a1, int v0, int v1, int size, int *n0, int *n1)
+{
+  if (a1 <= v0 || v1 <= a0)
+    return 0;
+  *n0 = fz_mini(a0, v0);
+  *n1 = fz_maxi(a1, v1);
+  if (*n1 - *n0 > size)
+  {
+    // Cut the side the view is moving away from
+    if (v0 < a0)
+      *n1 = *n0 + size;
+    else
+      *n0 = *n1 - size;
+  }
+  return 1;
+}
+
 static void update_texture(fz_context *ctx,
                            txp_renderer *self,
                            const SDL_FRect *page_rect,
-                           const SDL_FRect *view_rect)
+                           const SDL_FRect *view_rect,
+                           bool progressive)
 {
   SDL_FRect tex_rect = (SDL_FRect){
       .x = view_rect->x - page_rect->x,
@@ -567,91 +1939,103 @@ static void update_texture(fz_context *ctx,
   float doc_w = bounds.x1 - bounds.x0;
   float scale = (page_rect->w / doc_w);
 
+  track_motion(self, x, y, scale);
+
+  // Pick up the predicted strip, waiting for it if the view reached it
+  if (scale == self->st.scale && self->prefetch.active)
+  {
+    fz_irect strip = fz_translate_irect(self->prefetch.strip,
+                                        self->st.x - self->st.rect.x0,
+                                        self->st.y - self->st.rect.y0);
+    fz_irect view = fz_make_irect(x, y, x + w, y + h);
+    prefetch_collect(self, !fz_is_empty_irect(fz_intersect_irect(strip, view)));
+  }
+  else
+    prefetch_cancel(self);
+
+  // Bring the texture up to date before reusing it
+  if (scale == self->st.scale ||
+      (progressive && !fz_is_empty_irect(self->st.rect)))
+    render_dirty_tiles(ctx, self, bounds);
+
   int done = 0;
+  // Area of the page held by the texture
+  fz_irect a = texture_area(self);
 
-  if (scale != self->st.scale)
+  if (scale != self->st.scale && progressive &&
+      !fz_is_empty_irect(self->st.rect))
+  {
+    // Keep displaying the current texture, magnified, and refine later
+    if (self->zoom.stage == ZOOM_NONE || self->zoom.target != scale)
+    {
+      self->zoom.stage = ZOOM_SCALED;
+      self->zoom.target = scale;
+    }
+    done = 1;
+  }
+  else if (scale != self->st.scale)
   {
     self->st.scale = scale;
-    // TODO: Full rerender
+    self->zoom.stage = ZOOM_NONE;
   }
-  else if (self->st.x != x ||
-           self->st.y != y ||
-           fz_irect_width(self->st.rect) != w ||
-           fz_irect_height(self->st.rect) != h)
+  else if (fz_is_empty_irect(self->st.rect))
+    ;
+  else if (a.x0 > x || a.y0 > y || a.x1 < x + w || a.y1 < y + h)
   {
-    // TODO: Incremental rerender
     // Find reusable area in texture
-    fz_irect o = self->st.rect;
-    fz_irect n;
-    n.x0 = o.x0 - self->st.x + x,
-    n.y0 = o.y0 - self->st.y + y,
-    n.x1 = n.x0 + w;
-    n.y1 = n.y0 + h;
-    self->st.x = x;
-    self->st.y = y;
-    self->st.rect = n;
-
-    fz_irect overlap = fz_intersect_irect(o, n);
-    if (fz_is_empty_irect(overlap))
-      fprintf(stderr, "No overlap, rerendering full texture\n");
+    int nx0, ny0, nx1, ny1;
+    if (!keep_span(a.x0, a.x1, x, x + w, self->st.w, &nx0, &nx1) ||
+        !keep_span(a.y0, a.y1, y, y + h, self->st.h, &ny0, &ny1))
+      txp_debug(TXP_LOG_RENDER, "[render] no overlap, rerendering full texture\n");
     else
     {
-      fprintf(stderr, "Overlap: %d pixels\n", fz_irect_area(overlap));
+      fz_irect o = self->st.rect;
+      fz_irect n;
+      n.x0 = o.x0 - self->st.x + nx0,
+      n.y0 = o.y0 - self->st.y + ny0,
+      n.x1 = n.x0 + nx1 - nx0;
+      n.y1 = n.y0 + ny1 - ny0;
+      self->st.x = nx0;
+      self->st.y = ny0;
+      self->st.rect = n;
+
+      fz_irect overlap = fz_intersect_irect(o, n);
+      txp_debug(TXP_LOG_RENDER, "[render] overlap: %d pixels\n", fz_irect_area(overlap));
 
       fz_irect tl = fz_make_irect(n.x0, n.y0, fz_mini(n.x1, o.x0), fz_mini(n.y1, o.y1));
       fz_irect tr = fz_make_irect(fz_maxi(o.x0, n.x0), n.y0, n.x1, fz_mini(n.y1, o.y0));
       fz_irect bl = fz_make_irect(n.x0, fz_maxi(n.y0, o.y1), fz_mini(n.x1, o.x1), n.y1);
       fz_irect br = fz_make_irect(fz_maxi(n.x0, o.x1), fz_maxi(n.y0, o.y0), n.x1, n.y1);
 
-      int new_pixels = fz_irect_area(tl);
-      new_pixels = fz_maxi(new_pixels, fz_irect_area(tr));
-      new_pixels = fz_maxi(new_pixels, fz_irect_area(bl));
-      new_pixels = fz_maxi(new_pixels, fz_irect_area(br));
-
-      if (self->scratch == NULL)
-        self->scratch = fz_new_buffer(ctx, new_pixels * 3);
-      else if (self->scratch->len < new_pixels * 3)
-        fz_resize_buffer(ctx, self->scratch, new_pixels * 3);
-
-      void *pixels = self->scratch->data;
-
       stopclock_t sc;
       stopclock_start(&sc);
 
       if (!fz_is_empty_irect(tl))
       {
-        render_inc_rect(ctx, self, bounds, pixels, x, y, n, tl, scale);
-        fprintf(stderr, "render tl: %dus\n", stopclock_reset_us(&sc));
-        upload_texture_rect(self->tex, tl, pixels);
-        fprintf(stderr, "upload tl: %dus\n", stopclock_reset_us(&sc));
-        fprintf(stderr, "  tl: %d pixels\n", fz_irect_area(tl));
+        render_inc_rect(ctx, self, bounds, nx0, ny0, n, tl, scale);
+        txp_debug(TXP_LOG_RENDER, "[render] tl: %d pixels in %dus\n",
+                  fz_irect_area(tl), stopclock_reset_us(&sc));
       }
 
       if (!fz_is_empty_irect(tr))
       {
-        render_inc_rect(ctx, self, bounds, pixels, x, y, n, tr, scale);
-        fprintf(stderr, "render tr: %dus\n", stopclock_reset_us(&sc));
-        upload_texture_rect(self->tex, tr, pixels);
-        fprintf(stderr, "upload tr: %dus\n", stopclock_reset_us(&sc));
-        fprintf(stderr, "  tr: %d pixels\n", fz_irect_area(tr));
+        render_inc_rect(ctx, self, bounds, nx0, ny0, n, tr, scale);
+        txp_debug(TXP_LOG_RENDER, "[render] tr: %d pixels in %dus\n",
+                  fz_irect_area(tr), stopclock_reset_us(&sc));
       }
 
       if (!fz_is_empty_irect(bl))
       {
-        render_inc_rect(ctx, self, bounds, pixels, x, y, n, bl, scale);
-        fprintf(stderr, "render bl: %dus\n", stopclock_reset_us(&sc));
-        upload_texture_rect(self->tex, bl, pixels);
-        fprintf(stderr, "upload bl: %dus\n", stopclock_reset_us(&sc));
-        fprintf(stderr, "  bl: %d pixels\n", fz_irect_area(bl));
+        render_inc_rect(ctx, self, bounds, nx0, ny0, n, bl, scale);
+        txp_debug(TXP_LOG_RENDER, "[render] bl: %d pixels in %dus\n",
+                  fz_irect_area(bl), stopclock_reset_us(&sc));
       }
 
       if (!fz_is_empty_irect(br))
       {
-        render_inc_rect(ctx, self, bounds, pixels, x, y, n, br, scale);
-        fprintf(stderr, "render br: %dus\n", stopclock_reset_us(&sc));
-        upload_texture_rect(self->tex, br, pixels);
-        fprintf(stderr, "upload br: %dus\n", stopclock_reset_us(&sc));
-        fprintf(stderr, "  br: %d pixels\n", fz_irect_area(br));
+        render_inc_rect(ctx, self, bounds, nx0, ny0, n, br, scale);
+        txp_debug(TXP_LOG_RENDER, "[render] br: %d pixels in %dus\n",
+                  fz_irect_area(br), stopclock_reset_us(&sc));
       }
       done = 1;
     }
@@ -661,59 +2045,27 @@ static void update_texture(fz_context *ctx,
 
   #define STRESS 0
 
-  if (done)
-    return;
-
-  void *pixels;
-  int pitch;
-
-  if (STRESS)
-  {
-    int new_pixels = w * h;
-    if (self->scratch == NULL)
-      self->scratch = fz_new_buffer(ctx, new_pixels * 3);
-    else if (self->scratch->len < new_pixels * 3)
-      fz_resize_buffer(ctx, self->scratch, new_pixels * 3);
-
-    pixels = self->scratch->data;
-    pitch = w * 3;
-  }
-  else
-  {
-    SDL_Rect lock_rect = (SDL_Rect){.x = 0, .y = 0, .w = w, .h = h};
-    SDL_LockTexture(self->tex, &lock_rect, &pixels, &pitch);
-  }
-
-  fz_irect full_rect = fz_make_irect(0, 0, w, h);
-  render_rect(ctx, self, bounds, pixels, pitch, x, y, full_rect, scale);
-
-  self->st.x = x;
-  self->st.y = y;
-
-  int x0, y0;
-  if (STRESS)
-  {
-    x0 = (rand() % (self->st.w * 2)) - self->st.w;
-    y0 = (rand() % (self->st.h * 2)) - self->st.h;
-  }
-  else
+  if (!done)
   {
-    x0 = 0;
-    y0 = 0;
-    SDL_UnlockTexture(self->tex);
-  }
+    int x0 = 0, y0 = 0;
+    if (STRESS)
+    {
+      x0 = (rand() % (self->st.w * 2)) - self->st.w;
+      y0 = (rand() % (self->st.h * 2)) - self->st.h;
+    }
 
-  self->st.rect.x0 = x0;
-  self->st.rect.y0 = y0;
-  self->st.rect.x1 = x0 + w;
-  self->st.rect.y1 = y0 + h;
+    self->st.x = x;
+    self->st.y = y;
+    self->st.rect = fz_make_irect(x0, y0, x0 + w, y0 + h);
+    drop_tile_cache(self);
 
-  if (STRESS)
-  {
-    upload_texture_rect(self->tex, self->st.rect, pixels);
+    render_region(ctx, self, bounds, x, y, self->st.rect, scale);
   }
 
   // fprintf(stderr, "[txp_renderer] updated texture, new pixels: %d\n", w * h);
+
+  if (scale == self->st.scale && self->zoom.stage == ZOOM_NONE)
+    predict_scroll(ctx, self, bounds, x, y, w, h, scale);
 }
 
 static void render_caret(txp_renderer *self, int x, int y, int h)
@@ -740,15 +2092,85 @@ static void render_caret(txp_renderer *self, int x, int y, int h)
 }
 
 
-void txp_renderer_render(fz_context *ctx, txp_renderer *self)
+// Compute the area of the page that is visible on screen
+static bool get_view_rect(fz_context *ctx, txp_renderer *self,
+                          SDL_FRect *page_rect, SDL_FRect *view_rect,
+                          float *scale)
 {
-  SDL_FRect page_rect;
+  if (!txp_renderer_page_position(ctx, self, page_rect, NULL, scale))
+    return 0;
+
+  const SDL_FRect screen_rect =
+      (SDL_FRect){.x = 0, .y = 0, .w = self->output_w, .h = self->output_h};
+
+  view_rect->x = fmaxf(page_rect->x, screen_rect.x);
+  view_rect->y = fmaxf(page_rect->y, screen_rect.y);
+  view_rect->w = fminf(page_rect->x + page_rect->w, screen_rect.x + screen_rect.w) - view_rect->x;
+  view_rect->h = fminf(page_rect->y + page_rect->h, screen_rect.y + screen_rect.h) - view_rect->y;
+  return (view_rect->w > 0 && view_rect->h > 0);
+}
+
+// First refinement of a progressive zoom: render the view at low resolution
+static void render_low_res(fz_context *ctx, txp_renderer *self,
+                           const SDL_FRect *page_rect,
+                           const SDL_FRect *view_rect)
+{
+  prepare_texture(ctx, self);
+
+  fz_rect bounds = get_bounds(ctx, self);
+  float scale = page_rect->w / (bounds.x1 - bounds.x0) / ZOOM_LOW_FACTOR;
+
+  int x = (view_rect->x - page_rect->x) / ZOOM_LOW_FACTOR;
+  int y = (view_rect->y - page_rect->y) / ZOOM_LOW_FACTOR;
+  int w = fz_mini(view_rect->w / ZOOM_LOW_FACTOR + 2, self->st.w);
+  int h = fz_mini(view_rect->h / ZOOM_LOW_FACTOR + 2, self->st.h);
+
+  self->st.scale = scale;
+  self->st.x = x;
+  self->st.y = y;
+  self->st.rect = fz_make_irect(0, 0, w, h);
+  drop_tile_cache(self);
+  render_region(ctx, self, bounds, x, y, self->st.rect, scale);
+}
+
+bool txp_renderer_is_refining(fz_context *ctx, txp_renderer *self)
+{
+  return self->zoom.stage != ZOOM_NONE || self->prefetch.active;
+}
+
+bool txp_renderer_refine(fz_context *ctx, txp_renderer *self)
+{
+  SDL_FRect page_rect, view_rect;
   float scale;
 
-  // fprintf(stderr, "[txp_renderer] txp_renderer_render: compute page pos\n");
+  // Upload the predicted tiles while input is idle
+  if (self->zoom.stage == ZOOM_NONE)
+    return prefetch_collect(self, 0);
 
-  if (!txp_renderer_page_position(ctx, self, &page_rect, NULL, &scale))
-    return;
+  if (!get_view_rect(ctx, self, &page_rect, &view_rect, &scale))
+  {
+    self->zoom.stage = ZOOM_NONE;
+    return 0;
+  }
+
+  if (self->zoom.stage == ZOOM_SCALED)
+  {
+    render_low_res(ctx, self, &page_rect, &view_rect);
+    self->zoom.stage = ZOOM_LOW;
+  }
+  else
+  {
+    self->zoom.stage = ZOOM_NONE;
+    update_texture(ctx, self, &page_rect, &view_rect, 0);
+  }
+
+  return self->zoom.stage != ZOOM_NONE;
+}
+
+void txp_renderer_render(fz_context *ctx, txp_renderer *self)
+{
+  SDL_FRect page_rect, view_rect;
+  float scale;
 
   uint32_t bg, fg;
   txp_get_colors(&self->config, &bg, &fg);
@@ -756,45 +2178,40 @@ void txp_renderer_render(fz_context *ctx, txp_renderer *self)
   {
     self->cached_bg = bg;
     self->cached_fg = fg;
+    prefetch_cancel(self);
     clear_texture(self);
   }
 
-  // fprintf(stderr, "[txp_renderer] page rect: {x=%.02f y=%.02f w=%.02f
-  // h=%.02f}\n",
-  //         page_rect.x, page_rect.y, page_rect.w, page_rect.h);
-
-  const SDL_FRect screen_rect =
-      (SDL_FRect){.x = 0, .y = 0, .w = self->output_w, .h = self->output_h};
-
-  // fprintf(stderr, "[txp_renderer] screen rect: {x=%.02f y=%.02f w=%.02f h=%.02f}\n",
-  //         screen_rect.x, screen_rect.y, screen_rect.w, screen_rect.h);
-
-  SDL_FRect view_rect;
+  // fprintf(stderr, "[txp_renderer] txp_renderer_render: compute view rect\n");
 
-  // fprintf(stderr, "[txp_renderer] txp_renderer_render: intersect with screen\n");
-
-  view_rect.x = fmaxf(page_rect.x, screen_rect.x);
-  view_rect.y = fmaxf(page_rect.y, screen_rect.y);
-  view_rect.w = fminf(page_rect.x + page_rect.w, screen_rect.x + screen_rect.w) - view_rect.x;
-  view_rect.h = fminf(page_rect.y + page_rect.h, screen_rect.y + screen_rect.h) - view_rect.y;
-  if (view_rect.w <= 0 || view_rect.h <= 0)
+  if (!get_view_rect(ctx, self, &page_rect, &view_rect, &scale))
     return;
 
   // fprintf(stderr, "[txp_renderer] txp_renderer_render: update texture\n");
 
-  struct timespec update_start, update_end;
-  clock_gettime(CLOCK_MONOTONIC, &update_start);
-  update_texture(ctx, self, &page_rect, &view_rect);
-  clock_gettime(CLOCK_MONOTONIC, &update_end);
-  // fprintf(stderr, "[txp_renderer] updated texture in %ldus\n",
-  //         (update_end.tv_sec - update_start.tv_sec) * 1000 * 1000 +
-  //         (update_end.tv_nsec - update_start.tv_nsec) / 1000);
+  uint64_t update_start = latency_now();
+  update_texture(ctx, self, &page_rect, &view_rect, 1);
+  latency_span("update texture", update_start);
   // fprintf(stderr, "[txp_renderer] txp_renderer_render: blit texture to screen\n");
 
   int bx0 = floorf(view_rect.x);
   int by0 = floorf(view_rect.y);
   int pixel_pushed = 0;
-  render_texture_rect(self->sdl, bx0, by0, self->tex, self->st.rect);
+  fz_rect bounds = get_bounds(ctx, self);
+  float k = (page_rect.w / (bounds.x1 - bounds.x0)) / self->st.scale;
+  // The texture can extend beyond the view, with the strips rendered ahead
+  // of the scroll, and has been rendered at a different scale during a
+  // progressive zoom (then it is stretched)
+  int x = view_rect.x - page_rect.x;
+  int y = view_rect.y - page_rect.y;
+  if (k == 1)
+    render_texture_rect(self->sdl, bx0 + self->st.x - x, by0 + self->st.y - y,
+                        1, self->tex, self->st.rect);
+  else
+    render_texture_rect(self->sdl,
+                        bx0 + self->st.x * k - x,
+                        by0 + self->st.y * k - y,
+                        k, self->tex, self->st.rect);
   if (self->selection_count != 0)
   {
     SDL_SetRenderDrawBlendMode(self->sdl, SDL_BLENDMODE_BLEND);
@@ -874,10 +2291,6 @@ static int set_quads(fz_context *ctx, txp_renderer *self, fz_quad *quads, int co
 
 bool txp_renderer_drag_selection(fz_context *ctx, txp_renderer *self, fz_point pt)
 {
-  fz_stext_page *page = get_stext(ctx, self);
-  if (!page)
-    return 0;
-
   SDL_FRect page_rect;
   fz_point translate, p;
   float scale;
@@ -887,6 +2300,12 @@ bool txp_renderer_drag_selection(fz_context *ctx, txp_renderer *self, fz_point p
 
   p = fz_make_point((pt.x - translate.x) / scale, (pt.y - translate.y) / scale);
 
+  fz_stext_page *page =
+    get_stext(ctx, self, fz_min(p.y, self->selection_start.y),
+              fz_max(p.y, self->selection_start.y));
+  if (!page)
+    return 0;
+
   fz_quad quads[SELECTION_RECT_COUNT];
   int count = fz_highlight_selection(ctx, page, self->selection_start, p,
                                      quads, SELECTION_RECT_COUNT);
@@ -896,10 +2315,6 @@ bool txp_renderer_drag_selection(fz_context *ctx, txp_renderer *self, fz_point p
 
 bool txp_renderer_select_char(fz_context *ctx, txp_renderer *self, fz_point pt)
 {
-  fz_stext_page *page = get_stext(ctx, self);
-  if (!page)
-    return 0;
-
   SDL_FRect page_rect;
   fz_point translate, p, p0, p1;
   float scale;
@@ -909,6 +2324,10 @@ bool txp_renderer_select_char(fz_context *ctx, txp_renderer *self, fz_point pt)
     return 0;
 
   p0 = p1 = p = fz_make_point((pt.x - translate.x) / scale, (pt.y - translate.y) / scale);
+
+  fz_stext_page *page = get_stext(ctx, self, p.y, p.y);
+  if (!page)
+    return 0;
   q = fz_snap_selection(ctx, page, &p0, &p1, FZ_SELECT_WORDS);
 
   int count = 0;
@@ -935,7 +2354,7 @@ bool txp_renderer_select_char(fz_context *ctx, txp_renderer *self, fz_point pt)
   }
 
   fz_rect r = fz_rect_from_quad(q);
-  fprintf(stderr, "sel rect: (%f,%f)-(%f,%f)\n", r.x0, r.y0, r.x1, r.y1);
+  txp_debug(TXP_LOG_RENDER, "[render] sel rect: (%f,%f)-(%f,%f)\n", r.x0, r.y0, r.x1, r.y1);
 
 
   return set_quads(ctx, self, &q, count);
@@ -943,10 +2362,6 @@ bool txp_renderer_select_char(fz_context *ctx, txp_renderer *self, fz_point pt)
 
 bool txp_renderer_select_word(fz_context *ctx, txp_renderer *self, fz_point pt)
 {
-  fz_stext_page *page = get_stext(ctx, self);
-  if (!page)
-    return 0;
-
   SDL_FRect page_rect;
   fz_point translate, p, p0, p1;
   float scale;
@@ -956,6 +2371,10 @@ bool txp_renderer_select_word(fz_context *ctx, txp_renderer *self, fz_point pt)
     return 0;
 
   p0 = p1 = p = fz_make_point((pt.x - translate.x) / scale, (pt.y - translate.y) / scale);
+
+  fz_stext_page *page = get_stext(ctx, self, p.y, p.y);
+  if (!page)
+    return 0;
   q = fz_snap_selection(ctx, page, &p0, &p1, FZ_SELECT_WORDS);
 
   if (point_to_rect_dist(p, fz_rect_from_quad(q)) * scale > 20)
@@ -974,6 +2393,12 @@ void txp_renderer_set_scale_factor(fz_context *ctx, txp_renderer *self, fz_point
   self->scale_factor = scale;
 }
 
+void txp_renderer_place_page(fz_context *ctx, txp_renderer *self, bool enabled, float y)
+{
+  self->placement.enabled = enabled;
+  self->placement.y = y;
+}
+
 fz_point txp_renderer_screen_to_document(fz_context *ctx, txp_renderer *self, fz_point pt)
 {
   fz_point translate;
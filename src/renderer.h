@@ -37,6 +37,11 @@ typedef struct txp_renderer_s txp_renderer;
 txp_renderer *txp_renderer_new(fz_context *ctx, SDL_Renderer *sdl);
 void txp_renderer_free(fz_context *ctx, txp_renderer *r);
 
+// A renderer drawing to the same SDL renderer, starting with the same
+// configuration and sharing the rendering workers. Each one has its own
+// contents and texture, several pages can be displayed at once.
+txp_renderer *txp_renderer_new_sibling(fz_context *ctx, txp_renderer *other);
+
 enum txp_fit_mode
 {
   FIT_WIDTH,
@@ -76,7 +81,20 @@ bool txp_renderer_page_bounds(fz_context *ctx, txp_renderer *self, txp_renderer_
 bool txp_renderer_page_position(fz_context *ctx, txp_renderer *self, SDL_FRect *rect, fz_point *translate, float *scale);
 
 void txp_renderer_render(fz_context *ctx, txp_renderer *self);
+
+// Progressive zoom: after a change of scale, the texture is displayed
+// stretched until it is refined. Each call to refine renders the next
+// pass and returns true if more passes are needed.
+// While scrolling, refine also uploads the parts of the page rendered ahead
+// of the view in the background.
+bool txp_renderer_is_refining(fz_context *ctx, txp_renderer *self);
+bool txp_renderer_refine(fz_context *ctx, txp_renderer *self);
 void txp_renderer_set_scale_factor(fz_context *ctx, txp_renderer *self, fz_point scale);
+
+// Put the top of the page at y in window space, instead of deriving its
+// vertical position from config->pan.y (which is then left unclamped).
+// Used to stack pages in the continuous view.
+void txp_renderer_place_page(fz_context *ctx, txp_renderer *self, bool enabled, float y);
 bool txp_renderer_start_selection(fz_context *ctx, txp_renderer *self, fz_point pt);
 bool txp_renderer_drag_selection(fz_context *ctx, txp_renderer *self, fz_point pt);
 bool txp_renderer_select_word(fz_context *ctx, txp_renderer *self, fz_point pt);
@@ -89,6 +89,13 @@ const char *sexp_parse(fz_context *ctx, sexp_parser *cp, vstack *stack, const
             vstack_begin_string(ctx, stack);
             cp->state = P_STRING;
           }
+          else if (c == '#')
+          {
+            // Verbatim string: #<length>:<bytes>
+            vstack_begin_string(ctx, stack);
+            cp->verbatim = 0;
+            cp->state = P_VERBATIM_LENGTH;
+          }
           else if (is_digit(c))
           {
             cp->number = c - '0';
@@ -242,6 +249,35 @@ const char *sexp_parse(fz_context *ctx, sexp_parser *cp, vstack *stack, const
         vstack_push_char(ctx, stack, cp->octal);
         cp->state = P_STRING;
         break;
+
+      case P_VERBATIM_LENGTH:
+        while (input < limit && is_digit(*input))
+        {
+          cp->verbatim = cp->verbatim * 10 + (*input - '0');
+          input += 1;
+        }
+        if (input >= limit)
+          break;
+        if (*input != ':')
+          fz_throw(ctx, 0, "sexp parser: unexpected character %C in verbatim string\n", *input);
+        input += 1;
+        cp->state = P_VERBATIM;
+
+      case P_VERBATIM:
+        {
+          size_t n = limit - input;
+          if (n > cp->verbatim)
+            n = cp->verbatim;
+          vstack_push_chars(ctx, stack, input, n);
+          input += n;
+          cp->verbatim -= n;
+          if (cp->verbatim == 0)
+          {
+            vstack_end_string(ctx, stack);
+            cp->state = P_IDLE;
+          }
+        }
+        break;
     }
   }
   return NULL;
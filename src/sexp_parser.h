@@ -42,6 +42,8 @@ enum sexp_parser_state
   P_STRING_ESCAPE,
   P_STRING_OCTAL1,
   P_STRING_OCTAL2,
+  P_VERBATIM_LENGTH,
+  P_VERBATIM,
 };
 
 typedef struct
@@ -50,6 +52,8 @@ typedef struct
   union
   {
     int octal;
+    // Bytes remaining in a verbatim string
+    size_t verbatim;
     struct
     {
       float number;
@@ -23,12 +23,14 @@
  */
 
 #include "sprotocol.h"
+#include "txp_log.h"
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <cstdio>
 #include <variant>
 #include <optional>
@@ -139,6 +141,39 @@ void query::data::log(FILE *f)
   }, *this);
 }
 
+// Write a buffered header and a payload with a single system call
+static void writev_all(const int fd, const char *head, int head_size,
+                       const char *buf, int size)
+{
+  struct iovec iov[2] = {
+    { .iov_base = (void*)head, .iov_len = (size_t)head_size },
+    { .iov_base = (void*)buf, .iov_len = (size_t)size },
+  };
+  int total = head_size + size;
+
+  while (total > 0)
+  {
+    int n = writev(fd, iov, 2);
+    if (n == -1)
+    {
+      if (errno == EINTR) continue;
+      perror("sprotocol.c writev_all");
+      print_backtrace();
+      if (errno == ECONNRESET) return;
+    }
+    if (n <= 0) mabort();
+
+    total -= n;
+    for (int i = 0; i < 2; ++i)
+    {
+      size_t k = (size_t)n < iov[i].iov_len ? n : iov[i].iov_len;
+      iov[i].iov_base = (char*)iov[i].iov_base + k;
+      iov[i].iov_len -= k;
+      n -= k;
+    }
+  }
+}
+
 static void write_all(const int fd, const char *buf, int size)
 {
   while (size > 0)
@@ -178,7 +213,7 @@ size_t Channel::read_(const int fd, void *data, const size_t len)
   {
     if (errno == ECONNRESET)
     {
-      fprintf(stderr, "sprotocol:read_: ECONNRESET\n");
+      txp_error(TXP_LOG_PROTOCOL, "sprotocol:read_: ECONNRESET\n");
       fflush(stderr);
       return 0;
     }
@@ -276,13 +311,24 @@ bool Channel::load_at_least(const int fd, const int at_least)
   // Read from file until enough content is in the input buffer
   while (avail < at_least)
   {
-    const ssize_t n = this->read_(fd, this->input.buffer + avail, BUF_SIZE - avail);
+    const size_t room = this->input.cap - avail;
+    const ssize_t n = this->read_(fd, this->input.buffer + avail, room);
     if (n == 0)
     {
       this->input.len = avail;
       return false;
     }
     avail += n;
+
+    // The read filled the buffer: more queries are likely waiting, grow it
+    // to receive them with fewer system calls
+    if (n == room && this->input.cap < INPUT_BUF_MAX)
+    {
+      this->input.cap *= 2;
+      this->input.buffer =
+        static_cast<char*>(realloc(this->input.buffer, this->input.cap));
+      if (!this->input.buffer) mabort();
+    }
   }
 
   this->input.len = avail;
@@ -311,6 +357,11 @@ Channel::Channel()
   this->buf = static_cast<char*>(malloc(256));
   if (!this->buf) mabort();
   this->buf_size = 256;
+  this->input.buffer = static_cast<char*>(malloc(BUF_SIZE));
+  if (!this->input.buffer) mabort();
+  this->input.cap = BUF_SIZE;
+  this->input.pos = this->input.len = 0;
+  this->output.pos = 0;
   this->passed_fd = -1;
   this->fd = {};
 }
@@ -318,6 +369,7 @@ Channel::Channel()
 Channel::~Channel()
 {
   free(this->buf);
+  free(this->input.buffer);
 }
 
 // Double the size of the Channel buffer
@@ -369,7 +421,7 @@ bool Channel::read_bytes(size_t pos, size_t size)
   return this->load_size(this->fd.value(), &this->buf[pos], size);
 }
 
-void Channel::write_bytes(const int fd, void *buf, const int size)
+void Channel::write_bytes(const int fd, const void *buf, const int size)
 {
   if (this->output.pos + size <= BUF_SIZE)
   {
@@ -378,14 +430,17 @@ void Channel::write_bytes(const int fd, void *buf, const int size)
     return;
   }
 
-  this->cflush(fd);
-
-  if (size > BUF_SIZE) write_all(fd, (char*) buf, size);
-  else
+  if (size > BUF_SIZE)
   {
-    memcpy(this->output.buffer, buf, size);
-    this->output.pos = size;
+    writev_all(fd, this->output.buffer, this->output.pos,
+               (const char*) buf, size);
+    this->output.pos = 0;
+    return;
   }
+
+  this->cflush(fd);
+  memcpy(this->output.buffer, buf, size);
+  this->output.pos = size;
 }
 
 template<typename T> std::optional<T> Channel::try_read_item(const int fd)
@@ -411,6 +466,11 @@ void Channel::write_item(const int fd, T u)
   this->write_bytes(fd, &u, sizeof(T));
 }
 
+bool Channel::has_buffered_query() const
+{
+  return this->input.pos != this->input.len;
+}
+
 bool Channel::has_pending_query(int timeout) const
 {
   if (this->input.pos != this->input.len) return true;
@@ -452,7 +512,7 @@ std::optional<query::data> Channel::read_query()
   {
     case query::Q_OPEN:
     {
-        fprintf(stderr, "[info] Reading OPEN");
+        txp_debug(TXP_LOG_PROTOCOL, "[info] Reading OPEN\n");
         const auto fid = this->read_item<file_id>(fd);
         const int pos_path = this->read_zstr(&pos);
         const int pos_mode = this->read_zstr(&pos);
@@ -466,7 +526,7 @@ std::optional<query::data> Channel::read_query()
     }
     case query::Q_READ:
     {
-        fprintf(stderr, "[info] Reading READ");
+        txp_debug(TXP_LOG_PROTOCOL, "[info] Reading READ\n");
         return query::data(time, query::read {
             .fid = this->read_item<file_id>(fd),
             .pos = this->read_item<uint32_t>(fd),
@@ -475,7 +535,7 @@ std::optional<query::data> Channel::read_query()
     }
     case query::Q_WRIT:
     {
-        fprintf(stderr, "[info] Reading WRIT");
+        txp_debug(TXP_LOG_PROTOCOL, "[info] Reading WRIT\n");
         query::writ wr {
             .fid = this->read_item<uint32_t>(fd),
             .pos = this->read_item<uint32_t>(fd),
@@ -487,7 +547,7 @@ std::optional<query::data> Channel::read_query()
     }
     case query::Q_CLOS:
     {
-        fprintf(stderr, "[info] Reading CLOS");
+        txp_debug(TXP_LOG_PROTOCOL, "[info] Reading CLOS\n");
         query::clos cl {
             .fid = this->read_item<file_id>(fd)
         };
@@ -495,7 +555,7 @@ std::optional<query::data> Channel::read_query()
     }
     case query::Q_SIZE:
     {
-        fprintf(stderr, "[info] Reading SIZE");
+        txp_debug(TXP_LOG_PROTOCOL, "[info] Reading SIZE\n");
         query::size si {
             .fid = this->read_item<file_id>(fd)
         };
@@ -503,7 +563,7 @@ std::optional<query::data> Channel::read_query()
     }
     case query::Q_SEEN:
     {
-        fprintf(stderr, "[info] Reading SEEN");
+        txp_debug(TXP_LOG_PROTOCOL, "[info] Reading SEEN\n");
         query::seen se {
             .fid = this->read_item<file_id>(fd),
             .pos = this->read_item<file_id>(fd),
@@ -512,7 +572,7 @@ std::optional<query::data> Channel::read_query()
     }
     case query::Q_GPIC:
     {
-        fprintf(stderr, "[info] Reading GPIC");
+        txp_debug(TXP_LOG_PROTOCOL, "[info] Reading GPIC\n");
         int pos_path = this->read_zstr(&pos);
         query::gpic gp {
             .path = &this->buf[pos_path],
@@ -523,7 +583,7 @@ std::optional<query::data> Channel::read_query()
     }
     case query::Q_SPIC:
     {
-        fprintf(stderr, "[info] Reading SPIC");
+        txp_debug(TXP_LOG_PROTOCOL, "[info] Reading SPIC\n");
         int pos_path = this->read_zstr(&pos);
         query::spic sp {
             .path = &this->buf[pos_path],
@@ -542,7 +602,7 @@ std::optional<query::data> Channel::read_query()
     }
     case query::Q_CHLD:
     {
-        fprintf(stderr, "[info] Reading CHLD");
+        txp_debug(TXP_LOG_PROTOCOL, "[info] Reading CHLD\n");
         query::chld ch {
             .pid = static_cast<file_id>(this->read_item<uint32_t>(fd)),
             .fd = this->passed_fd,
@@ -553,8 +613,8 @@ std::optional<query::data> Channel::read_query()
     }
     default:
     {
-        fprintf(stderr, "unexpected tag: %c%c%c%c\n",
-                tag & 0xFF, (tag >> 8) & 0xFF, (tag >> 16) & 0xFF, (tag >> 24) & 0xFF);
+        txp_error(TXP_LOG_PROTOCOL, "unexpected tag: %c%c%c%c\n",
+                  tag & 0xFF, (tag >> 8) & 0xFF, (tag >> 16) & 0xFF, (tag >> 24) & 0xFF);
         mabort();
         return {};
     }
@@ -585,13 +645,7 @@ void Channel::write_ask(const int fd, ask_t *a)
 
 void Channel::write_answer(const int fd, const answer::data &a)
 {
-    // if (LOG)
-    // {
-      // if (a->tag == READ)
-      //   fprintf(stderr, "[info] -> READ %d\n", a->read.size);
-      // else
-        fprintf(stderr, "[info] -> %s\n", answer_to_string(a.to_enum()));
-    // }
+    txp_debug(TXP_LOG_PROTOCOL, "[info] -> %s\n", answer_to_string(a.to_enum()));
     this->write_item(fd, static_cast<uint32_t>(a.to_enum()));
     std::visit(overloaded {
         [](answer::done _) {},
@@ -599,7 +653,7 @@ void Channel::write_answer(const int fd, const answer::data &a)
         [](answer::fork _) {},
         [fd, this](answer::read r) {
             this->write_item(fd, r.size);
-            this->write_bytes(fd, this->buf, r.size);
+            this->write_bytes(fd, r.data ? r.data : this->buf, r.size);
         },
         [fd, this](answer::size s) {
             this->write_item(fd, s.size);
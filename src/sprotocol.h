@@ -46,8 +46,10 @@ extern "C" {
 
 typedef int file_id;
 
-#define LOG 0
 #define BUF_SIZE 4096
+// The input buffer grows up to this size when TeX sends queries faster than
+// they are consumed
+#define INPUT_BUF_MAX (64 * 1024)
 
 #define LEN(txt) (sizeof(txt)-1)
 #define STR(X) #X
@@ -171,6 +173,9 @@ namespace answer {
     };
     struct read {
       int size;
+      // Contents to send, the channel buffer (see get_buffer) if null.
+      // Must stay valid until the answer is written.
+      const void *data;
     };
     struct open {
       int size;
@@ -219,6 +224,8 @@ struct Channel
   ~Channel();
   bool handshake(int fd);
   bool has_pending_query(int timeout) const;
+  // A query has already been received, reading it won't block
+  bool has_buffered_query() const;
   std::optional<query::data> read_query();
   query::message peek_query();
   void write_ask(int fd, ask_t *a);
@@ -231,8 +238,8 @@ struct Channel
 private:
   std::optional<file_id> fd;
   struct {
-    char buffer[BUF_SIZE];
-    size_t pos, len;
+    char *buffer;
+    size_t pos, len, cap;
   } input;
   struct {
     char buffer[BUF_SIZE];
@@ -257,7 +264,7 @@ private:
   // writing to fd
   void cflush(int fd);
   template<typename T> void write_item(int fd, T item);
-  void write_bytes(int fd, void *buf, int size);
+  void write_bytes(int fd, const void *buf, int size);
   void resize_buf();
 };
 
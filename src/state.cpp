@@ -27,11 +27,18 @@
 #include "string.h"
 #include "mupdf_compat.h"
 #include "dvi/fz_util.h"
+#include "txp_log.h"
+#include "txp_memstat.h"
 
 /* Rollback log */
 
-#undef LOG
-#define LOG 0
+// The log is a stack of undo records stored in fixed-size segments.
+// Segments never move, so the log grows without copying the records
+// already pushed, and rolling back releases the segments past the mark as a
+// whole.
+// A mark is the number of records at the time of the snapshot. Record 0 is
+// never used so that marks are never 0, the snap of fresh cells and entries.
+#define LOG_SEGMENT 1024
 
 enum log_action {
   LOG_ENTRY = 0x42,
@@ -39,73 +46,94 @@ enum log_action {
   LOG_OVERWRITE
 };
 
+typedef struct {
+  enum log_action action;
+  union {
+    struct {
+      fileentry_t *entry;
+      decltype(fileentry_t::saved) saved;
+      size_t len;
+    } entry;
+    struct {
+      filecell_t *cell;
+      filecell_t value;
+    } cell;
+    struct {
+      fz_buffer *buf;
+      int start, len;
+      unsigned char *data;
+    } overwrite;
+  };
+} log_record;
+
 struct log_s
 {
   mark_t snap;
-  fz_buffer *data;
+  int len;
+  log_record **segments;
+  int segment_count;
 };
 
 log_t *log_new(fz_context *ctx)
 {
-  fz_ptr(log_t, log);
-  fz_ptr(fz_buffer, data);
-  fz_try(ctx)
-  {
-    log = fz_malloc_struct(ctx, log_t);
-    data = fz_new_buffer(ctx, 512);
-    log->data = data;
-    log->snap = 1;
-    fz_append_byte(ctx, log->data, 0);
-  }
-  fz_catch(ctx)
-  {
-    if (data)
-      fz_drop_buffer(ctx, data);
-    if (log)
-      fz_free(ctx, log);
-    fz_rethrow(ctx);
-  }
+  log_t *log = fz_malloc_struct(ctx, log_t);
+  log->snap = 1;
+  log->len = 1;
   return log;
 }
 
 void log_free(fz_context *ctx, log_t *log)
 {
-  fz_drop_buffer(ctx, log->data);
+  for (int i = 0; i < log->segment_count; ++i)
+    if (log->segments[i])
+      fz_free(ctx, log->segments[i]);
+  if (log->segments)
+    fz_free(ctx, log->segments);
   fz_free(ctx, log);
 }
 
-#define PUSH_VALUE(ctx, buf, val) \
-  fz_append_data(ctx, buf, &(val), sizeof(val))
-
-static void pop_value(fz_buffer *buf, void *val, size_t len)
+static log_record *log_push(fz_context *ctx, log_t *log, enum log_action action)
 {
-  if (buf->len < len) abort();
-  buf->len -= len;
-  memcpy(val, buf->data + buf->len, len);
-}
-
-#define POP_VALUE(buf, val) \
-  pop_value(buf, &(val), sizeof(val))
-
-static void push_action(fz_context *ctx, fz_buffer *buf, enum log_action action)
-{
-  uint8_t b = action;
-  PUSH_VALUE(ctx, buf, b);
+  int segment = log->len / LOG_SEGMENT;
+  int tag = txp_mem_enter(TXP_MEM_ROLLBACK);
+  fz_try(ctx)
+  {
+    if (segment >= log->segment_count)
+    {
+      int count = log->segment_count == 0 ? 16 : log->segment_count * 2;
+      log->segments = (log_record **)
+        fz_realloc(ctx, log->segments, count * sizeof(log_record *));
+      memset(log->segments + log->segment_count, 0,
+             (count - log->segment_count) * sizeof(log_record *));
+      log->segment_count = count;
+    }
+    if (!log->segments[segment])
+      log->segments[segment] =
+        fz_malloc_struct_array(ctx, LOG_SEGMENT, log_record);
+  }
+  fz_always(ctx)
+    txp_mem_leave(tag);
+  fz_catch(ctx)
+    fz_rethrow(ctx);
+  log_record *r = &log->segments[segment][log->len % LOG_SEGMENT];
+  log->len += 1;
+  r->action = action;
+  return r;
 }
 
 void log_fileentry(fz_context *ctx, log_t *log, fileentry_t *entry)
 {
   if (entry->saved.snap != log->snap)
   {
-    if (LOG) fprintf(stderr, "push LOG_ENTRY %s\n", entry->path);
+    txp_debug(TXP_LOG_ENGINE, "push LOG_ENTRY %s\n", entry->path);
+    log_record *r = log_push(ctx, log, LOG_ENTRY);
     if (entry->saved.data)
     {
       fz_keep_buffer(ctx, entry->saved.data);
-      PUSH_VALUE(ctx, log->data, entry->saved.data->len);
+      r->entry.len = entry->saved.data->len;
     }
-    PUSH_VALUE(ctx, log->data, entry->saved);
-    PUSH_VALUE(ctx, log->data, entry);
-    push_action(ctx, log->data, LOG_ENTRY);
+    r->entry.saved = entry->saved;
+    r->entry.entry = entry;
     entry->saved.snap = log->snap;
   }
 }
@@ -114,73 +142,71 @@ void log_filecell(fz_context *ctx, log_t *log, filecell_t *cell)
 {
   if (cell->snap != log->snap)
   {
-    if (LOG) fprintf(stderr, "push LOG_CELL\n");
-    PUSH_VALUE(ctx, log->data, *cell);
-    PUSH_VALUE(ctx, log->data, cell);
-    push_action(ctx, log->data, LOG_CELL);
+    txp_debug(TXP_LOG_ENGINE, "push LOG_CELL\n");
+    log_record *r = log_push(ctx, log, LOG_CELL);
+    r->cell.value = *cell;
+    r->cell.cell = cell;
     cell->snap = log->snap;
   }
 }
 
-struct overwrite_data {
-  fz_buffer *buf;
-  int start, len;
-};
-
 void log_overwrite(fz_context *ctx, log_t *log, fz_buffer *buf, int start, int len)
 {
-  if (LOG) fprintf(stderr, "push LOG_OVERWRITE\n");
+  txp_debug(TXP_LOG_ENGINE, "push LOG_OVERWRITE\n");
+  int tag = txp_mem_enter(TXP_MEM_ROLLBACK);
+  unsigned char *data = NULL;
+  fz_try(ctx)
+    data = (unsigned char *)fz_malloc(ctx, len);
+  fz_always(ctx)
+    txp_mem_leave(tag);
+  fz_catch(ctx)
+    fz_rethrow(ctx);
+  memcpy(data, buf->data + start, len);
+  log_record *r = NULL;
+  fz_try(ctx)
+    r = log_push(ctx, log, LOG_OVERWRITE);
+  fz_catch(ctx)
+  {
+    fz_free(ctx, data);
+    fz_rethrow(ctx);
+  }
   fz_keep_buffer(ctx, buf);
-  fz_append_data(ctx, log->data, buf->data + start, len);
-  struct overwrite_data data = {
-    .buf = buf,
-    .start = start,
-    .len = len,
-  };
-  PUSH_VALUE(ctx, log->data, data);
-  push_action(ctx, log->data, LOG_OVERWRITE);
-}
-
-static enum log_action pop_action(fz_buffer *buf)
-{
-  uint8_t b;
-  POP_VALUE(buf, b);
-  return b;
+  r->overwrite.buf = buf;
+  r->overwrite.start = start;
+  r->overwrite.len = len;
+  r->overwrite.data = data;
 }
 
 static void log_pop(fz_context *ctx, log_t *log)
 {
-  switch (pop_action(log->data))
+  log->len -= 1;
+  log_record *r = &log->segments[log->len / LOG_SEGMENT][log->len % LOG_SEGMENT];
+  switch (r->action)
   {
     case LOG_ENTRY:
     {
-      fileentry_t *entry;
-      POP_VALUE(log->data, entry);
-      if (LOG) fprintf(stderr, "pop LOG_ENTRY %s\n", entry->path);
+      fileentry_t *entry = r->entry.entry;
+      txp_debug(TXP_LOG_ENGINE, "pop LOG_ENTRY %s\n", entry->path);
       if (entry->saved.data)
         fz_drop_buffer(ctx, entry->saved.data);
-      POP_VALUE(log->data, entry->saved);
+      entry->saved = r->entry.saved;
       if (entry->saved.data)
-      {
-        POP_VALUE(log->data, entry->saved.data->len);
-      }
+        entry->saved.data->len = r->entry.len;
       break;
     }
     case LOG_CELL:
     {
-      if (LOG) fprintf(stderr, "pop LOG_CELL\n");
-      filecell_t *cell;
-      POP_VALUE(log->data, cell);
-      POP_VALUE(log->data, *cell);
+      txp_debug(TXP_LOG_ENGINE, "pop LOG_CELL\n");
+      *r->cell.cell = r->cell.value;
       break;
     }
     case LOG_OVERWRITE:
     {
-      if (LOG) fprintf(stderr, "pop LOG_OVERWRITE\n");
-      struct overwrite_data data;
-      POP_VALUE(log->data, data);
-      pop_value(log->data, data.buf->data + data.start, data.len);
-      fz_drop_buffer(ctx, data.buf);
+      txp_debug(TXP_LOG_ENGINE, "pop LOG_OVERWRITE\n");
+      memcpy(r->overwrite.buf->data + r->overwrite.start,
+             r->overwrite.data, r->overwrite.len);
+      fz_free(ctx, r->overwrite.data);
+      fz_drop_buffer(ctx, r->overwrite.buf);
       break;
     }
     default:
@@ -190,22 +216,32 @@ static void log_pop(fz_context *ctx, log_t *log)
 
 mark_t log_snapshot(fz_context *ctx, log_t *log)
 {
-  return (log->snap = log->data->len);
+  return (log->snap = log->len);
 }
 
 void log_rollback(fz_context *ctx, log_t *log, mark_t mark)
 {
   if (mark > log->snap) abort();
 
-  while (log->data->len > mark)
+  while (log->len > mark)
     log_pop(ctx, log);
 
-  if (mark != log->data->len)
+  if (mark != log->len)
   {
-    fprintf(stderr, "[fatal] rollback: mark=%d len =%d\n", mark, (int)log->data->len);
+    txp_error(TXP_LOG_ENGINE, "[fatal] rollback: mark=%d len =%d\n", mark, log->len);
     abort();
   }
 
+  // Release the segments past the one in use, keeping a spare one to not
+  // reallocate when the log grows again
+  for (int i = log->len / LOG_SEGMENT + 2; i < log->segment_count; ++i)
+  {
+    if (!log->segments[i])
+      break;
+    fz_free(ctx, log->segments[i]);
+    log->segments[i] = NULL;
+  }
+
   log->snap = mark;
 }
 
@@ -216,6 +252,37 @@ void state_init(state_t *st)
   memset(st, 0, sizeof(state_t));
 }
 
+void state_free(fz_context *ctx, state_t *st)
+{
+  for (int i = 0; i < st->chunk_count; ++i)
+    fz_free(ctx, st->chunks[i]);
+  fz_free(ctx, st->chunks);
+  st->chunks = NULL;
+  st->chunk_count = 0;
+}
+
+filecell_t *state_cell(fz_context *ctx, state_t *st, int fid)
+{
+  int chunk = fid / FILE_CHUNK;
+
+  if (chunk >= st->chunk_count)
+  {
+    int count = st->chunk_count == 0 ? 4 : st->chunk_count;
+    while (count <= chunk)
+      count *= 2;
+    st->chunks = (filecell_t **)
+      fz_realloc(ctx, st->chunks, count * sizeof(filecell_t *));
+    memset(st->chunks + st->chunk_count, 0,
+           (count - st->chunk_count) * sizeof(filecell_t *));
+    st->chunk_count = count;
+  }
+
+  if (!st->chunks[chunk])
+    st->chunks[chunk] = fz_malloc_struct_array(ctx, FILE_CHUNK, filecell_t);
+
+  return &st->chunks[chunk][fid % FILE_CHUNK];
+}
+
 static bool
 same_time(struct timespec a, struct timespec b)
 {
@@ -26,15 +26,22 @@
 #define STATE_H
 
 #include "pic_cache.h"
+#include "textbuf.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <sys/stat.h>
 #include <mupdf/fitz/buffer.h>
 
-#define MAX_FILES 1024
+// File cells are allocated by chunks that never move, as the rollback log
+// refers to them by address
+#define FILE_CHUNK 256
+
+// Granularity of change detection for files on disk
+#define FS_HASH_CHUNK 16384
 
 enum accesslevel {
   FILE_NONE,
@@ -51,11 +58,19 @@ typedef struct fileentry_s {
   struct stat fs_stat;
   fz_buffer *fs_data;
 
-  // Cached picture information
-  pic_cache pic_cache;
+  // Hashes of fs_data by chunks of FS_HASH_CHUNK bytes (NULL until the file
+  // is first rescanned), to locate changes without comparing contents
+  uint64_t *fs_hashes;
+
+  // Cached picture information, one entry per (type, page): documents
+  // commonly include several pages of the same PDF
+  struct {
+    pic_cache *entries;
+    int len, cap;
+  } pics;
 
   // State of the file in the text editor (or NULL if unedited)
-  fz_buffer *edit_data;
+  textbuf_t *edit_data;
 
   // State observed and/or produced by TeX process
   struct {
@@ -74,11 +89,16 @@ typedef struct filecell_s {
 } filecell_t;
 
 typedef struct {
-  filecell_t table[MAX_FILES];
+  filecell_t **chunks;
+  int chunk_count;
   filecell_t stdout, document, synctex, log;
 } state_t;
 
 void state_init(state_t *st);
+void state_free(fz_context *ctx, state_t *st);
+
+// Return the cell of file id fid, allocating it if needed
+filecell_t *state_cell(fz_context *ctx, state_t *st, int fid);
 
 typedef struct filesystem_s filesystem_t;
 typedef struct log_s log_t;
@@ -89,6 +109,16 @@ fileentry_t *filesystem_lookup_or_create(fz_context *ctx, filesystem_t *fs, cons
 fileentry_t *filesystem_lookup(filesystem_t *fs, const char *path);
 fileentry_t *filesystem_scan(filesystem_t *fs, int *index);
 
+// Reload fs_data of an entry from the file at path.
+// Return the offset of the first changed byte, or -1 if the contents are the
+// same or the file could not be read (fs_data is then left untouched).
+int fileentry_reload(fz_context *ctx, fileentry_t *e, const char *path);
+
+// Cached bounds of picture (type, page) of an entry, or NULL
+const pic_cache *fileentry_find_pic(fileentry_t *e, int type, int page);
+// Add the bounds of a picture to the cache, replacing the previous ones
+void fileentry_add_pic(fz_context *ctx, fileentry_t *e, const pic_cache *pic);
+
 log_t *log_new(fz_context *ctx);
 void log_free(fz_context *ctx, log_t *log);
 mark_t log_snapshot(fz_context *ctx, log_t *log);
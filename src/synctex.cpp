@@ -22,11 +22,14 @@
  * IN THE SOFTWARE.
  */
 
+#include <limits.h>
 #include <math.h>
+#include <stdint.h>
 #include <string.h>
 #include "synctex.h"
 #include "editor.h"
 #include "myabort.h"
+#include "txp_log.h"
 #include "mupdf_compat.h"
 
 struct int_buffer
@@ -69,7 +72,48 @@ struct record
   struct size size;
 };
 
+// Records of the pages, decoded once when the lines are received
+struct record_buffer
+{
+  struct record *ptr;
+  int len, cap;
+};
+
+// Spatial index of the records of a page for backward search.
+// The page is divided in a grid of cells, each listing (in page order) the
+// records that can be hit by a point of the cell: the record itself and all
+// the boxes containing it have to overlap the cell.
+struct page_grid
+{
+  fz_irect bounds;
+  int cols, rows;
+  // Enclosing box of each record of the page, or -1
+  int *parent;
+  // Records of cell i are items[cell_start[i]] to items[cell_start[i+1]]
+  int *cell_start, *items;
+};
+
+// Summary of the one-line records of an input on a page, for forward search
+struct tag_page
+{
+  int page;
+  // The first hbox of the page belongs to the input
+  int first_box;
+  // Largest line and last record of the page (INT_MIN if there is none)
+  int max_line;
+  int last_line, last_x, last_y;
+};
+
+struct tag_pages
+{
+  struct tag_page *ptr;
+  int len, cap;
+};
+
 static bool synctex_input_closed(fz_context *ctx, synctex_t *stx, unsigned index);
+static bool is_oneliner(enum kind k);
+static void grid_free(fz_context *ctx, struct page_grid *g);
+static void parse_record(const uint8_t *ptr, struct record *r);
 
 static void ib_init(struct int_buffer *ob)
 {
@@ -117,11 +161,39 @@ static void ib_append(fz_context *ctx, struct int_buffer *ib, int offset)
   ib->len += 1;
 }
 
+static void rb_append(fz_context *ctx, struct record_buffer *rb, const struct record *r)
+{
+  if (rb->len >= rb->cap)
+  {
+    int cap = rb->cap == 0 ? 256 : rb->cap * 2;
+    rb->ptr = (struct record *)fz_realloc(ctx, rb->ptr, sizeof(struct record) * cap);
+    rb->cap = cap;
+  }
+  rb->ptr[rb->len] = *r;
+  rb->len += 1;
+}
+
 struct synctex_s
 {
   struct int_buffer input_off, page_off, close_off, close_inp;
   int bol, cur;
 
+  /* Records of all pages, in order, with the offset of their lines.
+     The records of page i are records.ptr[page_rec.ptr[2*i]] up to
+     records.ptr[page_rec.ptr[2*i+1]] (the opening line of the page included,
+     as an STEX_OTHER record). */
+  struct record_buffer records;
+  struct int_buffer record_off, page_rec;
+
+  /* For each input tag, the pages that have one-line records of the input */
+  struct tag_pages *tags;
+  int tags_cap;
+  int page_has_box;
+
+  /* Spatial index of the pages, built by the first backward search */
+  struct page_grid **grids;
+  int grids_cap;
+
   /* Backward search state */
 
   /* Step 0. Initiating search. */
@@ -163,6 +235,9 @@ synctex_t *synctex_new(fz_context *ctx)
   ib_init(&stx->page_off);
   ib_init(&stx->close_off);
   ib_init(&stx->close_inp);
+  ib_init(&stx->record_off);
+  ib_init(&stx->page_rec);
+  stx->records = (struct record_buffer){.ptr = NULL, .len = 0, .cap = 0};
   stx->cur = 0;
   stx->target_path[0] = 0;
   return stx;
@@ -174,6 +249,19 @@ void synctex_free(fz_context *ctx, synctex_t *stx)
   ib_free(ctx, &stx->page_off);
   ib_free(ctx, &stx->close_off);
   ib_free(ctx, &stx->close_inp);
+  ib_free(ctx, &stx->record_off);
+  ib_free(ctx, &stx->page_rec);
+  if (stx->records.ptr)
+    fz_free(ctx, stx->records.ptr);
+  for (int i = 0; i < stx->tags_cap; ++i)
+    if (stx->tags[i].ptr)
+      fz_free(ctx, stx->tags[i].ptr);
+  if (stx->tags)
+    fz_free(ctx, stx->tags);
+  for (int i = 0; i < stx->grids_cap; ++i)
+    grid_free(ctx, stx->grids[i]);
+  if (stx->grids)
+    fz_free(ctx, stx->grids);
   fz_free(ctx, stx);
 }
 
@@ -182,11 +270,88 @@ int synctex_has_target(synctex_t *stx)
   return stx && (stx->target_path[0] != 0);
 }
 
+static void index_record(fz_context *ctx, synctex_t *stx, int page, const struct record *r)
+{
+  int tag = r->link.tag;
+  bool first_box = (r->kind == STEX_ENTER_H && !stx->page_has_box);
+  if (r->kind == STEX_ENTER_H)
+    stx->page_has_box = 1;
+  if (!(is_oneliner(r->kind) || first_box) || tag <= 0)
+    return;
+
+  if (tag >= stx->tags_cap)
+  {
+    int cap = stx->tags_cap == 0 ? 64 : stx->tags_cap;
+    while (cap <= tag)
+      cap *= 2;
+    stx->tags = (struct tag_pages *)
+      fz_realloc(ctx, stx->tags, sizeof(struct tag_pages) * cap);
+    memset(stx->tags + stx->tags_cap, 0,
+           sizeof(struct tag_pages) * (cap - stx->tags_cap));
+    stx->tags_cap = cap;
+  }
+
+  struct tag_pages *tp = &stx->tags[tag];
+  struct tag_page *last = tp->len > 0 ? &tp->ptr[tp->len - 1] : NULL;
+  if (!last || last->page != page)
+  {
+    if (tp->len == tp->cap)
+    {
+      tp->cap = tp->cap == 0 ? 8 : tp->cap * 2;
+      tp->ptr = (struct tag_page *)
+        fz_realloc(ctx, tp->ptr, sizeof(struct tag_page) * tp->cap);
+    }
+    last = &tp->ptr[tp->len++];
+    last->page = page;
+    last->first_box = 0;
+    last->max_line = INT_MIN;
+  }
+  if (first_box)
+  {
+    last->first_box = 1;
+    return;
+  }
+  if (r->link.line > last->max_line)
+    last->max_line = r->link.line;
+  last->last_line = r->link.line;
+  last->last_x = r->point.x;
+  last->last_y = r->point.y;
+}
+
+// Drop the summaries of the pages starting from page, then summarize again
+// the records of the page that are still there
+static void index_rollback(fz_context *ctx, synctex_t *stx, int page)
+{
+  for (int i = 0; i < stx->tags_cap; ++i)
+  {
+    struct tag_pages *tp = &stx->tags[i];
+    while (tp->len > 0 && tp->ptr[tp->len - 1].page >= page)
+      tp->len -= 1;
+  }
+
+  if (stx->page_rec.len & 1)
+  {
+    stx->page_has_box = 0;
+    for (int i = stx->page_rec.ptr[stx->page_rec.len - 1]; i < stx->records.len; ++i)
+      index_record(ctx, stx, page, &stx->records.ptr[i]);
+  }
+}
+
 void synctex_rollback(fz_context *ctx, synctex_t *stx, size_t offset)
 {
   ib_rollback(ctx, &stx->page_off, offset);
   ib_rollback(ctx, &stx->input_off, offset);
   ib_rollback(ctx, &stx->close_off, offset);
+  ib_rollback(ctx, &stx->record_off, offset);
+  stx->records.len = stx->record_off.len;
+  stx->page_rec.len = stx->page_off.len;
+  index_rollback(ctx, stx, stx->page_rec.len / 2);
+
+  for (int i = stx->page_rec.len / 2; i < stx->grids_cap; ++i)
+  {
+    grid_free(ctx, stx->grids[i]);
+    stx->grids[i] = NULL;
+  }
 
   while (stx->close_inp.len > stx->close_off.len)
   {
@@ -258,6 +423,7 @@ static const uint8_t *string_skip_prefix(const uint8_t *string, const char *pref
 
 static void synctex_process_line(fz_context *ctx, synctex_t *stx, int offset, const uint8_t *bol, uint8_t *eol)
 {
+  const uint8_t *line = bol;
   int index = 0;
   uint8_t c = *bol;
   bol += 1;
@@ -270,11 +436,13 @@ static void synctex_process_line(fz_context *ctx, synctex_t *stx, int offset, co
       if (!(bol = string_parse_int(bol, &index))) break;
       if (index != stx->page_off.len / 2 + 1 || is_closing != (stx->page_off.len & 1))
       {
-        fprintf(stderr, "[synctex] Invalid page index: index=%d/is_closing=%d expected=%d/%d\n",
-                index, is_closing, stx->page_off.len / 2 + 1, stx->page_off.len & 1);
+        txp_error(TXP_LOG_SYNCTEX, "[synctex] Invalid page index: index=%d/is_closing=%d expected=%d/%d\n",
+                  index, is_closing, stx->page_off.len / 2 + 1, stx->page_off.len & 1);
         myabort();
       }
       ib_append(ctx, &stx->page_off, offset);
+      ib_append(ctx, &stx->page_rec, stx->records.len);
+      stx->page_has_box = 0;
       break;
     }
 
@@ -285,8 +453,8 @@ static void synctex_process_line(fz_context *ctx, synctex_t *stx, int offset, co
       if (!(bol = string_skip_prefix(bol, ":"))) break;
       if (index != stx->input_off.len + 1)
       {
-        fprintf(stderr, "[synctex] Invalid input index: index=%d expected=%d\n",
-                index, stx->input_off.len + 1);
+        txp_error(TXP_LOG_SYNCTEX, "[synctex] Invalid input index: index=%d expected=%d\n",
+                  index, stx->input_off.len + 1);
         myabort();
       }
       ib_append(ctx, &stx->input_off, offset);
@@ -296,7 +464,7 @@ static void synctex_process_line(fz_context *ctx, synctex_t *stx, int offset, co
     case '/':
     {
       if (!(bol = string_parse_int(bol, &index))) break;
-      fprintf(stderr, "[synctex] Closed input: %d\n", index);
+      txp_debug(TXP_LOG_SYNCTEX, "[synctex] Closed input: %d\n", index);
       index -= 1;
       if (index < 0 || index >= stx->input_off.len) myabort();
       if (synctex_input_closed(ctx, stx, index))
@@ -311,6 +479,16 @@ static void synctex_process_line(fz_context *ctx, synctex_t *stx, int offset, co
     default:
       break;
   }
+
+  // Inside a page, decode the line
+  if (stx->page_off.len & 1)
+  {
+    struct record r;
+    parse_record(line, &r);
+    rb_append(ctx, &stx->records, &r);
+    ib_append(ctx, &stx->record_off, offset);
+    index_record(ctx, stx, stx->page_off.len / 2, &r);
+  }
 }
 
 void synctex_update(fz_context *ctx, synctex_t *stx, fz_buffer *buf)
@@ -387,44 +565,6 @@ static bool synctex_input_closed(fz_context *ctx, synctex_t *stx, unsigned index
   return stx->input_off.ptr[index] < 0;
 }
 
-static const uint8_t *nextline(const uint8_t *ptr)
-{
-  while (*ptr != '\n')
-    ptr++;
-  return ptr + 1;
-}
-
-static const uint8_t *
-skip_tree(const uint8_t *ptr, uint8_t open, uint8_t close)
-{
-  int nest = 1;
-  while (nest > 0)
-  {
-    if (*ptr == open)
-      nest += 1;
-    else if (*ptr == close)
-      nest -= 1;
-    else if (*ptr == '}')
-      break;
-    ptr = nextline(ptr);
-  }
-  return ptr;
-}
-
-static const uint8_t *
-skip_record(const uint8_t *ptr, struct record *r)
-{
-  switch (r->kind)
-  {
-    case STEX_ENTER_H:
-      return skip_tree(ptr, '(', ')');
-    case STEX_ENTER_V:
-      return skip_tree(ptr, '[', ']');
-    default:
-      return ptr;
-  }
-}
-
 static _Bool
 parse_link(const uint8_t **ptr, struct link *link)
 {
@@ -465,12 +605,9 @@ parse_size(const uint8_t **ptr, struct size *size)
   return 1;
 }
 
-static const uint8_t *
-parse_line(const uint8_t *ptr, struct record *r)
+static void
+parse_record(const uint8_t *ptr, struct record *r)
 {
-  if (!ptr) return NULL;
-  if (ptr[-1] != '\n') myabort();
-
   int has_link = 0, has_point = 0, has_size = 0, has_width = 0;
 
   *r = (struct record){0, };
@@ -515,9 +652,6 @@ parse_line(const uint8_t *ptr, struct record *r)
       r->kind = STEX_LEAVE_V;
       break;
 
-    case '}':
-      return NULL;
-
     default:
       r->kind = STEX_OTHER;
       break;
@@ -540,8 +674,14 @@ parse_line(const uint8_t *ptr, struct record *r)
       myabort();
     ptr = string_parse_int(ptr, &r->size.width);
   }
+}
 
-  return nextline(ptr);
+static void
+page_records(synctex_t *stx, int page,
+             const struct record **first, const struct record **last)
+{
+  *first = stx->records.ptr + stx->page_rec.ptr[2 * page + 0];
+  *last = stx->records.ptr + stx->page_rec.ptr[2 * page + 1];
 }
 
 struct candidate {
@@ -585,73 +725,229 @@ static int get_filename(synctex_t *stx, fz_buffer *buf, struct candidate *c, int
   return len;
 }
 
-static void
-parse_tree(synctex_t *stx, fz_buffer *buf, const uint8_t *ptr, int x, int y, struct candidate *c)
+static fz_irect record_rect(const struct record *r)
+{
+  fz_irect rect;
+  rect.x0 = r->point.x;
+  rect.x1 = r->point.x + r->size.width;
+  rect.y0 = r->point.y - r->size.height;
+  rect.y1 = r->point.y + r->size.depth;
+  return rect;
+}
+
+static void grid_free(fz_context *ctx, struct page_grid *g)
+{
+  if (!g)
+    return;
+  fz_free(ctx, g->parent);
+  fz_free(ctx, g->cell_start);
+  fz_free(ctx, g->items);
+  fz_free(ctx, g);
+}
+
+static int grid_col(const struct page_grid *g, int x)
 {
-  int nest = 0;
-  struct size saved[256];
+  int64_t w = (int64_t)g->bounds.x1 - g->bounds.x0 + 1;
+  int64_t c = ((int64_t)x - g->bounds.x0) * g->cols / w;
+  return c < 0 ? 0 : c >= g->cols ? g->cols - 1 : (int)c;
+}
+
+static int grid_row(const struct page_grid *g, int y)
+{
+  int64_t h = (int64_t)g->bounds.y1 - g->bounds.y0 + 1;
+  int64_t r = ((int64_t)y - g->bounds.y0) * g->rows / h;
+  return r < 0 ? 0 : r >= g->rows ? g->rows - 1 : (int)r;
+}
+
+static bool is_box(enum kind k)
+{
+  return (k == STEX_ENTER_H || k == STEX_ENTER_V);
+}
+
+static bool is_oneliner(enum kind k);
+
+// Region where a record can be hit: its own extent (unbounded horizontally
+// for one-liners) intersected with the extent of the enclosing boxes.
+static fz_irect hit_region(const struct record *r, fz_irect outer)
+{
+  fz_irect rect = record_rect(r);
+  if (!is_box(r->kind))
+  {
+    rect.x0 = INT_MIN;
+    rect.x1 = INT_MAX;
+  }
+  if (rect.x0 < outer.x0) rect.x0 = outer.x0;
+  if (rect.y0 < outer.y0) rect.y0 = outer.y0;
+  if (rect.x1 > outer.x1) rect.x1 = outer.x1;
+  if (rect.y1 > outer.y1) rect.y1 = outer.y1;
+  return rect;
+}
+
+static struct page_grid *
+grid_build(fz_context *ctx, const struct record *first, const struct record *last)
+{
+  int count = last - first;
+  struct page_grid *g = fz_malloc_struct(ctx, struct page_grid);
+  g->parent = fz_malloc_array(ctx, count > 0 ? count : 1, int);
+
+  // Nesting of the boxes, as followed by the linear scan: closing records
+  // match the last open box
+  int stack[256], depth = 0;
+  fz_irect bounds = {INT_MAX, INT_MAX, INT_MIN, INT_MIN};
+  for (int i = 0; i < count; ++i)
+  {
+    const struct record *r = &first[i];
+    g->parent[i] = depth > 0 ? stack[(depth < 256 ? depth : 256) - 1] : -1;
+    if (is_box(r->kind) || is_oneliner(r->kind))
+    {
+      fz_irect rect = record_rect(r);
+      if (rect.x0 < bounds.x0) bounds.x0 = rect.x0;
+      if (rect.y0 < bounds.y0) bounds.y0 = rect.y0;
+      if (rect.x1 > bounds.x1) bounds.x1 = rect.x1;
+      if (rect.y1 > bounds.y1) bounds.y1 = rect.y1;
+    }
+    if (is_box(r->kind))
+    {
+      if (depth < 256)
+        stack[depth] = i;
+      depth += 1;
+    }
+    else if ((r->kind == STEX_LEAVE_H || r->kind == STEX_LEAVE_V) && depth > 0)
+      depth -= 1;
+  }
+  if (bounds.x0 > bounds.x1)
+    bounds = (fz_irect){0, 0, 0, 0};
+  g->bounds = bounds;
+
+  // Roughly four records per cell, up to 32x32 cells
+  int side = 1;
+  while (side < 32 && side * side * 4 < count)
+    side += 1;
+  g->cols = g->rows = side;
+
+  int cells = g->cols * g->rows;
+  g->cell_start = fz_malloc_array(ctx, cells + 1, int);
+  memset(g->cell_start, 0, sizeof(int) * (cells + 1));
 
-  struct record r = {0,};
-  while ((ptr = parse_line(ptr, &r)))
+  fz_irect *regions = fz_malloc_array(ctx, count > 0 ? count : 1, fz_irect);
+  fz_irect everything = {INT_MIN, INT_MIN, INT_MAX, INT_MAX};
+
+  // First pass counts the items of each cell, second pass fills them
+  for (int pass = 0; pass < 2; ++pass)
   {
-    fz_irect rect;
-    rect.x0 = r.point.x;
-    rect.x1 = r.point.x + r.size.width;
-    rect.y0 = r.point.y - r.size.height;
-    rect.y1 = r.point.y + r.size.depth;
-    switch (r.kind)
+    for (int i = 0; i < count; ++i)
     {
-      case STEX_CURRENT:
-      case STEX_KERN:
-      case STEX_GLUE:
-      case STEX_MATH:
-        if (rect.y0 <= y && y <= rect.y1)
+      const struct record *r = &first[i];
+      if (!is_box(r->kind) && !is_oneliner(r->kind))
+        continue;
+      if (pass == 0)
+      {
+        int p = g->parent[i];
+        regions[i] = hit_region(r, p == -1 ? everything : regions[p]);
+      }
+      fz_irect rect = regions[i];
+      if (rect.x0 > rect.x1 || rect.y0 > rect.y1)
+        continue;
+      int c0 = grid_col(g, rect.x0), c1 = grid_col(g, rect.x1);
+      int r0 = grid_row(g, rect.y0), r1 = grid_row(g, rect.y1);
+      for (int row = r0; row <= r1; ++row)
+        for (int col = c0; col <= c1; ++col)
         {
-          if (rect.x0 < x)
-            rect.x1 = x;
+          int cell = row * g->cols + col;
+          if (pass == 0)
+            g->cell_start[cell + 1] += 1;
           else
-          {
-            rect.x1 = rect.x0;
-            rect.x0 = x;
-          }
-          float area = rect_area(rect);
-          // fprintf(stderr, "synctex pre-candidate area:%.2f (current:%.2f)\n", area, c->area);
-          if (area < c->area && get_filename(stx, buf, c, r.link.tag))
-          {
-            // fprintf(stderr, "synctex candidate\n");
-            c->area = area;
-            c->rect = rect;
-            c->link = r.link;
-          }
-        }
-        break;
-      case STEX_ENTER_H:
-      case STEX_ENTER_V:
-        if (fz_is_point_inside_irect(x, y, rect))
-        {
-          // fprintf(stderr, "synctex pre-candidate\n");
-          float area = rect_area(rect);
-          if (area < c->area && get_filename(stx, buf, c, r.link.tag))
-          {
-            // fprintf(stderr, "synctex candidate\n");
-            c->area = area;
-            c->rect = rect;
-            c->link = r.link;
-          }
-          saved[nest] = r.size;
-          nest += 1;
+            g->items[g->cell_start[cell]++] = i;
         }
-        else
-          ptr = skip_record(ptr, &r);
-        break;
-      case STEX_LEAVE_H:
-      case STEX_LEAVE_V:
-        nest -= 1;
-        if (nest < 0)
-          return;
-        r.size = saved[nest];
-      case STEX_OTHER:
+    }
+
+    if (pass == 0)
+    {
+      for (int cell = 0; cell < cells; ++cell)
+        g->cell_start[cell + 1] += g->cell_start[cell];
+      g->items = fz_malloc_array(ctx, g->cell_start[cells] + 1, int);
+    }
+    else
+    {
+      // Filling advanced each start to the next one: shift back
+      for (int cell = cells; cell > 0; --cell)
+        g->cell_start[cell] = g->cell_start[cell - 1];
+      g->cell_start[0] = 0;
+    }
+  }
+
+  fz_free(ctx, regions);
+  return g;
+}
+
+static struct page_grid *
+page_grid(fz_context *ctx, synctex_t *stx, int page)
+{
+  if (page >= stx->grids_cap)
+  {
+    int cap = stx->grids_cap == 0 ? 16 : stx->grids_cap;
+    while (cap <= page)
+      cap *= 2;
+    stx->grids = (struct page_grid **)
+      fz_realloc(ctx, stx->grids, sizeof(struct page_grid *) * cap);
+    for (int i = stx->grids_cap; i < cap; ++i)
+      stx->grids[i] = NULL;
+    stx->grids_cap = cap;
+  }
+
+  if (!stx->grids[page])
+  {
+    const struct record *first, *last;
+    page_records(stx, page, &first, &last);
+    stx->grids[page] = grid_build(ctx, first, last);
+  }
+  return stx->grids[page];
+}
+
+// Find the smallest record under (x, y). Only the records listed in the cell
+// of the point are tested, in page order, so that the outcome is the same
+// as a walk over the whole tree.
+static void
+grid_search(synctex_t *stx, fz_buffer *buf, const struct page_grid *g,
+            const struct record *first, int x, int y, struct candidate *c)
+{
+  int cell = grid_row(g, y) * g->cols + grid_col(g, x);
+  for (int k = g->cell_start[cell]; k < g->cell_start[cell + 1]; ++k)
+  {
+    int i = g->items[k];
+    const struct record *r = &first[i];
+
+    int p = g->parent[i];
+    while (p != -1 && fz_is_point_inside_irect(x, y, record_rect(&first[p])))
+      p = g->parent[p];
+    if (p != -1)
+      continue;
+
+    fz_irect rect = record_rect(r);
+    if (is_box(r->kind))
+    {
+      if (!fz_is_point_inside_irect(x, y, rect))
+        continue;
+    }
+    else
+    {
+      if (!(rect.y0 <= y && y <= rect.y1))
         continue;
+      if (rect.x0 < x)
+        rect.x1 = x;
+      else
+      {
+        rect.x1 = rect.x0;
+        rect.x0 = x;
+      }
+    }
+
+    float area = rect_area(rect);
+    if (area < c->area && get_filename(stx, buf, c, r->link.tag))
+    {
+      c->area = area;
+      c->rect = rect;
+      c->link = r->link;
     }
   }
 }
@@ -687,25 +983,24 @@ void synctex_scan(fz_context *ctx,
   if (synctex_page_count(stx) <= page)
     return;
 
-  int bop, eop;
-  synctex_page_offset(ctx, stx, page, &bop, &eop);
-
-  const uint8_t *ptr = &buf->data[bop];
+  const struct record *first, *last;
+  page_records(stx, page, &first, &last);
+  const struct page_grid *g = page_grid(ctx, stx, page);
 
   struct candidate c = {0,};
   c.area = INFINITY;
 
-  parse_tree(stx, buf, ptr, x, y, &c);
+  grid_search(stx, buf, g, first, x, y, &c);
   if (c.link.tag)
   {
     const char *fname;
     int len = get_input(buf, stx, c.link.tag-1, &fname);
-    fprintf(stderr,
-            "synctex best candidate: (%d,%d)-(%d,%d) "
-            "file:%.*s line:%d column:%d\n",
-            c.rect.x0, c.rect.y0, c.rect.x1, c.rect.y1,
-            len, fname,
-            c.link.line, c.link.column);
+    txp_info(TXP_LOG_SYNCTEX,
+             "synctex best candidate: (%d,%d)-(%d,%d) "
+             "file:%.*s line:%d column:%d\n",
+             c.rect.x0, c.rect.y0, c.rect.x1, c.rect.y1,
+             len, fname,
+             c.link.line, c.link.column);
     editor_synctex(doc_dir, fname, len, c.link.line, c.link.column);
   }
 }
@@ -775,13 +1070,6 @@ static bool synctex_find_input(fz_context *ctx, synctex_t *stx, fz_buffer *buf)
   return 0;
 }
 
-static const uint8_t *synctex_page_pointer(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int page)
-{
-  int bop, eop;
-  synctex_page_offset(ctx, stx, page, &bop, &eop);
-  return &buf->data[bop];
-}
-
 static void synctex_clear_search(synctex_t *stx)
 {
   stx->target_path[0] = 0;
@@ -792,15 +1080,17 @@ synctex_backscan_page(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int page,
 {
   int tag = stx->input_tag + 1;
   int line = stx->target_line;
-  const uint8_t *ptr = synctex_page_pointer(ctx, stx, buf, page);
+  const struct record *ptr, *end;
+  page_records(stx, page, &ptr, &end);
 
   struct record r = {0,}, r0;
   r0.link.tag = -1;
 
   int had_record = 0;
 
-  while ((ptr = parse_line(ptr, &r)))
+  while (ptr < end)
   {
+    r = *ptr++;
     // Remember the first location of the page to skip it:
     // it is the location where the shipout procedure was invoked
     // not the location of actual source contents
@@ -896,11 +1186,34 @@ int synctex_find_target(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int *pa
 
   int pages = synctex_page_count(stx);
   int updated_candidate = 0;
-  while (stx->target_path[0] && stx->scanned_pages < pages)
+
+  // Only the pages with records of the input can affect the search.
+  // When all lines of a page are before the target (and its first hbox,
+  // which synctex_backscan_page treats specially, is not from the input),
+  // the last record becomes the candidate. Other pages are scanned.
+  int tag = stx->input_tag + 1;
+  struct tag_pages *tp = tag < stx->tags_cap ? &stx->tags[tag] : NULL;
+  int i = 0;
+  if (tp)
+    while (i < tp->len && tp->ptr[i].page < stx->scanned_pages)
+      i += 1;
+  while (stx->target_path[0] && tp && i < tp->len && tp->ptr[i].page < pages)
   {
-    synctex_backscan_page(ctx, stx, buf, stx->scanned_pages, &updated_candidate);
-    stx->scanned_pages += 1;
+    const struct tag_page *e = &tp->ptr[i++];
+    if (!e->first_box && e->max_line < stx->target_line)
+    {
+      stx->candidate_page = e->page;
+      stx->candidate_x = e->last_x;
+      stx->candidate_y = e->last_y;
+      stx->candidate_line = e->last_line;
+      updated_candidate = 1;
+    }
+    else
+      synctex_backscan_page(ctx, stx, buf, e->page, &updated_candidate);
+    stx->scanned_pages = e->page + 1;
   }
+  if (stx->target_path[0])
+    stx->scanned_pages = pages;
 
   if (updated_candidate)
   {
@@ -0,0 +1,492 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include <mupdf/fitz.h>
+#include "textbuf.h"
+#include "mupdf_compat.h"
+
+// Compact the text when the piece array grows past this size, so that edits
+// and lookups stay cheap
+#define MAX_PIECES 256
+
+// Characters of the compacted contents are counted by blocks of this size,
+// so that columns are located without scanning lines from their beginning
+#define COLUMN_BLOCK 256
+
+typedef struct
+{
+  // Range in the source buffer
+  size_t start, len;
+  bool added;
+
+  // Newlines in the piece
+  int newlines;
+
+  // Offset following the piece and newlines up to its end, in the text
+  size_t end;
+  int lines;
+} piece_t;
+
+struct textbuf_s
+{
+  // Contents at the last compaction, and offsets of its newlines
+  fz_buffer *orig;
+  size_t *newlines;
+  int newline_count;
+
+  // Characters before each block of orig
+  int *columns;
+
+  // Text inserted since then
+  fz_buffer *add;
+
+  piece_t *pieces;
+  int count, cap;
+};
+
+static const unsigned char *piece_data(textbuf_t *t, piece_t *p)
+{
+  return (p->added ? t->add : t->orig)->data + p->start;
+}
+
+// Index of the first newline of orig at or after offset
+static int orig_newline(textbuf_t *t, size_t offset)
+{
+  int lo = 0, hi = t->newline_count;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (t->newlines[mid] < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int count_newlines(textbuf_t *t, piece_t *p)
+{
+  if (!p->added)
+    return orig_newline(t, p->start + p->len) - orig_newline(t, p->start);
+
+  const unsigned char *data = piece_data(t, p), *end = data + p->len;
+  int count = 0;
+  while ((data = (const unsigned char *)memchr(data, '\n', end - data)))
+  {
+    count += 1;
+    data += 1;
+  }
+  return count;
+}
+
+// Characters are counted by their leading byte
+static int char_weight(uint8_t byte)
+{
+  return (byte & 0xC0) != 0x80;
+}
+
+static void index_orig(fz_context *ctx, textbuf_t *t)
+{
+  const unsigned char *data = t->orig->data;
+  size_t len = t->orig->len;
+  int count = 0;
+
+  for (size_t i = 0; i < len; ++i)
+    count += (data[i] == '\n');
+
+  fz_free(ctx, t->newlines);
+  t->newlines = fz_malloc_struct_array(ctx, count + 1, size_t);
+  t->newline_count = count;
+
+  count = 0;
+  for (size_t i = 0; i < len; ++i)
+    if (data[i] == '\n')
+      t->newlines[count++] = i;
+
+  int blocks = len / COLUMN_BLOCK + 1;
+  int *columns = fz_malloc_struct_array(ctx, blocks, int);
+  int n = 0;
+  for (size_t i = 0; i < len; ++i)
+  {
+    if (i % COLUMN_BLOCK == 0)
+      columns[i / COLUMN_BLOCK] = n;
+    n += char_weight(data[i]);
+  }
+  if (len % COLUMN_BLOCK == 0)
+    columns[len / COLUMN_BLOCK] = n;
+  fz_free(ctx, t->columns);
+  t->columns = columns;
+}
+
+// Recompute cumulative offsets and line counts from piece i
+static void update_pieces(textbuf_t *t, int i)
+{
+  size_t end = i > 0 ? t->pieces[i - 1].end : 0;
+  int lines = i > 0 ? t->pieces[i - 1].lines : 0;
+
+  for (; i < t->count; ++i)
+  {
+    end += t->pieces[i].len;
+    lines += t->pieces[i].newlines;
+    t->pieces[i].end = end;
+    t->pieces[i].lines = lines;
+  }
+}
+
+static void reset_pieces(fz_context *ctx, textbuf_t *t)
+{
+  index_orig(ctx, t);
+  t->add->len = 0;
+  t->count = 0;
+  if (t->orig->len > 0)
+  {
+    piece_t *p = &t->pieces[0];
+    p->start = 0;
+    p->len = t->orig->len;
+    p->added = 0;
+    p->newlines = t->newline_count;
+    t->count = 1;
+  }
+  update_pieces(t, 0);
+}
+
+textbuf_t *textbuf_new_from_buffer(fz_context *ctx, fz_buffer *buf)
+{
+  textbuf_t *t = fz_malloc_struct(ctx, textbuf_t);
+  t->orig = fz_keep_buffer(ctx, buf);
+  t->add = fz_new_buffer(ctx, 256);
+  t->cap = 16;
+  t->pieces = fz_malloc_struct_array(ctx, t->cap, piece_t);
+  reset_pieces(ctx, t);
+  return t;
+}
+
+textbuf_t *textbuf_new(fz_context *ctx, const void *data, size_t len)
+{
+  fz_buffer *buf =
+    fz_new_buffer_from_copied_data(ctx, (const unsigned char *)data, len);
+  textbuf_t *t = textbuf_new_from_buffer(ctx, buf);
+  fz_drop_buffer(ctx, buf);
+  return t;
+}
+
+void textbuf_free(fz_context *ctx, textbuf_t *t)
+{
+  fz_drop_buffer(ctx, t->orig);
+  fz_drop_buffer(ctx, t->add);
+  fz_free(ctx, t->newlines);
+  fz_free(ctx, t->columns);
+  fz_free(ctx, t->pieces);
+  fz_free(ctx, t);
+}
+
+size_t textbuf_length(textbuf_t *t)
+{
+  return t->count > 0 ? t->pieces[t->count - 1].end : 0;
+}
+
+int textbuf_line_count(textbuf_t *t)
+{
+  return t->count > 0 ? t->pieces[t->count - 1].lines : 0;
+}
+
+// Index of the piece containing offset, count if offset is at the end
+static int find_piece(textbuf_t *t, size_t offset)
+{
+  int lo = 0, hi = t->count;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (t->pieces[mid].end <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static piece_t *insert_piece(fz_context *ctx, textbuf_t *t, int i)
+{
+  if (t->count == t->cap)
+  {
+    t->cap *= 2;
+    t->pieces = (piece_t *)fz_realloc(ctx, t->pieces, t->cap * sizeof(piece_t));
+  }
+  memmove(&t->pieces[i + 1], &t->pieces[i], (t->count - i) * sizeof(piece_t));
+  t->count += 1;
+  return &t->pieces[i];
+}
+
+// Make a piece start at offset, return its index
+static int split_at(fz_context *ctx, textbuf_t *t, size_t offset)
+{
+  int i = find_piece(t, offset);
+  if (i == t->count)
+    return i;
+
+  size_t begin = t->pieces[i].end - t->pieces[i].len;
+  if (begin == offset)
+    return i;
+
+  insert_piece(ctx, t, i + 1);
+  piece_t *left = &t->pieces[i], *right = &t->pieces[i + 1];
+  size_t cut = offset - begin;
+
+  *right = *left;
+  right->start = left->start + cut;
+  right->len = left->len - cut;
+  left->len = cut;
+
+  int newlines = left->newlines;
+  left->newlines = count_newlines(t, left);
+  right->newlines = newlines - left->newlines;
+  left->end = offset;
+  left->lines = right->lines - right->newlines;
+  return i + 1;
+}
+
+// Concatenate all pieces back in orig
+static void compact(fz_context *ctx, textbuf_t *t)
+{
+  size_t len = textbuf_length(t);
+  fz_buffer *buf = fz_new_buffer(ctx, len + 1);
+  for (int i = 0; i < t->count; ++i)
+    memcpy(buf->data + t->pieces[i].end - t->pieces[i].len,
+           piece_data(t, &t->pieces[i]), t->pieces[i].len);
+  buf->len = len;
+  fz_drop_buffer(ctx, t->orig);
+  t->orig = buf;
+  reset_pieces(ctx, t);
+}
+
+void textbuf_replace(fz_context *ctx, textbuf_t *t, size_t offset, size_t remove,
+                     const void *data, size_t len)
+{
+  int i = split_at(ctx, t, offset);
+  int j = split_at(ctx, t, offset + remove);
+
+  memmove(&t->pieces[i], &t->pieces[j], (t->count - j) * sizeof(piece_t));
+  t->count -= j - i;
+
+  if (len > 0)
+  {
+    size_t start = t->add->len;
+    fz_append_data(ctx, t->add, data, len);
+
+    // Typing usually extends the previous insertion
+    piece_t *p;
+    if (i > 0 && t->pieces[i - 1].added &&
+        t->pieces[i - 1].start + t->pieces[i - 1].len == start)
+      p = &t->pieces[i - 1];
+    else
+    {
+      p = insert_piece(ctx, t, i);
+      p->start = start;
+      p->len = 0;
+      p->added = 1;
+      p->newlines = 0;
+    }
+    piece_t ins = {.start = start, .len = len, .added = 1};
+    p->len += len;
+    p->newlines += count_newlines(t, &ins);
+    i = p - t->pieces;
+  }
+
+  update_pieces(t, i);
+
+  if (t->count > MAX_PIECES)
+    compact(ctx, t);
+}
+
+const unsigned char *textbuf_span(textbuf_t *t, size_t offset, size_t *len)
+{
+  int i = find_piece(t, offset);
+  if (i == t->count)
+  {
+    *len = 0;
+    return NULL;
+  }
+
+  piece_t *p = &t->pieces[i];
+  size_t begin = p->end - p->len;
+  *len = p->end - offset;
+  return piece_data(t, p) + (offset - begin);
+}
+
+fz_buffer *textbuf_buffer(fz_context *ctx, textbuf_t *t)
+{
+  bool contiguous =
+    t->count == 0 ? t->orig->len == 0 :
+    t->count == 1 && !t->pieces[0].added &&
+    t->pieces[0].start == 0 && t->pieces[0].len == t->orig->len;
+  if (!contiguous)
+    compact(ctx, t);
+  return t->orig;
+}
+
+int textbuf_line_offset(textbuf_t *t, int line)
+{
+  if (line == 0)
+    return 0;
+  if (line < 0 || line > textbuf_line_count(t))
+    return -1;
+
+  // First piece that ends after the newline preceding the line
+  int lo = 0, hi = t->count - 1;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (t->pieces[mid].lines < line)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  piece_t *p = &t->pieces[lo];
+  int k = line - (p->lines - p->newlines);
+  size_t begin = p->end - p->len, pos;
+
+  if (!p->added)
+    pos = t->newlines[orig_newline(t, p->start) + k - 1] - p->start;
+  else
+  {
+    const unsigned char *data = piece_data(t, p), *nl = data - 1;
+    while (k-- > 0)
+      nl = (const unsigned char *)memchr(nl + 1, '\n', data + p->len - nl - 1);
+    pos = nl - data;
+  }
+
+  return begin + pos + 1;
+}
+
+// Characters of orig before offset
+static int orig_columns(textbuf_t *t, size_t offset)
+{
+  size_t block = offset / COLUMN_BLOCK;
+  int n = t->columns[block];
+  for (size_t i = block * COLUMN_BLOCK; i < offset; ++i)
+    n += char_weight(t->orig->data[i]);
+  return n;
+}
+
+// Characters between offsets from and to of a piece
+static int piece_columns(textbuf_t *t, piece_t *p, size_t from, size_t to)
+{
+  if (!p->added)
+    return orig_columns(t, p->start + to) -
+           orig_columns(t, p->start + from);
+
+  const unsigned char *data = piece_data(t, p);
+  int n = 0;
+  for (size_t i = from; i < to; ++i)
+    n += char_weight(data[i]);
+  return n;
+}
+
+// Offset in a piece of the first character boundary at least count
+// characters after from, or to
+static size_t piece_locate(textbuf_t *t, piece_t *p, size_t from, size_t to,
+                           int count)
+{
+  const unsigned char *data = piece_data(t, p);
+  size_t i = from;
+
+  if (!p->added)
+  {
+    // Jump to the last block that starts before the target
+    int target = orig_columns(t, p->start + from) + count;
+    int lo = (p->start + from) / COLUMN_BLOCK,
+        hi = (p->start + to) / COLUMN_BLOCK;
+    while (lo < hi)
+    {
+      int mid = lo + (hi - lo + 1) / 2;
+      if (t->columns[mid] < target)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    size_t block = (size_t)lo * COLUMN_BLOCK;
+    if (block > p->start + from)
+    {
+      i = block - p->start;
+      count = target - t->columns[lo];
+    }
+  }
+
+  for (; i < to; ++i)
+  {
+    if (char_weight(data[i]))
+    {
+      if (count <= 0)
+        return i;
+      count -= 1;
+    }
+  }
+  return to;
+}
+
+int textbuf_column_offset(textbuf_t *t, int line, int column)
+{
+  int offset = textbuf_line_offset(t, line);
+  if (offset == -1 || column < 0)
+    return -1;
+  if (column == 0)
+    return offset;
+
+  // Stop at the '\n' ending the line
+  size_t len = textbuf_length(t);
+  int next = textbuf_line_offset(t, line + 1);
+  size_t stop = next == -1 ? len : next - 1;
+
+  size_t pos = offset;
+  for (int i = find_piece(t, pos); column > 0; ++i)
+  {
+    if (pos >= stop)
+      return -1;
+
+    piece_t *p = &t->pieces[i];
+    size_t begin = p->end - p->len;
+    size_t from = pos - begin, to = fz_mini(p->len, stop - begin);
+
+    int n = piece_columns(t, p, from, to);
+    if (n < column)
+    {
+      column -= n;
+      pos = begin + to;
+    }
+    else
+    {
+      pos = begin + piece_locate(t, p, from, to, column);
+      column = 0;
+    }
+  }
+
+  // A column can address the end of a line, but not the end of the text
+  if (pos >= len)
+    return -1;
+  return pos;
+}
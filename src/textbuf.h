@@ -0,0 +1,83 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef TEXTBUF_H
+#define TEXTBUF_H
+
+#include <stddef.h>
+#include <mupdf/fitz/buffer.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Contents of a file being edited.
+//
+// A piece table: the text is a sequence of slices of the contents at the last
+// compaction and of an append-only buffer of inserted text. Edits only touch
+// the piece array, so a keystroke does not move the rest of the file, and the
+// newlines of each piece are counted so that lines are located without
+// scanning from the beginning. Characters of the compacted contents are
+// counted by blocks, so that columns are found without scanning lines either.
+// Pieces are compacted back to a contiguous buffer when there are too many of
+// them.
+
+typedef struct textbuf_s textbuf_t;
+
+textbuf_t *textbuf_new(fz_context *ctx, const void *data, size_t len);
+// Same, sharing the contents of buf rather than copying them. buf must not
+// be modified afterwards.
+textbuf_t *textbuf_new_from_buffer(fz_context *ctx, fz_buffer *buf);
+void textbuf_free(fz_context *ctx, textbuf_t *t);
+
+size_t textbuf_length(textbuf_t *t);
+
+// Number of '\n' in the text
+int textbuf_line_count(textbuf_t *t);
+
+// Replace remove bytes at offset by len bytes of data
+void textbuf_replace(fz_context *ctx, textbuf_t *t, size_t offset, size_t remove,
+                     const void *data, size_t len);
+
+// Return the longest contiguous run of bytes starting at offset, its length
+// in *len (0 at the end of the text)
+const unsigned char *textbuf_span(textbuf_t *t, size_t offset, size_t *len);
+
+// Contiguous view of the whole text, valid until the next change
+fz_buffer *textbuf_buffer(fz_context *ctx, textbuf_t *t);
+
+// Offset of the beginning of a line (numbered from 0), -1 if the text has
+// fewer lines
+int textbuf_line_offset(textbuf_t *t, int line);
+
+// Offset of a column of a line, counting columns in UTF-8 codepoints.
+// Return -1 if the line is too short.
+int textbuf_column_offset(textbuf_t *t, int line, int column);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*!TEXTBUF_H*/
@@ -0,0 +1,542 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "tile_hash.h"
+#include "mupdf_compat.h"
+
+// Clips, masks, groups and tiles nest the operations they apply to
+#define STATE_DEPTH 64
+
+struct state
+{
+  uint64_t hash;
+  // Inside a tile, operations are repeated over the whole covered area
+  bool covered;
+  fz_rect cover;
+};
+
+typedef struct
+{
+  fz_device super;
+  fz_irect tiles;
+  int tile_size;
+  uint64_t *hashes;
+  tile_hash_ops *ops;
+
+  struct state stack[STATE_DEPTH];
+  int depth;
+  // States nested deeper than STATE_DEPTH are merged in the top one
+  int overflow;
+} tile_hash_device;
+
+/* Hashing */
+
+static uint64_t mix(uint64_t h, uint64_t v)
+{
+  h ^= v + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+  return h * 0xBF58476D1CE4E5B9ULL;
+}
+
+static uint64_t mix_float(uint64_t h, float f)
+{
+  uint32_t v;
+  memcpy(&v, &f, sizeof(v));
+  return mix(h, v);
+}
+
+static uint64_t mix_ptr(uint64_t h, const void *p)
+{
+  return mix(h, (uint64_t)(uintptr_t)p);
+}
+
+static uint64_t mix_matrix(uint64_t h, fz_matrix m)
+{
+  h = mix_float(mix_float(mix_float(h, m.a), m.b), m.c);
+  return mix_float(mix_float(mix_float(h, m.d), m.e), m.f);
+}
+
+static uint64_t mix_rect(uint64_t h, fz_rect r)
+{
+  return mix_float(mix_float(mix_float(mix_float(h, r.x0), r.y0), r.x1), r.y1);
+}
+
+static uint64_t mix_color(fz_context *ctx, uint64_t h, fz_colorspace *cs,
+                          const float *color, float alpha)
+{
+  h = mix_ptr(h, cs);
+  int n = (cs && color) ? fz_colorspace_n(ctx, cs) : 0;
+  for (int i = 0; i < n; ++i)
+    h = mix_float(h, color[i]);
+  return mix_float(h, alpha);
+}
+
+static uint64_t mix_stroke(uint64_t h, const fz_stroke_state *stroke)
+{
+  if (!stroke)
+    return mix(h, 0);
+  h = mix(mix(mix(mix(h, stroke->start_cap), stroke->dash_cap),
+              stroke->end_cap), stroke->linejoin);
+  h = mix_float(mix_float(h, stroke->linewidth), stroke->miterlimit);
+  h = mix(mix_float(h, stroke->dash_phase), stroke->dash_len);
+  for (int i = 0; i < stroke->dash_len; ++i)
+    h = mix_float(h, stroke->dash_list[i]);
+  return h;
+}
+
+static void walk_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+  uint64_t *h = (uint64_t *)arg;
+  *h = mix_float(mix_float(mix(*h, 'm'), x), y);
+}
+
+static void walk_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+  uint64_t *h = (uint64_t *)arg;
+  *h = mix_float(mix_float(mix(*h, 'l'), x), y);
+}
+
+static void walk_curveto(fz_context *ctx, void *arg, float x1, float y1,
+                         float x2, float y2, float x3, float y3)
+{
+  uint64_t *h = (uint64_t *)arg;
+  *h = mix_float(mix_float(mix(*h, 'c'), x1), y1);
+  *h = mix_float(mix_float(*h, x2), y2);
+  *h = mix_float(mix_float(*h, x3), y3);
+}
+
+static void walk_closepath(fz_context *ctx, void *arg)
+{
+  uint64_t *h = (uint64_t *)arg;
+  *h = mix(*h, 'h');
+}
+
+static void walk_rectto(fz_context *ctx, void *arg, float x1, float y1,
+                        float x2, float y2)
+{
+  uint64_t *h = (uint64_t *)arg;
+  *h = mix_float(mix_float(mix(*h, 'r'), x1), y1);
+  *h = mix_float(mix_float(*h, x2), y2);
+}
+
+static const fz_path_walker path_hasher = {
+  walk_moveto, walk_lineto, walk_curveto, walk_closepath,
+  NULL, NULL, NULL, walk_rectto,
+};
+
+static uint64_t mix_path(fz_context *ctx, uint64_t h, const fz_path *path)
+{
+  fz_walk_path(ctx, path, &path_hasher, &h);
+  return h;
+}
+
+static uint64_t mix_text(uint64_t h, const fz_text *text)
+{
+  for (fz_text_span *span = text->head; span; span = span->next)
+  {
+    h = mix_ptr(h, span->font);
+    h = mix(mix_matrix(h, span->trm), span->wmode);
+    for (int i = 0; i < span->len; ++i)
+    {
+      const fz_text_item *item = &span->items[i];
+      h = mix(mix_float(mix_float(h, item->x), item->y), item->gid);
+    }
+  }
+  return h;
+}
+
+/* Tiles */
+
+static struct state *top_state(tile_hash_device *dev)
+{
+  return &dev->stack[dev->depth];
+}
+
+static uint64_t begin_op(tile_hash_device *dev, int kind)
+{
+  return mix(top_state(dev)->hash, kind);
+}
+
+static void record_op(fz_context *ctx, tile_hash_ops *ops, uint64_t h, fz_rect bbox)
+{
+  if (ops->len == ops->cap)
+  {
+    int cap = ops->cap == 0 ? 256 : ops->cap * 2;
+    ops->ops = (tile_hash_op *)fz_realloc(ctx, ops->ops, sizeof(tile_hash_op) * cap);
+    ops->cap = cap;
+  }
+  ops->ops[ops->len].hash = h;
+  ops->ops[ops->len].bbox = bbox;
+  ops->len += 1;
+}
+
+// Add an operation to the tiles touched by its bounding box
+static void mark_tiles(fz_context *ctx, tile_hash_device *dev, fz_rect bbox, uint64_t h)
+{
+  struct state *st = top_state(dev);
+  if (st->covered)
+    bbox = st->cover;
+
+  // Anti-aliasing bleeds a bit outside the bounding box
+  float ts = dev->tile_size;
+  float x0 = fz_max(bbox.x0 - 2, dev->tiles.x0 * ts);
+  float y0 = fz_max(bbox.y0 - 2, dev->tiles.y0 * ts);
+  float x1 = fz_min(bbox.x1 + 2, dev->tiles.x1 * ts);
+  float y1 = fz_min(bbox.y1 + 2, dev->tiles.y1 * ts);
+  if (!(x0 < x1 && y0 < y1))
+    return;
+
+  if (dev->ops)
+    record_op(ctx, dev->ops, h, fz_make_rect(x0, y0, x1, y1));
+
+  int tx0 = floorf(x0 / ts), ty0 = floorf(y0 / ts);
+  int tx1 = fz_mini(ceilf(x1 / ts), dev->tiles.x1);
+  int ty1 = fz_mini(ceilf(y1 / ts), dev->tiles.y1);
+  int cols = dev->tiles.x1 - dev->tiles.x0;
+
+  for (int y = ty0; y < ty1; ++y)
+  {
+    uint64_t *row = dev->hashes + (y - dev->tiles.y0) * cols;
+    for (int x = tx0; x < tx1; ++x)
+      row[x - dev->tiles.x0] = mix(row[x - dev->tiles.x0], h);
+  }
+}
+
+static void push_state(tile_hash_device *dev, uint64_t h, const fz_rect *cover)
+{
+  struct state next = *top_state(dev);
+  next.hash = h;
+  if (cover && !next.covered)
+  {
+    next.covered = 1;
+    next.cover = *cover;
+  }
+
+  if (dev->depth + 1 < STATE_DEPTH)
+    dev->stack[++dev->depth] = next;
+  else
+  {
+    dev->overflow += 1;
+    *top_state(dev) = next;
+  }
+}
+
+static void pop_state(tile_hash_device *dev)
+{
+  if (dev->overflow > 0)
+    dev->overflow -= 1;
+  else if (dev->depth > 0)
+    dev->depth -= 1;
+}
+
+/* Device callbacks */
+
+static void th_fill_path(fz_context *ctx, fz_device *dev_, const fz_path *path,
+                         int even_odd, fz_matrix ctm, fz_colorspace *cs,
+                         const float *color, float alpha, fz_color_params cp)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix(mix_path(ctx, begin_op(dev, 'F'), path), even_odd);
+  h = mix_color(ctx, mix_matrix(h, ctm), cs, color, alpha);
+  mark_tiles(ctx, dev, fz_bound_path(ctx, path, NULL, ctm), h);
+}
+
+static void th_stroke_path(fz_context *ctx, fz_device *dev_, const fz_path *path,
+                           const fz_stroke_state *stroke, fz_matrix ctm,
+                           fz_colorspace *cs, const float *color, float alpha,
+                           fz_color_params cp)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix_stroke(mix_path(ctx, begin_op(dev, 'S'), path), stroke);
+  h = mix_color(ctx, mix_matrix(h, ctm), cs, color, alpha);
+  mark_tiles(ctx, dev, fz_bound_path(ctx, path, stroke, ctm), h);
+}
+
+static void th_clip_path(fz_context *ctx, fz_device *dev_, const fz_path *path,
+                         int even_odd, fz_matrix ctm, fz_rect scissor)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix(mix_path(ctx, begin_op(dev, 'C'), path), even_odd);
+  push_state(dev, mix_matrix(h, ctm), NULL);
+}
+
+static void th_clip_stroke_path(fz_context *ctx, fz_device *dev_, const fz_path *path,
+                                const fz_stroke_state *stroke, fz_matrix ctm,
+                                fz_rect scissor)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix_stroke(mix_path(ctx, begin_op(dev, 'D'), path), stroke);
+  push_state(dev, mix_matrix(h, ctm), NULL);
+}
+
+static void th_fill_text(fz_context *ctx, fz_device *dev_, const fz_text *text,
+                         fz_matrix ctm, fz_colorspace *cs, const float *color,
+                         float alpha, fz_color_params cp)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix_matrix(mix_text(begin_op(dev, 'T'), text), ctm);
+  h = mix_color(ctx, h, cs, color, alpha);
+  mark_tiles(ctx, dev, fz_bound_text(ctx, text, NULL, ctm), h);
+}
+
+static void th_stroke_text(fz_context *ctx, fz_device *dev_, const fz_text *text,
+                           const fz_stroke_state *stroke, fz_matrix ctm,
+                           fz_colorspace *cs, const float *color, float alpha,
+                           fz_color_params cp)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix_stroke(mix_text(begin_op(dev, 'U'), text), stroke);
+  h = mix_color(ctx, mix_matrix(h, ctm), cs, color, alpha);
+  mark_tiles(ctx, dev, fz_bound_text(ctx, text, stroke, ctm), h);
+}
+
+static void th_clip_text(fz_context *ctx, fz_device *dev_, const fz_text *text,
+                         fz_matrix ctm, fz_rect scissor)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  push_state(dev, mix_matrix(mix_text(begin_op(dev, 'V'), text), ctm), NULL);
+}
+
+static void th_clip_stroke_text(fz_context *ctx, fz_device *dev_, const fz_text *text,
+                                const fz_stroke_state *stroke, fz_matrix ctm,
+                                fz_rect scissor)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix_stroke(mix_text(begin_op(dev, 'W'), text), stroke);
+  push_state(dev, mix_matrix(h, ctm), NULL);
+}
+
+static void th_fill_shade(fz_context *ctx, fz_device *dev_, fz_shade *shade,
+                          fz_matrix ctm, float alpha, fz_color_params cp)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix_float(mix_matrix(mix_ptr(begin_op(dev, 'G'), shade), ctm), alpha);
+  mark_tiles(ctx, dev, fz_bound_shade(ctx, shade, ctm), h);
+}
+
+static void th_fill_image(fz_context *ctx, fz_device *dev_, fz_image *image,
+                          fz_matrix ctm, float alpha, fz_color_params cp)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix_float(mix_matrix(mix_ptr(begin_op(dev, 'I'), image), ctm), alpha);
+  mark_tiles(ctx, dev, fz_transform_rect(fz_unit_rect, ctm), h);
+}
+
+static void th_fill_image_mask(fz_context *ctx, fz_device *dev_, fz_image *image,
+                               fz_matrix ctm, fz_colorspace *cs,
+                               const float *color, float alpha,
+                               fz_color_params cp)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix_matrix(mix_ptr(begin_op(dev, 'J'), image), ctm);
+  h = mix_color(ctx, h, cs, color, alpha);
+  mark_tiles(ctx, dev, fz_transform_rect(fz_unit_rect, ctm), h);
+}
+
+static void th_clip_image_mask(fz_context *ctx, fz_device *dev_, fz_image *image,
+                               fz_matrix ctm, fz_rect scissor)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  push_state(dev, mix_matrix(mix_ptr(begin_op(dev, 'K'), image), ctm), NULL);
+}
+
+static void th_pop_clip(fz_context *ctx, fz_device *dev_)
+{
+  pop_state((tile_hash_device *)dev_);
+}
+
+// The mask is popped by pop_clip, end_mask only separates its definition
+// from the masked operations and does not change the state.
+static void th_begin_mask(fz_context *ctx, fz_device *dev_, fz_rect area,
+                          int luminosity, fz_colorspace *cs,
+                          const float *bc, fz_color_params cp)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix(mix_rect(begin_op(dev, 'M'), area), luminosity);
+  push_state(dev, mix_color(ctx, h, cs, bc, 1), NULL);
+}
+
+static void th_begin_group(fz_context *ctx, fz_device *dev_, fz_rect area,
+                           fz_colorspace *cs, int isolated, int knockout,
+                           int blendmode, float alpha)
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix_ptr(mix_rect(begin_op(dev, 'B'), area), cs);
+  h = mix(mix(mix(h, isolated), knockout), blendmode);
+  push_state(dev, mix_float(h, alpha), NULL);
+}
+
+static void th_end_group(fz_context *ctx, fz_device *dev_)
+{
+  pop_state((tile_hash_device *)dev_);
+}
+
+// Let the contents of the tile be run once, and account for them on the
+// whole tiled area
+static int th_begin_tile(fz_context *ctx, fz_device *dev_, fz_rect area,
+                         fz_rect view, float xstep, float ystep,
+                         fz_matrix ctm, int id
+#if (FZ_VERSION_MAJOR > 1) || (FZ_VERSION_MINOR >= 24)
+                         , int doc_id
+#endif
+                         )
+{
+  tile_hash_device *dev = (tile_hash_device *)dev_;
+  uint64_t h = mix_rect(mix_rect(begin_op(dev, 'P'), area), view);
+  h = mix_matrix(mix_float(mix_float(h, xstep), ystep), ctm);
+  fz_rect cover = fz_transform_rect(area, ctm);
+  push_state(dev, h, &cover);
+  return 0;
+}
+
+static void th_end_tile(fz_context *ctx, fz_device *dev_)
+{
+  pop_state((tile_hash_device *)dev_);
+}
+
+void tile_hash_ops_free(fz_context *ctx, tile_hash_ops *ops)
+{
+  if (ops->ops)
+    fz_free(ctx, ops->ops);
+  ops->ops = NULL;
+  ops->len = ops->cap = 0;
+}
+
+void tile_hash_display_list(fz_context *ctx, fz_display_list *dl,
+                            fz_matrix ctm, fz_irect tiles, int tile_size,
+                            uint64_t *hashes, tile_hash_ops *ops)
+{
+  int count = fz_irect_width(tiles) * fz_irect_height(tiles);
+  for (int i = 0; i < count; ++i)
+    hashes[i] = 0;
+
+  tile_hash_device *dev = fz_new_derived_device(ctx, tile_hash_device);
+  dev->tiles = tiles;
+  dev->tile_size = tile_size;
+  dev->hashes = hashes;
+  dev->ops = ops;
+  dev->stack[0].hash = tile_size;
+  if (ops)
+    ops->len = 0;
+
+  dev->super.fill_path = th_fill_path;
+  dev->super.stroke_path = th_stroke_path;
+  dev->super.clip_path = th_clip_path;
+  dev->super.clip_stroke_path = th_clip_stroke_path;
+  dev->super.fill_text = th_fill_text;
+  dev->super.stroke_text = th_stroke_text;
+  dev->super.clip_text = th_clip_text;
+  dev->super.clip_stroke_text = th_clip_stroke_text;
+  dev->super.fill_shade = th_fill_shade;
+  dev->super.fill_image = th_fill_image;
+  dev->super.fill_image_mask = th_fill_image_mask;
+  dev->super.clip_image_mask = th_clip_image_mask;
+  dev->super.pop_clip = th_pop_clip;
+  dev->super.begin_mask = th_begin_mask;
+  dev->super.begin_group = th_begin_group;
+  dev->super.end_group = th_end_group;
+  dev->super.begin_tile = th_begin_tile;
+  dev->super.end_tile = th_end_tile;
+
+  fz_rect area = fz_make_rect(tiles.x0 * tile_size, tiles.y0 * tile_size,
+                              tiles.x1 * tile_size, tiles.y1 * tile_size);
+  fz_try(ctx)
+  {
+    fz_run_display_list(ctx, dl, &dev->super, ctm, area, NULL);
+    fz_close_device(ctx, &dev->super);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_device(ctx, &dev->super);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+}
+
+/* Damage */
+
+static int compare_ops(const void *a, const void *b)
+{
+  uint64_t ha = ((const tile_hash_op *)a)->hash;
+  uint64_t hb = ((const tile_hash_op *)b)->hash;
+  return (ha > hb) - (ha < hb);
+}
+
+static void damage_op(const tile_hash_op *op, fz_irect tiles, int tile_size,
+                      fz_irect *damage)
+{
+  fz_irect r = fz_round_rect(op->bbox);
+  int cols = fz_irect_width(tiles);
+  int tx0 = fz_maxi(tiles.x0, r.x0 / tile_size);
+  int ty0 = fz_maxi(tiles.y0, r.y0 / tile_size);
+  int tx1 = fz_mini(tiles.x1, (r.x1 + tile_size - 1) / tile_size);
+  int ty1 = fz_mini(tiles.y1, (r.y1 + tile_size - 1) / tile_size);
+
+  for (int y = ty0; y < ty1; ++y)
+    for (int x = tx0; x < tx1; ++x)
+    {
+      fz_irect tile = fz_make_irect(x * tile_size, y * tile_size,
+                                    (x + 1) * tile_size, (y + 1) * tile_size);
+      fz_irect *d = &damage[(y - tiles.y0) * cols + (x - tiles.x0)];
+      fz_irect part = fz_intersect_irect(r, tile);
+      if (fz_is_empty_irect(part))
+        continue;
+      if (fz_is_empty_irect(*d))
+        *d = part;
+      else
+        *d = fz_make_irect(fz_mini(d->x0, part.x0), fz_mini(d->y0, part.y0),
+                           fz_maxi(d->x1, part.x1), fz_maxi(d->y1, part.y1));
+    }
+}
+
+void tile_hash_damage(tile_hash_ops *a, tile_hash_ops *b,
+                      fz_irect tiles, int tile_size, fz_irect *damage)
+{
+  int count = fz_irect_width(tiles) * fz_irect_height(tiles);
+  for (int i = 0; i < count; ++i)
+    damage[i] = fz_make_irect(0, 0, 0, 0);
+
+  // Match the two multisets of operations, sorted by hash
+  qsort(a->ops, a->len, sizeof(tile_hash_op), compare_ops);
+  qsort(b->ops, b->len, sizeof(tile_hash_op), compare_ops);
+
+  int i = 0, j = 0;
+  while (i < a->len || j < b->len)
+  {
+    if (j == b->len || (i < a->len && a->ops[i].hash < b->ops[j].hash))
+      damage_op(&a->ops[i++], tiles, tile_size, damage);
+    else if (i == a->len || b->ops[j].hash < a->ops[i].hash)
+      damage_op(&b->ops[j++], tiles, tile_size, damage);
+    else
+    {
+      i += 1;
+      j += 1;
+    }
+  }
+}
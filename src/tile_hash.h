@@ -0,0 +1,81 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef TILE_HASH_H
+#define TILE_HASH_H
+
+#include <stdint.h>
+#include <mupdf/fitz.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Content hashes of the tiles of a page.
+//
+// Device space is divided in square tiles of tile_size pixels. The hash of a
+// tile covers, in order, the drawing operations whose bounding box touch it,
+// with their parameters and the clips, masks and groups they are drawn in.
+// Two display lists drawing the same thing in a tile get the same hash for
+// it, whatever happens in the other tiles: the pixels of the tile can be
+// reused from one to the other.
+//
+// Images and shadings are compared by identity, this relies on the resource
+// manager sharing them between successive versions of a page.
+
+// A drawing operation, with its hash and bounding box in device space
+typedef struct
+{
+  uint64_t hash;
+  fz_rect bbox;
+} tile_hash_op;
+
+typedef struct
+{
+  int len, cap;
+  tile_hash_op *ops;
+} tile_hash_ops;
+
+void tile_hash_ops_free(fz_context *ctx, tile_hash_ops *ops);
+
+// Hash the tiles from (tiles.x0, tiles.y0) to (tiles.x1, tiles.y1), in tile
+// coordinates. hashes has one entry per tile, row by row.
+// If ops is not NULL, the operations touching the tiles are stored in it.
+void tile_hash_display_list(fz_context *ctx, fz_display_list *dl,
+                            fz_matrix ctm, fz_irect tiles, int tile_size,
+                            uint64_t *hashes, tile_hash_ops *ops);
+
+// Damage between two versions of a page: the operations of a that are not
+// in b, and those of b that are not in a. For each tile, damage receives the
+// part of the tile covered by their bounding boxes, in device space (empty
+// if none). The operations are reordered.
+void tile_hash_damage(tile_hash_ops *a, tile_hash_ops *b,
+                      fz_irect tiles, int tile_size, fz_irect *damage);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*!TILE_HASH_H*/
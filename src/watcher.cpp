@@ -0,0 +1,547 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include "watcher.h"
+#include "txp_log.h"
+#include "dvi/fz_util.h"
+
+#if defined(__linux__)
+#define WATCH_INOTIFY
+#include <sys/inotify.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#define WATCH_KQUEUE
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#if defined(WATCH_INOTIFY) || defined(WATCH_KQUEUE)
+
+// Files are watched through their parent directory: editors commonly save by
+// renaming a new file over the old one, which a watch on the file itself
+// would not follow, and a TeX tree has far fewer directories than files.
+
+typedef struct
+{
+  char *path;
+
+  // inotify: watch descriptor, kqueue: descriptor of the directory.
+  // -1 if the watch was lost: the files of the directory are polled until
+  // it is watched again.
+  int wd;
+
+  // First file of the directory, -1 if none
+  int first;
+} watch_dir;
+
+typedef struct
+{
+  fileentry_t *entry;
+
+  // Directory of the file and next file of the same directory (-1 if none).
+  // dir is -1 if the file is not watched and has to be polled.
+  int dir, next;
+
+  // Name of the file in its directory
+  char *name;
+
+  // kqueue: descriptor of the file itself, to see changes made in place
+  // that do not modify the directory. -1 past the descriptor budget: the
+  // file is then polled.
+  int fd;
+
+  // Notified since the file was last scanned
+  bool changed;
+} watch_item;
+
+struct watcher_s
+{
+  int fd;
+  int count, cap;
+  watch_item *items;
+
+  // Open-addressing table from entry address to item index + 1
+  int *slots;
+  int slot_cap;
+
+  int dir_count, dir_cap;
+  watch_dir *dirs;
+
+  // Open-addressing table from directory path to dir index + 1
+  int *dir_slots;
+  int dir_slot_cap;
+
+#ifdef WATCH_INOTIFY
+  // Dir index + 1 by watch descriptor, those are allocated sequentially
+  int *wd_dirs;
+  int wd_cap;
+#else
+  // Descriptors of files are limited to a share of RLIMIT_NOFILE
+  int file_fds, file_budget;
+#endif
+};
+
+watcher_t *watcher_new(fz_context *ctx)
+{
+#ifdef WATCH_INOTIFY
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+  int fd = kqueue();
+#endif
+  if (fd == -1)
+  {
+    perror("[watch] cannot create watcher, falling back to polling");
+    return NULL;
+  }
+
+  watcher_t *w = fz_malloc_struct(ctx, watcher_t);
+  w->fd = fd;
+#ifdef WATCH_KQUEUE
+  struct rlimit rl;
+  w->file_budget = 64;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    w->file_budget = fz_maxi(0, (int)(rl.rlim_cur / 4) - 16);
+#endif
+  return w;
+}
+
+void watcher_free(fz_context *ctx, watcher_t *w)
+{
+  for (int i = 0; i < w->count; ++i)
+  {
+#ifdef WATCH_KQUEUE
+    if (w->items[i].fd != -1)
+      close(w->items[i].fd);
+#endif
+    fz_free(ctx, w->items[i].name);
+  }
+  for (int i = 0; i < w->dir_count; ++i)
+  {
+#ifdef WATCH_KQUEUE
+    if (w->dirs[i].wd != -1)
+      close(w->dirs[i].wd);
+#endif
+    fz_free(ctx, w->dirs[i].path);
+  }
+  fz_free(ctx, w->items);
+  fz_free(ctx, w->slots);
+  fz_free(ctx, w->dirs);
+  fz_free(ctx, w->dir_slots);
+#ifdef WATCH_INOTIFY
+  fz_free(ctx, w->wd_dirs);
+#endif
+  close(w->fd);
+  fz_free(ctx, w);
+}
+
+static int *item_slot(watcher_t *w, fileentry_t *e)
+{
+  unsigned long mask = w->slot_cap - 1;
+  unsigned long index = hash_bucket((uintptr_t)e, w->slot_cap);
+
+  while (w->slots[index] && w->items[w->slots[index] - 1].entry != e)
+    index = (index + 1) & mask;
+
+  return &w->slots[index];
+}
+
+static void grow_slots(fz_context *ctx, watcher_t *w)
+{
+  fz_free(ctx, w->slots);
+  w->slot_cap = w->slot_cap ? w->slot_cap * 2 : 64;
+  w->slots = fz_malloc_struct_array(ctx, w->slot_cap, int);
+  for (int i = 0; i < w->count; ++i)
+    *item_slot(w, w->items[i].entry) = i + 1;
+}
+
+static int *dir_slot(watcher_t *w, const char *path)
+{
+  unsigned long mask = w->dir_slot_cap - 1;
+  unsigned long index = hash_bucket(sdbm_hash_string(path, NULL), w->dir_slot_cap);
+
+  while (w->dir_slots[index] &&
+         strcmp(w->dirs[w->dir_slots[index] - 1].path, path) != 0)
+    index = (index + 1) & mask;
+
+  return &w->dir_slots[index];
+}
+
+static void grow_dir_slots(fz_context *ctx, watcher_t *w)
+{
+  fz_free(ctx, w->dir_slots);
+  w->dir_slot_cap = w->dir_slot_cap ? w->dir_slot_cap * 2 : 64;
+  w->dir_slots = fz_malloc_struct_array(ctx, w->dir_slot_cap, int);
+  for (int i = 0; i < w->dir_count; ++i)
+    *dir_slot(w, w->dirs[i].path) = i + 1;
+}
+
+// A lost directory watch makes its files polled: report them once more so
+// that changes made before the loss are not missed
+static void lose_dir(watcher_t *w, watch_dir *dir)
+{
+  dir->wd = -1;
+  for (int i = dir->first; i != -1; i = w->items[i].next)
+    w->items[i].changed = 1;
+}
+
+static bool item_polled(watcher_t *w, watch_item *item)
+{
+  if (item->dir == -1 || w->dirs[item->dir].wd == -1)
+    return 1;
+#ifdef WATCH_KQUEUE
+  if (item->fd == -1)
+    return 1;
+#endif
+  return 0;
+}
+
+#ifdef WATCH_INOTIFY
+
+#define WATCH_MASK \
+  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+   IN_MOVED_FROM | IN_MOVED_TO)
+
+static void watch_dir_path(fz_context *ctx, watcher_t *w, int index)
+{
+  watch_dir *dir = &w->dirs[index];
+  int wd = inotify_add_watch(w->fd, dir->path, WATCH_MASK);
+  if (wd == -1)
+    return;
+
+  // Another path to a directory already watched (symbolic link): its
+  // events are attributed to the other path, poll this one
+  if (wd < w->wd_cap && w->wd_dirs[wd] && w->wd_dirs[wd] != index + 1)
+    return;
+  dir->wd = wd;
+
+  if (dir->wd >= w->wd_cap)
+  {
+    int cap = fz_maxi(w->wd_cap ? w->wd_cap * 2 : 64, dir->wd + 1);
+    w->wd_dirs = (int *)fz_realloc(ctx, w->wd_dirs, cap * sizeof(int));
+    memset(w->wd_dirs + w->wd_cap, 0, (cap - w->wd_cap) * sizeof(int));
+    w->wd_cap = cap;
+  }
+  w->wd_dirs[dir->wd] = index + 1;
+}
+
+// The directory watch also reports changes made in place
+static void watch_item_file(fz_context *ctx, watcher_t *w, int index, const char *fs_path)
+{
+}
+
+bool watcher_poll(watcher_t *w)
+{
+  char buf[4096]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool complete = 1;
+  ssize_t n;
+
+  while ((n = read(w->fd, buf, sizeof(buf))) > 0)
+  {
+    char *p = buf;
+    while (p < buf + n)
+    {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW)
+      {
+        complete = 0;
+        continue;
+      }
+
+      if (ev->wd < 0 || ev->wd >= w->wd_cap || !w->wd_dirs[ev->wd])
+        continue;
+      watch_dir *dir = &w->dirs[w->wd_dirs[ev->wd] - 1];
+
+      if (ev->mask & IN_IGNORED)
+      {
+        // Directory is gone, poll its files until they are watched again
+        w->wd_dirs[ev->wd] = 0;
+        lose_dir(w, dir);
+      }
+      else if (ev->len > 0)
+      {
+        for (int i = dir->first; i != -1; i = w->items[i].next)
+          if (strcmp(w->items[i].name, ev->name) == 0)
+            w->items[i].changed = 1;
+      }
+    }
+  }
+
+  if (!complete)
+    txp_info(TXP_LOG_MAIN, "[watch] notification queue overflowed\n");
+
+  return complete;
+}
+
+#else /* WATCH_KQUEUE */
+
+// Events carry the index of the item or of the directory, told apart by
+// the lowest bit
+#define UDATA_DIR 1
+
+static int kqueue_watch(watcher_t *w, const char *path, int udata, u_int fflags)
+{
+#ifdef O_EVTONLY
+  int fd = open(path, O_EVTONLY | O_CLOEXEC);
+#else
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+  if (fd == -1)
+    return -1;
+
+  struct kevent ev;
+  EV_SET(&ev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, fflags, 0,
+         (void *)(intptr_t)udata);
+
+  if (kevent(w->fd, &ev, 1, NULL, 0, NULL) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+#define LOST_FLAGS (NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE)
+
+static void watch_dir_path(fz_context *ctx, watcher_t *w, int index)
+{
+  watch_dir *dir = &w->dirs[index];
+  // NOTE_WRITE: an entry was added, removed or renamed
+  dir->wd = kqueue_watch(w, dir->path, index * 2 + UDATA_DIR,
+                         NOTE_WRITE | LOST_FLAGS);
+}
+
+static void watch_item_file(fz_context *ctx, watcher_t *w, int index, const char *fs_path)
+{
+  watch_item *item = &w->items[index];
+  if (item->fd != -1 || w->file_fds >= w->file_budget)
+    return;
+  item->fd = kqueue_watch(w, fs_path, index * 2,
+                          NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | LOST_FLAGS);
+  if (item->fd != -1)
+    w->file_fds += 1;
+}
+
+bool watcher_poll(watcher_t *w)
+{
+  struct kevent evs[64];
+  struct timespec zero = {0, 0};
+  int n;
+
+  while ((n = kevent(w->fd, NULL, 0, evs, 64, &zero)) > 0)
+  {
+    for (int i = 0; i < n; ++i)
+    {
+      intptr_t udata = (intptr_t)evs[i].udata;
+      bool lost = evs[i].fflags & LOST_FLAGS;
+
+      if (udata & UDATA_DIR)
+      {
+        watch_dir *dir = &w->dirs[udata / 2];
+        if (lost && dir->wd != -1)
+        {
+          close(dir->wd);
+          lose_dir(w, dir);
+        }
+        else
+          for (int j = dir->first; j != -1; j = w->items[j].next)
+            w->items[j].changed = 1;
+        continue;
+      }
+
+      watch_item *item = &w->items[udata / 2];
+      item->changed = 1;
+
+      // The descriptor still refers to the old file: drop it, the
+      // directory watch notices the new one
+      if (lost && item->fd != -1)
+      {
+        close(item->fd);
+        item->fd = -1;
+        w->file_fds -= 1;
+      }
+    }
+    if (n < 64)
+      break;
+  }
+
+  if (n == -1)
+  {
+    perror("[watch] kevent");
+    return 0;
+  }
+
+  return 1;
+}
+
+#endif
+
+// Find or create the directory of fs_path, and return the name of the file
+// in it. Return -1 if the path is too long.
+static int add_dir(fz_context *ctx, watcher_t *w, const char *fs_path,
+                   const char **name)
+{
+  char path[1024];
+  const char *sep = strrchr(fs_path, '/');
+
+  if (!sep)
+  {
+    strcpy(path, ".");
+    *name = fs_path;
+  }
+  else
+  {
+    int len = sep == fs_path ? 1 : sep - fs_path;
+    if (len >= (int)sizeof(path))
+      return -1;
+    memcpy(path, fs_path, len);
+    path[len] = 0;
+    *name = sep + 1;
+  }
+
+  if (2 * (w->dir_count + 1) > w->dir_slot_cap)
+    grow_dir_slots(ctx, w);
+
+  int *slot = dir_slot(w, path);
+  if (*slot)
+    return *slot - 1;
+
+  if (w->dir_count == w->dir_cap)
+  {
+    w->dir_cap = w->dir_cap ? w->dir_cap * 2 : 16;
+    w->dirs = (watch_dir *)fz_realloc(ctx, w->dirs, w->dir_cap * sizeof(watch_dir));
+  }
+  int index = w->dir_count++;
+  *slot = index + 1;
+  w->dirs[index] = (watch_dir){.path = fz_strdup(ctx, path), .wd = -1, .first = -1};
+  return index;
+}
+
+void watcher_add(fz_context *ctx, watcher_t *w, fileentry_t *e, const char *fs_path)
+{
+  if (2 * (w->count + 1) > w->slot_cap)
+    grow_slots(ctx, w);
+
+  int *slot = item_slot(w, e);
+  int index;
+
+  if (*slot)
+    index = *slot - 1;
+  else
+  {
+    if (w->count == w->cap)
+    {
+      w->cap = w->cap ? w->cap * 2 : 64;
+      w->items = (watch_item *)fz_realloc(ctx, w->items, w->cap * sizeof(watch_item));
+    }
+    index = w->count++;
+    *slot = index + 1;
+
+    const char *name;
+    int dir = add_dir(ctx, w, fs_path, &name);
+    watch_item *item = &w->items[index];
+    item->entry = e;
+    item->dir = dir;
+    item->next = -1;
+    item->name = dir == -1 ? NULL : fz_strdup(ctx, name);
+    item->fd = -1;
+    if (dir != -1)
+    {
+      item->next = w->dirs[dir].first;
+      w->dirs[dir].first = index;
+    }
+  }
+
+  // The caller is scanning the file: earlier notifications are consumed
+  watch_item *item = &w->items[index];
+  item->changed = 0;
+
+  if (item->dir == -1)
+    return;
+  if (w->dirs[item->dir].wd == -1)
+    watch_dir_path(ctx, w, item->dir);
+  watch_item_file(ctx, w, index, fs_path);
+
+  if (item_polled(w, item))
+    txp_debug(TXP_LOG_MAIN, "[watch] cannot watch %s, polling it\n", fs_path);
+}
+
+fileentry_t *watcher_scan(watcher_t *w, int *index)
+{
+  while (*index < w->count)
+  {
+    watch_item *item = &w->items[(*index)++];
+    if (item->changed || item_polled(w, item))
+      return item->entry;
+  }
+  return NULL;
+}
+
+int watcher_fd(watcher_t *w)
+{
+  return w->fd;
+}
+
+#else
+
+// No notification backend, callers fall back to scanning all files
+
+watcher_t *watcher_new(fz_context *ctx)
+{
+  return NULL;
+}
+
+void watcher_free(fz_context *ctx, watcher_t *w)
+{
+}
+
+void watcher_add(fz_context *ctx, watcher_t *w, fileentry_t *e, const char *fs_path)
+{
+}
+
+bool watcher_poll(watcher_t *w)
+{
+  return 0;
+}
+
+fileentry_t *watcher_scan(watcher_t *w, int *index)
+{
+  return NULL;
+}
+
+int watcher_fd(watcher_t *w)
+{
+  return -1;
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include "state.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Filesystem notifications for the files read by TeX.
+//
+// Files added to a watcher are reported by watcher_scan only when the system
+// notified a change (inotify on Linux, kqueue on macOS and BSDs), so that a
+// rescan does not have to stat every dependency. Files that could not be
+// watched are always reported and are checked by polling. Notifications are
+// kept until the file is actually scanned, see watcher_add.
+
+typedef struct watcher_s watcher_t;
+
+// Return NULL if notifications are not supported on this platform
+watcher_t *watcher_new(fz_context *ctx);
+void watcher_free(fz_context *ctx, watcher_t *w);
+
+// Start watching entry e, backed by the file at fs_path.
+// Adding an entry again tells that it was scanned: it is no longer reported
+// until the next notification. Its watch is re-armed if it was lost (file
+// or directory replaced).
+void watcher_add(fz_context *ctx, watcher_t *w, fileentry_t *e, const char *fs_path);
+
+// Collect pending notifications. Return false if some were lost and all
+// files have to be scanned.
+bool watcher_poll(watcher_t *w);
+
+// Iterate on entries that might have changed since the last scan
+fileentry_t *watcher_scan(watcher_t *w, int *index);
+
+// Descriptor that becomes readable when notifications are pending
+int watcher_fd(watcher_t *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*!WATCHER_H*/